@@ -0,0 +1,77 @@
+// Compares file size and load time of levels saved with different options.
+// Usage: compression_bench [terrain count] [vertices per terrain]
+
+#include "generate.h"
+#include "serialize.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <string>
+
+namespace {
+
+template <typename F> double best_of(int runs, F &&f) {
+  double best = 1e30;
+  for (int i = 0; i < runs; ++i) {
+    auto start = std::chrono::steady_clock::now();
+    f();
+    std::chrono::duration<double, std::milli> took =
+        std::chrono::steady_clock::now() - start;
+    best = std::min(best, took.count());
+  }
+  return best;
+}
+
+void run(const char *label, const std::string &folder, const cw::Level &level,
+         const cw::SaveOptions &options) {
+  if (cw::serialize(folder.c_str(), label, true, level, options) !=
+      cw::SerializeResultCode::Okay) {
+    std::fprintf(stderr, "failed to save %s\n", label);
+    std::exit(1);
+  }
+  std::string path = folder + "/" + label + ".cwl";
+  auto size = std::filesystem::file_size(path);
+
+  double load = best_of(20, [&path] {
+    cw::Level out;
+    if (cw::deserialize(path.c_str(), &out) != cw::DeserializeResultCode::Okay)
+      std::exit(1);
+  });
+  double view = best_of(20, [&path] {
+    cw::LevelView out;
+    if (out.open(path.c_str()) != cw::DeserializeResultCode::Okay)
+      std::exit(1);
+  });
+
+  std::printf("%-16s %10zu bytes  deserialize %7.3f ms  view %7.3f ms\n",
+              label, size_t(size), load, view);
+  std::filesystem::remove(path);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  size_t terrain_count = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 2000;
+  size_t verts = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 256;
+
+  bench::LevelShape shape{
+      .terrains = terrain_count,
+      .verts_per_terrain = verts,
+      .turrets = terrain_count / 4,
+      .images = terrain_count / 4,
+      .build_sites = terrain_count / 16,
+  };
+  bench::GeneratedLevel room;
+  bench::generate(room, shape);
+  cw::Level level = room.level();
+
+  std::string folder = std::filesystem::temp_directory_path().string();
+  std::printf("%zu terrains, %zu vertices each\n", terrain_count, verts);
+  run("uncompressed", folder, level, {});
+  run("compressed", folder, level, {.compressed = cw::LevelParts::All});
+  run("grid", folder, level, {.vertex_grid = 1});
+  run("grid+compressed", folder, level,
+      {.compressed = cw::LevelParts::All, .vertex_grid = 1});
+}
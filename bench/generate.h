@@ -0,0 +1,175 @@
+#pragma once
+// Synthetic levels for the benchmarks
+
+#include "serialize.h"
+#include <cmath>
+#include <cstring>
+#include <random>
+#include <vector>
+
+namespace bench {
+
+struct LevelShape {
+  size_t terrains = 0;
+  size_t verts_per_terrain = 0;
+  size_t turrets = 0;
+  size_t images = 0;
+  size_t build_sites = 0;
+  /// each a handful of small terrains, turrets, images and build sites
+  size_t prefabs = 0;
+  /// of random prefabs, ignored without any
+  size_t instances = 0;
+  uint32_t seed = 1234;
+};
+
+/// Owns everything a generated cw::Level points to
+struct GeneratedLevel {
+  std::vector<std::vector<Vec2>> polygons;
+  std::vector<cw::TerrainEntry> terrains;
+  std::vector<cw::Turret> turrets;
+  std::vector<cw::Image> images;
+  std::vector<cw::BuildSite> build_sites;
+  /// what the prefabs point into, reserved up front so they never move
+  std::vector<cw::TerrainEntry> prefab_terrains;
+  std::vector<cw::Turret> prefab_turrets;
+  std::vector<cw::Image> prefab_images;
+  std::vector<cw::BuildSite> prefab_sites;
+  std::vector<cw::Prefab> prefabs;
+  std::vector<cw::PrefabInstance> instances;
+
+  inline cw::Level level() const {
+    return {
+        .player_spawn = {.position = {0, 0}},
+        .terrains = terrains,
+        .images = images,
+        .build_sites = build_sites,
+        .turrets = turrets,
+        .prefabs = prefabs,
+        .instances = instances,
+    };
+  }
+
+  inline size_t vertex_count() const {
+    size_t count = 0;
+    for (const auto &polygon : polygons)
+      count += polygon.size();
+    return count;
+  }
+};
+
+// something shaped like what the editor makes: wobbly closed polygons placed
+// with the mouse, so coordinates land on whole pixels
+inline void generate(GeneratedLevel &room, const LevelShape &shape) {
+  std::mt19937 rng(shape.seed);
+  std::uniform_real_distribution<float> place(0, 20000);
+  std::uniform_real_distribution<float> wobble(0.7f, 1.3f);
+
+  room.polygons.resize(shape.terrains);
+  for (auto &polygon : room.polygons) {
+    Vec2 center{place(rng), place(rng)};
+    float radius = 50 + place(rng) / 50;
+    polygon.reserve(shape.verts_per_terrain);
+    for (size_t i = 0; i < shape.verts_per_terrain; ++i) {
+      float angle =
+          2 * float(M_PI) * float(i) / float(shape.verts_per_terrain);
+      float r = radius * wobble(rng);
+      polygon.push_back({std::round(center.x + r * std::cos(angle)),
+                         std::round(center.y + r * std::sin(angle))});
+    }
+    room.terrains.push_back({
+        .verts = polygon,
+        .type = cw::TerrainType(rng() % 2),
+    });
+  }
+
+  for (size_t i = 0; i < shape.turrets; ++i) {
+    room.turrets.push_back({
+        .position = {std::round(place(rng)), std::round(place(rng))},
+        .direction = {0, 1},
+        .fireRateSeconds = 1.5f,
+        .pattern = cw::TurretPattern::Circle,
+    });
+  }
+
+  static const char *filenames[] = {
+      "assets/rock.png",  "assets/tree.png",   "assets/crate.png",
+      "assets/wall.png",  "assets/bush.png",   "assets/barrel.png",
+      "assets/fence.png", "assets/puddle.png",
+  };
+  for (size_t i = 0; i < shape.images; ++i) {
+    const char *filename = filenames[i % std::size(filenames)];
+    room.images.push_back({
+        .filename = std::span(filename, std::strlen(filename)),
+        .data = {.position = {std::round(place(rng)), std::round(place(rng))},
+                 .rotation = 0},
+    });
+  }
+
+  room.build_sites.resize(shape.build_sites);
+
+  // prefab polygons go in with the rest, after the level's own
+  constexpr size_t PREFAB_ITEMS = 4;
+  room.polygons.reserve(room.polygons.size() + shape.prefabs * PREFAB_ITEMS);
+  room.prefab_terrains.reserve(shape.prefabs * PREFAB_ITEMS);
+  room.prefab_turrets.reserve(shape.prefabs * PREFAB_ITEMS);
+  room.prefab_images.reserve(shape.prefabs * PREFAB_ITEMS);
+  room.prefab_sites.reserve(shape.prefabs * PREFAB_ITEMS);
+  std::uniform_real_distribution<float> near(-100, 100);
+  for (size_t i = 0; i < shape.prefabs; ++i) {
+    size_t terrains = rng() % PREFAB_ITEMS, turrets = rng() % PREFAB_ITEMS,
+           images = rng() % PREFAB_ITEMS, sites = rng() % PREFAB_ITEMS;
+    size_t first_terrain = room.prefab_terrains.size();
+    for (size_t j = 0; j < terrains; ++j) {
+      auto &polygon = room.polygons.emplace_back();
+      for (size_t k = 3 + rng() % 6; k > 0; --k)
+        polygon.push_back({std::round(near(rng)), std::round(near(rng))});
+      room.prefab_terrains.push_back({
+          .verts = polygon,
+          .type = cw::TerrainType(rng() % 2),
+      });
+    }
+    size_t first_turret = room.prefab_turrets.size();
+    for (size_t j = 0; j < turrets; ++j) {
+      room.prefab_turrets.push_back({
+          .position = {std::round(near(rng)), std::round(near(rng))},
+          .direction = {1, 0},
+          .fireRateSeconds = 0.5f,
+          .pattern = cw::TurretPattern::Tracking,
+      });
+    }
+    size_t first_image = room.prefab_images.size();
+    for (size_t j = 0; j < images; ++j) {
+      const char *filename = filenames[rng() % std::size(filenames)];
+      room.prefab_images.push_back({
+          .filename = std::span(filename, std::strlen(filename)),
+          .data = {.position = {std::round(near(rng)), std::round(near(rng))},
+                   .rotation = 0},
+      });
+    }
+    size_t first_site = room.prefab_sites.size();
+    for (size_t j = 0; j < sites; ++j) {
+      room.prefab_sites.push_back(
+          {.position_a = {std::round(near(rng)), std::round(near(rng))},
+           .position_b = {std::round(near(rng)), std::round(near(rng))}});
+    }
+    room.prefabs.push_back({
+        .terrains = std::span(room.prefab_terrains).subspan(first_terrain),
+        .turrets = std::span(room.prefab_turrets).subspan(first_turret),
+        .images = std::span(room.prefab_images).subspan(first_image),
+        .build_sites = std::span(room.prefab_sites).subspan(first_site),
+    });
+  }
+
+  std::uniform_real_distribution<float> turn(0, 2 * float(M_PI));
+  for (size_t i = 0; i < shape.instances && !room.prefabs.empty(); ++i) {
+    Vec2 at{std::round(place(rng)), std::round(place(rng))};
+    room.instances.push_back({
+        .prefab = uint32_t(rng() % room.prefabs.size()),
+        .transform = Affine::rotate(turn(rng), {0, 0}),
+    });
+    room.instances.back().transform.tx += at.x;
+    room.instances.back().transform.ty += at.y;
+  }
+}
+
+} // namespace bench
@@ -0,0 +1,317 @@
+// Times saving and loading synthetic levels from tiny to a million vertices,
+// counts allocations, and checks that saving a loaded level gives back the
+// exact same bytes. Verify is what checking checksums adds to loading a level
+// into memory nobody has touched yet, the way a room's first load goes. Levels also go through the text format, which has to give
+// back the same level.
+// Usage: roundtrip_bench [--stress iterations]
+
+#include "generate.h"
+#include "serialize.h"
+#include "text.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <new>
+#include <random>
+#include <string>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <vector>
+
+namespace {
+
+struct AllocationCounts {
+  size_t count = 0;
+  size_t bytes = 0;
+};
+// the benchmark is single threaded, so these don't need to be atomic
+AllocationCounts allocations;
+
+// kept out of line: once malloc and free are inlined into new and delete,
+// the compiler takes a delete[] of a new[] for a mismatched pair
+[[gnu::noinline]] void *allocate(size_t size) {
+  ++allocations.count;
+  allocations.bytes += size;
+  if (void *p = std::malloc(size ? size : 1))
+    return p;
+  throw std::bad_alloc();
+}
+[[gnu::noinline]] void release(void *p) noexcept { std::free(p); }
+
+} // namespace
+
+void *operator new(size_t size) { return allocate(size); }
+void *operator new[](size_t size) { return allocate(size); }
+void operator delete(void *p) noexcept { release(p); }
+void operator delete[](void *p) noexcept { release(p); }
+void operator delete(void *p, size_t) noexcept { release(p); }
+void operator delete[](void *p, size_t) noexcept { release(p); }
+
+namespace {
+
+struct Case {
+  const char *label;
+  bench::LevelShape shape;
+};
+
+// vertex counts from 10 up to 1M, split into few big or many small polygons
+const Case cases[] = {
+    {"10 verts", {.terrains = 1, .verts_per_terrain = 10}},
+    {"1k verts",
+     {.terrains = 100, .verts_per_terrain = 10, .turrets = 1000,
+      .images = 1000, .build_sites = 100}},
+    {"10k instances",
+     {.terrains = 100, .verts_per_terrain = 10, .turrets = 100,
+      .images = 100, .build_sites = 10, .prefabs = 20, .instances = 10000}},
+    {"100k verts",
+     {.terrains = 1000, .verts_per_terrain = 100, .turrets = 5000,
+      .images = 5000, .build_sites = 500}},
+    {"1M verts, big",
+     {.terrains = 10, .verts_per_terrain = 100000, .turrets = 2000,
+      .images = 2000, .build_sites = 100}},
+    {"1M verts, small",
+     {.terrains = 100000, .verts_per_terrain = 10, .turrets = 10000,
+      .images = 10000, .build_sites = 1000}},
+};
+
+struct Format {
+  const char *label;
+  cw::SaveOptions options;
+};
+
+const Format formats[] = {
+    {"plain", {}},
+    {"compressed", {.compressed = cw::LevelParts::All}},
+    {"grid", {.vertex_grid = 1}},
+    {"grid+compressed",
+     {.compressed = cw::LevelParts::All, .vertex_grid = 1}},
+    {"baked", {.bake = true}},
+};
+
+// hands out pages nobody has touched yet, like the memory a room loaded for
+// the first time lands in. reloading into memory just freed finds it mapped
+// and in cache, where copying is so quick that checksumming it costs a lot
+// more by comparison than it ever does in a game
+class FreshPages : public std::pmr::memory_resource {
+  void *do_allocate(size_t bytes, size_t) override {
+    void *p = mmap(nullptr, bytes ? bytes : 1, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+      throw std::bad_alloc();
+    return p;
+  }
+  void do_deallocate(void *p, size_t bytes, size_t) override {
+    munmap(p, bytes ? bytes : 1);
+  }
+  bool do_is_equal(const memory_resource &other) const noexcept override {
+    return this == &other;
+  }
+};
+
+struct Timing {
+  double ms = 1e30;
+  AllocationCounts allocations;
+};
+
+template <typename F> Timing best_of(int runs, F &&f) {
+  Timing best;
+  for (int i = 0; i < runs; ++i) {
+    AllocationCounts before = allocations;
+    auto start = std::chrono::steady_clock::now();
+    f();
+    std::chrono::duration<double, std::milli> took =
+        std::chrono::steady_clock::now() - start;
+    best.ms = std::min(best.ms, took.count());
+    best.allocations = {.count = allocations.count - before.count,
+                        .bytes = allocations.bytes - before.bytes};
+  }
+  return best;
+}
+
+size_t peak_rss_kb() {
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+double mb_per_s(size_t bytes, double ms) {
+  return ms > 0 ? double(bytes) / (1024.0 * 1024.0) / (ms / 1000.0) : 0;
+}
+
+/// Save, load and save again. Returns false if the second save differs.
+bool round_trip(const std::string &path, const cw::Level &level,
+                const cw::SaveOptions &options,
+                std::vector<std::byte> *saved) {
+  cw::serialize_to_buffer(level, saved, options);
+  FILE *file = std::fopen(path.c_str(), "wb");
+  if (!file || std::fwrite(saved->data(), 1, saved->size(), file) !=
+                   saved->size()) {
+    std::fprintf(stderr, "failed to write %s\n", path.c_str());
+    std::exit(1);
+  }
+  std::fclose(file);
+
+  cw::Level loaded;
+  if (cw::deserialize(path.c_str(), &loaded) !=
+      cw::DeserializeResultCode::Okay)
+    return false;
+  std::vector<std::byte> again;
+  cw::serialize_to_buffer(loaded, &again, options);
+  return again == *saved;
+}
+
+bool run(const std::string &path, const Case &test, const Format &format,
+         const cw::Level &level) {
+  std::vector<std::byte> saved;
+  if (!round_trip(path, level, format.options, &saved)) {
+    std::printf("%-16s %-16s ROUND TRIP MISMATCH\n", test.label,
+                format.label);
+    return false;
+  }
+
+  int runs = saved.size() > 16 * 1024 * 1024 ? 3 : 10;
+  std::vector<std::byte> out;
+  Timing save = best_of(runs, [&] {
+    out.clear();
+    out.shrink_to_fit();
+    cw::serialize_to_buffer(level, &out, format.options);
+  });
+  auto load_with = [&](int times, std::pmr::memory_resource *resource,
+                       const cw::LoadOptions &options) {
+    return best_of(times, [&] {
+      cw::Level loaded;
+      if (cw::deserialize(path.c_str(), &loaded, resource, options) !=
+          cw::DeserializeResultCode::Okay)
+        std::exit(1);
+    });
+  };
+  Timing load = load_with(runs, std::pmr::get_default_resource(), {});
+  // what checking the checksums adds to a first load. they take turns, so
+  // whatever else the machine is up to slows both down alike
+  FreshPages fresh;
+  double first = 1e30, trusted = 1e30;
+  for (int i = 0; i < 4 * runs; ++i) {
+    first = std::min(first, load_with(1, &fresh, {}).ms);
+    trusted = std::min(trusted, load_with(1, &fresh, {.trusted = true}).ms);
+  }
+
+  std::printf("%-16s %-16s %10zu bytes  save %8.3f ms %8.1f MB/s %5zu allocs"
+              "  load %8.3f ms %8.1f MB/s %5zu allocs  verify %+6.1f%%"
+              "  peak %7zu KiB\n",
+              test.label, format.label, saved.size(), save.ms,
+              mb_per_s(saved.size(), save.ms), save.allocations.count,
+              load.ms, mb_per_s(saved.size(), load.ms),
+              load.allocations.count, (first / trusted - 1) * 100,
+              peak_rss_kb());
+  return true;
+}
+
+/// Write a level as text and read it back. Returns false if the level read
+/// back doesn't save to the same bytes as the original.
+bool text_round_trip(const cw::Level &level, std::vector<char> *text) {
+  cw::serialize_text_to_buffer(level, text);
+  cw::Level loaded;
+  if (cw::deserialize_text(*text, &loaded) != cw::DeserializeResultCode::Okay)
+    return false;
+  std::vector<std::byte> expected, again;
+  cw::serialize_to_buffer(level, &expected);
+  cw::serialize_to_buffer(loaded, &again);
+  return again == expected;
+}
+
+bool run_text(const Case &test, const cw::Level &level) {
+  std::vector<char> text;
+  if (!text_round_trip(level, &text)) {
+    std::printf("%-16s %-16s ROUND TRIP MISMATCH\n", test.label, "text");
+    return false;
+  }
+
+  int runs = text.size() > 16 * 1024 * 1024 ? 3 : 10;
+  std::vector<char> out;
+  Timing save = best_of(runs, [&] {
+    out.clear();
+    out.shrink_to_fit();
+    cw::serialize_text_to_buffer(level, &out);
+  });
+  Timing load = best_of(runs, [&] {
+    cw::Level loaded;
+    if (cw::deserialize_text(text, &loaded) != cw::DeserializeResultCode::Okay)
+      std::exit(1);
+  });
+
+  std::printf("%-16s %-16s %10zu bytes  save %8.3f ms %8.1f MB/s %5zu allocs"
+              "  load %8.3f ms %8.1f MB/s %5zu allocs\n",
+              test.label, "text", text.size(), save.ms,
+              mb_per_s(text.size(), save.ms), save.allocations.count, load.ms,
+              mb_per_s(text.size(), load.ms), load.allocations.count);
+  return true;
+}
+
+/// Round trip random levels with random options, only reporting failures
+bool stress(const std::string &path, size_t iterations) {
+  std::mt19937 rng(42);
+  size_t failures = 0;
+  for (size_t i = 0; i < iterations; ++i) {
+    bench::LevelShape shape{
+        .terrains = rng() % 64,
+        .verts_per_terrain = 3 + rng() % 512,
+        .turrets = rng() % 256,
+        .images = rng() % 256,
+        .build_sites = rng() % 32,
+        .prefabs = rng() % 3 == 0 ? rng() % 16 : 0,
+        .instances = rng() % 512,
+        .seed = uint32_t(rng()),
+    };
+    uint32_t parts = rng() % (uint32_t(cw::LevelParts::All) + 1);
+    cw::SaveOptions options{
+        .compressed = cw::LevelParts(parts),
+        .vertex_grid = rng() % 2 ? 1.0f : 0.0f,
+        .bake = rng() % 2 == 0,
+    };
+    bench::GeneratedLevel room;
+    bench::generate(room, shape);
+    std::vector<std::byte> saved;
+    if (!round_trip(path, room.level(), options, &saved)) {
+      std::printf("stress %zu: round trip mismatch (seed %u)\n", i,
+                  shape.seed);
+      ++failures;
+    }
+    std::vector<char> text;
+    if (!text_round_trip(room.level(), &text)) {
+      std::printf("stress %zu: text round trip mismatch (seed %u)\n", i,
+                  shape.seed);
+      ++failures;
+    }
+  }
+  std::printf("stress: %zu of %zu round trips failed\n", failures,
+              iterations);
+  return failures == 0;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  std::string path =
+      (std::filesystem::temp_directory_path() / "roundtrip_bench.cwl")
+          .string();
+  bool ok = true;
+
+  if (argc > 2 && std::strcmp(argv[1], "--stress") == 0) {
+    ok = stress(path, std::strtoul(argv[2], nullptr, 10));
+  } else {
+    for (const auto &test : cases) {
+      bench::GeneratedLevel room;
+      bench::generate(room, test.shape);
+      cw::Level level = room.level();
+      for (const auto &format : formats)
+        ok = run(path, test, format, level) && ok;
+      ok = run_text(test, level) && ok;
+    }
+  }
+
+  std::filesystem::remove(path);
+  return ok ? 0 : 1;
+}
@@ -21,6 +21,10 @@ const cpp_sources = &[_][]const u8{
     "src/util.cpp",
     "src/ImageSelector.cpp",
     "src/Room.cpp",
+    "src/Autosave.cpp",
+    "src/PointGrid.cpp",
+    "src/VertexPool.cpp",
+    "src/UndoHistory.cpp",
 };
 
 const include_dirs = &[_][]const u8{
@@ -88,6 +92,12 @@ pub fn build(b: *std.Build) !void {
     b.getInstallStep().dependOn(&b.addInstallHeaderFile("src/serialize.h", "crosswire_editor/serialize.h").step);
     b.getInstallStep().dependOn(&b.addInstallHeaderFile("src/Vec2.h", "crosswire_editor/Vec2.h").step);
     b.getInstallStep().dependOn(&b.addInstallHeaderFile("src/terrain.h", "crosswire_editor/terrain.h").step);
+    b.getInstallStep().dependOn(&b.addInstallHeaderFile("src/lz.h", "crosswire_editor/lz.h").step);
+    b.getInstallStep().dependOn(&b.addInstallHeaderFile("src/crc32c.h", "crosswire_editor/crc32c.h").step);
+    b.getInstallStep().dependOn(&b.addInstallHeaderFile("src/journal.h", "crosswire_editor/journal.h").step);
+    b.getInstallStep().dependOn(&b.addInstallHeaderFile("src/pack.h", "crosswire_editor/pack.h").step);
+    b.getInstallStep().dependOn(&b.addInstallHeaderFile("src/bake.h", "crosswire_editor/bake.h").step);
+    b.getInstallStep().dependOn(&b.addInstallHeaderFile("src/text.h", "crosswire_editor/text.h").step);
 
     // add "zig build run"
     {
@@ -100,6 +110,57 @@ pub fn build(b: *std.Build) !void {
         run_step.dependOn(&run_cmd.step);
     }
 
+    // add "zig build bench" and "zig build roundtrip", which only need the
+    // serializer headers
+    {
+        const benches = [_]struct { name: []const u8, source: []const u8, step: []const u8, description: []const u8 }{
+            .{ .name = "compression_bench", .source = "bench/compression.cpp", .step = "bench", .description = "Run the serializer benchmarks" },
+            .{ .name = "roundtrip_bench", .source = "bench/roundtrip.cpp", .step = "roundtrip", .description = "Time and check round trips of synthetic levels (pass -- --stress N to fuzz)" },
+        };
+        for (benches) |info| {
+            const bench = b.addExecutable(.{
+                .name = info.name,
+                .optimize = .ReleaseFast,
+                .target = target,
+            });
+            bench.linkLibCpp();
+            bench.addCSourceFiles(&.{info.source}, &.{ "-std=c++20", "-DNDEBUG", "-Isrc/" });
+            const bench_cmd = b.addRunArtifact(bench);
+            if (b.args) |args| {
+                bench_cmd.addArgs(args);
+            }
+            const bench_step = b.step(info.step, info.description);
+            bench_step.dependOn(&bench_cmd.step);
+        }
+    }
+
+    // add "zig build pack", which packs level files for shipping:
+    // zig build pack -- <folder> <pack name> <level files...>
+    // and "zig build text", which converts levels to and from text:
+    // zig build text -- <level file> [out file]
+    {
+        const tools = [_]struct { name: []const u8, source: []const u8, step: []const u8, description: []const u8 }{
+            .{ .name = "crosswire_pack", .source = "tools/pack.cpp", .step = "pack", .description = "Pack level files into one .cwp" },
+            .{ .name = "crosswire_text", .source = "tools/text.cpp", .step = "text", .description = "Convert a level to or from text" },
+        };
+        for (tools) |info| {
+            const tool = b.addExecutable(.{
+                .name = info.name,
+                .optimize = mode,
+                .target = target,
+            });
+            tool.linkLibCpp();
+            tool.addCSourceFiles(&.{info.source}, &.{ "-std=c++20", "-Isrc/" });
+            b.installArtifact(tool);
+            const tool_cmd = b.addRunArtifact(tool);
+            if (b.args) |args| {
+                tool_cmd.addArgs(args);
+            }
+            const tool_step = b.step(info.step, info.description);
+            tool_step.dependOn(&tool_cmd.step);
+        }
+    }
+
     // windows requires that no targets use pkg-config. of course.
     // because its a unix thing.
     switch (target.getOsTag()) {
@@ -0,0 +1,88 @@
+#pragma once
+
+#include "Vec2.h"
+#include <cassert>
+#include <cmath>
+#include <span>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/// Moves points by x' = a x + b y + tx, y' = c x + d y + ty. Covers moving,
+/// rotating, scaling and mirroring, and any mix of them.
+struct Affine {
+  float a = 1, b = 0;
+  float c = 0, d = 1;
+  float tx = 0, ty = 0;
+
+  static inline Affine translate(Vec2 by) { return {.tx = by.x, .ty = by.y}; }
+  /// Turn by radians around pivot. y points down on screen, so positive
+  /// angles turn clockwise there.
+  static inline Affine rotate(float radians, Vec2 pivot) {
+    const float cos = std::cos(radians), sin = std::sin(radians);
+    return around({.a = cos, .b = -sin, .c = sin, .d = cos}, pivot);
+  }
+  /// Stretch away from pivot. A negative factor mirrors that axis.
+  static inline Affine scale(float x, float y, Vec2 pivot) {
+    return around({.a = x, .d = y}, pivot);
+  }
+
+  inline Vec2 apply(Vec2 p) const {
+    return {a * p.x + b * p.y + tx, c * p.x + d * p.y + ty};
+  }
+  /// This done to wherever first puts a point
+  inline Affine after(const Affine &first) const {
+    return {
+        .a = a * first.a + b * first.c,
+        .b = a * first.b + b * first.d,
+        .c = c * first.a + d * first.c,
+        .d = c * first.b + d * first.d,
+        .tx = a * first.tx + b * first.ty + tx,
+        .ty = c * first.tx + d * first.ty + ty,
+    };
+  }
+
+private:
+  // linear, which only uses a to d, done with pivot held still
+  static inline Affine around(Affine linear, Vec2 pivot) {
+    Vec2 moved = linear.apply(pivot);
+    linear.tx = pivot.x - moved.x;
+    linear.ty = pivot.y - moved.y;
+    return linear;
+  }
+};
+
+/// out[i] = transform.apply(in[i]) for every point, in one pass. in and out
+/// can be the same.
+inline void transform_points(const Affine &transform, std::span<const Vec2> in,
+                             std::span<Vec2> out) {
+  static_assert(sizeof(Vec2) == 2 * sizeof(float));
+  assert(in.size() == out.size());
+  size_t i = 0;
+#if defined(__SSE2__)
+  // points are x y x y, so a and d multiply them as they are and b and c
+  // multiply them with each x and y swapped
+  const __m128 straight = _mm_setr_ps(transform.a, transform.d, transform.a,
+                                      transform.d);
+  const __m128 swapped = _mm_setr_ps(transform.b, transform.c, transform.b,
+                                     transform.c);
+  const __m128 shift = _mm_setr_ps(transform.tx, transform.ty, transform.tx,
+                                   transform.ty);
+  for (; i + 4 <= in.size(); i += 4) {
+    __m128 low = _mm_loadu_ps(&in[i].x);
+    __m128 high = _mm_loadu_ps(&in[i + 2].x);
+    __m128 low_swapped = _mm_shuffle_ps(low, low, _MM_SHUFFLE(2, 3, 0, 1));
+    __m128 high_swapped = _mm_shuffle_ps(high, high, _MM_SHUFFLE(2, 3, 0, 1));
+    low = _mm_add_ps(_mm_add_ps(_mm_mul_ps(low, straight),
+                                _mm_mul_ps(low_swapped, swapped)),
+                     shift);
+    high = _mm_add_ps(_mm_add_ps(_mm_mul_ps(high, straight),
+                                 _mm_mul_ps(high_swapped, swapped)),
+                      shift);
+    _mm_storeu_ps(&out[i].x, low);
+    _mm_storeu_ps(&out[i + 2].x, high);
+  }
+#endif
+  for (; i < in.size(); ++i)
+    out[i] = transform.apply(in[i]);
+}
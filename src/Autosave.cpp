@@ -0,0 +1,81 @@
+#include "Autosave.h"
+#include <algorithm>
+
+Autosave::Autosave(AutosaveConfig config)
+    : config(std::move(config)),
+      nextSave(std::chrono::steady_clock::now() + this->config.interval),
+      finished(AutosaveReport{}) {
+  this->config.retention = std::max<uint16_t>(this->config.retention, 1);
+  worker = std::thread([this] { run(); });
+}
+
+Autosave::~Autosave() noexcept {
+  // a save which is already being written gets to finish, one which hasn't
+  // started yet is dropped
+  delete pending.exchange(&stop);
+  pending.notify_one();
+  worker.join();
+}
+
+void Autosave::update(const Room &room) {
+  if (config.interval.count() == 0)
+    return;
+  if (std::chrono::steady_clock::now() < nextSave)
+    return;
+  // the last autosave already has everything
+  if (sequence != 0 && room.getChanges().version() == savedVersion) {
+    nextSave = std::chrono::steady_clock::now() + config.interval;
+    return;
+  }
+  saveNow(room);
+}
+
+void Autosave::saveNow(const Room &room) {
+  nextSave = std::chrono::steady_clock::now() + config.interval;
+  savedVersion = room.getChanges().version();
+  ++sequence;
+  uint16_t slot = (sequence - 1) % config.retention;
+
+  auto *job = new Job{
+      .snapshot = room.snapshot(),
+      .folder = config.folder,
+      .levelname = config.name + "_" + std::to_string(slot),
+      .report = {.sequence = sequence, .slot = slot},
+  };
+  // if the worker hasn't picked up the last one yet this one is newer anyway
+  delete pending.exchange(job);
+  pending.notify_one();
+}
+
+std::optional<AutosaveReport> Autosave::poll() noexcept {
+  AutosaveReport report = finished.load(std::memory_order_acquire);
+  if (report.sequence == lastPolled)
+    return {};
+  lastPolled = report.sequence;
+  return report;
+}
+
+void Autosave::setInterval(std::chrono::seconds interval) {
+  nextSave += interval - config.interval;
+  config.interval = interval;
+}
+
+void Autosave::setRetention(uint16_t retention) {
+  config.retention = std::max<uint16_t>(retention, 1);
+}
+
+void Autosave::run() noexcept {
+  while (true) {
+    pending.wait(nullptr);
+    Job *job = pending.exchange(nullptr);
+    if (job == &stop)
+      return;
+    if (!job)
+      continue;
+
+    job->report.result = job->snapshot.trySerialize(
+        job->folder.c_str(), job->levelname.c_str(), true);
+    finished.store(job->report, std::memory_order_release);
+    delete job;
+  }
+}
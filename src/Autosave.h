@@ -0,0 +1,86 @@
+#pragma once
+
+#include "Room.h"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <thread>
+
+struct AutosaveConfig {
+  /// time between autosaves, zero turns autosaving off
+  std::chrono::seconds interval{120};
+  /// how many autosaves are kept around. once there are this many the oldest
+  /// one gets overwritten
+  uint16_t retention = 5;
+  std::string folder = "levels";
+  /// autosaves are written to <folder>/<name>_<slot>.cwl
+  std::string name = "autosave";
+};
+
+/// What happened to an autosave, posted by the worker thread
+struct AutosaveReport {
+  /// counts up from 1 with each autosave started, 0 means none has finished
+  uint32_t sequence = 0;
+  /// which of the retained files it went to
+  uint16_t slot = 0;
+  cw::SerializeResultCode result = cw::SerializeResultCode::Okay;
+};
+
+/**
+ * @brief Saves snapshots of a room every so often on a worker thread, so the
+ * editor doesn't freeze while a big room is written out.
+ *
+ * The main loop hands over snapshots and picks up reports through a pair of
+ * atomics, so it never waits on the worker. If a snapshot is still waiting
+ * when the next one is taken, the newer one replaces it.
+ */
+class Autosave {
+public:
+  explicit Autosave(AutosaveConfig config = {});
+  ~Autosave() noexcept;
+  Autosave(const Autosave &) = delete;
+  Autosave &operator=(const Autosave &) = delete;
+
+  /// Call once per frame. Snapshots the room when the interval is up, unless
+  /// it hasn't changed since the last one.
+  void update(const Room &room);
+
+  /// Snapshot the room right away, without waiting for the interval
+  void saveNow(const Room &room);
+
+  /// The latest finished autosave, if it hasn't been returned before
+  std::optional<AutosaveReport> poll() noexcept;
+
+  inline const AutosaveConfig &getConfig() const { return config; }
+  void setInterval(std::chrono::seconds interval);
+  void setRetention(uint16_t retention);
+
+private:
+  struct Job {
+    RoomSnapshot snapshot;
+    std::string folder;
+    std::string levelname;
+    AutosaveReport report;
+  };
+
+  void run() noexcept;
+
+  AutosaveConfig config;
+  std::chrono::steady_clock::time_point nextSave;
+  uint32_t sequence = 0;
+  uint32_t lastPolled = 0;
+  // how far along the room was when it was last snapshotted
+  uint64_t savedVersion = 0;
+
+  // main thread -> worker. owned by whoever exchanges it out
+  std::atomic<Job *> pending = nullptr;
+  // worker -> main thread
+  std::atomic<AutosaveReport> finished;
+  static_assert(std::atomic<AutosaveReport>::is_always_lock_free);
+  // posted instead of a job to stop the worker
+  Job stop;
+
+  std::thread worker;
+};
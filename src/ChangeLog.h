@@ -0,0 +1,126 @@
+#pragma once
+
+#include "SlotMap.h"
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+/**
+ * @brief What has changed in one SlotMap, so whatever keeps something worked
+ * out from it (a cache, an index, a save) can catch up on only the items
+ * which changed instead of going through all of them.
+ *
+ * Every change is stamped with a version, which the owner hands out from one
+ * counter for everything it tracks, so a single version says how far along
+ * something is in all of them. Whatever catches up remembers the version it
+ * got to, and asks for the changes since then next time.
+ *
+ * The log of changes only goes back so far. Asking from before that, or from
+ * before everything was replaced, says so, and everything has to be looked at
+ * again.
+ */
+template <typename T> class ChangeLog {
+public:
+  /// The last change to any item, 0 if there never was one
+  inline uint64_t version() const { return latest; }
+  /// The last time items were added or erased, which moves others to a
+  /// different index
+  inline uint64_t layoutVersion() const { return layout; }
+  /// The last change to the item, 0 if it's gone or hasn't changed since
+  /// everything was replaced
+  inline uint64_t versionOf(Handle<T> handle) const {
+    if (handle.slot >= stamps.size() ||
+        stamps[handle.slot].generation != handle.generation)
+      return 0;
+    return stamps[handle.slot].version;
+  }
+
+  /// The item at handle is new
+  void added(Handle<T> handle, uint64_t at) {
+    layout = at;
+    changed(handle, at);
+  }
+  /// Something in the item at handle is different
+  void changed(Handle<T> handle, uint64_t at) {
+    assert(at >= latest);
+    latest = at;
+    if (handle.slot >= stamps.size())
+      stamps.resize(handle.slot + 1);
+    stamps[handle.slot] = {handle.generation, at};
+    // dragging changes the same item again and again, which only needs the
+    // one entry
+    if (!log.empty() && log.back().handle == handle && !log.back().erased) {
+      log.back().at = at;
+      return;
+    }
+    push({handle, at, false});
+  }
+  /// The item at handle is gone
+  void erased(Handle<T> handle, uint64_t at) {
+    assert(at >= latest);
+    latest = layout = at;
+    if (handle.slot < stamps.size() &&
+        stamps[handle.slot].generation == handle.generation)
+      stamps[handle.slot] = {};
+    push({handle, at, true});
+  }
+  /// Everything was replaced, whatever was worked out before has to start
+  /// over
+  void reset(uint64_t at) {
+    assert(at >= latest);
+    latest = layout = since = at;
+    stamps.clear();
+    log.clear();
+  }
+
+  /// Call visit(handle, erased) once for each item changed after version,
+  /// ending with what it is now: erased, or still there and changed. Returns
+  /// false without calling it if the log doesn't go back that far.
+  template <typename F> bool changesSince(uint64_t version, F &&visit) const {
+    if (version < since)
+      return false;
+    auto first = std::upper_bound(
+        log.begin(), log.end(), version,
+        [](uint64_t version, const Entry &entry) { return version < entry.at; });
+    for (auto entry = first; entry != log.end(); ++entry) {
+      // erasing only happens once to a handle. of its changes only the last
+      // one is still stamped on it
+      if (entry->erased || versionOf(entry->handle) == entry->at)
+        visit(entry->handle, entry->erased);
+    }
+    return true;
+  }
+
+private:
+  struct Entry {
+    Handle<T> handle;
+    uint64_t at;
+    bool erased;
+  };
+  struct Stamp {
+    uint32_t generation = 0;
+    uint64_t version = 0;
+  };
+
+  // the log is cut back to the newer half once it gets long, rather than kept
+  // forever
+  static constexpr size_t MAX_LOG = 1 << 16;
+
+  void push(Entry entry) {
+    if (log.size() == MAX_LOG) {
+      const size_t drop = MAX_LOG / 2;
+      since = log[drop - 1].at;
+      log.erase(log.begin(), log.begin() + drop);
+    }
+    log.push_back(entry);
+  }
+
+  uint64_t latest = 0;
+  uint64_t layout = 0;
+  // changes from before this aren't in the log
+  uint64_t since = 0;
+  // by slot, when that slot's item last changed
+  std::vector<Stamp> stamps;
+  // in order of at
+  std::vector<Entry> log;
+};
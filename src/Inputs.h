@@ -17,6 +17,9 @@ struct Inputs{
             uint16_t IncrementSelection : 1;
             uint16_t DecrementSelection : 1;
             uint16_t SetPlayerSpawn     : 1;
+            uint16_t Undo               : 1;
+            uint16_t Redo               : 1;
+            uint16_t ExtendSelection    : 1;
         };
     };
 };
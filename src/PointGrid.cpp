@@ -0,0 +1,86 @@
+#include "PointGrid.h"
+#include <algorithm>
+#include <cassert>
+
+void PointGrid::insert(size_t index, Vec2 position) {
+  assert(index <= count);
+  // the usual case of adding to the end doesn't renumber anything
+  if (index < count)
+    renumber(uint32_t(index), 1);
+  add(cellKey(position), uint32_t(index));
+  ++count;
+}
+
+void PointGrid::move(size_t index, Vec2 from, Vec2 to) {
+  assert(index < count);
+  uint64_t before = cellKey(from);
+  uint64_t after = cellKey(to);
+  if (before == after)
+    return;
+  remove(before, uint32_t(index));
+  add(after, uint32_t(index));
+}
+
+void PointGrid::erase(size_t index, Vec2 position) {
+  assert(index < count);
+  remove(cellKey(position), uint32_t(index));
+  --count;
+  if (index < count)
+    renumber(uint32_t(index) + 1, -1);
+}
+
+void PointGrid::swapErase(size_t index, Vec2 position, Vec2 last_position) {
+  assert(index < count);
+  remove(cellKey(position), uint32_t(index));
+  --count;
+  if (index == count)
+    return;
+  relabel(cellKey(last_position), uint32_t(count), uint32_t(index));
+}
+
+void PointGrid::swapInsert(size_t index, Vec2 position, Vec2 moved_position) {
+  assert(index <= count);
+  if (index < count)
+    relabel(cellKey(moved_position), uint32_t(index), uint32_t(count));
+  add(cellKey(position), uint32_t(index));
+  ++count;
+}
+
+void PointGrid::clear() {
+  cells.clear();
+  count = 0;
+}
+
+void PointGrid::add(uint64_t key, uint32_t index) {
+  cells[key].push_back(index);
+}
+
+void PointGrid::remove(uint64_t key, uint32_t index) {
+  auto found = cells.find(key);
+  assert(found != cells.end());
+  auto &cell = found->second;
+  auto it = std::find(cell.begin(), cell.end(), index);
+  assert(it != cell.end());
+  // order within a cell doesn't matter
+  *it = cell.back();
+  cell.pop_back();
+  // so that cells left behind by dragging things around don't pile up
+  if (cell.empty())
+    cells.erase(found);
+}
+
+void PointGrid::relabel(uint64_t key, uint32_t from, uint32_t to) {
+  auto found = cells.find(key);
+  assert(found != cells.end());
+  auto &cell = found->second;
+  auto it = std::find(cell.begin(), cell.end(), from);
+  assert(it != cell.end());
+  *it = to;
+}
+
+void PointGrid::renumber(uint32_t first, int32_t delta) {
+  for (auto &[key, cell] : cells)
+    for (uint32_t &index : cell)
+      if (index >= first)
+        index += delta;
+}
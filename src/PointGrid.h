@@ -0,0 +1,137 @@
+#pragma once
+
+#include "Vec2.h"
+#include <cmath>
+#include <cstdint>
+#include <optional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/**
+ * @brief Indices of points bucketed into a uniform grid of square cells, so
+ * finding what's under the mouse only looks at the points near it.
+ *
+ * The grid keeps nothing but the indices. Whoever owns the points tells it
+ * whenever one is added, moved or removed, with the same indices as the
+ * vector they're kept in. Adding or removing anywhere but the end renumbers
+ * the points after it, which costs as much as it does for the vector, apart
+ * from swapErase and swapInsert which only renumber one point.
+ */
+class PointGrid {
+public:
+  /// Picking within cell_size of the mouse looks at 9 cells at most
+  explicit PointGrid(float cell_size) : cell_size(cell_size) {}
+
+  /// Add a point at index, moving the ones from index onwards along one
+  void insert(size_t index, Vec2 position);
+  /// Point index has moved from one place to another
+  void move(size_t index, Vec2 from, Vec2 to);
+  /// Remove point index, which is at position, moving later ones back one
+  void erase(size_t index, Vec2 position);
+  /// Remove point index, which is at position, by moving the last point,
+  /// which is at last_position, into its place
+  void swapErase(size_t index, Vec2 position, Vec2 last_position);
+  /// Add a point at index by moving the one there, which is at moved_position,
+  /// to the end
+  void swapInsert(size_t index, Vec2 position, Vec2 moved_position);
+  void clear();
+
+  inline size_t size() const { return count; }
+
+  /// How many cells queryBox looks in for a box from min to max. Once that's
+  /// as many as there are points, going through the points is quicker.
+  inline uint64_t cellsCovering(Vec2 min, Vec2 max) const {
+    const int32_t x0 = cellCoord(min.x), x1 = cellCoord(max.x);
+    const int32_t y0 = cellCoord(min.y), y1 = cellCoord(max.y);
+    if (x1 < x0 || y1 < y0)
+      return 0;
+    return (uint64_t(x1 - x0) + 1) * (uint64_t(y1 - y0) + 1);
+  }
+
+  /// Calls fn(index) for every point which could be within radius of
+  /// position. Some further away are passed too, so check the distance.
+  template <typename Fn>
+  void query(Vec2 position, float radius, Fn &&fn) const {
+    queryBox({position.x - radius, position.y - radius},
+             {position.x + radius, position.y + radius}, fn);
+  }
+
+  /// Calls fn(index) for every point which could be between min and max, in
+  /// no particular order. Some outside are passed too, so check.
+  template <typename Fn> void queryBox(Vec2 min, Vec2 max, Fn &&fn) const {
+    const int32_t x0 = cellCoord(min.x);
+    const int32_t x1 = cellCoord(max.x);
+    const int32_t y0 = cellCoord(min.y);
+    const int32_t y1 = cellCoord(max.y);
+    if (x1 < x0 || y1 < y0)
+      return;
+    // a huge box covers more cells than there are, so just go through the
+    // ones there are
+    if ((uint64_t(x1 - x0) + 1) * (uint64_t(y1 - y0) + 1) > cells.size()) {
+      for (const auto &[key, cell] : cells)
+        for (uint32_t index : cell)
+          fn(size_t(index));
+      return;
+    }
+    for (int32_t y = y0; y <= y1; ++y) {
+      for (int32_t x = x0; x <= x1; ++x) {
+        auto found = cells.find(cellKey(x, y));
+        if (found == cells.end())
+          continue;
+        for (uint32_t index : found->second)
+          fn(size_t(index));
+      }
+    }
+  }
+
+  /// The point nearest to position and closer than radius, along with how far
+  /// it is. Ties go to the lowest index. position_of(index) gives back where a
+  /// point is.
+  template <typename PositionOf>
+  std::optional<std::pair<size_t, float>>
+  nearest(Vec2 position, float radius, PositionOf &&position_of) const {
+    std::optional<std::pair<size_t, float>> best;
+    query(position, radius, [&](size_t index) {
+      Vec2 point = position_of(index);
+      float w = point.x - position.x;
+      float h = point.y - position.y;
+      float dist = std::sqrt(w * w + h * h);
+      if (dist < radius &&
+          (!best || dist < best->second ||
+           (dist == best->second && index < best->first)))
+        best = {index, dist};
+    });
+    return best;
+  }
+
+private:
+  /// Which column or row a coordinate falls in. Points too far out, or not
+  /// numbers at all, share the cells at the very edge.
+  inline int32_t cellCoord(float value) const {
+    constexpr float LIMIT = 1 << 30;
+    float cell = std::floor(value / cell_size);
+    if (!(cell > -LIMIT))
+      return -int32_t(LIMIT);
+    if (cell > LIMIT)
+      return int32_t(LIMIT);
+    return int32_t(cell);
+  }
+  static inline uint64_t cellKey(int32_t x, int32_t y) {
+    return uint64_t(uint32_t(x)) << 32 | uint32_t(y);
+  }
+  inline uint64_t cellKey(Vec2 position) const {
+    return cellKey(cellCoord(position.x), cellCoord(position.y));
+  }
+
+  void add(uint64_t key, uint32_t index);
+  void remove(uint64_t key, uint32_t index);
+  // the point numbered from in cell key is now numbered to
+  void relabel(uint64_t key, uint32_t from, uint32_t to);
+  // add delta to every index from first onwards
+  void renumber(uint32_t first, int32_t delta);
+
+  std::unordered_map<uint64_t, std::vector<uint32_t>> cells;
+  float cell_size;
+  size_t count = 0;
+};
@@ -4,6 +4,7 @@
 #else
 #include <SDL.h>
 #endif
+#include <algorithm>
 #include <cmath>
 #include <limits>
 #include "util.h"
@@ -11,7 +12,8 @@
 #include <string>
 #include <iomanip>
 
-void Polygon::addPoint(Inputs& i){
+void Polygon::addPoint(const VertexPool& pool, Inputs& i, std::vector<PointChange>& changes){
+        auto points = pool.points(range);
         if (i.AddPoint && points.size() >= 2) {
             float minDistance = std::numeric_limits<float>::max();
             size_t closestSegmentIndex = 0;
@@ -29,73 +31,136 @@ void Polygon::addPoint(Inputs& i){
                 (points[closestSegmentIndex].x + points[(closestSegmentIndex + 1) % points.size()].x) / 2.0f,
                 (points[closestSegmentIndex].y + points[(closestSegmentIndex + 1) % points.size()].y) / 2.0f
             };
-            points.insert(points.begin() + closestSegmentIndex + 1, midPoint);
+            changes.push_back({PointChange::Kind::Insert, closestSegmentIndex + 1, midPoint});
         }
     }
 
 
-void Polygon::selectPoint(Inputs& i){
+void Polygon::selectPoint(const VertexPool& pool, Inputs& i){
+        auto points = pool.points(range);
         selectedPoint = -1;
         Vec2 mousePoint = {(float)i.mouseX, (float)i.mouseY};
-        for(int i = 0; i < points.size(); i++){
-            float dist = pointPointDistance(points[i], mousePoint);
-            if(dist < SELECT_DISTANCE){
-                selectedPoint = i;
-                break;
+        buildGrid(pool);
+        // the first point close enough, same as going through them in order
+        grid.query(mousePoint, SELECT_DISTANCE, [&](size_t j) {
+            float dist = pointPointDistance(points[j], mousePoint);
+            if (dist < SELECT_DISTANCE && (selectedPoint == -1 || (int)j < selectedPoint)) {
+                selectedPoint = j;
             }
+        });
+    }
+void Polygon::buildGrid(const VertexPool& pool){
+        if (gridBuilt) return;
+        auto points = pool.points(range);
+        for (size_t j = 0; j < points.size(); j++) {
+            grid.insert(j, points[j]);
         }
+        gridBuilt = true;
+    }
+void Polygon::growBounds(Vec2 position){
+        boundsMin = {std::min(boundsMin.x, position.x), std::min(boundsMin.y, position.y)};
+        boundsMax = {std::max(boundsMax.x, position.x), std::max(boundsMax.y, position.y)};
     }
-void Polygon::dragPoint(Inputs& i){
+bool Polygon::overlaps(const VertexPool& pool, Vec2 min, Vec2 max){
+        auto points = pool.points(range);
+        if (points.empty()) return false;
+        if (!boundsKnown) {
+            boundsMin = boundsMax = points[0];
+            for (Vec2 point : points) growBounds(point);
+            boundsKnown = true;
+        }
+        return max.x >= boundsMin.x && min.x <= boundsMax.x && max.y >= boundsMin.y && min.y <= boundsMax.y;
+    }
+void Polygon::dragPoint(Inputs& i, std::vector<PointChange>& changes){
     if(selectedPoint != -1){
-        points[selectedPoint].x = i.mouseX;
-        points[selectedPoint].y = i.mouseY;
+        Vec2 position = {(float)i.mouseX, (float)i.mouseY};
+        changes.push_back({PointChange::Kind::Move, (size_t)selectedPoint, position});
     }
 }
 
-void Polygon::deletePoint(Inputs& i){
+void Polygon::deletePoint(std::vector<PointChange>& changes){
     if(selectedPoint != -1){
-        if(points.size() > 3){
-            points.erase(points.begin() + selectedPoint);
+        if(range.count > 3){
+            size_t index = selectedPoint;
+            changes.push_back({PointChange::Kind::Erase, index, {}});
         }
     }
 }
-void Polygon::updatePolygon(Inputs& i){
+std::vector<PointChange> Polygon::updatePolygon(const VertexPool& pool, Inputs& i){
+    std::vector<PointChange> changes;
     if (i.AddPoint) {
-        addPoint(i);
+        addPoint(pool, i, changes);
     }
     if(i.Select){
-        selectPoint(i);
+        selectPoint(pool, i);
     } else if(i.DragPoint){
-        dragPoint(i);
+        dragPoint(i, changes);
     } else if(i.DeletePoint){ 
-        deletePoint(i);
+        deletePoint(changes);
+    }
+    return changes;
+}
+
+void Polygon::insertPoint(VertexPool& pool, size_t index, Vec2 position){
+    if (gridBuilt) grid.insert(index, position);
+    if (boundsKnown) growBounds(position);
+    pool.insert(range, index, position);
+    ++version;
+}
+
+void Polygon::movePoint(VertexPool& pool, size_t index, Vec2 position){
+    Vec2& point = pool.points(range)[index];
+    if (gridBuilt) grid.move(index, point, position);
+    if (boundsKnown) growBounds(position);
+    point = position;
+    ++version;
+}
+
+void Polygon::erasePoint(VertexPool& pool, size_t index){
+    if (gridBuilt) grid.erase(index, pool.points(range)[index]);
+    pool.erase(range, index);
+    if(selectedPoint >= (int)range.count){
+        selectedPoint = -1;
     }
+    ++version;
+}
+
+void Polygon::release(VertexPool& pool){
+    pool.release(range);
+    grid.clear();
+    gridBuilt = false;
+    boundsKnown = false;
+    selectedPoint = -1;
+    ++version;
 }
 
-void Polygon::drawPolygon(SDL_Renderer* r, uint8_t red, uint8_t green, uint8_t blue){
+void Polygon::drawPolygon(const VertexPool& pool, SDL_Renderer* r, uint8_t red, uint8_t green, uint8_t blue) const{
     SDL_SetRenderDrawColor(r, red, green, blue, 255); //White Lines
 
+    auto points = pool.points(range);
     if (points.size() < 2) {
         return;
     }
-    
+
+    // Vec2 is laid out the same as SDL_FPoint, so the outline is drawn
+    // straight out of the pool
+    static_assert(sizeof(Vec2) == sizeof(SDL_FPoint));
+    SDL_RenderDrawLinesF(r, reinterpret_cast<const SDL_FPoint*>(points.data()), points.size());
+    SDL_RenderDrawLineF(r, points.back().x, points.back().y, points[0].x, points[0].y);
+
     //Render Rectangles
     SDL_Rect rect;
     rect.w = 8;
     rect.h = 8;
-    for (size_t i = 0; i < points.size() - 1; ++i) {
-        SDL_RenderDrawLine(r, points[i].x, points[i].y, points[i + 1].x, points[i + 1].y);
-        rect.x = points[i].x - 4;
-        rect.y = points[i].y - 4;
+    for (const Vec2& point : points) {
+        rect.x = point.x - 4;
+        rect.y = point.y - 4;
         SDL_RenderFillRect(r, &rect);
     }
-    SDL_RenderDrawLine(r, points.back().x, points.back().y, points[0].x, points[0].y);
-        rect.x = points.back().x - 4;
-        rect.y = points.back().y - 4;
-        SDL_RenderFillRect(r, &rect);
 }
 
-std::string Polygon::SerializePolygon() {
+std::string Polygon::SerializePolygon(const VertexPool& pool) const {
+    auto points = pool.points(range);
     std::ostringstream oss;
     for (const Vec2& point : points) {
         oss << std::fixed << std::setprecision(2) << point.x << " " << point.y << " ";
@@ -7,42 +7,113 @@
 #include <SDL.h>
 #endif
 #include "Inputs.h"
+#include "PointGrid.h"
 #include "Vec2.h"
+#include "VertexPool.h"
+#include <algorithm>
+#include <array>
 #include <span>
 
 const float SELECT_DISTANCE = 25.0f;
 
+// A change the inputs make to the points, which the room goes on to make
+struct PointChange{
+    enum class Kind{ Insert, Move, Erase };
+    Kind kind;
+    size_t index;
+    Vec2 position;
+};
+
+// The points themselves are kept in a VertexPool shared by every polygon in
+// the room, which gets passed to anything that looks at them
 struct Polygon{
 private:
     //Variables    
-    std::vector<Vec2> points;
-    int selectedPoint;
+    VertexPool::Range range;
+    int selectedPoint = -1;
+    // the points again, for picking one with the mouse. only built the first
+    // time a point is picked, so loading lots of polygons doesn't pay for it
+    PointGrid grid{SELECT_DISTANCE};
+    bool gridBuilt = false;
+    // a box around the points, worked out the first time a box selection
+    // looks at them. erasing a point leaves it as big as it was
+    Vec2 boundsMin, boundsMax;
+    bool boundsKnown = false;
+    // goes up whenever the points change
+    uint32_t version = 0;
 
     //Private Functions
-    void addPoint(Inputs& i);
-    void selectPoint(Inputs& i);
-    void dragPoint(Inputs& i);
-    void deletePoint(Inputs& i);
+    void addPoint(const VertexPool& pool, Inputs& i, std::vector<PointChange>& changes);
+    void selectPoint(const VertexPool& pool, Inputs& i);
+    void dragPoint(Inputs& i, std::vector<PointChange>& changes);
+    void deletePoint(std::vector<PointChange>& changes);
+    void buildGrid(const VertexPool& pool);
+    void growBounds(Vec2 position);
+    // whether the points' bounds reach into the box from min to max
+    bool overlaps(const VertexPool& pool, Vec2 min, Vec2 max);
 
 public:
-    inline constexpr const std::vector<Vec2>& getPoints() const {return points;}
-    Polygon(const std::span<const Vec2>& vertices) {
-        points.reserve(vertices.size());
-        // copy the vertices
-        for (const auto& vertex : vertices) {
-            points.push_back(vertex);
-        }
-        selectedPoint = -1;
+    inline std::span<const Vec2> getPoints(const VertexPool& pool) const {return pool.points(range);}
+    inline VertexPool::Range& getRange() {return range;}
+    // Different every time the points have changed, for anything worked out
+    // from them to tell if it's out of date
+    inline uint32_t getVersion() const {return version;}
+
+    // No points yet
+    Polygon() = default;
+    // copy the vertices into the pool
+    Polygon(VertexPool& pool, std::span<const Vec2> vertices) : range(pool.add(vertices)) {}
+    // Points which are already in the pool, e.g. copied there while loading
+    explicit Polygon(VertexPool::Range range) : range(range) {}
+
+    // The points of a new polygon placed at x, y
+    static std::array<Vec2, 3> startingPoints(int x, int y){
+        return {{
+            {static_cast<float>(x - 20), static_cast<float>(y + 20)},
+            {static_cast<float>(x - 20), static_cast<float>(y - 20)},
+            {static_cast<float>(x + 20), static_cast<float>(y - 20)},
+        }};
     }
+    // Returns what the inputs do to the points, in the order it happens. The
+    // points don't change until somebody makes the changes with the functions
+    // below, so they can be undone.
+    std::vector<PointChange> updatePolygon(const VertexPool& pool, Inputs& i);
+
+    // Change the points directly. The index has to be in range.
+    void insertPoint(VertexPool& pool, size_t index, Vec2 position);
+    void movePoint(VertexPool& pool, size_t index, Vec2 position);
+    void erasePoint(VertexPool& pool, size_t index);
+    // Give the points back to the pool, when the polygon is going away
+    void release(VertexPool& pool);
+    // The points were moved straight through the pool, so the grid and bounds
+    // for picking them are out of date. They're worked out again the next
+    // time they're needed.
+    inline void pointsMoved() {grid.clear(); gridBuilt = false; boundsKnown = false; ++version;}
 
-    //Constructor
-    Polygon(int x, int y){
-        points.push_back((Vec2){static_cast<float>(x - 20), static_cast<float>(y + 20)});
-        points.push_back((Vec2){static_cast<float>(x - 20), static_cast<float>(y - 20)});
-        points.push_back((Vec2){static_cast<float>(x + 20), static_cast<float>(y - 20)});
-        selectedPoint = -1;
+    // Calls fn(index) for every point from min to max, lowest first.
+    // inside(point) has the last word on the ones which are close.
+    template <typename Inside, typename Fn>
+    void pointsWithin(const VertexPool& pool, Vec2 min, Vec2 max, Inside&& inside, Fn&& fn){
+        if (!overlaps(pool, min, max)) return;
+        auto points = pool.points(range);
+        // the grid only pays off once the box is small next to the polygon
+        const Vec2 from = {std::max(min.x, boundsMin.x), std::max(min.y, boundsMin.y)};
+        const Vec2 to = {std::min(max.x, boundsMax.x), std::min(max.y, boundsMax.y)};
+        if (grid.cellsCovering(from, to) >= points.size()) {
+            for (size_t j = 0; j < points.size(); j++) {
+                if (inside(points[j])) fn(j);
+            }
+            return;
+        }
+        buildGrid(pool);
+        std::vector<size_t> found;
+        grid.queryBox(min, max, [&](size_t j) {
+            if (inside(points[j])) found.push_back(j);
+        });
+        std::sort(found.begin(), found.end());
+        for (size_t j : found) fn(j);
     }
-    void updatePolygon(Inputs& i);
-    void drawPolygon(SDL_Renderer* r, uint8_t red, uint8_t green, uint8_t blue);
-    std::string SerializePolygon();
+
+    void drawPolygon(const VertexPool& pool, SDL_Renderer* r, uint8_t red, uint8_t green, uint8_t blue) const;
+    std::string SerializePolygon(const VertexPool& pool) const;
 };
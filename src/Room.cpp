@@ -1,12 +1,132 @@
 #include "Room.h"
+#include "util.h"
+#include <algorithm>
 #include <cmath>
+#include <string_view>
+#include <tuple>
+#include <unordered_map>
 
-Room::Room() {
-  setCurrentTool(EditingTool::Polygons);
-  currentPolygon = -1;
+namespace {
+// the game loads what the editor saves, so it gets its geometry worked out
+// when saving instead of every time a room loads. only terrains that changed
+// since they were last baked are triangulated again
+constexpr cw::SaveOptions SAVE_OPTIONS{.bake = true, .keep_baked = true};
+
+bool erases(const cw::Edit &edit) {
+  return edit.op == cw::EditOp::Erase || edit.op == cw::EditOp::SwapErase;
+}
+
+// how to undo op on an item
+cw::EditOp reverseOp(cw::EditOp op) {
+  switch (op) {
+  case cw::EditOp::Insert:
+    return cw::EditOp::Erase;
+  case cw::EditOp::Set:
+    return cw::EditOp::Set;
+  case cw::EditOp::Erase:
+    return cw::EditOp::Insert;
+  case cw::EditOp::SwapErase:
+    return cw::EditOp::SwapInsert;
+  case cw::EditOp::SwapInsert:
+    return cw::EditOp::SwapErase;
+  }
+  std::abort();
+}
+
+// insert, overwrite or erase items[edit.index], if that is in range, and
+// note it in log at version at
+template <typename T>
+bool editSlots(SlotMap<T> &items, ChangeLog<T> &log, uint64_t at,
+               const cw::Edit &edit, const T &value) {
+  switch (edit.op) {
+  case cw::EditOp::Insert:
+    if (edit.index > items.size())
+      return false;
+    log.added(items.insert(edit.index, value), at);
+    return true;
+  case cw::EditOp::Set:
+    if (edit.index >= items.size())
+      return false;
+    items[edit.index] = value;
+    log.changed(items.handleAt(edit.index), at);
+    return true;
+  case cw::EditOp::Erase:
+    if (edit.index >= items.size())
+      return false;
+    log.erased(items.handleAt(edit.index), at);
+    items.erase(edit.index);
+    return true;
+  case cw::EditOp::SwapErase:
+    if (edit.index >= items.size())
+      return false;
+    log.erased(items.handleAt(edit.index), at);
+    items.swapErase(edit.index);
+    return true;
+  case cw::EditOp::SwapInsert:
+    if (edit.index > items.size())
+      return false;
+    log.added(items.swapInsert(edit.index, value), at);
+    return true;
+  }
+  return false;
+}
+
+// make the same change to grid as editSlots just made to the items it
+// indexes. before is where the edited item was, after where it is now and
+// last where the last item was, which swapErase moves. swapInsert moves the
+// item which was at before
+void editGrid(PointGrid &grid, const cw::Edit &edit, Vec2 before, Vec2 after,
+              Vec2 last) {
+  switch (edit.op) {
+  case cw::EditOp::Insert:
+    grid.insert(edit.index, after);
+    return;
+  case cw::EditOp::Set:
+    grid.move(edit.index, before, after);
+    return;
+  case cw::EditOp::Erase:
+    grid.erase(edit.index, before);
+    return;
+  case cw::EditOp::SwapErase:
+    grid.swapErase(edit.index, before, last);
+    return;
+  case cw::EditOp::SwapInsert:
+    grid.swapInsert(edit.index, after, before);
+    return;
+  }
+}
+
+bool samePoint(Vec2 a, Vec2 b) { return a.x == b.x && a.y == b.y; }
+
+bool sameTransform(const Affine &a, const Affine &b) {
+  return a.a == b.a && a.b == b.b && a.c == b.c && a.d == b.d &&
+         a.tx == b.tx && a.ty == b.ty;
+}
+
+Vec2 origin(const cw::PrefabInstance &instance) {
+  return {instance.transform.tx, instance.transform.ty};
+}
+
+// sort items by key and drop the ones with the same key as another
+template <typename T, typename Key>
+void removeDuplicates(std::vector<T> &items, Key &&key) {
+  std::sort(items.begin(), items.end(),
+            [&](const T &a, const T &b) { return key(a) < key(b); });
+  items.erase(std::unique(items.begin(), items.end(),
+                          [&](const T &a, const T &b) {
+                            return key(a) == key(b);
+                          }),
+              items.end());
 }
+} // namespace
+
+Room::Room() { setCurrentTool(EditingTool::Polygons); }
 
 void Room::setCurrentTool(EditingTool tool) {
+  if (tool != currentTool) {
+    endTransform();
+    selectPath.clear();
+  }
   currentTool = tool;
   switch (tool) {
   case EditingTool::Polygons:
@@ -21,14 +141,28 @@ void Room::setCurrentTool(EditingTool tool) {
   case EditingTool::BuildSites:
     updateFunc = [this](Inputs i) { updateRoomBuildSiteTool(i); };
     return;
+  case EditingTool::Select:
+    updateFunc = [this](Inputs i) { updateRoomSelectTool(i); };
+    return;
+  case EditingTool::Prefabs:
+    updateFunc = [this](Inputs i) { updateRoomPrefabTool(i); };
+    return;
   }
   std::abort();
 }
 
 void Room::updateRoom(Inputs i) {
   if (i.SetPlayerSpawn) {
-    player_spawn = {.x = (float)i.mouseX, .y = (float)i.mouseY};
+    apply(cw::Edit{
+        .op = cw::EditOp::Set,
+        .target = cw::EditTarget::Spawn,
+        .position = {.x = (float)i.mouseX, .y = (float)i.mouseY},
+    });
   }
+  if (i.Undo)
+    undo();
+  if (i.Redo)
+    redo();
   if (updateFunc)
     updateFunc.value()(i);
 }
@@ -36,330 +170,1561 @@ void Room::updateRoom(Inputs i) {
 void Room::updateRoomPolygonTool(Inputs i) {
   // Add New Polygon
   if (i.New) {
-    Areas.push_back(Polygon(i.mouseX, i.mouseY));
-    terrain_types.push_back(terrain_type);
-    currentPolygon = Areas.size() - 1;
+    uint32_t index = terrains.size();
+    apply(cw::Edit{
+        .op = cw::EditOp::Insert,
+        .target = cw::EditTarget::Terrain,
+        .index = index,
+        .terrain_type = terrain_type,
+    });
+    uint32_t vertex = 0;
+    for (Vec2 point : Polygon::startingPoints(i.mouseX, i.mouseY)) {
+      apply(cw::Edit{
+          .op = cw::EditOp::Insert,
+          .target = cw::EditTarget::Vertex,
+          .index = index,
+          .vertex = vertex++,
+          .position = point,
+      });
+    }
+    currentPolygon = terrains.handleAt(index);
   }
   // Delete current Polygon
   if (i.Delete) {
-    if (currentPolygon && Areas.size() != 0) {
-      if (currentPolygon.value() >= Areas.size()) {
-        currentPolygon = {};
-        return;
-      }
-      Areas.erase(Areas.begin() + currentPolygon.value());
-      terrain_types.erase(terrain_types.begin() + currentPolygon.value());
+    if (auto index = terrains.indexOf(currentPolygon)) {
+      apply(cw::Edit{
+          .op = cw::EditOp::SwapErase,
+          .target = cw::EditTarget::Terrain,
+          .index = uint32_t(*index),
+      });
     }
   }
 
   // change current polygon with keyboard
-  if (!Areas.empty()) {
+  if (!terrains.empty()) {
     if (i.IncrementSelection) {
-      if (!currentPolygon)
-        currentPolygon = 0;
-      currentPolygon = (currentPolygon.value() + 1) % Areas.size();
+      size_t index = terrains.indexOf(currentPolygon).value_or(0);
+      currentPolygon = terrains.handleAt((index + 1) % terrains.size());
     }
 
     if (i.DecrementSelection) {
-      if (!currentPolygon)
-        currentPolygon = 0;
-      currentPolygon =
-          (currentPolygon.value() - 1 + Areas.size()) % Areas.size();
-    }
-    // Update Polygon
-    if (currentPolygon) {
-      if (currentPolygon.value() >= Areas.size()) {
-        currentPolygon = {};
-        return;
-      }
-      Areas[currentPolygon.value()].updatePolygon(i);
+      size_t index = terrains.indexOf(currentPolygon).value_or(0);
+      currentPolygon = terrains.handleAt((index - 1 + terrains.size()) %
+                                         terrains.size());
+    }
+  }
+
+  // Update Polygon
+  if (currentPolygon != Handle<RoomTerrain>{}) {
+    auto index = terrains.indexOf(currentPolygon);
+    if (!index) {
+      // it was deleted
+      currentPolygon = {};
+      return;
+    }
+    auto changes = terrains[*index].polygon.updatePolygon(vertices, i);
+    for (const auto &change : changes) {
+      cw::EditOp op = cw::EditOp::Erase;
+      if (change.kind == PointChange::Kind::Insert)
+        op = cw::EditOp::Insert;
+      else if (change.kind == PointChange::Kind::Move)
+        op = cw::EditOp::Set;
+      apply(cw::Edit{
+          .op = op,
+          .target = cw::EditTarget::Vertex,
+          .index = uint32_t(*index),
+          .vertex = uint32_t(change.index),
+          .position = change.position,
+      });
     }
   }
 }
 
 void Room::createImageAt(const char *filename, SDL_Texture *tex, float x,
                          float y) {
-  runtimeImageData.push_back(tex);
-  serializableImageData.push_back(cw::Image{
-      .filename = std::span(filename, strlen(filename)),
-      .data =
-          cw::ImageData{
-              .position =
-                  {
-                      .x = x,
-                      .y = y,
-                  },
-              .rotation = 0.0f,
-          },
-  });
+  apply(
+      cw::Edit{
+          .op = cw::EditOp::Insert,
+          .target = cw::EditTarget::Image,
+          .index = uint32_t(images.size()),
+          .image =
+              cw::Image{
+                  .filename = std::span(filename, strlen(filename)),
+                  .data =
+                      cw::ImageData{
+                          .position =
+                              {
+                                  .x = x,
+                                  .y = y,
+                              },
+                          .rotation = 0.0f,
+                      },
+              },
+      },
+      tex);
 }
 
 void Room::updateRoomBuildSiteTool(Inputs i) {
   if (i.New) {
-    buildSites.push_back(cw::BuildSite{
-        .position_a =
-            {
-                .x = (float)i.mouseX,
-                .y = (float)i.mouseY,
-            },
-        .position_b =
+    apply(cw::Edit{
+        .op = cw::EditOp::Insert,
+        .target = cw::EditTarget::BuildSite,
+        .index = uint32_t(buildSites.size()),
+        .build_site =
             {
-                .x = (float)i.mouseX,
-                .y = (float)i.mouseY + 10,
+                .position_a =
+                    {
+                        .x = (float)i.mouseX,
+                        .y = (float)i.mouseY,
+                    },
+                .position_b =
+                    {
+                        .x = (float)i.mouseX,
+                        .y = (float)i.mouseY + 10,
+                    },
             },
     });
   } else if (i.Delete) {
-    if (currentBuildSite) {
-      if (currentBuildSite.value() >= buildSites.size()) {
-        currentBuildSite = {};
-        return;
-      }
-      assert(buildSites.size() != 0);
-      buildSites.erase(buildSites.begin() + currentBuildSite.value());
+    if (auto index = buildSites.indexOf(currentBuildSite)) {
+      apply(cw::Edit{
+          .op = cw::EditOp::SwapErase,
+          .target = cw::EditTarget::BuildSite,
+          .index = uint32_t(*index),
+      });
     }
   }
 
   if (i.DragPoint && buildSites.size() != 0) {
     if (!buildSiteSelection) {
-      size_t nearest_index = 0;
-      float best_distance = INFINITY;
-      bool is_a;
-
-      size_t index = 0;
-      for (auto &site : buildSites) {
-        auto check = [i, &best_distance, &is_a, index,
-                      &nearest_index](Vec2 point, bool this_is_a) {
-          float w = abs(point.x - i.mouseX);
-          float h = abs(point.y - i.mouseY);
-          float dist = sqrt((w * w) + (h * h));
-
-          if (dist < best_distance) {
-            best_distance = dist;
-            is_a = this_is_a;
-            nearest_index = index;
-          }
-        };
-
-        check(site.position_a, true);
-        check(site.position_b, false);
-
-        index++;
-      }
-
-      if (best_distance > 30)
+      Vec2 mouse = {(float)i.mouseX, (float)i.mouseY};
+      auto a = buildSiteGridA.nearest(
+          mouse, BUILD_SITE_PICK_DISTANCE,
+          [this](size_t index) { return buildSites[index].position_a; });
+      auto b = buildSiteGridB.nearest(
+          mouse, BUILD_SITE_PICK_DISTANCE,
+          [this](size_t index) { return buildSites[index].position_b; });
+      if (!a && !b)
         return;
 
-      buildSiteSelection = {.index = nearest_index, .is_a = is_a};
+      // on a tie the earlier site wins, and a wins over b of the same site
+      bool is_a = a && (!b || a->second < b->second ||
+                        (a->second == b->second && a->first <= b->first));
+      buildSiteSelection = {
+          .site = buildSites.handleAt(is_a ? a->first : b->first),
+          .is_a = is_a,
+      };
     }
 
-    Vec2 &point = buildSiteSelection->is_a
-                      ? buildSites[buildSiteSelection->index].position_a
-                      : buildSites[buildSiteSelection->index].position_b;
+    auto index = buildSites.indexOf(buildSiteSelection->site);
+    if (!index) {
+      buildSiteSelection = {};
+      return;
+    }
+    cw::BuildSite site = buildSites[*index];
+    Vec2 &point = buildSiteSelection->is_a ? site.position_a : site.position_b;
 
     point.x = i.mouseX;
     point.y = i.mouseY;
+    apply(cw::Edit{
+        .op = cw::EditOp::Set,
+        .target = cw::EditTarget::BuildSite,
+        .index = uint32_t(*index),
+        .build_site = site,
+    });
   } else {
     buildSiteSelection = {};
   }
 }
 void Room::updateRoomTurretTool(Inputs i) {
   if (i.New) {
-    turrets.push_back(cw::Turret{
-        .position =
+    apply(cw::Edit{
+        .op = cw::EditOp::Insert,
+        .target = cw::EditTarget::Turret,
+        .index = uint32_t(turrets.size()),
+        .turret =
             {
-                .x = (float)i.mouseX,
-                .y = (float)i.mouseY,
+                .position =
+                    {
+                        .x = (float)i.mouseX,
+                        .y = (float)i.mouseY,
+                    },
+                .direction = {0, 1},
+                .fireRateSeconds = turret_fire_rate,
+                .pattern = turret_pattern,
             },
-        .direction = {0, 1},
-        .fireRateSeconds = turret_fire_rate,
-        .pattern = turret_pattern,
     });
   } else if (i.Delete) {
-    if (currentTurret) {
-      if (currentTurret.value() >= turrets.size())
-        currentTurret = {};
-      assert(turrets.size() != 0);
-      turrets.erase(turrets.begin() + currentTurret.value());
+    if (auto index = turrets.indexOf(currentTurret)) {
+      apply(cw::Edit{
+          .op = cw::EditOp::SwapErase,
+          .target = cw::EditTarget::Turret,
+          .index = uint32_t(*index),
+      });
     }
   }
 }
 
+void Room::setTurret(size_t index, const cw::Turret &turret) {
+  apply(cw::Edit{
+      .op = cw::EditOp::Set,
+      .target = cw::EditTarget::Turret,
+      .index = uint32_t(index),
+      .turret = turret,
+  });
+}
+
+void Room::setTerrainTypeFor(size_t index, cw::TerrainType type) {
+  apply(cw::Edit{
+      .op = cw::EditOp::Set,
+      .target = cw::EditTarget::Terrain,
+      .index = uint32_t(index),
+      .terrain_type = type,
+  });
+}
+
 void Room::updateRoomImageTool(Inputs i) {
   if (i.New && selectedImageFilename && selectedImage) {
     createImageAt(selectedImageFilename.value(), selectedImage.value(),
                   i.mouseX, i.mouseY);
   } else if (i.Delete) {
-    if (currentImage) {
-      if (currentImage.value() >= runtimeImageData.size()) {
-        currentImage = {};
-        return;
-      }
-      assert(runtimeImageData.size() != 0);
-      runtimeImageData.erase(runtimeImageData.begin() + currentImage.value());
-      serializableImageData.erase(serializableImageData.begin() +
-                                  currentImage.value());
+    if (auto index = images.indexOf(currentImage)) {
+      apply(cw::Edit{
+          .op = cw::EditOp::SwapErase,
+          .target = cw::EditTarget::Image,
+          .index = uint32_t(*index),
+      });
     }
   }
 
   if (i.DragPoint) {
-    if (currentImage) {
-      Vec2 &pos = serializableImageData[currentImage.value()].data.position;
+    if (auto index = images.indexOf(currentImage)) {
+      cw::Image image = images[*index].serializable;
+      Vec2 &pos = image.data.position;
       float w = abs(pos.x - i.mouseX);
       float h = abs(pos.y - i.mouseY);
       float dist = sqrt(w * w + h * h);
       // TODO: use AABB collision here with width and height of image, once i
       // figure out how to get that
-      if (dist < 100) {
+      if (dist < IMAGE_PICK_DISTANCE) {
         pos.x = i.mouseX;
         pos.y = i.mouseY;
+        apply(
+            cw::Edit{
+                .op = cw::EditOp::Set,
+                .target = cw::EditTarget::Image,
+                .index = uint32_t(*index),
+                .image = image,
+            },
+            images[*index].texture);
       }
     }
   } else if (i.Select) {
-    if (serializableImageData.size() == 0)
+    if (images.empty())
       return;
 
-    std::optional<size_t> best_image_index = {};
     // choose nearest image
-    float best_distance = INFINITY;
-    size_t index = 0;
-    for (const auto &image : serializableImageData) {
-      const auto &pos = image.data.position;
-      float w = abs(pos.x - i.mouseX);
-      float h = abs(pos.y - i.mouseY);
-      float dist = sqrt(w * w + h * h);
-      if (dist < best_distance && dist < 100) {
-        best_distance = dist;
-        best_image_index = index;
+    auto nearest = imageGrid.nearest(
+        {(float)i.mouseX, (float)i.mouseY}, IMAGE_PICK_DISTANCE,
+        [this](size_t index) {
+          return images[index].serializable.data.position;
+        });
+    if (!nearest)
+      return;
+
+    currentImage = images.handleAt(nearest->first);
+  }
+}
+
+void Room::updateRoomPrefabTool(Inputs i) {
+  const Vec2 mouse = {(float)i.mouseX, (float)i.mouseY};
+  if (i.New && currentPrefab < prefabs.size()) {
+    uint32_t index = instances.size();
+    apply(cw::Edit{
+        .op = cw::EditOp::Insert,
+        .target = cw::EditTarget::Instance,
+        .index = index,
+        .instance =
+            {
+                .prefab = uint32_t(currentPrefab),
+                .transform = Affine::translate(mouse),
+            },
+    });
+    currentInstance = instances.handleAt(index);
+  } else if (i.Delete) {
+    if (auto index = instances.indexOf(currentInstance)) {
+      apply(cw::Edit{
+          .op = cw::EditOp::SwapErase,
+          .target = cw::EditTarget::Instance,
+          .index = uint32_t(*index),
+      });
+    }
+  }
+
+  if (i.DragPoint) {
+    if (auto index = instances.indexOf(currentInstance)) {
+      cw::PrefabInstance instance = instances[*index];
+      if (pointPointDistance(origin(instance), mouse) <
+          INSTANCE_PICK_DISTANCE) {
+        instance.transform.tx = mouse.x;
+        instance.transform.ty = mouse.y;
+        apply(cw::Edit{
+            .op = cw::EditOp::Set,
+            .target = cw::EditTarget::Instance,
+            .index = uint32_t(*index),
+            .instance = instance,
+        });
       }
-      ++index;
     }
+  } else if (i.Select) {
+    auto nearest = instanceGrid.nearest(
+        mouse, INSTANCE_PICK_DISTANCE,
+        [this](size_t index) { return origin(instances[index]); });
+    if (nearest)
+      currentInstance = instances.handleAt(nearest->first);
+  }
+}
 
-    if (!best_image_index)
+void Room::updateRoomSelectTool(Inputs i) {
+  const Vec2 mouse = {(float)i.mouseX, (float)i.mouseY};
+  if (i.Cancel) {
+    if (transforming)
+      cancelTransform();
+    else
+      selection.clear();
+    selectPath.clear();
+    return;
+  }
+
+  if (i.Select) {
+    // taking hold of the selection transforms it, clicking anywhere else
+    // starts selecting
+    if (!i.ExtendSelection && beginTransform() &&
+        mouse.x > transforming->min.x - SELECT_DISTANCE &&
+        mouse.x < transforming->max.x + SELECT_DISTANCE &&
+        mouse.y > transforming->min.y - SELECT_DISTANCE &&
+        mouse.y < transforming->max.y + SELECT_DISTANCE) {
+      transforming->grabbed = mouse;
       return;
+    }
+    transforming = {};
+    selectPath = {mouse, mouse};
+    return;
+  }
 
-    currentImage = best_image_index;
+  if (i.DragPoint) {
+    if (transforming) {
+      const Vec2 pivot = transforming->pivot;
+      const Vec2 grabbed = transforming->grabbed;
+      switch (selectionDrag) {
+      case SelectionDrag::Move:
+        moveSelection(
+            Affine::translate({mouse.x - grabbed.x, mouse.y - grabbed.y}));
+        break;
+      case SelectionDrag::Rotate:
+        moveSelection(Affine::rotate(
+            std::atan2(mouse.y - pivot.y, mouse.x - pivot.x) -
+                std::atan2(grabbed.y - pivot.y, grabbed.x - pivot.x),
+            pivot));
+        break;
+      case SelectionDrag::Scale: {
+        // taken hold of right in the middle, there's nothing to scale by
+        float from = pointPointDistance(grabbed, pivot);
+        if (from < 1)
+          break;
+        float by = pointPointDistance(mouse, pivot) / from;
+        moveSelection(Affine::scale(by, by, pivot));
+        break;
+      }
+      }
+    } else if (!selectPath.empty()) {
+      // a box only needs where it started, a lasso gets a point whenever the
+      // mouse has gone far enough
+      if (selectShape == SelectShape::Box)
+        selectPath.back() = mouse;
+      else if (pointPointDistance(selectPath.back(), mouse) >= 4)
+        selectPath.push_back(mouse);
+    }
+    return;
   }
+
+  // let go
+  endTransform();
+  if (!selectPath.empty())
+    finishSelecting(i.ExtendSelection);
+}
+
+void Room::finishSelecting(bool extend) {
+  if (!extend)
+    selection.clear();
+  Vec2 min = selectPath[0], max = selectPath[0];
+  for (Vec2 point : selectPath) {
+    min = {std::min(min.x, point.x), std::min(min.y, point.y)};
+    max = {std::max(max.x, point.x), std::max(max.y, point.y)};
+  }
+  const bool lasso = selectShape == SelectShape::Lasso;
+  auto inside = [&](Vec2 p) {
+    if (p.x < min.x || p.x > max.x || p.y < min.y || p.y > max.y)
+      return false;
+    return !lasso || pointInPolygon(p, selectPath);
+  };
+
+  // only the cells the box covers are looked in, unless there are more of
+  // them than items. what's found goes in lowest index first either way
+  for (size_t terrain = 0; terrain < terrains.size(); ++terrain) {
+    const auto handle = terrains.handleAt(terrain);
+    terrains[terrain].polygon.pointsWithin(
+        vertices, min, max, inside, [&](size_t vertex) {
+          selection.vertices.push_back({handle, uint32_t(vertex)});
+        });
+  }
+  std::vector<size_t> found;
+  auto within = [&](const PointGrid &grid, auto position_of, auto select) {
+    if (grid.cellsCovering(min, max) >= grid.size()) {
+      for (size_t index = 0; index < grid.size(); ++index) {
+        if (inside(position_of(index)))
+          select(index);
+      }
+      return;
+    }
+    found.clear();
+    grid.queryBox(min, max, [&](size_t index) {
+      if (inside(position_of(index)))
+        found.push_back(index);
+    });
+    std::sort(found.begin(), found.end());
+    for (size_t index : found)
+      select(index);
+  };
+  within(
+      turretGrid, [this](size_t index) { return turrets[index].position; },
+      [this](size_t index) {
+        selection.turrets.push_back(turrets.handleAt(index));
+      });
+  within(
+      imageGrid,
+      [this](size_t index) { return images[index].serializable.data.position; },
+      [this](size_t index) {
+        selection.images.push_back(images.handleAt(index));
+      });
+  within(
+      buildSiteGridA,
+      [this](size_t index) { return buildSites[index].position_a; },
+      [this](size_t index) {
+        selection.buildSiteEnds.push_back({buildSites.handleAt(index), true});
+      });
+  within(
+      buildSiteGridB,
+      [this](size_t index) { return buildSites[index].position_b; },
+      [this](size_t index) {
+        selection.buildSiteEnds.push_back({buildSites.handleAt(index), false});
+      });
+  within(
+      instanceGrid, [this](size_t index) { return origin(instances[index]); },
+      [this](size_t index) {
+        selection.instances.push_back(instances.handleAt(index));
+      });
+  selectPath.clear();
+
+  if (extend) {
+    removeDuplicates(selection.vertices, [](const RoomSelection::Vertex &v) {
+      return std::tuple(v.terrain.slot, v.terrain.generation, v.index);
+    });
+    auto handle = [](auto h) { return std::pair(h.slot, h.generation); };
+    removeDuplicates(selection.turrets, handle);
+    removeDuplicates(selection.images, handle);
+    removeDuplicates(selection.instances, handle);
+    removeDuplicates(selection.buildSiteEnds,
+                     [](const RoomSelection::BuildSiteEnd &end) {
+                       return std::tuple(end.site.slot, end.site.generation,
+                                         end.is_a);
+                     });
+  }
+}
+
+bool Room::beginTransform() {
+  endTransform();
+  SelectionTransform t;
+  auto pool = vertices.all();
+  std::erase_if(selection.vertices, [&](const RoomSelection::Vertex &vertex) {
+    auto terrain = terrains.indexOf(vertex.terrain);
+    if (!terrain)
+      return true;
+    auto range = terrains[*terrain].polygon.getRange();
+    if (vertex.index >= range.count)
+      return true;
+    t.vertexOffsets.push_back(range.offset + vertex.index);
+    t.vertices.push_back({uint32_t(*terrain), vertex.index});
+    t.from.push_back(pool[range.offset + vertex.index]);
+    if (t.terrains.empty() || t.terrains.back() != *terrain)
+      t.terrains.push_back(uint32_t(*terrain));
+    return false;
+  });
+  std::erase_if(selection.turrets, [&](Handle<cw::Turret> turret) {
+    auto index = turrets.indexOf(turret);
+    if (!index)
+      return true;
+    t.turrets.push_back(uint32_t(*index));
+    return false;
+  });
+  std::erase_if(selection.images, [&](Handle<RoomImage> image) {
+    auto index = images.indexOf(image);
+    if (!index)
+      return true;
+    t.images.push_back(uint32_t(*index));
+    return false;
+  });
+  std::erase_if(selection.buildSiteEnds,
+                [&](const RoomSelection::BuildSiteEnd &end) {
+                  auto index = buildSites.indexOf(end.site);
+                  if (!index)
+                    return true;
+                  t.buildSiteEnds.push_back({uint32_t(*index), end.is_a});
+                  return false;
+                });
+  std::erase_if(selection.instances, [&](Handle<cw::PrefabInstance> instance) {
+    auto index = instances.indexOf(instance);
+    if (!index)
+      return true;
+    t.instances.push_back(uint32_t(*index));
+    t.instanceFrom.push_back(instances[*index].transform);
+    return false;
+  });
+  if (selection.empty())
+    return false;
+
+  for (uint32_t index : t.turrets)
+    t.from.push_back(turrets[index].position);
+  for (uint32_t index : t.images)
+    t.from.push_back(images[index].serializable.data.position);
+  // a then b of each site
+  std::sort(t.buildSiteEnds.begin(), t.buildSiteEnds.end(),
+            [](auto a, auto b) {
+              return std::pair(a.first, !a.second) <
+                     std::pair(b.first, !b.second);
+            });
+  for (auto [index, is_a] : t.buildSiteEnds) {
+    const auto &site = buildSites[index];
+    t.from.push_back(is_a ? site.position_a : site.position_b);
+  }
+  for (uint32_t index : t.instances)
+    t.from.push_back(origin(instances[index]));
+
+  std::sort(t.terrains.begin(), t.terrains.end());
+  t.terrains.erase(std::unique(t.terrains.begin(), t.terrains.end()),
+                   t.terrains.end());
+
+  t.min = t.max = t.from[0];
+  for (Vec2 point : t.from) {
+    t.min = {std::min(t.min.x, point.x), std::min(t.min.y, point.y)};
+    t.max = {std::max(t.max.x, point.x), std::max(t.max.y, point.y)};
+  }
+  t.pivot = {(t.min.x + t.max.x) / 2, (t.min.y + t.max.y) / 2};
+  t.to = t.from;
+  transforming = std::move(t);
+  return true;
+}
+
+void Room::moveSelection(const Affine &transform) {
+  auto &t = *transforming;
+  transform_points(transform, t.from, t.to);
+
+  // then scatter them back, the vertices mostly in order through the pool.
+  // none of this goes through applyEdit, so it notes the changes itself
+  const uint64_t at = changes.next();
+  size_t k = 0;
+  auto pool = vertices.all();
+  for (uint32_t offset : t.vertexOffsets)
+    pool[offset] = t.to[k++];
+  // the vertices were moved behind the polygons' backs
+  for (uint32_t terrain : t.terrains) {
+    terrains[terrain].polygon.pointsMoved();
+    changes.terrains.changed(terrains.handleAt(terrain), at);
+  }
+  for (uint32_t index : t.turrets) {
+    Vec2 &position = turrets[index].position;
+    turretGrid.move(index, position, t.to[k]);
+    position = t.to[k++];
+    changes.turrets.changed(turrets.handleAt(index), at);
+  }
+  for (uint32_t index : t.images) {
+    Vec2 &position = images[index].serializable.data.position;
+    imageGrid.move(index, position, t.to[k]);
+    position = t.to[k++];
+    changes.images.changed(images.handleAt(index), at);
+  }
+  for (auto [index, is_a] : t.buildSiteEnds) {
+    auto &site = buildSites[index];
+    Vec2 &position = is_a ? site.position_a : site.position_b;
+    (is_a ? buildSiteGridA : buildSiteGridB).move(index, position, t.to[k]);
+    position = t.to[k++];
+    changes.buildSites.changed(buildSites.handleAt(index), at);
+  }
+  for (size_t j = 0; j < t.instances.size(); ++j) {
+    cw::PrefabInstance &instance = instances[t.instances[j]];
+    const Vec2 from = origin(instance);
+    instance.transform = transform.after(t.instanceFrom[j]);
+    instanceGrid.move(t.instances[j], from, origin(instance));
+    changes.instances.changed(instances.handleAt(t.instances[j]), at);
+  }
+}
+
+void Room::endTransform() {
+  if (!transforming)
+    return;
+  const auto &t = *transforming;
+  // the room already looks like this, it only has to be remembered
+  auto remember = [this](const cw::Edit &edit, const cw::Edit &undo,
+                         SDL_Texture *tex = nullptr) {
+    record(edit);
+    const UndoCommand command{undo, tex};
+    history.record(edit, std::span(&command, 1));
+  };
+
+  size_t k = 0;
+  for (auto [terrain, vertex] : t.vertices) {
+    const size_t at = k++;
+    if (samePoint(t.from[at], t.to[at]))
+      continue;
+    cw::Edit edit{
+        .op = cw::EditOp::Set,
+        .target = cw::EditTarget::Vertex,
+        .index = terrain,
+        .vertex = vertex,
+        .position = t.to[at],
+    };
+    cw::Edit undo = edit;
+    undo.position = t.from[at];
+    remember(edit, undo);
+  }
+  for (uint32_t index : t.turrets) {
+    const size_t at = k++;
+    if (samePoint(t.from[at], t.to[at]))
+      continue;
+    cw::Edit edit{
+        .op = cw::EditOp::Set,
+        .target = cw::EditTarget::Turret,
+        .index = index,
+        .turret = turrets[index],
+    };
+    cw::Edit undo = edit;
+    undo.turret.position = t.from[at];
+    remember(edit, undo);
+  }
+  for (uint32_t index : t.images) {
+    const size_t at = k++;
+    if (samePoint(t.from[at], t.to[at]))
+      continue;
+    cw::Edit edit{
+        .op = cw::EditOp::Set,
+        .target = cw::EditTarget::Image,
+        .index = index,
+        .image = images[index].serializable,
+    };
+    cw::Edit undo = edit;
+    undo.image.data.position = t.from[at];
+    remember(edit, undo, images[index].texture);
+  }
+  // one edit for each site, even when both its ends moved
+  for (size_t end = 0; end < t.buildSiteEnds.size();) {
+    const uint32_t index = t.buildSiteEnds[end].first;
+    cw::Edit edit{
+        .op = cw::EditOp::Set,
+        .target = cw::EditTarget::BuildSite,
+        .index = index,
+        .build_site = buildSites[index],
+    };
+    cw::Edit undo = edit;
+    bool moved = false;
+    for (; end < t.buildSiteEnds.size() && t.buildSiteEnds[end].first == index;
+         ++end) {
+      const size_t at = k++;
+      moved |= !samePoint(t.from[at], t.to[at]);
+      (t.buildSiteEnds[end].second ? undo.build_site.position_a
+                                   : undo.build_site.position_b) = t.from[at];
+    }
+    if (moved)
+      remember(edit, undo);
+  }
+  for (size_t j = 0; j < t.instances.size(); ++j) {
+    const uint32_t index = t.instances[j];
+    if (sameTransform(t.instanceFrom[j], instances[index].transform))
+      continue;
+    cw::Edit edit{
+        .op = cw::EditOp::Set,
+        .target = cw::EditTarget::Instance,
+        .index = index,
+        .instance = instances[index],
+    };
+    cw::Edit undo = edit;
+    undo.instance.transform = t.instanceFrom[j];
+    remember(edit, undo);
+  }
+  transforming = {};
+}
+
+void Room::cancelTransform() {
+  if (!transforming)
+    return;
+  moveSelection(Affine{});
+  transforming = {};
+}
+
+void Room::rotateSelection(float radians) {
+  if (!beginTransform())
+    return;
+  moveSelection(Affine::rotate(radians, transforming->pivot));
+  endTransform();
+}
+
+void Room::scaleSelection(float x, float y) {
+  if (!beginTransform())
+    return;
+  moveSelection(Affine::scale(x, y, transforming->pivot));
+  endTransform();
+}
+
+bool Room::makePrefab() {
+  // works out where everything selected is, and the middle of it, which
+  // becomes the prefab's origin. nothing gets moved
+  if (!beginTransform())
+    return false;
+  const SelectionTransform t = std::move(*transforming);
+  transforming = {};
+  const Affine relative = Affine::translate({-t.pivot.x, -t.pivot.y});
+
+  auto prefab = std::make_shared<RoomPrefab>();
+  for (uint32_t terrain : t.terrains) {
+    auto points = terrains[terrain].polygon.getPoints(vertices);
+    for (Vec2 point : points)
+      prefab->vertices.push_back(relative.apply(point));
+    prefab->vertex_counts.push_back(uint32_t(points.size()));
+    prefab->terrain_types.push_back(terrains[terrain].type);
+  }
+  for (uint32_t index : t.turrets) {
+    cw::Turret turret = turrets[index];
+    turret.position = relative.apply(turret.position);
+    prefab->turrets.push_back(turret);
+  }
+  for (uint32_t index : t.images) {
+    const auto &[image, texture] = images[index];
+    prefab->image_filenames.emplace_back(image.filename.data(),
+                                         image.filename.size());
+    prefab->images.push_back({
+        .position = relative.apply(image.data.position),
+        .rotation = image.data.rotation,
+    });
+    prefab->image_textures.push_back(texture);
+  }
+  // each site once, however many of its ends are selected
+  std::vector<uint32_t> sites;
+  for (auto [index, is_a] : t.buildSiteEnds) {
+    if (sites.empty() || sites.back() != index)
+      sites.push_back(index);
+  }
+  for (uint32_t index : sites) {
+    prefab->buildSites.push_back({
+        .position_a = relative.apply(buildSites[index].position_a),
+        .position_b = relative.apply(buildSites[index].position_b),
+    });
+  }
+  if (prefab->empty())
+    return false;
+
+  // prefabs aren't journaled, so the next save writes the whole level
+  prefabs.push_back(std::move(prefab));
+  currentPrefab = prefabs.size() - 1;
+  changes.prefabs = changes.next();
+  journal.close();
+  unsavedEdits.clear();
+
+  // the originals go from the back, so swapping the last item into the gap
+  // never moves one which is still to go
+  history.endStep();
+  auto eraseAll = [this](cw::EditTarget target,
+                         const std::vector<uint32_t> &indices) {
+    for (auto index = indices.rbegin(); index != indices.rend(); ++index) {
+      apply(cw::Edit{
+          .op = cw::EditOp::SwapErase,
+          .target = target,
+          .index = *index,
+      });
+    }
+  };
+  auto sorted = [](std::vector<uint32_t> indices) {
+    std::sort(indices.begin(), indices.end());
+    return indices;
+  };
+  eraseAll(cw::EditTarget::Terrain, t.terrains);
+  eraseAll(cw::EditTarget::Turret, sorted(t.turrets));
+  eraseAll(cw::EditTarget::Image, sorted(t.images));
+  eraseAll(cw::EditTarget::BuildSite, sites);
+  const uint32_t index = instances.size();
+  apply(cw::Edit{
+      .op = cw::EditOp::Insert,
+      .target = cw::EditTarget::Instance,
+      .index = index,
+      .instance =
+          {
+              .prefab = uint32_t(currentPrefab),
+              .transform = Affine::translate(t.pivot),
+          },
+  });
+  history.endStep();
+
+  selection.clear();
+  currentInstance = instances.handleAt(index);
+  selection.instances.push_back(currentInstance);
+  return true;
+}
+
+void Room::apply(const cw::Edit &edit, SDL_Texture *tex) {
+  // worked out first, it needs what the edit is about to change
+  std::vector<UndoCommand> undo;
+  invert(edit, &undo);
+  if (!applyEdit(edit, tex))
+    return;
+  record(edit);
+  history.record(edit, undo);
+}
+
+void Room::invert(const cw::Edit &edit,
+                  std::vector<UndoCommand> *out) const {
+  cw::Edit undo{
+      .op = reverseOp(edit.op),
+      .target = edit.target,
+      .index = edit.index,
+      .vertex = edit.vertex,
+  };
+  // undoing an insert needs nothing but where it went
+  if (erases(undo)) {
+    out->push_back({undo});
+    return;
+  }
+
+  // otherwise it puts back what's there now
+  switch (edit.target) {
+  case cw::EditTarget::Vertex: {
+    if (edit.index >= terrains.size())
+      return;
+    auto points = terrains[edit.index].polygon.getPoints(vertices);
+    if (edit.vertex >= points.size())
+      return;
+    undo.position = points[edit.vertex];
+    out->push_back({undo});
+    return;
+  }
+  case cw::EditTarget::Terrain: {
+    if (edit.index >= terrains.size())
+      return;
+    const auto &terrain = terrains[edit.index];
+    undo.terrain_type = terrain.type;
+    if (edit.op != cw::EditOp::Set) {
+      // a terrain is put back empty, and then its vertices one by one
+      auto points = terrain.polygon.getPoints(vertices);
+      for (size_t vertex = points.size(); vertex-- > 0;) {
+        out->push_back({cw::Edit{
+            .op = cw::EditOp::Insert,
+            .target = cw::EditTarget::Vertex,
+            .index = edit.index,
+            .vertex = uint32_t(vertex),
+            .position = points[vertex],
+        }});
+      }
+    }
+    out->push_back({undo});
+    return;
+  }
+  case cw::EditTarget::Turret:
+    if (edit.index >= turrets.size())
+      return;
+    undo.turret = turrets[edit.index];
+    out->push_back({undo});
+    return;
+  case cw::EditTarget::Image:
+    if (edit.index >= images.size())
+      return;
+    undo.image = images[edit.index].serializable;
+    out->push_back({undo, images[edit.index].texture});
+    return;
+  case cw::EditTarget::BuildSite:
+    if (edit.index >= buildSites.size())
+      return;
+    undo.build_site = buildSites[edit.index];
+    out->push_back({undo});
+    return;
+  case cw::EditTarget::Spawn:
+    undo.position = player_spawn;
+    out->push_back({undo});
+    return;
+  case cw::EditTarget::Instance:
+    if (edit.index >= instances.size())
+      return;
+    undo.instance = instances[edit.index];
+    out->push_back({undo});
+    return;
+  }
+}
+
+std::vector<UndoCommand> Room::replay(std::span<const UndoCommand> step) {
+  std::vector<UndoCommand> reverse;
+  for (auto command = step.rbegin(); command != step.rend(); ++command) {
+    const size_t mark = reverse.size();
+    invert(command->edit, &reverse);
+    if (applyEdit(command->edit, command->texture))
+      record(command->edit);
+    else
+      reverse.resize(mark);
+  }
+  return reverse;
+}
+
+void Room::undo() {
+  endTransform();
+  auto step = history.takeUndo();
+  history.pushRedo(replay(step));
+}
+
+void Room::redo() {
+  endTransform();
+  auto step = history.takeRedo();
+  history.pushUndo(replay(step));
+}
+
+bool Room::applyEdit(const cw::Edit &edit, SDL_Texture *tex) {
+  // handed out whether or not the edit works, versions only have to go up
+  const uint64_t at = changes.next();
+  switch (edit.target) {
+  case cw::EditTarget::Vertex: {
+    if (edit.index >= terrains.size())
+      return false;
+    Polygon &area = terrains[edit.index].polygon;
+    size_t count = area.getPoints(vertices).size();
+    // only stamped once it's known to work
+    auto changed = [&] {
+      changes.terrains.changed(terrains.handleAt(edit.index), at);
+      return true;
+    };
+    switch (edit.op) {
+    case cw::EditOp::Insert:
+      if (edit.vertex > count)
+        return false;
+      area.insertPoint(vertices, edit.vertex, edit.position);
+      compactVertices();
+      // the vertices after it are numbered differently now. undoing a big
+      // delete inserts thousands one at a time, so rather than renumber the
+      // selection each time it's dropped
+      selection.vertices.clear();
+      return changed();
+    case cw::EditOp::Set:
+      if (edit.vertex >= count)
+        return false;
+      area.movePoint(vertices, edit.vertex, edit.position);
+      return changed();
+    case cw::EditOp::Erase:
+      if (edit.vertex >= count)
+        return false;
+      area.erasePoint(vertices, edit.vertex);
+      selection.vertices.clear();
+      return changed();
+    case cw::EditOp::SwapErase:
+    case cw::EditOp::SwapInsert:
+      // never journaled, see cw::valid_edit
+      return false;
+    }
+    return false;
+  }
+  case cw::EditTarget::Terrain:
+    // setting a terrain only changes its type, its vertices are edited one by
+    // one
+    if (edit.op == cw::EditOp::Set) {
+      if (edit.index >= terrains.size())
+        return false;
+      terrains[edit.index].type = edit.terrain_type;
+      changes.terrains.changed(terrains.handleAt(edit.index), at);
+      return true;
+    }
+    if (erases(edit) && edit.index < terrains.size())
+      terrains[edit.index].polygon.release(vertices);
+    if (!editSlots(terrains, changes.terrains, at, edit,
+                   RoomTerrain{.polygon = Polygon(), .type = edit.terrain_type}))
+      return false;
+    compactVertices();
+    return true;
+  case cw::EditTarget::Turret: {
+    Vec2 before =
+        edit.index < turrets.size() ? turrets[edit.index].position : Vec2{};
+    Vec2 last =
+        turrets.empty() ? Vec2{} : turrets[turrets.size() - 1].position;
+    if (!editSlots(turrets, changes.turrets, at, edit, edit.turret))
+      return false;
+    editGrid(turretGrid, edit, before, edit.turret.position, last);
+    return true;
+  }
+  case cw::EditTarget::Image: {
+    if (!erases(edit) && !tex)
+      return false;
+    Vec2 before = edit.index < images.size()
+                      ? images[edit.index].serializable.data.position
+                      : Vec2{};
+    Vec2 last = images.empty() ? Vec2{}
+                               : images[images.size() - 1]
+                                     .serializable.data.position;
+    if (!editSlots(images, changes.images, at, edit,
+                   RoomImage{edit.image, tex}))
+      return false;
+    editGrid(imageGrid, edit, before, edit.image.data.position, last);
+    return true;
+  }
+  case cw::EditTarget::BuildSite: {
+    cw::BuildSite before = edit.index < buildSites.size()
+                               ? buildSites[edit.index]
+                               : cw::BuildSite{};
+    cw::BuildSite last =
+        buildSites.empty() ? cw::BuildSite{} : buildSites[buildSites.size() - 1];
+    if (!editSlots(buildSites, changes.buildSites, at, edit, edit.build_site))
+      return false;
+    editGrid(buildSiteGridA, edit, before.position_a,
+             edit.build_site.position_a, last.position_a);
+    editGrid(buildSiteGridB, edit, before.position_b,
+             edit.build_site.position_b, last.position_b);
+    return true;
+  }
+  case cw::EditTarget::Spawn:
+    player_spawn = edit.position;
+    changes.spawn = at;
+    return true;
+  case cw::EditTarget::Instance: {
+    if (!erases(edit) && edit.instance.prefab >= prefabs.size())
+      return false;
+    Vec2 before =
+        edit.index < instances.size() ? origin(instances[edit.index]) : Vec2{};
+    Vec2 last =
+        instances.empty() ? Vec2{} : origin(instances[instances.size() - 1]);
+    if (!editSlots(instances, changes.instances, at, edit, edit.instance))
+      return false;
+    editGrid(instanceGrid, edit, before, origin(edit.instance), last);
+    return true;
+  }
+  }
+  return false;
+}
+
+void Room::compactVertices() {
+  if (!vertices.needsCompaction())
+    return;
+  // laid out in the same order as the terrains, which is how they're saved
+  vertices.compact(terrains, [](RoomTerrain &terrain) -> VertexPool::Range & {
+    return terrain.polygon.getRange();
+  });
+}
+
+void Room::bakeTerrains() {
+  std::vector<uint32_t> stale;
+  size_t num_vertices = 0;
+  for (size_t i = 0; i < terrains.size(); ++i) {
+    const RoomTerrain &terrain = terrains[i];
+    if (terrain.baked && terrain.bakedVersion == terrain.polygon.getVersion())
+      continue;
+    stale.push_back(uint32_t(i));
+    num_vertices += terrain.polygon.getPoints(vertices).size();
+  }
+  // the same as cw::serialize would do with them, only kept for next time
+  cw::detail::parallel_for(
+      stale.size(),
+      cw::detail::worker_threads(num_vertices,
+                                 cw::detail::BAKE_THREAD_VERTICES),
+      [&](size_t i) {
+        RoomTerrain &terrain = terrains[stale[i]];
+        auto points = terrain.polygon.getPoints(vertices);
+        auto bake = std::make_shared<TerrainBake>();
+        bake->bounds = cw::bake::bounds(points);
+        bake->triangles.resize(cw::bake::triangle_count(points.size()));
+        cw::bake::triangulate(points, bake->triangles);
+        terrain.baked = std::move(bake);
+        terrain.bakedVersion = terrain.polygon.getVersion();
+      });
+}
+
+void Room::record(const cw::Edit &edit) {
+  if (!journal.isOpen())
+    return;
+  // dragging something sets it every frame, only the last one matters
+  if (edit.op == cw::EditOp::Set && !unsavedEdits.empty()) {
+    cw::Edit &last = unsavedEdits.back();
+    if (last.op == cw::EditOp::Set && last.target == edit.target &&
+        last.index == edit.index && last.vertex == edit.vertex) {
+      last = edit;
+      return;
+    }
+  }
+  unsavedEdits.push_back(edit);
 }
 
 cw::SerializeResultCode Room::trySerialize(const char *levelname,
-                                           bool overwrite) const {
+                                           bool overwrite) {
+  if (journalLevelname != levelname)
+    flushJournal();
+  if (overwrite && journal.isOpen() && journalLevelname == levelname &&
+      !journal.needsCompaction()) {
+    if (journal.append(unsavedEdits) == cw::SerializeResultCode::Okay) {
+      unsavedEdits.clear();
+      return cw::SerializeResultCode::Okay;
+    }
+    // the journal closed itself, writing everything out starts a new one
+  }
+
+  unsavedEdits.clear();
+  bakeTerrains();
+  auto res = snapshot().trySerialize("levels", levelname, overwrite, &journal);
+  if (res == cw::SerializeResultCode::Okay)
+    journalLevelname = levelname;
+  return res;
+}
+
+bool Room::flushJournal() {
+  if (journalLevelname.empty())
+    return true;
+  const std::string levelname = std::move(journalLevelname);
+  journalLevelname.clear();
+  bool flushed = true;
+  if (journal.isOpen() && journal.empty()) {
+    // the file already has everything
+  } else if (journal.isOpen() && unsavedEdits.empty()) {
+    // the room is exactly what was last saved, so it's written out from here
+    bakeTerrains();
+    flushed = snapshot().trySerialize("levels", levelname.c_str(), true,
+                                      &journal) == cw::SerializeResultCode::Okay;
+  } else {
+    // the room has edits past what was saved, so the journal is put back on
+    // top of the file instead
+    journal.close();
+    std::string path = "levels/" + levelname;
+    std::string level_path = path + "." CROSSWIRE_LEVEL_FILE_EXTENSION;
+    std::string journal_path = path + "." CROSSWIRE_JOURNAL_FILE_EXTENSION;
+    cw::JournaledLevel saved;
+    cw::JournalWriter fresh;
+    flushed = saved.open(level_path.c_str(), journal_path.c_str()) ==
+                  cw::DeserializeResultCode::Okay &&
+              (saved.edits() == 0 ||
+               cw::compact_journal("levels", levelname.c_str(), true,
+                                   saved.level(), &fresh, SAVE_OPTIONS) ==
+                   cw::SerializeResultCode::Okay);
+  }
+  journal.close();
+  unsavedEdits.clear();
+  return flushed;
+}
+
+RoomSnapshot Room::snapshot() const {
+  RoomSnapshot out;
+  out.vertices.reserve(vertices.size());
+  out.vertex_counts.reserve(terrains.size());
+  out.terrain_types.reserve(terrains.size());
+  out.baked.reserve(terrains.size());
+  for (const auto &terrain : terrains) {
+    auto points = terrain.polygon.getPoints(vertices);
+    out.vertices.insert(out.vertices.end(), points.begin(), points.end());
+    out.vertex_counts.push_back(uint32_t(points.size()));
+    out.terrain_types.push_back(terrain.type);
+    const bool current =
+        terrain.bakedVersion == terrain.polygon.getVersion();
+    out.baked.push_back(current ? terrain.baked : nullptr);
+  }
+
+  // images almost all share a handful of filenames, only copy each once
+  std::unordered_map<std::string_view, uint32_t> seen;
+  out.images.reserve(images.size());
+  out.image_filename_indices.reserve(images.size());
+  for (const auto &[image, texture] : images) {
+    auto [it, inserted] = seen.try_emplace(
+        std::string_view(image.filename.data(), image.filename.size()),
+        uint32_t(out.image_filenames.size()));
+    if (inserted) {
+      out.image_filenames.emplace_back(image.filename.data(),
+                                       image.filename.size());
+    }
+    out.image_filename_indices.push_back(it->second);
+    out.images.push_back(image.data);
+  }
+
+  out.turrets.assign(turrets.begin(), turrets.end());
+  out.buildSites.assign(buildSites.begin(), buildSites.end());
+  // prefabs never change, so they're shared rather than copied
+  out.prefabs = prefabs;
+  out.instances.assign(instances.begin(), instances.end());
+  out.player_spawn = player_spawn;
+  return out;
+}
+
+cw::SerializeResultCode
+RoomSnapshot::trySerialize(const char *folder, const char *levelname,
+                           bool overwrite, cw::JournalWriter *journal) const {
   std::vector<cw::TerrainEntry> terrains;
-  size_t index = 0;
-  for (const auto &type : terrain_types) {
+  terrains.reserve(terrain_types.size());
+  size_t first_vertex = 0;
+  for (size_t i = 0; i < terrain_types.size(); ++i) {
     terrains.push_back(cw::TerrainEntry{
-        .verts = Areas[index].getPoints(),
-        .type = type,
+        .verts = std::span(vertices).subspan(first_vertex, vertex_counts[i]),
+        .type = terrain_types[i],
+    });
+    if (baked[i]) {
+      terrains.back().bounds = baked[i]->bounds;
+      terrains.back().triangles = baked[i]->triangles;
+    }
+    first_vertex += vertex_counts[i];
+  }
+
+  std::vector<cw::Image> level_images;
+  level_images.reserve(images.size());
+  for (size_t i = 0; i < images.size(); ++i) {
+    const auto &filename = image_filenames[image_filename_indices[i]];
+    level_images.push_back(cw::Image{
+        .filename = std::span(filename.data(), filename.size()),
+        .data = images[i],
+    });
+  }
+
+  // every prefab's terrains and images one after another, reserved up front
+  // so the spans into them stay put
+  size_t prefab_terrain_count = 0, prefab_image_count = 0;
+  for (const auto &prefab : prefabs) {
+    prefab_terrain_count += prefab->terrain_types.size();
+    prefab_image_count += prefab->images.size();
+  }
+  std::vector<cw::TerrainEntry> prefab_terrains;
+  std::vector<cw::Image> prefab_images;
+  std::vector<cw::Prefab> level_prefabs;
+  prefab_terrains.reserve(prefab_terrain_count);
+  prefab_images.reserve(prefab_image_count);
+  level_prefabs.reserve(prefabs.size());
+  for (const auto &prefab : prefabs) {
+    const size_t first_terrain = prefab_terrains.size();
+    size_t first_vertex = 0;
+    for (size_t i = 0; i < prefab->terrain_types.size(); ++i) {
+      prefab_terrains.push_back(cw::TerrainEntry{
+          .verts = std::span(prefab->vertices)
+                       .subspan(first_vertex, prefab->vertex_counts[i]),
+          .type = prefab->terrain_types[i],
+      });
+      first_vertex += prefab->vertex_counts[i];
+    }
+    const size_t first_image = prefab_images.size();
+    for (size_t i = 0; i < prefab->images.size(); ++i) {
+      const auto &filename = prefab->image_filenames[i];
+      prefab_images.push_back(cw::Image{
+          .filename = std::span(filename.data(), filename.size()),
+          .data = prefab->images[i],
+      });
+    }
+    level_prefabs.push_back(cw::Prefab{
+        .terrains = std::span(prefab_terrains).subspan(first_terrain),
+        .turrets = prefab->turrets,
+        .images = std::span(prefab_images).subspan(first_image),
+        .build_sites = prefab->buildSites,
     });
-    index++;
   }
+
   cw::Level level{
       .player_spawn = {player_spawn},
       .terrains = terrains,
-      .images = serializableImageData,
+      .images = level_images,
       .build_sites = buildSites,
       .turrets = turrets,
+      .prefabs = level_prefabs,
+      .instances = instances,
   };
 
-  return cw::serialize("levels", levelname, overwrite, level);
+  if (journal)
+    return cw::compact_journal(folder, levelname, overwrite, level, journal,
+                               SAVE_OPTIONS);
+  return cw::serialize(folder, levelname, overwrite, level, SAVE_OPTIONS);
 }
 
-cw::DeserializeResultCode
-Room::tryDeserialize(const char *levelname,
-                     const ImageSelector &image_selector) {
-  std::string filename = "levels/" + std::string(levelname) + ".cwl";
-  cw::Level level;
-  auto res = cw::deserialize(filename.c_str(), &level);
-  if (res != decltype(res)::Okay) {
-    return res;
-  }
-
-  // deserialization successful, but do the image files exist?
-  std::vector<cw::Image> newSerializableImages;
-  std::vector<SDL_Texture *> newRuntimeImages;
+// Fills new editor containers straight from a level file as it's parsed, so
+// everything is copied out of the file once and nothing is copied again
+struct Room::Loader {
+  const ImageSelector &image_selector;
+  // every image the selector knows of, so images can point at their name
   std::vector<std::string> filenames;
-  newSerializableImages.reserve(level.images.size());
-  newRuntimeImages.reserve(level.images.size());
-  {
+  // which of those each different filename in the file is, looked up once
+  // however many times it's placed
+  std::vector<size_t> foundIndices;
+  bool missingImage = false;
+  // compressed sections are decoded into here
+  std::vector<std::unique_ptr<std::byte[]>> scratch;
+
+  std::vector<RoomTerrain> newTerrains;
+  VertexPool newVertices;
+  std::vector<cw::Turret> newTurrets;
+  std::vector<RoomImage> newImages;
+  std::vector<cw::BuildSite> newBuildSites;
+  std::vector<std::shared_ptr<const RoomPrefab>> newPrefabs;
+  std::vector<cw::PrefabInstance> newInstances;
+  Vec2 newPlayerSpawn = {};
+
+  explicit Loader(const ImageSelector &image_selector)
+      : image_selector(image_selector) {
     filenames.reserve(image_selector.size());
     for (size_t i = 0; i < image_selector.size(); ++i) {
       filenames.push_back(image_selector.get_filename(i));
     }
+  }
 
-    std::array<char, 1024> buf;
-    for (const cw::Image &image : level.images) {
-      std::memcpy(buf.data(), image.filename.data(), image.filename.size());
-      buf[image.filename.size()] = 0; // null terminate
-
-      std::string comparable(buf.data());
-      SDL_Texture *runtimeData = nullptr;
-      size_t found_index = 0;
-      for (const auto &filename : filenames) {
-        if (filename == comparable) {
-          runtimeData = image_selector.get(found_index);
-          break;
-        }
-        ++found_index;
+  std::byte *decode_target(size_t bytes) {
+    scratch.push_back(std::make_unique_for_overwrite<std::byte[]>(bytes));
+    return scratch.back().get();
+  }
+  void spawn(cw::PlayerSpawnPoint spawn) { newPlayerSpawn = spawn.position; }
+  void terrain_count(size_t count) { newTerrains.reserve(count); }
+  void terrain(cw::TerrainType type, cw::LevelItems<Vec2> verts) {
+    auto range = newVertices.add(verts.count);
+    verts.copy_to(newVertices.points(range).data());
+    newTerrains.push_back(RoomTerrain{
+        .polygon = Polygon(range),
+        .type = type,
+    });
+  }
+  // a baked level comes with what every terrain bakes to, so saving it again
+  // doesn't have to start over
+  void baked(const cw::detail::BakedSections &baked) {
+    size_t first = 0;
+    for (size_t i = 0; i < newTerrains.size(); ++i) {
+      auto &terrain = newTerrains[i];
+      const size_t count = cw::bake::triangle_count(terrain.polygon.getRange().count);
+      auto bake = std::make_shared<TerrainBake>();
+      bake->bounds = baked.bounds.load(i);
+      bake->triangles.resize(count);
+      baked.triangles.subspan(first, count).copy_to(bake->triangles.data());
+      terrain.baked = std::move(bake);
+      terrain.bakedVersion = terrain.polygon.getVersion();
+      first += count;
+    }
+  }
+  void turrets(cw::LevelItems<cw::Turret> turrets) {
+    newTurrets.resize(turrets.count);
+    turrets.copy_to(newTurrets.data());
+  }
+  void image_filename_count(size_t count) { foundIndices.reserve(count); }
+  void image_filename(cw::LevelItems<char> filename) {
+    std::string_view comparable(reinterpret_cast<const char *>(filename.bytes),
+                                filename.count);
+    auto found = std::find(filenames.begin(), filenames.end(), comparable);
+    if (found == filenames.end() ||
+        !image_selector.get(found - filenames.begin())) {
+      // the rest of the level is still parsed, but never used
+      missingImage = true;
+      foundIndices.push_back(0);
+      return;
+    }
+    foundIndices.push_back(found - filenames.begin());
+  }
+  void image_count(size_t count) { newImages.reserve(count); }
+  void image(uint32_t filename_index, cw::ImageData data) {
+    if (missingImage)
+      return;
+    size_t found_index = foundIndices[filename_index];
+    newImages.push_back(RoomImage{
+        .serializable =
+            cw::Image{
+                // BUG: possible bug happens if a std::string inside filenames
+                // reallocates
+                .filename = std::span(filenames[found_index].data(),
+                                      filenames[found_index].size()),
+                .data = data,
+            },
+        .texture = image_selector.get(found_index),
+    });
+  }
+  void build_sites(cw::LevelItems<cw::BuildSite> sites) {
+    newBuildSites.resize(sites.count);
+    sites.copy_to(newBuildSites.data());
+  }
+  void prefabs(const cw::LevelPrefabs &found) {
+    newPrefabs.reserve(found.prefabs.count);
+    for (size_t i = 0; i < found.prefabs.count; ++i) {
+      const cw::PrefabRecord record = found.prefabs.load(i);
+      auto prefab = std::make_shared<RoomPrefab>();
+      for (size_t j = 0; j < record.terrain_count; ++j) {
+        const cw::TerrainRecord terrain =
+            found.terrains.load(record.first_terrain + j);
+        const size_t first = prefab->vertices.size();
+        prefab->vertices.resize(first + terrain.vertex_count);
+        found.verts.subspan(terrain.first_vertex, terrain.vertex_count)
+            .copy_to(prefab->vertices.data() + first);
+        prefab->vertex_counts.push_back(terrain.vertex_count);
+        prefab->terrain_types.push_back(cw::TerrainType(terrain.type));
       }
-
-      if (!runtimeData)
-        return cw::DeserializeResultCode::NoSuchImageFile;
-
-      newRuntimeImages.push_back(runtimeData);
-      newSerializableImages.push_back(cw::Image{
-          // BUG: possible bug happens if a std::string inside filenames
-          // reallocates
-          .filename = std::span(filenames[found_index].data(),
-                                filenames[found_index].size()),
-          .data = image.data,
-      });
+      prefab->turrets.resize(record.turret_count);
+      found.turrets.subspan(record.first_turret, record.turret_count)
+          .copy_to(prefab->turrets.data());
+      for (size_t j = 0; j < record.image_count && !missingImage; ++j) {
+        const cw::PlacementRecord image =
+            found.images.load(record.first_image + j);
+        const size_t found_index = foundIndices[image.filename];
+        prefab->image_filenames.push_back(filenames[found_index]);
+        prefab->images.push_back(image.data);
+        prefab->image_textures.push_back(image_selector.get(found_index));
+      }
+      prefab->buildSites.resize(record.build_site_count);
+      found.build_sites
+          .subspan(record.first_build_site, record.build_site_count)
+          .copy_to(prefab->buildSites.data());
+      newPrefabs.push_back(std::move(prefab));
     }
+    newInstances.resize(found.instances.count);
+    found.instances.copy_to(newInstances.data());
   }
+};
+
+cw::DeserializeResultCode Room::loadLevel(Loader &&loaded) {
+  // deserialization successful, but do the image files exist?
+  if (loaded.missingImage)
+    return cw::DeserializeResultCode::NoSuchImageFile;
 
   // successfully read level into memory, now destroy existing editor data
-  Areas = {};
-  terrain_types = {};
   currentPolygon = {};
   currentBuildSite = {};
   currentTurret = {};
   currentImage = {};
+  currentInstance = {};
+  currentPrefab = 0;
   selectedImage = {};
   selectedImageFilename = {};
-  serializableImageData = {};
-  runtimeImageData = {};
-  turrets = {};
-  buildSites = {};
   buildSiteSelection = {};
+  selection.clear();
+  selectPath.clear();
+  transforming = {};
+  // what's in the history only makes sense for the level it was made on
+  history.clear();
   // don't reset update func, its okay for the editor to remember which
   // tool its using
-  filenamesLoadedFromFile = std::move(filenames);
-  serializableImageData = std::move(newSerializableImages);
-  runtimeImageData = std::move(newRuntimeImages);
+  terrains.assign(std::move(loaded.newTerrains));
+  vertices = std::move(loaded.newVertices);
+  filenamesLoadedFromFile = std::move(loaded.filenames);
+  images.assign(std::move(loaded.newImages));
+  turrets.assign(std::move(loaded.newTurrets));
+  buildSites.assign(std::move(loaded.newBuildSites));
+  prefabs = std::move(loaded.newPrefabs);
+  instances.assign(std::move(loaded.newInstances));
+  player_spawn = loaded.newPlayerSpawn;
 
-  turrets.reserve(level.turrets.size());
-  for (const auto &turret : level.turrets) {
-    turrets.push_back(turret);
+  // nothing worked out from the last level is any use
+  const uint64_t at = changes.next();
+  changes.terrains.reset(at);
+  changes.images.reset(at);
+  changes.turrets.reset(at);
+  changes.buildSites.reset(at);
+  changes.instances.reset(at);
+  changes.spawn = changes.prefabs = at;
+
+  turretGrid.clear();
+  for (size_t index = 0; index < turrets.size(); ++index)
+    turretGrid.insert(index, turrets[index].position);
+  imageGrid.clear();
+  for (size_t index = 0; index < images.size(); ++index)
+    imageGrid.insert(index, images[index].serializable.data.position);
+  buildSiteGridA.clear();
+  buildSiteGridB.clear();
+  for (size_t index = 0; index < buildSites.size(); ++index) {
+    buildSiteGridA.insert(index, buildSites[index].position_a);
+    buildSiteGridB.insert(index, buildSites[index].position_b);
   }
-  player_spawn = level.player_spawn.position;
+  instanceGrid.clear();
+  for (size_t index = 0; index < instances.size(); ++index)
+    instanceGrid.insert(index, origin(instances[index]));
+  return cw::DeserializeResultCode::Okay;
+}
 
-  for (const auto &entry : level.terrains) {
-    terrain_types.push_back(entry.type);
-    Areas.push_back(Polygon(entry.verts));
+cw::DeserializeResultCode
+Room::tryDeserialize(const char *levelname,
+                     const ImageSelector &image_selector) {
+  if (journalLevelname != levelname)
+    flushJournal();
+  std::string filename = "levels/" + std::string(levelname) + ".cwl";
+  Loader loader(image_selector);
+  auto res = cw::stream_level(filename.c_str(), loader);
+  if (res != decltype(res)::Okay) {
+    return res;
+  }
+  res = loadLevel(std::move(loader));
+  if (res != decltype(res)::Okay) {
+    return res;
+  }
+
+  // the level file is loaded, now put back any edits which were appended to
+  // its journal but never compacted into it
+  journal.close();
+  journalLevelname = levelname;
+  unsavedEdits = {};
+  std::string journal_filename = "levels/" + std::string(levelname) + "." +
+                                 CROSSWIRE_JOURNAL_FILE_EXTENSION;
+  cw::JournalTail tail;
+  auto replayed = cw::replay_journal(
+      filename.c_str(), journal_filename.c_str(),
+      [this, &image_selector](cw::Edit edit) {
+        SDL_Texture *tex = nullptr;
+        if (edit.target == cw::EditTarget::Image && !erases(edit)) {
+          // the filename points into the journal, which is about to go away
+          std::string_view comparable(edit.image.filename.data(),
+                                      edit.image.filename.size());
+          auto found = std::find(filenamesLoadedFromFile.begin(),
+                                 filenamesLoadedFromFile.end(), comparable);
+          if (found == filenamesLoadedFromFile.end())
+            return false;
+          tex = image_selector.get(found - filenamesLoadedFromFile.begin());
+          edit.image.filename = std::span(found->data(), found->size());
+        }
+        return applyEdit(edit, tex);
+      },
+      &tail);
+
+  switch (replayed) {
+  case cw::DeserializeResultCode::Okay:
+    journal.open(journal_filename.c_str(), tail);
+    return res;
+  // nothing to replay. a journal for some other version of the file is left
+  // behind if we crashed while compacting, it's replaced by the next save
+  case cw::DeserializeResultCode::NoSuchFile:
+  case cw::DeserializeResultCode::JournalMismatch:
+    return res;
+  default:
+    // whatever could be replayed stays, and with the journal closed the next
+    // save writes it all out
+    return cw::DeserializeResultCode::InvalidJournalEdit;
   }
+}
 
-  buildSites.reserve(level.build_sites.size());
-  for (const auto &site : level.build_sites) {
-    buildSites.push_back(site);
+cw::DeserializeResultCode
+Room::tryDeserialize(const cw::LevelPack &pack, const char *levelname,
+                     const ImageSelector &image_selector) {
+  flushJournal();
+  auto file = pack.find(levelname);
+  if (file.empty()) {
+    return cw::DeserializeResultCode::NoSuchFile;
+  }
+  Loader loader(image_selector);
+  auto res = cw::stream_level(file, loader);
+  if (res != decltype(res)::Okay) {
+    return res;
+  }
+  res = loadLevel(std::move(loader));
+  if (res != decltype(res)::Okay) {
+    return res;
   }
 
-  // return okay
+  // packs are only ever written whole, so there is no journal to replay and
+  // the next save writes the room out as its own level file
+  journal.close();
+  journalLevelname = {};
+  unsavedEdits = {};
   return res;
 }
 
 std::string Room::getDisplayNameAtIndex(size_t index) const {
-  if (index >= Areas.size())
+  if (index >= terrains.size())
     return "";
 
-  switch (terrain_types[index]) {
+  switch (terrains[index].type) {
   case cw::TerrainType::Ditch:
     return "Ditch Polygon " + std::to_string(index);
     break;
@@ -377,9 +1742,10 @@ void Room::drawRoom(SDL_Renderer *renderer) {
                 BASE_DITCH_BLUE = 128;
 
   {
+    const auto selectedSite = buildSites.indexOf(currentBuildSite);
     size_t index = 0;
     for (const auto &site : buildSites) {
-      if (index == currentBuildSite) {
+      if (index == selectedSite) {
         SDL_SetRenderDrawColor(renderer, 0, 255, 0, 255);
       } else {
         SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
@@ -396,7 +1762,7 @@ void Room::drawRoom(SDL_Renderer *renderer) {
       rect.y = site.position_b.y;
       SDL_RenderFillRect(renderer, &rect);
 
-      if (index == currentBuildSite) {
+      if (index == selectedSite) {
         SDL_SetRenderDrawColor(renderer, 0, 255, 0, 255);
       } else {
         SDL_SetRenderDrawColor(renderer, 255, 0, 0, 255);
@@ -409,14 +1775,15 @@ void Room::drawRoom(SDL_Renderer *renderer) {
 
   // draw turrets
   {
+    const auto selectedTurret = turrets.indexOf(currentTurret);
     size_t index = 0;
     for (const auto &turret : turrets) {
-      if (index == currentTurret) {
+      if (index == selectedTurret) {
         SDL_SetRenderDrawColor(renderer, 70, 255, 40, 255);
       } else {
         SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
       }
-      int size = index == currentTurret ? 20 : 10;
+      int size = index == selectedTurret ? 20 : 10;
       const float dirlength = 40.0f;
       SDL_Rect rect{
           .x = (int)turret.position.x - (size / 2),
@@ -441,18 +1808,19 @@ void Room::drawRoom(SDL_Renderer *renderer) {
 
   // draw images
   {
+    const auto highlighted = images.indexOf(currentImage);
     size_t index = 0;
-    for (auto &tex : runtimeImageData) {
+    for (const auto &[image, tex] : images) {
       SDL_Rect dest{
-          .x = (int)serializableImageData[index].data.position.x,
-          .y = (int)serializableImageData[index].data.position.y,
+          .x = (int)image.data.position.x,
+          .y = (int)image.data.position.y,
           // TODO: store actual width and height of image
           .w = 100,
           .h = 100,
       };
       SDL_RenderCopy(renderer, tex, nullptr, &dest);
 
-      if (currentImage == index) {
+      if (highlighted == index) {
         dest.x -= 10;
         dest.y -= 10;
         dest.w += 20;
@@ -464,20 +1832,136 @@ void Room::drawRoom(SDL_Renderer *renderer) {
   }
 
   // draw terrain
-  assert(Areas.size() == terrain_types.size());
-  for (int i = 0; i < Areas.size(); i++) {
-    if (i == currentPolygon) {
-      Areas[i].drawPolygon(renderer, SELECT_RED, SELECT_GREEN, SELECT_BLUE);
+  const auto selectedPolygon = terrains.indexOf(currentPolygon);
+  for (size_t i = 0; i < terrains.size(); i++) {
+    const Polygon &area = terrains[i].polygon;
+    if (i == selectedPolygon) {
+      area.drawPolygon(vertices, renderer, SELECT_RED, SELECT_GREEN,
+                       SELECT_BLUE);
     } else {
-      switch (terrain_types[i]) {
+      switch (terrains[i].type) {
       case cw::TerrainType::Ditch:
-        Areas[i].drawPolygon(renderer, BASE_DITCH_RED, BASE_DITCH_BLUE,
-                             BASE_DITCH_GREEN);
+        area.drawPolygon(vertices, renderer, BASE_DITCH_RED, BASE_DITCH_BLUE,
+                         BASE_DITCH_GREEN);
         break;
       case cw::TerrainType::Obstacle:
-        Areas[i].drawPolygon(renderer, BASE_RED, BASE_GREEN, BASE_BLUE);
+        area.drawPolygon(vertices, renderer, BASE_RED, BASE_GREEN, BASE_BLUE);
         break;
       }
     }
   }
+
+  // draw instances, each prefab's vertices moved to wherever the instance
+  // puts them
+  {
+    const auto highlighted = instances.indexOf(currentInstance);
+    size_t index = 0;
+    for (const auto &instance : instances) {
+      const RoomPrefab &prefab = *prefabs[instance.prefab];
+      const Affine &transform = instance.transform;
+      instanceVertices.resize(prefab.vertices.size());
+      transform_points(transform, prefab.vertices, instanceVertices);
+      size_t first = 0;
+      for (size_t i = 0; i < prefab.vertex_counts.size(); ++i) {
+        auto points = std::span(instanceVertices)
+                          .subspan(first, prefab.vertex_counts[i]);
+        first += points.size();
+        if (points.size() < 2)
+          continue;
+        if (index == highlighted)
+          SDL_SetRenderDrawColor(renderer, SELECT_RED, SELECT_GREEN,
+                                 SELECT_BLUE, 255);
+        else if (prefab.terrain_types[i] == cw::TerrainType::Ditch)
+          SDL_SetRenderDrawColor(renderer, BASE_DITCH_RED, BASE_DITCH_BLUE,
+                                 BASE_DITCH_GREEN, 255);
+        else
+          SDL_SetRenderDrawColor(renderer, BASE_RED, BASE_GREEN, BASE_BLUE,
+                                 255);
+        SDL_RenderDrawLinesF(
+            renderer, reinterpret_cast<const SDL_FPoint *>(points.data()),
+            int(points.size()));
+        SDL_RenderDrawLineF(renderer, points.back().x, points.back().y,
+                            points.front().x, points.front().y);
+      }
+
+      for (size_t i = 0; i < prefab.images.size(); ++i) {
+        Vec2 at = transform.apply(prefab.images[i].position);
+        SDL_Rect dest{.x = (int)at.x, .y = (int)at.y, .w = 100, .h = 100};
+        SDL_RenderCopy(renderer, prefab.image_textures[i], nullptr, &dest);
+      }
+      SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
+      for (const auto &turret : prefab.turrets) {
+        Vec2 at = transform.apply(turret.position);
+        SDL_FRect rect{.x = at.x - 5, .y = at.y - 5, .w = 10, .h = 10};
+        SDL_RenderFillRectF(renderer, &rect);
+      }
+      SDL_SetRenderDrawColor(renderer, 255, 0, 0, 255);
+      for (const auto &site : prefab.buildSites) {
+        Vec2 a = transform.apply(site.position_a),
+             b = transform.apply(site.position_b);
+        SDL_RenderDrawLineF(renderer, a.x, a.y, b.x, b.y);
+      }
+
+      // a cross where the instance is, which is what gets picked up
+      const Vec2 at = origin(instance);
+      SDL_SetRenderDrawColor(renderer, 0, 200, 255, 255);
+      SDL_RenderDrawLineF(renderer, at.x - 6, at.y, at.x + 6, at.y);
+      SDL_RenderDrawLineF(renderer, at.x, at.y - 6, at.x, at.y + 6);
+      ++index;
+    }
+  }
+
+  // draw the selection over everything else, all in one go
+  SDL_SetRenderDrawColor(renderer, 255, 200, 0, 255);
+  if (!selection.empty()) {
+    std::vector<SDL_FRect> marks;
+    marks.reserve(selection.size());
+    auto mark = [&marks](Vec2 p) {
+      marks.push_back({.x = p.x - 3, .y = p.y - 3, .w = 6, .h = 6});
+    };
+    for (const auto &vertex : selection.vertices) {
+      auto terrain = terrains.indexOf(vertex.terrain);
+      if (!terrain)
+        continue;
+      auto points = terrains[*terrain].polygon.getPoints(vertices);
+      if (vertex.index < points.size())
+        mark(points[vertex.index]);
+    }
+    for (auto turret : selection.turrets) {
+      if (auto index = turrets.indexOf(turret))
+        mark(turrets[*index].position);
+    }
+    for (auto image : selection.images) {
+      if (auto index = images.indexOf(image))
+        mark(images[*index].serializable.data.position);
+    }
+    for (const auto &end : selection.buildSiteEnds) {
+      if (auto index = buildSites.indexOf(end.site))
+        mark(end.is_a ? buildSites[*index].position_a
+                      : buildSites[*index].position_b);
+    }
+    for (auto instance : selection.instances) {
+      if (auto index = instances.indexOf(instance))
+        mark(origin(instances[*index]));
+    }
+    SDL_RenderFillRectsF(renderer, marks.data(), int(marks.size()));
+  }
+  if (selectPath.size() >= 2) {
+    if (selectShape == SelectShape::Box) {
+      const Vec2 a = selectPath.front(), b = selectPath.back();
+      const SDL_FRect box{
+          .x = std::min(a.x, b.x),
+          .y = std::min(a.y, b.y),
+          .w = std::abs(a.x - b.x),
+          .h = std::abs(a.y - b.y),
+      };
+      SDL_RenderDrawRectF(renderer, &box);
+    } else {
+      SDL_RenderDrawLinesF(
+          renderer, reinterpret_cast<const SDL_FPoint *>(selectPath.data()),
+          int(selectPath.size()));
+      SDL_RenderDrawLineF(renderer, selectPath.back().x, selectPath.back().y,
+                          selectPath.front().x, selectPath.front().y);
+    }
+  }
 }
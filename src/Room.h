@@ -1,10 +1,18 @@
 #pragma once
+#include "Affine.h"
+#include "ChangeLog.h"
 #include "ImageSelector.h"
 #include "Inputs.h"
 #include "Polygons.h"
+#include "SlotMap.h"
+#include "UndoHistory.h"
+#include "journal.h"
+#include "pack.h"
 #include "serialize.h"
 #include <functional>
+#include <memory>
 #include <optional>
+#include <string>
 #include <vector>
 
 enum class EditingTool {
@@ -12,6 +20,149 @@ enum class EditingTool {
   Images,
   Turrets,
   BuildSites,
+  Select,
+  Prefabs,
+};
+
+/// What the select tool picks with
+enum class SelectShape {
+  Box,
+  Lasso,
+};
+
+/// What dragging the selection around does to it
+enum class SelectionDrag {
+  Move,
+  Rotate,
+  Scale,
+};
+
+/// A group of terrains, turrets, images and build sites made once and placed
+/// any number of times. Everything in it is relative to where an instance puts
+/// it. It never changes once made, so rooms and their snapshots share it.
+struct RoomPrefab {
+  std::vector<Vec2> vertices;
+  std::vector<uint32_t> vertex_counts;
+  std::vector<cw::TerrainType> terrain_types;
+  std::vector<cw::Turret> turrets;
+  // its own copy of each image's filename, and the texture it's drawn with
+  std::vector<std::string> image_filenames;
+  std::vector<cw::ImageData> images;
+  std::vector<SDL_Texture *> image_textures;
+  std::vector<cw::BuildSite> buildSites;
+
+  inline bool empty() const {
+    return vertex_counts.empty() && turrets.empty() && images.empty() &&
+           buildSites.empty();
+  }
+};
+
+/// The bounds and triangles of a terrain, worked out once for some version of
+/// its polygon. It never changes once made, so rooms and their snapshots share
+/// it.
+struct TerrainBake {
+  cw::Aabb bounds;
+  std::vector<cw::Triangle> triangles;
+};
+
+/**
+ * @brief A copy of everything in a Room that gets saved. It owns all of its
+ * data, so it stays the same when the room changes and can be handed to
+ * another thread.
+ */
+struct RoomSnapshot {
+  // the vertices of every terrain one after another, so they're saved in one go
+  std::vector<Vec2> vertices;
+  std::vector<uint32_t> vertex_counts;
+  std::vector<cw::TerrainType> terrain_types;
+  // what each terrain bakes to, or null where it has changed since. only those
+  // are triangulated when saving
+  std::vector<std::shared_ptr<const TerrainBake>> baked;
+  // each different image filename once, images refer to them by index
+  std::vector<std::string> image_filenames;
+  std::vector<uint32_t> image_filename_indices;
+  std::vector<cw::ImageData> images;
+  std::vector<cw::Turret> turrets;
+  std::vector<cw::BuildSite> buildSites;
+  std::vector<std::shared_ptr<const RoomPrefab>> prefabs;
+  std::vector<cw::PrefabInstance> instances;
+  Vec2 player_spawn;
+
+  /// With a journal the level is written through compact_journal, which
+  /// starts the journal over for the new file
+  cw::SerializeResultCode
+  trySerialize(const char *folder, const char *levelname, bool overwrite,
+               cw::JournalWriter *journal = nullptr) const;
+};
+
+/// A polygon in a room along with what kind of terrain it is. Its points are in
+/// the room's VertexPool
+struct RoomTerrain {
+  Polygon polygon;
+  cw::TerrainType type;
+  // what the polygon baked to when its version was bakedVersion, so saving
+  // only triangulates terrains again once they've changed
+  std::shared_ptr<const TerrainBake> baked = nullptr;
+  uint32_t bakedVersion = 0;
+};
+
+/// An image placed in a room, and the texture it's drawn with
+struct RoomImage {
+  cw::Image serializable;
+  SDL_Texture *texture;
+};
+
+/// Everything the select tool has picked. Kept as handles like the other
+/// selections, so whatever has gone since is left out when it's used.
+struct RoomSelection {
+  struct Vertex {
+    Handle<RoomTerrain> terrain;
+    uint32_t index;
+  };
+  struct BuildSiteEnd {
+    Handle<cw::BuildSite> site;
+    bool is_a;
+  };
+  std::vector<Vertex> vertices;
+  std::vector<Handle<cw::Turret>> turrets;
+  std::vector<Handle<RoomImage>> images;
+  std::vector<BuildSiteEnd> buildSiteEnds;
+  std::vector<Handle<cw::PrefabInstance>> instances;
+
+  inline size_t size() const {
+    return vertices.size() + turrets.size() + images.size() +
+           buildSiteEnds.size() + instances.size();
+  }
+  inline bool empty() const { return size() == 0; }
+  inline void clear() {
+    vertices.clear();
+    turrets.clear();
+    images.clear();
+    buildSiteEnds.clear();
+    instances.clear();
+  }
+};
+
+/// What has changed in a room and when. Versions come from one counter for
+/// the whole room, so remembering version() is enough to later catch up on
+/// every collection with changesSince.
+struct RoomChanges {
+  ChangeLog<RoomTerrain> terrains;
+  ChangeLog<RoomImage> images;
+  ChangeLog<cw::Turret> turrets;
+  ChangeLog<cw::BuildSite> buildSites;
+  ChangeLog<cw::PrefabInstance> instances;
+  // these are single values, or only ever added to, so a version is enough
+  uint64_t spawn = 0;
+  uint64_t prefabs = 0;
+
+  /// The last change to anything in the room
+  inline uint64_t version() const { return clock; }
+  /// The version for the next change
+  inline uint64_t next() { return ++clock; }
+
+private:
+  uint64_t clock = 0;
 };
 
 /**
@@ -19,34 +170,112 @@ enum class EditingTool {
  */
 struct Room {
 private:
-  std::vector<Polygon> Areas;
-  std::vector<cw::TerrainType> terrain_types;
-  std::optional<size_t> currentPolygon;
-  std::optional<size_t> currentBuildSite;
-  std::optional<size_t> currentTurret;
-  std::optional<size_t> currentImage;
+  // everything in the room is kept in slot maps. where an item sits in its
+  // map is its index in edits and in saved levels, and erasing one moves the
+  // last one into its place. the selections are handles, so they stay on the
+  // same item however the others move, and come back empty once it's gone
+  SlotMap<RoomTerrain> terrains;
+  VertexPool vertices;
+  Handle<RoomTerrain> currentPolygon;
+  Handle<cw::BuildSite> currentBuildSite;
+  Handle<cw::Turret> currentTurret;
+  Handle<RoomImage> currentImage;
   std::optional<SDL_Texture *> selectedImage;
   std::optional<const char *> selectedImageFilename;
 
-  // these two should always be the same length
-  std::vector<cw::Image> serializableImageData;
-  std::vector<SDL_Texture *> runtimeImageData;
+  SlotMap<RoomImage> images;
 
-  std::vector<cw::Turret> turrets;
+  SlotMap<cw::Turret> turrets;
 
-  std::vector<cw::BuildSite> buildSites;
+  SlotMap<cw::BuildSite> buildSites;
   Vec2 player_spawn = {100, 100};
 
+  // prefabs are only ever added, so instances can point at them by index.
+  // undoing making one leaves it defined, it just has no instances
+  std::vector<std::shared_ptr<const RoomPrefab>> prefabs;
+  SlotMap<cw::PrefabInstance> instances;
+  Handle<cw::PrefabInstance> currentInstance;
+  size_t currentPrefab = 0;
+  // where the vertices of the instance being drawn end up
+  std::vector<Vec2> instanceVertices;
+
+  // every edit, selection transform and load notes what it changed here
+  RoomChanges changes;
+
+  // how close the mouse has to be to pick something up
+  static constexpr float IMAGE_PICK_DISTANCE = 100;
+  static constexpr float BUILD_SITE_PICK_DISTANCE = 30;
+  static constexpr float INSTANCE_PICK_DISTANCE = 50;
+  // where the turrets, images, both ends of the build sites and the instances'
+  // origins are, so picking one or selecting a box doesn't look at all of
+  // them. applyEdit, moveSelection and loadLevel keep these in step
+  PointGrid turretGrid{SELECT_DISTANCE};
+  PointGrid imageGrid{IMAGE_PICK_DISTANCE};
+  PointGrid buildSiteGridA{BUILD_SITE_PICK_DISTANCE};
+  PointGrid buildSiteGridB{BUILD_SITE_PICK_DISTANCE};
+  PointGrid instanceGrid{INSTANCE_PICK_DISTANCE};
+
   struct SelectedBuildSiteInfo {
-    size_t index;
+    Handle<cw::BuildSite> site;
     bool is_a;
   };
   std::optional<SelectedBuildSiteInfo> buildSiteSelection;
 
+  RoomSelection selection;
+  SelectShape selectShape = SelectShape::Box;
+  SelectionDrag selectionDrag = SelectionDrag::Move;
+  // the two corners of the box or every point of the lasso, while one is
+  // being dragged out
+  std::vector<Vec2> selectPath;
+
+  // The selection while it's being transformed. Where every point started
+  // is copied out once, so each frame is one transform_points over all of
+  // them and writing them back. The room is only edited directly while this
+  // is open, the edits are made for the journal and undo when it's done.
+  struct SelectionTransform {
+    // the vertices first, then the turrets, images and build site ends
+    std::vector<Vec2> from;
+    std::vector<Vec2> to;
+    // where each vertex is in the pool, and its terrain and index there
+    std::vector<uint32_t> vertexOffsets;
+    std::vector<std::pair<uint32_t, uint32_t>> vertices;
+    std::vector<uint32_t> turrets;
+    std::vector<uint32_t> images;
+    // sorted, so both ends of a site are next to each other
+    std::vector<std::pair<uint32_t, bool>> buildSiteEnds;
+    // instances are moved by their whole transform rather than a point. their
+    // origins are last in from, so they count towards the bounds
+    std::vector<uint32_t> instances;
+    std::vector<Affine> instanceFrom;
+    // every terrain with a vertex in the selection
+    std::vector<uint32_t> terrains;
+    // the middle of the bounds, which rotating and scaling go around
+    Vec2 pivot;
+    Vec2 min, max;
+    // where the mouse took hold of it
+    Vec2 grabbed;
+  };
+  std::optional<SelectionTransform> transforming;
+
+  void updateRoomSelectTool(Inputs i);
+  // Select everything inside selectPath, on top of what's selected if extend
+  void finishSelecting(bool extend);
+  // Work out where everything selected is, dropping whatever's gone. Returns
+  // false if nothing is left.
+  bool beginTransform();
+  // Put everything in the selection where transform takes it from where it
+  // started
+  void moveSelection(const Affine &transform);
+  // Make the edits for where everything ended up
+  void endTransform();
+  // Put it all back where it started instead
+  void cancelTransform();
+
   void updateRoomPolygonTool(Inputs i);
   void updateRoomBuildSiteTool(Inputs i);
   void updateRoomTurretTool(Inputs i);
   void updateRoomImageTool(Inputs i);
+  void updateRoomPrefabTool(Inputs i);
   void createImageAt(const char *filename, SDL_Texture *tex, float x, float y);
 
   std::optional<std::function<void(Inputs)>> updateFunc;
@@ -58,8 +287,86 @@ private:
 
   std::vector<std::string> filenamesLoadedFromFile;
 
+  // edits since the last save, for appending to the journal of the level
+  // named journalLevelname. only kept while the journal is open, otherwise
+  // the next save writes the whole level anyway
+  cw::JournalWriter journal;
+  std::string journalLevelname;
+  std::vector<cw::Edit> unsavedEdits;
+
+  // undo gets this much memory, enough for hundreds of thousands of drags
+  static constexpr size_t UNDO_BUDGET = 8 << 20;
+  UndoHistory history{UNDO_BUDGET};
+
+  // Make a change to the room and remember it for the journal and for undo
+  void apply(const cw::Edit &edit, SDL_Texture *tex = nullptr);
+  // Add what reverses edit, made on the room as it is now, to out. Added in
+  // the reverse of the order it has to be made in, the way UndoHistory keeps
+  // it. Adds nothing if the edit is out of range.
+  void invert(const cw::Edit &edit, std::vector<UndoCommand> *out) const;
+  // Make the commands of an undo or redo step, from the back, and return what
+  // reverses them
+  std::vector<UndoCommand> replay(std::span<const UndoCommand> step);
+  // Make a change to the room without remembering it. Images need their
+  // texture. Returns false if the edit is out of range.
+  bool applyEdit(const cw::Edit &edit, SDL_Texture *tex = nullptr);
+  // Remember a change which was already made
+  void record(const cw::Edit &edit);
+  // Close the gaps left in the vertex pool, once they've grown big enough
+  void compactVertices();
+  // Work out the bounds and triangles of every terrain changed since it was
+  // last baked
+  void bakeTerrains();
+  // Visitor for cw::stream_level which loads a level into new containers
+  struct Loader;
+  // Replace everything in the editor with a loaded level. Leaves the room
+  // alone and returns NoSuchImageFile if an image it places can't be found.
+  cw::DeserializeResultCode loadLevel(Loader &&loaded);
+
 public:
   void setCurrentTool(EditingTool tool);
+
+  // Undo or redo the last step, if there is one. Both are journaled like any
+  // other edit.
+  void undo();
+  void redo();
+  inline bool canUndo() const { return history.canUndo(); }
+  inline bool canRedo() const { return history.canRedo(); }
+  // Whatever is changed next is undone separately from what came before.
+  // Everything changed in between is undone in one go.
+  inline void endUndoStep() { history.endStep(); }
+
+  inline void setSelectShape(SelectShape shape) { selectShape = shape; }
+  inline void setSelectionDrag(SelectionDrag drag) { selectionDrag = drag; }
+  inline size_t getSelectionSize() const { return selection.size(); }
+  inline void clearSelection() {
+    endTransform();
+    selection.clear();
+  }
+  // Turn the selection by radians around its middle
+  void rotateSelection(float radians);
+  // Stretch the selection away from its middle. Negative factors mirror it.
+  void scaleSelection(float x, float y);
+
+  // Turn the selection into a new prefab, and put an instance of it where the
+  // selection was. Takes every terrain with a vertex in the selection, and
+  // every build site with an end in it. Selected instances are left alone.
+  // Undoing it puts the selection back, but the prefab stays. Returns false
+  // if there was nothing to make one from.
+  bool makePrefab();
+  inline size_t getNumPrefabs() const { return prefabs.size(); }
+  inline const RoomPrefab &getPrefab(size_t index) const {
+    assert(index < prefabs.size());
+    return *prefabs[index];
+  }
+  // Which prefab the prefab tool places next
+  inline void setCurrentPrefab(size_t index) {
+    if (index < prefabs.size())
+      currentPrefab = index;
+  }
+  inline size_t getCurrentPrefab() const { return currentPrefab; }
+  inline size_t getNumInstances() const { return instances.size(); }
+
   std::string getDisplayNameAtIndex(size_t index) const;
   inline constexpr void setTerrainType(cw::TerrainType type) {
     terrain_type = type;
@@ -74,20 +381,20 @@ public:
   }
   inline constexpr float getTurretFireRate() { return turret_fire_rate; }
 
-  inline constexpr void setCurrentImage(size_t index) {
-    if (index >= runtimeImageData.size())
+  inline void setCurrentImage(size_t index) {
+    if (index >= images.size())
       return;
-    currentImage = index;
+    currentImage = images.handleAt(index);
   }
 
-  inline constexpr void setCurrentBuildSite(size_t index) {
+  inline void setCurrentBuildSite(size_t index) {
     if (index >= buildSites.size()) {
       return;
     }
-    currentBuildSite = index;
+    currentBuildSite = buildSites.handleAt(index);
   }
 
-  inline constexpr size_t getNumBuildSites() const { return buildSites.size(); }
+  inline size_t getNumBuildSites() const { return buildSites.size(); }
 
   // change the characteristics of the next image placed
   inline constexpr void changeImagePlacementOptions(const char *filename,
@@ -96,42 +403,56 @@ public:
     selectedImageFilename = filename;
   }
 
-  inline constexpr const std::vector<cw::Image> &getImages() const {
-    return serializableImageData;
+  inline std::span<const RoomImage> getImages() const {
+    return images.values();
   }
 
-  inline constexpr const std::vector<cw::Turret> &getTurrets() const {
-    return turrets;
+  inline std::span<const cw::Turret> getTurrets() const {
+    return turrets.values();
   }
 
-  inline constexpr cw::Turret &getTurret(size_t index) {
-    assert(index <= turrets.size());
-    return turrets[index];
-  }
+  void setTurret(size_t index, const cw::Turret &turret);
 
   // TODO: naming convention on this is inconsistent, should be setCurrentTurret
-  inline constexpr void selectTurret(size_t index) {
+  inline void selectTurret(size_t index) {
     if (index >= turrets.size())
       return;
-    currentTurret = index;
+    currentTurret = turrets.handleAt(index);
   }
 
-  inline constexpr void setTerrainTypeFor(size_t index, cw::TerrainType type) {
-    if (index >= terrain_types.size()) {
-      return;
-    }
-    terrain_types[index] = type;
-  }
-  inline constexpr cw::TerrainType getTerrainTypeFor(size_t index) {
-    assert(index < terrain_types.size());
-    return terrain_types[index];
+  void setTerrainTypeFor(size_t index, cw::TerrainType type);
+  inline cw::TerrainType getTerrainTypeFor(size_t index) {
+    assert(index < terrains.size());
+    return terrains[index].type;
   }
 
-  cw::SerializeResultCode trySerialize(const char *levelname,
-                                       bool overwrite) const;
+  // What has changed and when, for keeping things worked out from the room
+  // up to date without going through all of it
+  inline const RoomChanges &getChanges() const { return changes; }
 
+  // Only appends what changed to the level's journal when it can, otherwise
+  // writes the whole level out
+  cw::SerializeResultCode trySerialize(const char *levelname, bool overwrite);
+
+  // Copy out everything that gets saved, for saving somewhere else
+  RoomSnapshot snapshot() const;
+
+  // Fold the journal back into the level file it was started for, so the file
+  // has every saved edit in it on its own and can be handed to anything else.
+  // Done on loading or saving a different level, and should be done before
+  // closing the editor. Edits that weren't saved stay unsaved. Returns false
+  // if it couldn't, which leaves the journal to be replayed the next time the
+  // level is loaded.
+  bool flushJournal();
+
+  // Also replays any journal left behind by a crash. If the journal can't be
+  // replayed the level is still loaded, and InvalidJournalEdit is returned.
   cw::DeserializeResultCode tryDeserialize(const char *levelname,
                                            const ImageSelector &image_selector);
+  // Load a room out of a pack instead of the levels folder
+  cw::DeserializeResultCode tryDeserialize(const cw::LevelPack &pack,
+                                           const char *levelname,
+                                           const ImageSelector &image_selector);
 
   // Constructor
   Room();
@@ -142,13 +463,13 @@ public:
   void drawRoom(SDL_Renderer *renderer);
 
   // Get the number of polygons in the room
-  inline constexpr size_t getNumberOfPolygons() { return Areas.size(); }
+  inline size_t getNumberOfPolygons() { return terrains.size(); }
 
   // Select a polygon of the ones currently in the room. If the polygon is out
   // of range, does nothing.
-  inline constexpr void selectPolygon(size_t i) {
+  inline void selectPolygon(size_t i) {
     if (i < getNumberOfPolygons()) {
-      currentPolygon = i;
+      currentPolygon = terrains.handleAt(i);
     }
   }
 };
@@ -0,0 +1,164 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <utility>
+#include <vector>
+
+/// Names one item of a SlotMap<T>. It keeps naming the same item however the
+/// others get moved around, and once that item is erased it names nothing,
+/// even after its slot is given to something new.
+template <typename T> struct Handle {
+  uint32_t slot = UINT32_MAX;
+  uint32_t generation = 0;
+
+  bool operator==(const Handle &) const = default;
+};
+
+/**
+ * @brief Items packed together in one vector, so drawing and saving them is a
+ * plain loop, which are also found through handles that survive other items
+ * coming and going.
+ *
+ * Each item has a slot which knows where in the vector it is. Erasing moves
+ * the last item into the gap and bumps the generation of the erased item's
+ * slot, so old handles to it stop working. Items can also be reached by where
+ * they are in the vector, which is what gets saved and put in edits.
+ */
+template <typename T> class SlotMap {
+public:
+  inline size_t size() const { return items.size(); }
+  inline bool empty() const { return items.empty(); }
+  inline T &operator[](size_t index) { return items[index]; }
+  inline const T &operator[](size_t index) const { return items[index]; }
+  inline auto begin() { return items.begin(); }
+  inline auto end() { return items.end(); }
+  inline auto begin() const { return items.begin(); }
+  inline auto end() const { return items.end(); }
+  inline std::span<const T> values() const { return items; }
+
+  /// Add an item at the end
+  Handle<T> push_back(T value) {
+    uint32_t slot = takeSlot(uint32_t(items.size()));
+    items.push_back(std::move(value));
+    slotOf.push_back(slot);
+    return {slot, slots[slot].generation};
+  }
+
+  /// Put an item at index, moving the ones from index onwards along. Costs as
+  /// much as inserting into a vector, it's only here for edits made that way
+  Handle<T> insert(size_t index, T value) {
+    assert(index <= items.size());
+    Handle<T> handle = push_back(std::move(value));
+    for (size_t i = items.size() - 1; i > index; --i)
+      swapItems(i, i - 1);
+    return handle;
+  }
+
+  /// Put an item at index by moving the one there to the end, the reverse of
+  /// swapErase
+  Handle<T> swapInsert(size_t index, T value) {
+    assert(index <= items.size());
+    Handle<T> handle = push_back(std::move(value));
+    swapItems(index, items.size() - 1);
+    return handle;
+  }
+
+  /// Erase the item at index by moving the last one into its place
+  void swapErase(size_t index) {
+    assert(index < items.size());
+    swapItems(index, items.size() - 1);
+    popBack();
+  }
+
+  /// Erase the item at index, moving the ones after it back. Costs as much as
+  /// erasing from a vector, it's only here for edits made that way
+  void erase(size_t index) {
+    assert(index < items.size());
+    for (size_t i = index; i + 1 < items.size(); ++i)
+      swapItems(i, i + 1);
+    popBack();
+  }
+
+  /// Where the item is in the vector, if it's still there
+  inline std::optional<size_t> indexOf(Handle<T> handle) const {
+    if (handle.slot >= slots.size() ||
+        slots[handle.slot].generation != handle.generation)
+      return {};
+    return slots[handle.slot].index;
+  }
+  inline Handle<T> handleAt(size_t index) const {
+    assert(index < items.size());
+    uint32_t slot = slotOf[index];
+    return {slot, slots[slot].generation};
+  }
+  inline T *get(Handle<T> handle) {
+    auto index = indexOf(handle);
+    return index ? &items[*index] : nullptr;
+  }
+  inline const T *get(Handle<T> handle) const {
+    auto index = indexOf(handle);
+    return index ? &items[*index] : nullptr;
+  }
+
+  /// Erase everything. Handles to what was here stop working, same as if each
+  /// item was erased on its own
+  void clear() {
+    while (!items.empty())
+      popBack();
+  }
+
+  /// Replace everything with values, which get handles of their own
+  void assign(std::vector<T> &&values) {
+    clear();
+    slotOf.reserve(values.size());
+    for (size_t i = 0; i < values.size(); ++i)
+      slotOf.push_back(takeSlot(uint32_t(i)));
+    items = std::move(values);
+  }
+
+private:
+  struct Slot {
+    /// of the item in the vector, or of the next free slot when free
+    uint32_t index;
+    uint32_t generation;
+  };
+
+  uint32_t takeSlot(uint32_t index) {
+    if (freeSlot == UINT32_MAX) {
+      slots.push_back({index, 0});
+      return uint32_t(slots.size() - 1);
+    }
+    uint32_t slot = freeSlot;
+    freeSlot = slots[slot].index;
+    slots[slot].index = index;
+    return slot;
+  }
+
+  void swapItems(size_t a, size_t b) {
+    if (a == b)
+      return;
+    std::swap(items[a], items[b]);
+    std::swap(slotOf[a], slotOf[b]);
+    slots[slotOf[a]].index = uint32_t(a);
+    slots[slotOf[b]].index = uint32_t(b);
+  }
+
+  void popBack() {
+    uint32_t slot = slotOf.back();
+    ++slots[slot].generation;
+    slots[slot].index = freeSlot;
+    freeSlot = slot;
+    items.pop_back();
+    slotOf.pop_back();
+  }
+
+  std::vector<T> items;
+  /// which slot each item has
+  std::vector<uint32_t> slotOf;
+  std::vector<Slot> slots;
+  /// head of the list of free slots, threaded through Slot::index
+  uint32_t freeSlot = UINT32_MAX;
+};
@@ -0,0 +1,177 @@
+#include "UndoHistory.h"
+#include <cassert>
+#include <cstring>
+
+namespace {
+// in front of every command
+struct CommandHeader {
+  cw::EditOp op;
+  cw::EditTarget target;
+  // of the body after this
+  uint16_t length;
+};
+
+// after the body of a command which puts an image in place. the journal only
+// keeps the bytes of the filename, but the room wants back the very string
+// the image had
+struct ImageRefs {
+  const char *filename;
+  SDL_Texture *texture;
+};
+
+bool placesImage(const cw::Edit &edit) {
+  return edit.target == cw::EditTarget::Image &&
+         edit.op != cw::EditOp::Erase && edit.op != cw::EditOp::SwapErase;
+}
+
+void writeBody(cw::detail::ByteWriter &writer, const UndoCommand &command) {
+  cw::detail::write_edit_body(writer, command.edit);
+  if (placesImage(command.edit))
+    writer.write(ImageRefs{command.edit.image.filename.data(), command.texture});
+}
+} // namespace
+
+void UndoHistory::record(const cw::Edit &done,
+                         std::span<const UndoCommand> undo) {
+  redoSteps.clear();
+  const bool set = done.op == cw::EditOp::Set;
+  if (stepOpen && set && lastWasSet && done.target == lastTarget &&
+      done.index == lastIndex && done.vertex == lastVertex)
+    return;
+
+  if (!stepOpen) {
+    undoSteps.begin();
+    stepOpen = true;
+  }
+  for (const auto &command : undo)
+    undoSteps.append(command);
+  lastWasSet = set;
+  lastTarget = done.target;
+  lastIndex = done.index;
+  lastVertex = done.vertex;
+  trim(undoSteps);
+}
+
+void UndoHistory::endStep() {
+  stepOpen = false;
+  lastWasSet = false;
+}
+
+void UndoHistory::clear() {
+  undoSteps.clear();
+  redoSteps.clear();
+  endStep();
+}
+
+std::vector<UndoCommand> UndoHistory::takeUndo() {
+  endStep();
+  return undoSteps.takeNewest();
+}
+
+std::vector<UndoCommand> UndoHistory::takeRedo() {
+  endStep();
+  return redoSteps.takeNewest();
+}
+
+void UndoHistory::pushRedo(std::span<const UndoCommand> commands) {
+  if (commands.empty())
+    return;
+  redoSteps.begin();
+  for (const auto &command : commands)
+    redoSteps.append(command);
+  trim(redoSteps);
+}
+
+void UndoHistory::pushUndo(std::span<const UndoCommand> commands) {
+  if (commands.empty())
+    return;
+  undoSteps.begin();
+  for (const auto &command : commands)
+    undoSteps.append(command);
+  trim(undoSteps);
+}
+
+void UndoHistory::trim(const Steps &keep) {
+  while (bytes() > budget) {
+    // steps which can be redone are only forgotten once there's nothing left
+    // to undo, and then the furthest one goes first
+    if (undoSteps.steps() > (&keep == &undoSteps ? 1 : 0))
+      undoSteps.dropOldest();
+    else if (redoSteps.steps() > (&keep == &redoSteps ? 1 : 0))
+      redoSteps.dropOldest();
+    else
+      return;
+  }
+}
+
+void UndoHistory::Steps::begin() { starts.push_back(packed.size()); }
+
+void UndoHistory::Steps::append(const UndoCommand &command) {
+  assert(!starts.empty());
+  assert(cw::detail::valid_edit(command.edit.op, command.edit.target));
+  cw::detail::ByteWriter sizer(nullptr);
+  writeBody(sizer, command);
+  assert(sizer.used() <= UINT16_MAX);
+
+  const size_t start = packed.size();
+  packed.resize(start + sizeof(CommandHeader) + sizer.used());
+  const CommandHeader header{
+      .op = command.edit.op,
+      .target = command.edit.target,
+      .length = uint16_t(sizer.used()),
+  };
+  std::memcpy(packed.data() + start, &header, sizeof(header));
+  cw::detail::ByteWriter writer(packed.data() + start + sizeof(header));
+  writeBody(writer, command);
+}
+
+std::vector<UndoCommand> UndoHistory::Steps::takeNewest() {
+  std::vector<UndoCommand> out;
+  if (starts.empty())
+    return out;
+  for (size_t at = starts.back(); at < packed.size();) {
+    CommandHeader header;
+    std::memcpy(&header, packed.data() + at, sizeof(header));
+    std::span<const std::byte> body(packed.data() + at + sizeof(header),
+                                    header.length);
+    UndoCommand command{.edit = {.op = header.op, .target = header.target}};
+    [[maybe_unused]] bool read = cw::detail::read_edit_body(body, &command.edit);
+    assert(read);
+    if (placesImage(command.edit)) {
+      ImageRefs refs;
+      std::memcpy(&refs, body.data() + body.size() - sizeof(refs),
+                  sizeof(refs));
+      command.edit.image.filename = {refs.filename,
+                                     command.edit.image.filename.size()};
+      command.texture = refs.texture;
+    }
+    out.push_back(command);
+    at += sizeof(header) + header.length;
+  }
+
+  packed.resize(starts.back());
+  starts.pop_back();
+  if (starts.empty())
+    clear();
+  return out;
+}
+
+void UndoHistory::Steps::dropOldest() {
+  assert(!starts.empty());
+  starts.pop_front();
+  first = starts.empty() ? packed.size() : starts.front();
+  // only move what's left to the front once it's most of the vector, so each
+  // byte is moved about once
+  if (first * 2 > packed.size()) {
+    packed.erase(packed.begin(), packed.begin() + first);
+    for (size_t &start : starts)
+      start -= first;
+    first = 0;
+  }
+}
+
+void UndoHistory::Steps::clear() {
+  packed.clear();
+  first = 0;
+  starts.clear();
+}
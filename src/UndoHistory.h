@@ -0,0 +1,96 @@
+#pragma once
+
+#include "journal.h"
+#include <cstddef>
+#include <deque>
+#include <span>
+#include <vector>
+
+struct SDL_Texture;
+
+/// An edit which undoes or redoes part of a step, along with the texture it
+/// needs if it puts an image back
+struct UndoCommand {
+  cw::Edit edit;
+  SDL_Texture *texture = nullptr;
+};
+
+/**
+ * @brief Steps which can be undone and redone, each kept as the edits which
+ * reverse it rather than as a copy of the room. Undoing costs as much as the
+ * step did, however big the room is.
+ *
+ * The edits are packed the same way the journal packs them, so a step of
+ * dragging one vertex around takes about 20 bytes. Once everything kept
+ * outgrows the budget the oldest steps are forgotten, apart from the newest
+ * one which is kept however big it is.
+ *
+ * Commands are kept in the reverse of the order they have to be made in, so
+ * a step is undone by making its commands from the back to the front.
+ */
+class UndoHistory {
+public:
+  explicit UndoHistory(size_t budget_bytes) : budget(budget_bytes) {}
+
+  /// Remember that done was just made and that undo reverses it, as part of
+  /// the open step. Forgets everything that could be redone. Setting the same
+  /// thing again in one step keeps what reverses the first time, so dragging
+  /// something about is only remembered once.
+  void record(const cw::Edit &done, std::span<const UndoCommand> undo);
+  /// Whatever is recorded next starts a new step
+  void endStep();
+  void clear();
+
+  inline bool canUndo() const { return undoSteps.steps() != 0; }
+  inline bool canRedo() const { return redoSteps.steps() != 0; }
+  /// Take off the newest step which can be undone, or nothing
+  std::vector<UndoCommand> takeUndo();
+  /// Take off the newest step which can be redone, or nothing
+  std::vector<UndoCommand> takeRedo();
+  /// What redoes the step which was just undone
+  void pushRedo(std::span<const UndoCommand> commands);
+  /// What undoes the step which was just redone
+  void pushUndo(std::span<const UndoCommand> commands);
+
+  /// How much all the steps take up
+  inline size_t bytes() const { return undoSteps.bytes() + redoSteps.bytes(); }
+  inline size_t undoDepth() const { return undoSteps.steps(); }
+
+private:
+  /// Steps packed one after the other
+  class Steps {
+  public:
+    void begin();
+    // add to the newest step
+    void append(const UndoCommand &command);
+    std::vector<UndoCommand> takeNewest();
+    void dropOldest();
+    void clear();
+
+    inline size_t steps() const { return starts.size(); }
+    inline size_t bytes() const {
+      return packed.size() - first + starts.size() * sizeof(size_t);
+    }
+
+  private:
+    std::vector<std::byte> packed;
+    // where the oldest step still kept starts
+    size_t first = 0;
+    std::deque<size_t> starts;
+  };
+
+  // forget the oldest steps until everything fits, but never the newest step
+  // of keep
+  void trim(const Steps &keep);
+
+  Steps undoSteps;
+  Steps redoSteps;
+  size_t budget;
+
+  // the step being recorded, and the last thing it set
+  bool stepOpen = false;
+  bool lastWasSet = false;
+  cw::EditTarget lastTarget{};
+  uint32_t lastIndex = 0;
+  uint32_t lastVertex = 0;
+};
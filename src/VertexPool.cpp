@@ -0,0 +1,75 @@
+#include "VertexPool.h"
+#include <algorithm>
+#include <cassert>
+
+VertexPool::Range VertexPool::add(std::span<const Vec2> points) {
+  Range range = add(points.size());
+  std::copy(points.begin(), points.end(), vertices.begin() + range.offset);
+  return range;
+}
+
+VertexPool::Range VertexPool::add(size_t count) {
+  // an empty range at the end would be left past it once the range before it
+  // is released and cut off, so they all sit at the start instead
+  if (count == 0)
+    return {};
+  assert(vertices.size() + count <= UINT32_MAX);
+  Range range{
+      .offset = uint32_t(vertices.size()),
+      .count = uint32_t(count),
+      .capacity = uint32_t(count),
+  };
+  vertices.resize(vertices.size() + count);
+  used += count;
+  return range;
+}
+
+void VertexPool::insert(Range &range, size_t index, Vec2 position) {
+  assert(index <= range.count);
+  if (range.count == range.capacity)
+    grow(range, std::max<size_t>(4, size_t(range.count) * 2));
+  auto begin = vertices.begin() + range.offset;
+  std::copy_backward(begin + index, begin + range.count,
+                     begin + range.count + 1);
+  begin[index] = position;
+  ++range.count;
+  ++used;
+}
+
+void VertexPool::erase(Range &range, size_t index) {
+  assert(index < range.count);
+  auto begin = vertices.begin() + range.offset;
+  std::copy(begin + index + 1, begin + range.count, begin + index);
+  --range.count;
+  --used;
+}
+
+void VertexPool::release(Range &range) {
+  used -= range.count;
+  // the last range can just be cut off
+  if (range.offset + range.capacity == vertices.size())
+    vertices.resize(range.offset);
+  range = {};
+}
+
+void VertexPool::clear() {
+  vertices.clear();
+  used = 0;
+}
+
+void VertexPool::grow(Range &range, size_t capacity) {
+  assert(capacity > range.count);
+  if (range.offset + range.capacity == vertices.size()) {
+    // already at the end, so there's nothing after it to move out of the way
+    vertices.resize(range.offset + capacity);
+    range.capacity = uint32_t(capacity);
+    return;
+  }
+  assert(vertices.size() + capacity <= UINT32_MAX);
+  size_t offset = vertices.size();
+  vertices.resize(offset + capacity);
+  std::copy_n(vertices.begin() + range.offset, range.count,
+              vertices.begin() + offset);
+  range.offset = uint32_t(offset);
+  range.capacity = uint32_t(capacity);
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include "Vec2.h"
+#include <cstdint>
+#include <span>
+#include <vector>
+
+/**
+ * @brief The vertices of every polygon in a room, kept in one vector with each
+ * polygon owning a range of it.
+ *
+ * A range has room to grow. A polygon which outgrows its range moves to the
+ * end of the vector and leaves a gap behind, as does one which is released.
+ * compact() closes the gaps by laying the ranges out again one after another
+ * in the order it's given them, after which the whole room's vertices are
+ * all() in that order.
+ */
+class VertexPool {
+public:
+  /// Where a polygon's vertices are
+  struct Range {
+    uint32_t offset = 0;
+    uint32_t count = 0;
+    /// how many fit before the range has to move
+    uint32_t capacity = 0;
+  };
+
+  /// A new range holding points, with no room to spare
+  Range add(std::span<const Vec2> points);
+  /// A new range of count vertices, to be filled in through points(). An
+  /// empty one is Range{}.
+  Range add(size_t count);
+  /// Add a vertex at index, moving the ones from index onwards along
+  void insert(Range &range, size_t index, Vec2 position);
+  /// Remove the vertex at index, moving later ones back
+  void erase(Range &range, size_t index);
+  /// Give the range back, it's empty afterwards
+  void release(Range &range);
+  void clear();
+
+  inline std::span<Vec2> points(Range range) {
+    return std::span(vertices).subspan(range.offset, range.count);
+  }
+  inline std::span<const Vec2> points(Range range) const {
+    return std::span(vertices).subspan(range.offset, range.count);
+  }
+  /// Every vertex, gaps and all
+  inline std::span<const Vec2> all() const { return vertices; }
+  inline std::span<Vec2> all() { return vertices; }
+  /// How many vertices are in use
+  inline size_t size() const { return used; }
+
+  /// Whether the gaps have grown to take up more than the vertices in use
+  inline bool needsCompaction() const {
+    return vertices.size() > COMPACT_SLACK + 2 * used;
+  }
+
+  /// Pack the ranges of items one after another, in the order the items are
+  /// in. range_of(item) gives back the Range of an item, and every range
+  /// still in use has to be among them.
+  template <typename Items, typename RangeOf>
+  void compact(Items &items, RangeOf &&range_of) {
+    std::vector<Vec2> packed;
+    packed.reserve(used);
+    for (auto &item : items) {
+      Range &range = range_of(item);
+      auto from = points(range);
+      // empty ones go to the start, same as in add()
+      range.offset = range.count ? uint32_t(packed.size()) : 0;
+      range.capacity = range.count;
+      packed.insert(packed.end(), from.begin(), from.end());
+    }
+    vertices = std::move(packed);
+  }
+
+private:
+  // gaps smaller than this are never worth closing
+  static constexpr size_t COMPACT_SLACK = 4096;
+
+  // move range to the end of the vector with room for at least capacity
+  void grow(Range &range, size_t capacity);
+
+  std::vector<Vec2> vertices;
+  size_t used = 0;
+};
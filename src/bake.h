@@ -0,0 +1,395 @@
+#pragma once
+#include "Vec2.h"
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+// Geometry the game needs for every room, worked out from the terrains when
+// the editor saves a level instead of every time the game loads it: the
+// bounds of each terrain, its triangles, and a grid sorting terrains by where
+// they are. Saved when SaveOptions::bake is set.
+
+namespace cw {
+
+/// NOTE: written directly to the level file
+struct Aabb {
+  Vec2 min;
+  Vec2 max;
+};
+
+/// NOTE: written directly to the level file. Corners of a triangle, as indices
+/// into the vertices of the terrain it belongs to, wound the same way as the
+/// terrain.
+struct Triangle {
+  uint32_t a;
+  uint32_t b;
+  uint32_t c;
+};
+
+/// NOTE: written directly to the level file. A grid of square cells, columns
+/// wide and rows high, with its top left corner at origin
+struct BroadphaseGrid {
+  Vec2 origin;
+  float cell_size;
+  uint32_t columns;
+  uint32_t rows;
+};
+
+namespace bake::detail {
+
+/// The grid cells a box covers, clamped to the grid
+struct CellRange {
+  uint32_t x0, y0, x1, y1;
+};
+
+inline CellRange cells_of(const BroadphaseGrid &grid, const Aabb &box) {
+  auto cell = [&grid](float at, float origin, uint32_t cells) {
+    // written so that NaNs land in the first cell
+    float index = std::floor((at - origin) / grid.cell_size);
+    return index > 0 ? uint32_t(std::min(index, float(cells - 1))) : 0;
+  };
+  return {cell(box.min.x, grid.origin.x, grid.columns),
+          cell(box.min.y, grid.origin.y, grid.rows),
+          cell(box.max.x, grid.origin.x, grid.columns),
+          cell(box.max.y, grid.origin.y, grid.rows)};
+}
+
+} // namespace bake::detail
+
+/// Terrains sorted into a grid by their bounds, so the ones near a point or
+/// box can be found without looking at all of them
+struct Broadphase {
+  BroadphaseGrid grid{};
+  /// cell row * columns + column holds items cell_starts[cell] up to
+  /// cell_starts[cell + 1]. one more than there are cells
+  std::span<const uint32_t> cell_starts;
+  /// terrain indices, ascending within each cell
+  std::span<const uint32_t> items;
+
+  /// Call fn(terrain index) for each terrain whose bounds may overlap box. A
+  /// terrain in several of the cells box covers comes up once for each.
+  template <typename Fn> inline void query(const Aabb &box, Fn &&fn) const {
+    if (cell_starts.empty())
+      return;
+    auto [x0, y0, x1, y1] = bake::detail::cells_of(grid, box);
+    for (uint32_t y = y0; y <= y1; ++y) {
+      for (uint32_t x = x0; x <= x1; ++x) {
+        size_t index = size_t(y) * grid.columns + x;
+        for (uint32_t i = cell_starts[index]; i < cell_starts[index + 1]; ++i)
+          fn(items[i]);
+      }
+    }
+  }
+};
+
+/// most cells a broadphase grid has on either side
+inline constexpr uint32_t MAX_BROADPHASE_CELLS = 4096;
+
+namespace bake {
+
+/// Triangles of a terrain with this many vertices, however it's shaped
+inline constexpr size_t triangle_count(size_t vertex_count) {
+  return vertex_count < 3 ? 0 : vertex_count - 2;
+}
+
+inline Aabb bounds(std::span<const Vec2> verts) {
+  if (verts.empty())
+    return {};
+  Aabb box{verts[0], verts[0]};
+  for (const Vec2 &v : verts) {
+    box.min = {std::min(box.min.x, v.x), std::min(box.min.y, v.y)};
+    box.max = {std::max(box.max.x, v.x), std::max(box.max.y, v.y)};
+  }
+  // adding zero turns -0 into 0, which is what vertices stored on a grid come
+  // back as
+  return {{box.min.x + 0.0f, box.min.y + 0.0f},
+          {box.max.x + 0.0f, box.max.y + 0.0f}};
+}
+
+namespace detail {
+
+/// Twice the signed area of the triangle o a b. Doubles, since level
+/// coordinates are big enough for products of floats to lose bits.
+inline double cross(Vec2 o, Vec2 a, Vec2 b) {
+  return (double(a.x) - o.x) * (double(b.y) - o.y) -
+         (double(a.y) - o.y) * (double(b.x) - o.x);
+}
+
+inline bool in_triangle(Vec2 p, Vec2 a, Vec2 b, Vec2 c) {
+  return cross(a, b, p) >= 0 && cross(b, c, p) >= 0 && cross(c, a, p) >= 0;
+}
+
+inline bool same_point(Vec2 a, Vec2 b) { return a.x == b.x && a.y == b.y; }
+
+/// A grid of square cells covering all, no smaller than cell_size and no more
+/// than max_cells on a side
+inline BroadphaseGrid grid_over(const Aabb &all, float cell_size,
+                                uint32_t max_cells) {
+  float width = all.max.x - all.min.x;
+  float height = all.max.y - all.min.y;
+  cell_size = std::max(cell_size, std::max(width, height) / float(max_cells));
+  if (!(cell_size > 0) || !std::isfinite(cell_size))
+    cell_size = 1;
+  auto cells = [&](float extent) {
+    float count = extent / cell_size;
+    return count < float(max_cells - 1) ? uint32_t(count) + 1 : max_cells;
+  };
+  return {.origin = all.min,
+          .cell_size = cell_size,
+          .columns = cells(width),
+          .rows = cells(height)};
+}
+
+} // namespace detail
+
+/// Sort boxes into the cells of grid they cover, as the cell_starts and items
+/// of a Broadphase
+inline void bin(const BroadphaseGrid &grid, std::span<const Aabb> boxes,
+                std::vector<uint32_t> *cell_starts,
+                std::vector<uint32_t> *items) {
+  const size_t cells = size_t(grid.columns) * grid.rows;
+  cell_starts->assign(cells + 1, 0);
+  auto for_each_cell = [&grid](const Aabb &box, auto &&fn) {
+    auto [x0, y0, x1, y1] = detail::cells_of(grid, box);
+    for (uint32_t y = y0; y <= y1; ++y)
+      for (uint32_t x = x0; x <= x1; ++x)
+        fn(size_t(y) * grid.columns + x);
+  };
+  // count, then place. placing in item order keeps each cell sorted
+  for (const Aabb &box : boxes)
+    for_each_cell(box, [&](size_t cell) { ++(*cell_starts)[cell + 1]; });
+  for (size_t i = 0; i < cells; ++i)
+    (*cell_starts)[i + 1] += (*cell_starts)[i];
+  items->resize(cell_starts->back());
+  std::vector<uint32_t> next(cell_starts->begin(), cell_starts->end() - 1);
+  for (size_t i = 0; i < boxes.size(); ++i)
+    for_each_cell(boxes[i], [&](size_t cell) {
+      (*items)[next[cell]++] = uint32_t(i);
+    });
+}
+
+/// Cut a terrain into triangle_count(verts.size()) triangles by clipping ears
+/// off it, filling out, which has to be exactly that big. Only reflex corners
+/// can poke into an ear, so just those are kept in a grid to check ears
+/// against, which keeps big terrains fast. Terrains which cross over
+/// themselves still get the same number of triangles, they just won't cover
+/// the terrain exactly.
+inline void triangulate(std::span<const Vec2> verts,
+                        std::span<Triangle> out) {
+  using detail::cross;
+  const size_t n = verts.size();
+  assert(out.size() == triangle_count(n));
+  if (n < 3)
+    return;
+
+  double area = 0;
+  for (size_t i = 0, j = n - 1; i < n; j = i++)
+    area += double(verts[j].x) * verts[i].y - double(verts[i].x) * verts[j].y;
+  // corners turning the same way as the whole terrain are convex
+  const double winding = area < 0 ? -1 : 1;
+
+  std::vector<uint32_t> prev(n), next(n);
+  for (size_t i = 0; i < n; ++i) {
+    prev[i] = uint32_t(i == 0 ? n - 1 : i - 1);
+    next[i] = uint32_t(i + 1 == n ? 0 : i + 1);
+  }
+  // positive for convex corners, zero where the terrain doesn't turn
+  auto turn = [&](uint32_t i) {
+    return winding * cross(verts[prev[i]], verts[i], verts[next[i]]);
+  };
+  std::vector<bool> clipped(n, false);
+  size_t remaining = n;
+  auto clip = [&](uint32_t i) {
+    out[n - remaining] = {prev[i], i, next[i]};
+    clipped[i] = true;
+    next[prev[i]] = next[i];
+    prev[next[i]] = prev[i];
+    --remaining;
+  };
+
+  // corners which don't turn, like repeated vertices, cut off triangles with
+  // no area, so they can always go. doing them first keeps them out of the
+  // grid
+  std::vector<uint32_t> work;
+  for (uint32_t i = 0; i < n; ++i) {
+    if (turn(i) == 0)
+      work.push_back(i);
+  }
+  while (!work.empty() && remaining > 3) {
+    uint32_t i = work.back();
+    work.pop_back();
+    if (clipped[i] || turn(i) != 0)
+      continue;
+    clip(i);
+    work.push_back(prev[i]);
+    work.push_back(next[i]);
+  }
+
+  // corners only ever get more convex as ears are clipped off next to them,
+  // so the grid is built once and corners which stopped being reflex are
+  // skipped when they come up
+  std::vector<uint32_t> reflex;
+  for (uint32_t i = 0; i < n; ++i) {
+    if (!clipped[i] && turn(i) < 0)
+      reflex.push_back(i);
+  }
+  // small terrains just check every reflex corner
+  const bool use_grid = reflex.size() > 32;
+  BroadphaseGrid grid{};
+  std::vector<uint32_t> cell_starts, cell_items;
+  if (use_grid) {
+    Aabb all = bounds(verts);
+    float extent = std::max(all.max.x - all.min.x, all.max.y - all.min.y);
+    grid = detail::grid_over(
+        all, extent / std::sqrt(float(reflex.size()) + 1), 1024);
+    std::vector<Aabb> boxes;
+    boxes.reserve(reflex.size());
+    for (uint32_t i : reflex)
+      boxes.push_back({verts[i], verts[i]});
+    bin(grid, boxes, &cell_starts, &cell_items);
+  }
+
+  // ears get long and thin, so rather than every cell under an ear's bounds
+  // this goes through the cells each row of the grid has under the ear itself,
+  // give or take a cell
+  auto for_each_reflex_in = [&](Vec2 a, Vec2 b, Vec2 c, auto &&fn) {
+    if (!use_grid) {
+      for (uint32_t j : reflex)
+        fn(j);
+      return;
+    }
+    Aabb box{{std::min({a.x, b.x, c.x}), std::min({a.y, b.y, c.y})},
+             {std::max({a.x, b.x, c.x}), std::max({a.y, b.y, c.y})}};
+    auto [x0, y0, x1, y1] = detail::cells_of(grid, box);
+    const Vec2 corners[] = {a, b, c, a};
+    for (uint32_t y = y0; y <= y1; ++y) {
+      float low =
+          std::max(box.min.y, grid.origin.y + float(y) * grid.cell_size);
+      float high = std::min(box.max.y, low + grid.cell_size);
+      // x extent of the part of the ear between low and high
+      float left = box.max.x, right = box.min.x;
+      for (int e = 0; e < 3; ++e) {
+        Vec2 p = corners[e], q = corners[e + 1];
+        float from = 0, to = 1;
+        if (p.y != q.y) {
+          from = (low - p.y) / (q.y - p.y);
+          to = (high - p.y) / (q.y - p.y);
+          if (from > to)
+            std::swap(from, to);
+          from = std::max(from, 0.0f);
+          to = std::min(to, 1.0f);
+        } else if (p.y < low || p.y > high) {
+          continue;
+        }
+        if (!(from <= to))
+          continue;
+        float at_from = p.x + (q.x - p.x) * from;
+        float at_to = p.x + (q.x - p.x) * to;
+        left = std::min({left, at_from, at_to});
+        right = std::max({right, at_from, at_to});
+      }
+      if (!(left <= right)) {
+        left = box.min.x;
+        right = box.max.x;
+      }
+      auto row = detail::cells_of(grid, {{left, low}, {right, low}});
+      uint32_t first = std::max(x0, row.x0 == 0 ? 0 : row.x0 - 1);
+      uint32_t last = std::min(x1, row.x1 + 1);
+      for (uint32_t x = first; x <= last; ++x) {
+        size_t cell = size_t(y) * grid.columns + x;
+        for (uint32_t k = cell_starts[cell]; k < cell_starts[cell + 1]; ++k)
+          fn(reflex[cell_items[k]]);
+      }
+    }
+  };
+
+  auto is_ear = [&](uint32_t i) {
+    double corner = turn(i);
+    if (corner <= 0)
+      return corner == 0;
+    Vec2 a = verts[prev[i]], b = verts[i], c = verts[next[i]];
+    if (winding < 0)
+      std::swap(a, c);
+    bool ear = true;
+    for_each_reflex_in(a, b, c, [&](uint32_t j) {
+      if (!ear || clipped[j] || j == i || j == prev[i] || j == next[i])
+        return;
+      Vec2 p = verts[j];
+      if (detail::same_point(p, a) || detail::same_point(p, b) ||
+          detail::same_point(p, c) || turn(j) > 0)
+        return;
+      ear = !detail::in_triangle(p, a, b, c);
+    });
+    return ear;
+  };
+
+  // clipping an ear only changes whether its two neighbours are ears, so
+  // every corner is checked once up front and after that only those are.
+  // ears are clipped first come first served, which works round the terrain
+  // cutting it up evenly instead of into a fan of ever longer triangles.
+  // entries which stopped being ears go stale instead of being removed
+  std::vector<bool> ear(n, false);
+  work.clear();
+  uint32_t last = 0;
+  for (uint32_t i = 0; i < n; ++i) {
+    if (clipped[i])
+      continue;
+    last = i;
+    if (is_ear(i)) {
+      ear[i] = true;
+      work.push_back(i);
+    }
+  }
+  size_t head = 0;
+  while (remaining > 3) {
+    while (head < work.size() && (clipped[work[head]] || !ear[work[head]]))
+      ++head;
+    uint32_t i = last;
+    if (head < work.size()) {
+      i = work[head++];
+    } else {
+      // no ears left means the terrain crosses itself. cut off a nearby
+      // corner which is at least convex, to still end up with n - 2
+      // triangles
+      for (size_t step = 0; step < 64 && turn(i) < 0; ++step)
+        i = next[i];
+    }
+    clip(i);
+    last = next[i];
+    for (uint32_t neighbour : {prev[i], next[i]}) {
+      bool now = is_ear(neighbour);
+      if (now && !ear[neighbour])
+        work.push_back(neighbour);
+      ear[neighbour] = now;
+    }
+  }
+  out[n - 3] = {prev[last], last, next[last]};
+}
+
+/// A grid over the bounds of every terrain, with about as many cells as there
+/// are terrains but none smaller than the average terrain, so each terrain
+/// only lands in a few of them
+inline BroadphaseGrid broadphase_grid(std::span<const Aabb> boxes) {
+  Aabb all{};
+  double average = 0;
+  if (!boxes.empty())
+    all = boxes[0];
+  for (const Aabb &box : boxes) {
+    all.min = {std::min(all.min.x, box.min.x), std::min(all.min.y, box.min.y)};
+    all.max = {std::max(all.max.x, box.max.x), std::max(all.max.y, box.max.y)};
+    average += std::max(box.max.x - box.min.x, box.max.y - box.min.y);
+  }
+  average /= double(std::max<size_t>(boxes.size(), 1));
+  float extent = std::max(all.max.x - all.min.x, all.max.y - all.min.y);
+  float cell_size = std::max(float(average),
+                             extent / std::sqrt(float(boxes.size()) + 1));
+  return detail::grid_over(all, cell_size, MAX_BROADPHASE_CELLS);
+}
+
+} // namespace bake
+
+} // namespace cw
@@ -0,0 +1,368 @@
+#pragma once
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define CW_CRC32C_X86 1
+#include <immintrin.h>
+#endif
+
+// CRC-32C (Castagnoli), the checksum iSCSI and ext4 use. On x86-64 the fastest
+// way the CPU running it has is picked the first time it's used, whatever the
+// build targets: folding 256 bytes at a time with AVX-512 carry-less
+// multiplies, or the SSE4.2 crc32 instruction. Everywhere else, and on CPUs
+// with neither, it uses a slicing-by-8 table. They all give the same values,
+// so files checked one way verify any other way.
+
+namespace cw::crc32c {
+
+namespace detail {
+
+// reflected polynomial
+inline constexpr uint32_t POLY = 0x82f63b78;
+
+/// Multiply a and b modulo the polynomial, where bit 31 is x^0. a must not be
+/// zero.
+inline constexpr uint32_t multiply(uint32_t a, uint32_t b) {
+  uint32_t m = uint32_t(1) << 31;
+  uint32_t product = 0;
+  for (;;) {
+    if (a & m) {
+      product ^= b;
+      if ((a & (m - 1)) == 0)
+        break;
+    }
+    m >>= 1;
+    b = b & 1 ? (b >> 1) ^ POLY : b >> 1;
+  }
+  return product;
+}
+
+/// x^(2^n) modulo the polynomial
+inline constexpr auto X2N = [] {
+  std::array<uint32_t, 64> table{};
+  uint32_t p = uint32_t(1) << 30; // x^1
+  for (auto &entry : table) {
+    entry = p;
+    p = multiply(p, p);
+  }
+  return table;
+}();
+
+/// x^n modulo the polynomial
+inline constexpr uint32_t power(uint64_t n) {
+  uint32_t p = uint32_t(1) << 31; // x^0
+  for (size_t k = 0; n; n >>= 1, ++k) {
+    if (n & 1)
+      p = multiply(X2N[k % X2N.size()], p);
+  }
+  return p;
+}
+
+/// x^(8 * bytes) modulo the polynomial. Multiplying a checksum by it moves it
+/// past that many more bytes.
+inline constexpr uint32_t shift(uint64_t bytes) { return power(8 * bytes); }
+
+inline constexpr auto TABLES = [] {
+  std::array<std::array<uint32_t, 256>, 8> tables{};
+  for (uint32_t i = 0; i < 256; ++i) {
+    uint32_t crc = i;
+    for (int bit = 0; bit < 8; ++bit)
+      crc = crc & 1 ? (crc >> 1) ^ POLY : crc >> 1;
+    tables[0][i] = crc;
+  }
+  for (uint32_t i = 0; i < 256; ++i) {
+    for (size_t t = 1; t < tables.size(); ++t) {
+      uint32_t prev = tables[t - 1][i];
+      tables[t][i] = (prev >> 8) ^ tables[0][prev & 0xff];
+    }
+  }
+  return tables;
+}();
+
+/// Runs the raw register over bytes, without the inversions on either end
+inline uint32_t update_software(uint32_t state, const std::byte *p,
+                                size_t size) {
+  if constexpr (std::endian::native == std::endian::little) {
+    for (; size >= 8; p += 8, size -= 8) {
+      uint64_t word;
+      std::memcpy(&word, p, sizeof(word));
+      word ^= state;
+      state = TABLES[7][word & 0xff] ^ TABLES[6][(word >> 8) & 0xff] ^
+              TABLES[5][(word >> 16) & 0xff] ^ TABLES[4][(word >> 24) & 0xff] ^
+              TABLES[3][(word >> 32) & 0xff] ^ TABLES[2][(word >> 40) & 0xff] ^
+              TABLES[1][(word >> 48) & 0xff] ^ TABLES[0][word >> 56];
+    }
+  }
+  for (; size; ++p, --size)
+    state = (state >> 8) ^ TABLES[0][(state ^ uint32_t(*p)) & 0xff];
+  return state;
+}
+
+#if defined(CW_CRC32C_X86)
+// built for these whatever the rest of the build targets, and only called once
+// the CPU says it has them
+#define CW_CRC32C_SSE42 __attribute__((target("sse4.2")))
+#define CW_CRC32C_FOLD                                                         \
+  __attribute__((target("sse4.2,pclmul,avx512f,vpclmulqdq")))
+
+CW_CRC32C_SSE42 inline uint32_t update_hardware(uint32_t state,
+                                                const std::byte *p,
+                                                size_t size) {
+  uint64_t wide = state;
+  for (; size >= 8; p += 8, size -= 8) {
+    uint64_t word;
+    std::memcpy(&word, p, sizeof(word));
+    wide = _mm_crc32_u64(wide, word);
+  }
+  state = uint32_t(wide);
+  for (; size; ++p, --size)
+    state = _mm_crc32_u8(state, uint8_t(*p));
+  return state;
+}
+
+// each crc32 instruction waits on the one before it, but three independent
+// ones can be in flight at once. so long inputs are run as three stripes side
+// by side and stitched back together
+inline constexpr size_t STRIPE = 32 * 1024;
+inline constexpr uint32_t STRIPE_SHIFT = shift(STRIPE);
+inline constexpr uint32_t DOUBLE_STRIPE_SHIFT = shift(2 * STRIPE);
+
+CW_CRC32C_SSE42 inline uint32_t update_striped(uint32_t state,
+                                               const std::byte *p,
+                                               size_t size) {
+  for (; size >= 3 * STRIPE; p += 3 * STRIPE, size -= 3 * STRIPE) {
+    // the later stripes start from zero, so they only hold what their own
+    // bytes add, and can be shifted past the rest and xored in
+    uint64_t a = state, b = 0, c = 0;
+    for (size_t i = 0; i < STRIPE; i += 8) {
+      uint64_t words[3];
+      std::memcpy(&words[0], p + i, 8);
+      std::memcpy(&words[1], p + STRIPE + i, 8);
+      std::memcpy(&words[2], p + 2 * STRIPE + i, 8);
+      a = _mm_crc32_u64(a, words[0]);
+      b = _mm_crc32_u64(b, words[1]);
+      c = _mm_crc32_u64(c, words[2]);
+    }
+    state = multiply(DOUBLE_STRIPE_SHIFT, uint32_t(a)) ^
+            multiply(STRIPE_SHIFT, uint32_t(b)) ^ uint32_t(c);
+  }
+  return update_hardware(state, p, size);
+}
+
+// Folding treats 16 bytes as a polynomial of degree below 128, lowest address
+// highest degree, and moves it some number of bits further along by
+// multiplying its halves by x^(bits + 63) and x^(bits - 1). Those are below degree 32, so the product
+// fits back in 16 bytes, and it's the same modulo the polynomial, which is all
+// the checksum depends on. Each 64 bit half of these holds one of them
+// reflected in its top 32 bits, the way the carry-less multiply lines up.
+inline constexpr uint64_t fold_constant(uint64_t bits) {
+  return uint64_t(power(bits)) << 32;
+}
+struct FoldConstants {
+  uint64_t low, high;
+};
+inline constexpr FoldConstants fold_by(uint64_t bits) {
+  return {fold_constant(bits + 63), fold_constant(bits - 1)};
+}
+
+CW_CRC32C_FOLD inline __m128i fold_128(__m128i x, FoldConstants k) {
+  const __m128i constants = _mm_set_epi64x(int64_t(k.high), int64_t(k.low));
+  return _mm_xor_si128(_mm_clmulepi64_si128(x, constants, 0x00),
+                       _mm_clmulepi64_si128(x, constants, 0x11));
+}
+
+CW_CRC32C_FOLD inline __m512i fold_512(__m512i x, __m512i constants,
+                                       __m512i next) {
+  // 0x96 xors all three
+  return _mm512_ternarylogic_epi64(_mm512_clmulepi64_epi128(x, constants, 0x00),
+                                   _mm512_clmulepi64_epi128(x, constants, 0x11),
+                                   next, 0x96);
+}
+
+// the 64 bytes offset into p, also copied to dest when folding copies
+template <bool Copy>
+CW_CRC32C_FOLD inline __m512i load_64(const std::byte *p, std::byte *dest,
+                                      size_t offset) {
+  __m512i x = _mm512_loadu_si512(p + offset);
+  if constexpr (Copy)
+    _mm512_storeu_si512(dest + offset, x);
+  return x;
+}
+
+/// With Copy, every byte read is also written to the same place in dest, so
+/// copying and checking go over memory once between them
+template <bool Copy>
+CW_CRC32C_FOLD inline uint32_t fold(uint32_t state, const std::byte *p,
+                                    size_t size, std::byte *dest) {
+  constexpr size_t BLOCK = 256;
+  if (size < 2 * BLOCK) {
+    if constexpr (Copy)
+      std::memcpy(dest, p, size);
+    return update_striped(state, p, size);
+  }
+
+  // starting from state is the same as starting from zero with state xored
+  // into the first four bytes
+  __m512i x[4];
+  for (size_t i = 0; i < 4; ++i)
+    x[i] = load_64<Copy>(p, dest, 64 * i);
+  x[0] = _mm512_xor_si512(x[0], _mm512_zextsi128_si512(
+                                    _mm_cvtsi32_si128(int32_t(state))));
+  p += BLOCK;
+  dest += Copy ? BLOCK : 0;
+  size -= BLOCK;
+
+  // four independent folds in flight, each a whole block ahead
+  constexpr FoldConstants by_block = fold_by(8 * BLOCK);
+  const __m512i block = _mm512_set4_epi64(
+      int64_t(by_block.high), int64_t(by_block.low), int64_t(by_block.high),
+      int64_t(by_block.low));
+  for (; size >= BLOCK; p += BLOCK, size -= BLOCK) {
+    for (size_t i = 0; i < 4; ++i)
+      x[i] = fold_512(x[i], block, load_64<Copy>(p, dest, 64 * i));
+    dest += Copy ? BLOCK : 0;
+  }
+
+  // then down to 64 bytes, and on through whatever is left of those
+  constexpr FoldConstants by_64 = fold_by(8 * 64);
+  const __m512i next = _mm512_set4_epi64(int64_t(by_64.high),
+                                         int64_t(by_64.low),
+                                         int64_t(by_64.high),
+                                         int64_t(by_64.low));
+  __m512i folded = fold_512(x[0], next, x[1]);
+  folded = fold_512(folded, next, x[2]);
+  folded = fold_512(folded, next, x[3]);
+  for (; size >= 64; p += 64, size -= 64) {
+    folded = fold_512(folded, next, load_64<Copy>(p, dest, 0));
+    dest += Copy ? 64 : 0;
+  }
+
+  // the four lanes onto the last one
+  constexpr FoldConstants by_48 = fold_by(8 * 48);
+  constexpr FoldConstants by_32 = fold_by(8 * 32);
+  constexpr FoldConstants by_16 = fold_by(8 * 16);
+  __m128i lanes[4];
+  _mm512_storeu_si512(lanes, folded);
+  __m128i last = _mm_xor_si128(lanes[3], fold_128(lanes[0], by_48));
+  last = _mm_xor_si128(last, fold_128(lanes[1], by_32));
+  last = _mm_xor_si128(last, fold_128(lanes[2], by_16));
+
+  // those 16 bytes have the same checksum as everything so far, and the rest
+  // follows them
+  uint64_t words[2];
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(words), last);
+  uint64_t wide = _mm_crc32_u64(0, words[0]);
+  wide = _mm_crc32_u64(wide, words[1]);
+  if constexpr (Copy)
+    std::memcpy(dest, p, size);
+  return update_hardware(uint32_t(wide), p, size);
+}
+
+CW_CRC32C_FOLD inline uint32_t update_folding(uint32_t state,
+                                              const std::byte *p,
+                                              size_t size) {
+  return fold<false>(state, p, size, nullptr);
+}
+
+CW_CRC32C_FOLD inline uint32_t copy_update_folding(uint32_t state,
+                                                   std::byte *dest,
+                                                   const std::byte *p,
+                                                   size_t size) {
+  // stores that straddle cache lines go at half speed, so get dest lined up
+  // first
+  size_t head = -reinterpret_cast<uintptr_t>(dest) % 64;
+  if (head < size) {
+    std::memcpy(dest, p, head);
+    state = update_hardware(state, p, head);
+    dest += head;
+    p += head;
+    size -= head;
+  }
+  return fold<true>(state, p, size, dest);
+}
+
+using Update = uint32_t (*)(uint32_t, const std::byte *, size_t);
+
+inline Update pick_update() {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f") &&
+      __builtin_cpu_supports("vpclmulqdq") &&
+      __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.2"))
+    return update_folding;
+  if (__builtin_cpu_supports("sse4.2"))
+    return update_striped;
+  return update_software;
+}
+
+/// Runs the raw register over bytes, the fastest way this CPU can
+inline uint32_t update(uint32_t state, const std::byte *p, size_t size) {
+  static const Update best = pick_update();
+  return best(state, p, size);
+}
+#else
+inline uint32_t update(uint32_t state, const std::byte *p, size_t size) {
+  return update_software(state, p, size);
+}
+#endif
+
+// a piece at a time, so the checksum reads bytes the copy has only just
+// brought into cache
+inline constexpr size_t COPY_PIECE = 64 * 1024;
+
+inline uint32_t copy_update_pieces(uint32_t state, std::byte *dest,
+                                   const std::byte *p, size_t size) {
+  for (size_t offset = 0; offset < size; offset += COPY_PIECE) {
+    size_t piece = size - offset < COPY_PIECE ? size - offset : COPY_PIECE;
+    std::memcpy(dest + offset, p + offset, piece);
+    state = update(state, p + offset, piece);
+  }
+  return state;
+}
+
+/// Copies bytes to dest while running the raw register over them
+#if defined(CW_CRC32C_X86)
+inline uint32_t copy_update(uint32_t state, std::byte *dest,
+                            const std::byte *p, size_t size) {
+  static const bool folds = pick_update() == update_folding;
+  if (folds)
+    return copy_update_folding(state, dest, p, size);
+  return copy_update_pieces(state, dest, p, size);
+}
+#else
+inline uint32_t copy_update(uint32_t state, std::byte *dest,
+                            const std::byte *p, size_t size) {
+  return copy_update_pieces(state, dest, p, size);
+}
+#endif
+
+} // namespace detail
+
+/// Checksum of the bytes that gave crc followed by bytes. Starting from zero
+/// checksums bytes alone.
+inline uint32_t extend(uint32_t crc, std::span<const std::byte> bytes) {
+  return ~detail::update(~crc, bytes.data(), bytes.size());
+}
+
+inline uint32_t checksum(std::span<const std::byte> bytes) {
+  return extend(0, bytes);
+}
+
+/// Copy bytes into dest, which has to be the same size, and extend crc by them
+/// the same as extend. Where the CPU can fold, each byte is checksummed as it
+/// goes past on its way to dest, so this costs little more than the copy.
+inline uint32_t copy_extend(uint32_t crc, std::span<std::byte> dest,
+                            std::span<const std::byte> bytes) {
+  return ~detail::copy_update(~crc, dest.data(), bytes.data(), bytes.size());
+}
+
+/// Checksum of a followed by b, given the checksum of each and b's size. Lets
+/// pieces of one buffer be checksummed separately, e.g. on different threads.
+inline uint32_t combine(uint32_t crc_a, uint32_t crc_b, uint64_t size_b) {
+  return detail::multiply(detail::shift(size_b), crc_a) ^ crc_b;
+}
+
+} // namespace cw::crc32c
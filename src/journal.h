@@ -0,0 +1,672 @@
+#pragma once
+#include "serialize.h"
+#include <string>
+
+// Edits made to a level since it was last written out in full, appended to a
+// journal file next to it. Saving an edit costs as much as the edit instead
+// of the whole level, and a journal left over after a crash is replayed on
+// top of the level the next time it is loaded. Once the journal has grown
+// big enough it is folded back into the level with compact_journal. Anything
+// else reading the level sees the edits by loading it as a JournaledLevel.
+
+namespace cw {
+
+#define CROSSWIRE_JOURNAL_FILE_EXTENSION "cwj"
+
+enum class EditOp : uint8_t {
+  Insert = 1, // at index, moving everything from index onwards along
+  Set = 2,
+  Erase = 3, // at index, moving everything after it back
+  /// at index, moving the last one into its place instead. the editor erases
+  /// everything but vertices this way, so it never has to move the rest
+  SwapErase = 4,
+  /// at index, moving the one there to the end. puts back what a SwapErase
+  /// took out, for undo
+  SwapInsert = 5,
+};
+
+enum class EditTarget : uint8_t {
+  Vertex = 1, // a vertex of a terrain
+  Terrain = 2,
+  Turret = 3,
+  Image = 4,
+  BuildSite = 5,
+  Spawn = 6, // only ever Set
+  /// an instance of a prefab. the prefabs themselves are never journaled,
+  /// changing them means writing the whole level out
+  Instance = 7,
+};
+
+/// One change to a level. Only the value belonging to target is used, and
+/// erasing doesn't use any.
+struct Edit {
+  EditOp op;
+  EditTarget target;
+  /// which terrain, turret, image, build site or instance
+  uint32_t index = 0;
+  /// which vertex of terrain index
+  uint32_t vertex = 0;
+
+  Vec2 position{}; // Vertex and Spawn
+  /// Terrain. inserted terrains start out with no vertices
+  TerrainType terrain_type{};
+  Turret turret{};
+  /// the filename is only borrowed, it has to outlive the edit
+  Image image{};
+  BuildSite build_site{};
+  PrefabInstance instance{};
+};
+
+/// NOTE: unlike levels, journals are written in host byte order. they only
+/// ever get replayed by the machine that wrote them
+struct JournalHeader {
+  const char header_text[16] = "Crosswire Edits";
+  uint64_t magic = 12834734829201;
+  /// version 1: base_hash is an FNV-1a of the level file
+  /// version 2: base_hash is its CRC-32C, which is many times faster
+  uint32_t version = 2;
+  uint32_t reserved = 0;
+  /// size and hash of the exact level file the edits go on top of
+  uint64_t base_size = 0;
+  uint64_t base_hash = 0;
+};
+
+/// NOTE: written directly to the journal in front of every edit
+struct JournalRecordHeader {
+  /// of the rest of the record, so a torn write at the end of the journal can
+  /// be told apart from an edit
+  uint32_t checksum;
+  EditOp op;
+  EditTarget target;
+  /// bytes in the record after this header, a multiple of 4
+  uint16_t length;
+};
+
+/// NOTE: written directly to the journal after every JournalRecordHeader,
+/// followed by the value of the edit unless it erases something
+struct EditRecord {
+  uint32_t index;
+  uint32_t vertex;
+};
+
+/// Where a replayed journal ends, so appending can carry on from there
+struct JournalTail {
+  /// bytes up to the end of the last intact edit
+  size_t valid_size = 0;
+  /// size of the level file the journal was started for
+  size_t base_size = 0;
+};
+
+namespace detail {
+
+/// FNV-1a, nothing here needs to stand up to anyone trying to collide it.
+/// Only for the base of version 1 journals, it goes a byte at a time.
+inline uint64_t hash64(std::span<const std::byte> bytes) {
+  uint64_t hash = 14695981039346656037ull;
+  for (std::byte byte : bytes) {
+    hash ^= uint64_t(byte);
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+inline uint32_t hash32(std::span<const std::byte> bytes) {
+  uint32_t hash = 2166136261u;
+  for (std::byte byte : bytes) {
+    hash ^= uint32_t(byte);
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+inline bool valid_edit(EditOp op, EditTarget target) {
+  if (op < EditOp::Insert || op > EditOp::SwapInsert ||
+      target < EditTarget::Vertex || target > EditTarget::Instance)
+    return false;
+  // the order of a terrain's vertices is its shape
+  if (target == EditTarget::Vertex &&
+      (op == EditOp::SwapErase || op == EditOp::SwapInsert))
+    return false;
+  return target != EditTarget::Spawn || op == EditOp::Set;
+}
+
+/// Write the parts of an edit after its record header
+inline void write_edit_body(ByteWriter &writer, const Edit &edit) {
+  writer.write(EditRecord{.index = edit.index, .vertex = edit.vertex});
+  if (edit.op == EditOp::Erase || edit.op == EditOp::SwapErase)
+    return;
+  switch (edit.target) {
+  case EditTarget::Vertex:
+  case EditTarget::Spawn:
+    writer.write(edit.position);
+    break;
+  case EditTarget::Terrain:
+    writer.write(uint32_t(edit.terrain_type));
+    break;
+  case EditTarget::Turret:
+    writer.write(edit.turret);
+    break;
+  case EditTarget::Image:
+    assert(edit.image.filename.size() <= UINT16_MAX);
+    writer.write(edit.image.data);
+    writer.write(uint32_t(edit.image.filename.size()));
+    writer.write_array(edit.image.filename);
+    break;
+  case EditTarget::BuildSite:
+    writer.write(edit.build_site);
+    break;
+  case EditTarget::Instance:
+    writer.write(edit.instance);
+    break;
+  }
+  writer.align(4);
+}
+
+/// Lay out journal records for the given edits at the end of out
+inline void append_records(std::span<const Edit> edits,
+                           std::vector<std::byte> *out) {
+  for (const auto &edit : edits) {
+    assert(valid_edit(edit.op, edit.target));
+    ByteWriter sizer(nullptr);
+    write_edit_body(sizer, edit);
+
+    const size_t start = out->size();
+    out->resize(start + sizeof(JournalRecordHeader) + sizer.used());
+    std::byte *body = out->data() + start + sizeof(JournalRecordHeader);
+    ByteWriter writer(body);
+    write_edit_body(writer, edit);
+
+    JournalRecordHeader header{
+        .checksum = 0,
+        .op = edit.op,
+        .target = edit.target,
+        .length = uint16_t(sizer.used()),
+    };
+    std::memcpy(out->data() + start, &header, sizeof(header));
+    header.checksum = hash32(
+        {out->data() + start + sizeof(header.checksum),
+         sizeof(JournalRecordHeader) - sizeof(header.checksum) +
+             sizer.used()});
+    std::memcpy(out->data() + start, &header.checksum,
+                sizeof(header.checksum));
+  }
+}
+
+/// Read the body of a record back into an edit. The filename of images
+/// points into the journal.
+inline bool read_edit_body(std::span<const std::byte> body, Edit *edit) {
+  ByteReader reader(body);
+  EditRecord record;
+  if (!reader.read(&record))
+    return false;
+  edit->index = record.index;
+  edit->vertex = record.vertex;
+  if (edit->op == EditOp::Erase || edit->op == EditOp::SwapErase)
+    return true;
+
+  switch (edit->target) {
+  case EditTarget::Vertex:
+  case EditTarget::Spawn:
+    return reader.read(&edit->position);
+  case EditTarget::Terrain: {
+    uint32_t type;
+    if (!reader.read(&type))
+      return false;
+    edit->terrain_type = TerrainType(type);
+    return true;
+  }
+  case EditTarget::Turret:
+    return reader.read(&edit->turret);
+  case EditTarget::Image: {
+    uint32_t length;
+    if (!reader.read(&edit->image.data) || !reader.read(&length) ||
+        length > reader.remaining())
+      return false;
+    edit->image.filename = {
+        reinterpret_cast<const char *>(body.data() + reader.position()),
+        length};
+    return true;
+  }
+  case EditTarget::BuildSite:
+    return reader.read(&edit->build_site);
+  case EditTarget::Instance:
+    return reader.read(&edit->instance);
+  }
+  return false;
+}
+
+/// Make an edit to items the same way the editor makes it to its own, see
+/// EditOp. Returns false if the index is out of range.
+template <typename T>
+inline bool edit_items(std::vector<T> &items, const Edit &edit, T value) {
+  switch (edit.op) {
+  case EditOp::Insert:
+    if (edit.index > items.size())
+      return false;
+    items.insert(items.begin() + edit.index, std::move(value));
+    return true;
+  case EditOp::Set:
+    if (edit.index >= items.size())
+      return false;
+    items[edit.index] = std::move(value);
+    return true;
+  case EditOp::Erase:
+    if (edit.index >= items.size())
+      return false;
+    items.erase(items.begin() + edit.index);
+    return true;
+  case EditOp::SwapErase:
+    if (edit.index >= items.size())
+      return false;
+    std::swap(items[edit.index], items.back());
+    items.pop_back();
+    return true;
+  case EditOp::SwapInsert:
+    if (edit.index > items.size())
+      return false;
+    items.push_back(std::move(value));
+    std::swap(items[edit.index], items.back());
+    return true;
+  }
+  return false;
+}
+
+} // namespace detail
+
+/// Appends edits to the journal of one level file
+class JournalWriter {
+public:
+  JournalWriter() = default;
+  JournalWriter(const JournalWriter &) = delete;
+  JournalWriter &operator=(const JournalWriter &) = delete;
+  ~JournalWriter() { close(); }
+
+  /// Start an empty journal at path for the level file whose contents are
+  /// base, replacing any journal already there
+  inline SerializeResultCode create(const char *folder, const char *path,
+                                    std::span<const std::byte> base);
+
+  /// Carry on appending to a journal which was just replayed. Anything past
+  /// the tail is a torn write from a crash and gets cut off.
+  inline SerializeResultCode open(const char *path, const JournalTail &tail);
+
+  /// Append the edits and make sure they are on disk before returning. After
+  /// a failure the journal is closed, since its end is no longer known.
+  inline SerializeResultCode append(std::span<const Edit> edits);
+
+  inline void close() {
+    if (fd >= 0)
+      ::close(fd);
+    fd = -1;
+  }
+
+  inline bool isOpen() const { return fd >= 0; }
+
+  /// Nothing has been appended since the journal was started
+  inline bool empty() const { return size <= sizeof(JournalHeader); }
+
+  /// Whether replaying the journal has started to cost a fair fraction of
+  /// loading the level, so it's time to compact it
+  inline bool needsCompaction() const {
+    return size > sizeof(JournalHeader) + 64 * 1024 + base_size / 2;
+  }
+
+private:
+  int fd = -1;
+  size_t size = 0;
+  size_t base_size = 0;
+};
+
+inline SerializeResultCode JournalWriter::create(
+    const char *folder, const char *path, std::span<const std::byte> base) {
+  close();
+  static constexpr JournalHeader header;
+  std::vector<std::byte> image(sizeof(JournalHeader));
+  detail::ByteWriter writer(image.data());
+  writer.write(header.header_text);
+  writer.write(header.magic);
+  writer.write(header.version);
+  writer.write(header.reserved);
+  writer.write(uint64_t(base.size()));
+  writer.write(uint64_t(crc32c::checksum(base)));
+  assert(writer.used() == image.size());
+
+  auto res = detail::write_file_atomic(folder, path, true, image);
+  if (res != SerializeResultCode::Okay)
+    return res;
+  return open(path, {.valid_size = image.size(), .base_size = base.size()});
+}
+
+inline SerializeResultCode JournalWriter::open(const char *path,
+                                               const JournalTail &tail) {
+  close();
+  fd = ::open(path, O_WRONLY | O_CLOEXEC);
+  if (fd < 0)
+    return SerializeResultCode::UnknownFileOpenError;
+  if (ftruncate(fd, tail.valid_size) != 0) {
+    close();
+    return SerializeResultCode::FileWriteErr;
+  }
+  size = tail.valid_size;
+  base_size = tail.base_size;
+  return SerializeResultCode::Okay;
+}
+
+inline SerializeResultCode JournalWriter::append(std::span<const Edit> edits) {
+  if (fd < 0)
+    return SerializeResultCode::UnknownFileOpenError;
+  if (edits.empty())
+    return SerializeResultCode::Okay;
+
+  std::vector<std::byte> records;
+  detail::append_records(edits, &records);
+
+  size_t written = 0;
+  while (written < records.size()) {
+    ssize_t res = pwrite(fd, records.data() + written,
+                         records.size() - written, size + written);
+    if (res < 0 && errno == EINTR)
+      continue;
+    if (res <= 0) {
+      close();
+      return SerializeResultCode::FileWriteErr;
+    }
+    written += res;
+  }
+  if (fdatasync(fd) != 0) {
+    close();
+    return SerializeResultCode::FileWriteErr;
+  }
+  size += written;
+  return SerializeResultCode::Okay;
+}
+
+/// Replay the journal at journal_path, which must have been started for the
+/// level file at level_path exactly as it is now, by calling fn(const Edit &)
+/// for every edit in order. fn returns false if an edit can't be applied,
+/// which stops the replay. A torn record at the end is left out of tail.
+template <typename Fn>
+inline DeserializeResultCode replay_journal(const char *level_path,
+                                            const char *journal_path, Fn &&fn,
+                                            JournalTail *tail) {
+  // no journal is the usual case, so don't go complaining about it
+  if (access(journal_path, F_OK) != 0 && errno == ENOENT)
+    return DeserializeResultCode::NoSuchFile;
+  detail::MappedFile level;
+  if (auto res = level.open(level_path); res != DeserializeResultCode::Okay)
+    return res;
+  detail::MappedFile journal;
+  if (auto res = journal.open(journal_path);
+      res != DeserializeResultCode::Okay)
+    return res;
+
+  static constexpr JournalHeader expected;
+  detail::ByteReader reader(journal.bytes());
+  std::array<char, sizeof(expected.header_text)> text;
+  uint64_t magic;
+  uint32_t version;
+  uint32_t reserved;
+  uint64_t base_size;
+  uint64_t base_hash;
+  if (!reader.read(&text) || !reader.read(&magic) || !reader.read(&version) ||
+      !reader.read(&reserved) || !reader.read(&base_size) ||
+      !reader.read(&base_hash))
+    return DeserializeResultCode::EarlyEOF;
+  if (std::memcmp(text.data(), expected.header_text, text.size()) != 0 ||
+      magic != expected.magic)
+    return DeserializeResultCode::InvalidHeader;
+  if (version < 1 || version > expected.version)
+    return DeserializeResultCode::UnsupportedVersion;
+  // a crash between writing out a compacted level and starting its new
+  // journal leaves the old journal behind, which has to be ignored
+  if (base_size != level.bytes().size() ||
+      base_hash != (version == 1 ? detail::hash64(level.bytes())
+                                 : crc32c::checksum(level.bytes())))
+    return DeserializeResultCode::JournalMismatch;
+
+  tail->base_size = base_size;
+  tail->valid_size = reader.position();
+  JournalRecordHeader header;
+  while (reader.read(&header)) {
+    if (header.length % 4 != 0 || header.length > reader.remaining())
+      break;
+    const std::byte *start = journal.bytes().data() + reader.position() -
+                             sizeof(header) + sizeof(header.checksum);
+    if (detail::hash32({start, sizeof(header) - sizeof(header.checksum) +
+                                   header.length}) != header.checksum)
+      break;
+
+    // intact but not understood means it was written by a newer editor
+    Edit edit{.op = header.op, .target = header.target};
+    std::span<const std::byte> body{journal.bytes().data() + reader.position(),
+                                    header.length};
+    if (!detail::valid_edit(header.op, header.target) ||
+        !detail::read_edit_body(body, &edit))
+      return DeserializeResultCode::UnsupportedVersion;
+    if (!fn(edit))
+      return DeserializeResultCode::InvalidJournalEdit;
+
+    reader.skip(header.length);
+    tail->valid_size = reader.position();
+  }
+  return DeserializeResultCode::Okay;
+}
+
+/// A level file with its journal replayed on top of it, which is the level as
+/// it was last saved. The file alone can be missing edits that were only ever
+/// appended to the journal. Owns everything level() points to.
+class JournaledLevel {
+public:
+  JournaledLevel() = default;
+  JournaledLevel(const JournaledLevel &) = delete;
+  JournaledLevel &operator=(const JournaledLevel &) = delete;
+
+  /// Load the level file at level_path and replay the journal at journal_path
+  /// over it, if there is one that was started for the file as it is now. A
+  /// torn edit at the end of the journal is left out, the same as the editor
+  /// does.
+  inline DeserializeResultCode open(const char *level_path,
+                                    const char *journal_path);
+
+  inline const Level &level() const { return view; }
+  /// how many edits were replayed from the journal
+  inline size_t edits() const { return replayed; }
+
+private:
+  struct Terrain {
+    std::vector<Vec2> verts;
+    TerrainType type;
+    // from the file, until the vertices are edited
+    Aabb bounds{};
+    std::span<const Triangle> triangles{};
+  };
+  struct OwnedImage {
+    std::string filename;
+    ImageData data;
+  };
+
+  // prefabs can't be journaled, so they're used straight from here
+  Level file;
+  std::vector<Terrain> terrains;
+  std::vector<OwnedImage> images;
+  std::vector<BuildSite> build_sites;
+  std::vector<Turret> turrets;
+  std::vector<PrefabInstance> instances;
+  PlayerSpawnPoint player_spawn{};
+  size_t replayed = 0;
+
+  // what view points to
+  std::vector<TerrainEntry> terrain_entries;
+  std::vector<Image> image_entries;
+  Level view;
+
+  inline bool apply(const Edit &edit);
+};
+
+inline DeserializeResultCode JournaledLevel::open(const char *level_path,
+                                                  const char *journal_path) {
+  if (auto res = deserialize(level_path, &file);
+      res != DeserializeResultCode::Okay)
+    return res;
+  terrains.clear();
+  terrains.reserve(file.terrains.size());
+  for (const auto &terrain : file.terrains) {
+    terrains.push_back({
+        .verts = {terrain.verts.begin(), terrain.verts.end()},
+        .type = terrain.type,
+        .bounds = terrain.bounds,
+        .triangles = terrain.triangles,
+    });
+  }
+  images.clear();
+  images.reserve(file.images.size());
+  for (const auto &image : file.images) {
+    images.push_back({
+        .filename = {image.filename.begin(), image.filename.end()},
+        .data = image.data,
+    });
+  }
+  build_sites.assign(file.build_sites.begin(), file.build_sites.end());
+  turrets.assign(file.turrets.begin(), file.turrets.end());
+  instances.assign(file.instances.begin(), file.instances.end());
+  player_spawn = file.player_spawn;
+  replayed = 0;
+
+  JournalTail tail;
+  auto res = replay_journal(
+      level_path, journal_path,
+      [this](const Edit &edit) {
+        if (!apply(edit))
+          return false;
+        ++replayed;
+        return true;
+      },
+      &tail);
+  // no journal, or one left behind for an older version of the file
+  if (res != DeserializeResultCode::Okay &&
+      res != DeserializeResultCode::NoSuchFile &&
+      res != DeserializeResultCode::JournalMismatch)
+    return res;
+
+  terrain_entries.clear();
+  terrain_entries.reserve(terrains.size());
+  for (const auto &terrain : terrains) {
+    terrain_entries.push_back({
+        .verts = terrain.verts,
+        .type = terrain.type,
+        .bounds = terrain.bounds,
+        .triangles = terrain.triangles,
+    });
+  }
+  image_entries.clear();
+  image_entries.reserve(images.size());
+  for (const auto &image : images) {
+    image_entries.push_back({
+        .filename = {image.filename.data(), image.filename.size()},
+        .data = image.data,
+    });
+  }
+  view.player_spawn = player_spawn;
+  view.terrains = terrain_entries;
+  view.images = image_entries;
+  view.build_sites = build_sites;
+  view.turrets = turrets;
+  view.prefabs = file.prefabs;
+  view.instances = instances;
+  return DeserializeResultCode::Okay;
+}
+
+inline bool JournaledLevel::apply(const Edit &edit) {
+  const bool erases =
+      edit.op == EditOp::Erase || edit.op == EditOp::SwapErase;
+  switch (edit.target) {
+  case EditTarget::Vertex: {
+    if (edit.index >= terrains.size())
+      return false;
+    Terrain &terrain = terrains[edit.index];
+    auto &verts = terrain.verts;
+    switch (edit.op) {
+    case EditOp::Insert:
+      if (edit.vertex > verts.size())
+        return false;
+      verts.insert(verts.begin() + edit.vertex, edit.position);
+      break;
+    case EditOp::Set:
+      if (edit.vertex >= verts.size())
+        return false;
+      verts[edit.vertex] = edit.position;
+      break;
+    case EditOp::Erase:
+      if (edit.vertex >= verts.size())
+        return false;
+      verts.erase(verts.begin() + edit.vertex);
+      break;
+    default:
+      return false;
+    }
+    // the file's triangles are for the old shape
+    terrain.triangles = {};
+    return true;
+  }
+  case EditTarget::Terrain:
+    // setting a terrain only changes its type, like in the editor
+    if (edit.op == EditOp::Set) {
+      if (edit.index >= terrains.size())
+        return false;
+      terrains[edit.index].type = edit.terrain_type;
+      return true;
+    }
+    return detail::edit_items(terrains, edit,
+                              Terrain{.verts = {}, .type = edit.terrain_type});
+  case EditTarget::Turret:
+    return detail::edit_items(turrets, edit, edit.turret);
+  case EditTarget::Image:
+    return detail::edit_items(
+        images, edit,
+        OwnedImage{
+            .filename = {edit.image.filename.begin(),
+                         edit.image.filename.end()},
+            .data = edit.image.data,
+        });
+  case EditTarget::BuildSite:
+    return detail::edit_items(build_sites, edit, edit.build_site);
+  case EditTarget::Spawn:
+    player_spawn.position = edit.position;
+    return true;
+  case EditTarget::Instance:
+    if (!erases && edit.instance.prefab >= file.prefabs.size())
+      return false;
+    return detail::edit_items(instances, edit, edit.instance);
+  }
+  return false;
+}
+
+/// Fold a level's journal back into it: write the whole level out and start
+/// an empty journal for the new file
+inline SerializeResultCode compact_journal(const char *folder,
+                                           const char *levelname,
+                                           bool overwrite, const Level &level,
+                                           JournalWriter *journal,
+                                           const SaveOptions &options = {}) {
+  journal->close();
+  detail::PathBuffer level_path;
+  detail::PathBuffer journal_path;
+  if (auto res = detail::format_path(&level_path, folder, levelname,
+                                     CROSSWIRE_LEVEL_FILE_EXTENSION);
+      res != SerializeResultCode::Okay)
+    return res;
+  if (auto res = detail::format_path(&journal_path, folder, levelname,
+                                     CROSSWIRE_JOURNAL_FILE_EXTENSION);
+      res != SerializeResultCode::Okay)
+    return res;
+
+  std::vector<std::byte> image;
+  serialize_to_buffer(level, &image, options);
+  auto res =
+      detail::write_file_atomic(folder, level_path.data(), overwrite, image);
+  if (res != SerializeResultCode::Okay)
+    return res;
+  return journal->create(folder, journal_path.data(), image);
+}
+
+} // namespace cw
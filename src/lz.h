@@ -0,0 +1,180 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <span>
+
+// Small LZ77 block codec using the LZ4 block layout: a run of sequences, each
+// a token byte (literal length in the high nibble, match length - 4 in the low
+// nibble), extra length bytes for either when their nibble is 15, the
+// literals, and a two byte little endian offset back into the output. The
+// last sequence is literals only.
+
+namespace cw::lz {
+
+inline constexpr size_t MIN_MATCH = 4;
+inline constexpr size_t MAX_OFFSET = 65535;
+// matches may not start this close to the end, which leaves room for the
+// final run of literals
+inline constexpr size_t END_LITERALS = 12;
+
+/// Largest number of bytes compress can produce for the given input size
+inline constexpr size_t compress_bound(size_t size) {
+  return size + size / 255 + 16;
+}
+
+namespace detail {
+
+inline constexpr size_t HASH_BITS = 12;
+
+inline uint32_t read32(const std::byte *p) {
+  uint32_t value;
+  std::memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+inline uint32_t hash(uint32_t sequence) {
+  return (sequence * 2654435761u) >> (32 - HASH_BITS);
+}
+
+inline std::byte *write_length(std::byte *out, size_t length) {
+  while (length >= 255) {
+    *out++ = std::byte(255);
+    length -= 255;
+  }
+  *out++ = std::byte(length);
+  return out;
+}
+
+} // namespace detail
+
+/// Compress src into dst, which must have room for compress_bound(src.size())
+/// bytes. Returns how many bytes were written.
+inline size_t compress(std::span<const std::byte> src, std::byte *dst) {
+  const std::byte *const begin = src.data();
+  const std::byte *const end = begin + src.size();
+  const std::byte *anchor = begin; // start of pending literals
+  std::byte *out = dst;
+
+  auto emit = [&out](const std::byte *literals, size_t literal_length,
+                     size_t offset, size_t match_length) {
+    std::byte *token = out++;
+    uint8_t high = literal_length >= 15 ? 15 : uint8_t(literal_length);
+    if (literal_length >= 15)
+      out = detail::write_length(out, literal_length - 15);
+    if (literal_length)
+      std::memcpy(out, literals, literal_length);
+    out += literal_length;
+    if (match_length == 0) {
+      *token = std::byte(high << 4);
+      return;
+    }
+    *out++ = std::byte(offset & 0xff);
+    *out++ = std::byte(offset >> 8);
+    size_t extra = match_length - MIN_MATCH;
+    uint8_t low = extra >= 15 ? 15 : uint8_t(extra);
+    if (extra >= 15)
+      out = detail::write_length(out, extra - 15);
+    *token = std::byte((high << 4) | low);
+  };
+
+  if (src.size() > END_LITERALS) {
+    std::array<uint32_t, 1 << detail::HASH_BITS> table{};
+    const std::byte *const match_limit = end - END_LITERALS;
+    const std::byte *ip = begin + 1;
+
+    while (ip < match_limit) {
+      uint32_t sequence = detail::read32(ip);
+      uint32_t &slot = table[detail::hash(sequence)];
+      const std::byte *candidate = begin + slot;
+      slot = uint32_t(ip - begin);
+
+      if (candidate >= ip || size_t(ip - candidate) > MAX_OFFSET ||
+          detail::read32(candidate) != sequence) {
+        ++ip;
+        continue;
+      }
+
+      // extend the match as far as it goes, leaving the tail for literals
+      size_t length = MIN_MATCH;
+      while (ip + length < end - 5 && ip[length] == candidate[length])
+        ++length;
+
+      emit(anchor, ip - anchor, ip - candidate, length);
+      ip += length;
+      anchor = ip;
+    }
+  }
+
+  emit(anchor, end - anchor, 0, 0);
+  return out - dst;
+}
+
+/// Decompress exactly dst.size() bytes out of src. Returns false if src is
+/// malformed or doesn't decode to exactly that many bytes.
+inline bool decompress(std::span<const std::byte> src,
+                       std::span<std::byte> dst) {
+  const std::byte *ip = src.data();
+  const std::byte *const in_end = ip + src.size();
+  std::byte *op = dst.data();
+  std::byte *const out_end = op + dst.size();
+
+  auto read_length = [&ip, in_end](size_t *length) -> bool {
+    uint8_t byte;
+    do {
+      if (ip >= in_end)
+        return false;
+      byte = uint8_t(*ip++);
+      *length += byte;
+    } while (byte == 255);
+    return true;
+  };
+
+  while (ip < in_end) {
+    uint8_t token = uint8_t(*ip++);
+
+    size_t literal_length = token >> 4;
+    if (literal_length == 15 && !read_length(&literal_length))
+      return false;
+    if (literal_length > size_t(in_end - ip) ||
+        literal_length > size_t(out_end - op))
+      return false;
+    if (literal_length)
+      std::memcpy(op, ip, literal_length);
+    ip += literal_length;
+    op += literal_length;
+
+    // the final sequence has no match
+    if (ip == in_end)
+      break;
+
+    if (in_end - ip < 2)
+      return false;
+    size_t offset = size_t(*ip) | (size_t(ip[1]) << 8);
+    ip += 2;
+    size_t match_length = (token & 15);
+    if (match_length == 15 && !read_length(&match_length))
+      return false;
+    match_length += MIN_MATCH;
+
+    if (offset == 0 || offset > size_t(op - dst.data()) ||
+        match_length > size_t(out_end - op))
+      return false;
+
+    // matches may overlap their own output, so copy forwards byte by byte
+    // unless the source is entirely behind the destination
+    const std::byte *match = op - offset;
+    if (offset >= match_length) {
+      std::memcpy(op, match, match_length);
+      op += match_length;
+    } else {
+      for (size_t i = 0; i < match_length; ++i)
+        *op++ = match[i];
+    }
+  }
+
+  return op == out_end;
+}
+
+} // namespace cw::lz
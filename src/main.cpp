@@ -15,6 +15,7 @@
 #include <vector>
 #include <fstream>
 
+#include "Autosave.h"
 #include "Inputs.h"
 #include "Room.h"
 #include "ImageSelector.h"
@@ -26,6 +27,8 @@ Inputs getInputs(bool& done) {
     Inputs i = {0, 0, 0};
     SDL_GetMouseState(&i.mouseX, &i.mouseY);
     i.DragPoint = mouseHeld;
+    // selecting with shift held adds to the selection
+    i.ExtendSelection = (SDL_GetModState() & KMOD_SHIFT) != 0;
 
     SDL_Event event;
     while (SDL_PollEvent(&event)) {
@@ -46,6 +49,15 @@ Inputs getInputs(bool& done) {
                     case SDLK_RIGHT: i.IncrementSelection = 1; break;
                     case SDLK_LEFT:  i.DecrementSelection = 1; break;
                     case SDLK_ESCAPE:i.Cancel = 1; break;
+                    case SDLK_z:
+                        if (event.key.keysym.mod & KMOD_CTRL) {
+                            if (event.key.keysym.mod & KMOD_SHIFT) i.Redo = 1;
+                            else i.Undo = 1;
+                        }
+                        break;
+                    case SDLK_y:
+                        if (event.key.keysym.mod & KMOD_CTRL) i.Redo = 1;
+                        break;
                 }
                 break;
             case SDL_MOUSEBUTTONDOWN:
@@ -133,6 +145,8 @@ int main(int argc, char* argv[]){
     // TODO: image selector should be destroyed before SDL_Quit so that the textures get freed at the right time
     ImageSelector selector(renderer, "assets");
     std::vector<std::string> image_names = selector.get_image_names();
+    // saves copies of the room in the background every so often
+    Autosave autosave;
     const char* turret_tracking_types[] {"Circle", "Tracking", "Straight Line"};
     int selected_turret_tracking_type = 0;
     bool select_induvidual_vertices = true;
@@ -143,6 +157,7 @@ int main(int argc, char* argv[]){
 
     std::optional<cw::SerializeResultCode> lasterr = {};
     std::optional<cw::DeserializeResultCode> lastdeserializeerr = {};
+    std::optional<AutosaveReport> lastautosave = {};
 
     bool overwrite_files = false;
 
@@ -155,9 +170,18 @@ int main(int argc, char* argv[]){
         ////////////////////////
         ///// Update Logic /////
         Inputs i = getInputs(done);
+        // everything changed while the mouse is held down, whether by
+        // dragging in the room or a slider, is undone in one go
+        if (i.Select || !i.DragPoint) {
+            level.endUndoStep();
+        }
         if (!window_active) {
             level.updateRoom(i);
         }
+        autosave.update(level);
+        if (auto report = autosave.poll()) {
+            lastautosave = report;
+        }
         
 
         //Start Dear IMGUI Frame
@@ -234,7 +258,7 @@ int main(int argc, char* argv[]){
 
                     index = 0;
                     for (const auto& image : level.getImages()) {
-                        if (ImGui::Selectable(image.filename.data())) {
+                        if (ImGui::Selectable(image.serializable.filename.data())) {
                             level.setCurrentImage(index);
                         }
                         ++index;
@@ -295,12 +319,13 @@ int main(int argc, char* argv[]){
                             selected_turret = index;
                         }
                         if (index == selected_turret) {
-                            auto& turret = level.getTurret(index);
+                            cw::Turret turret = level.getTurrets()[index];
                             float direction = atan2(turret.direction.y, turret.direction.x);
-                            ImGui::SliderFloat("Fire Rate", &turret.fireRateSeconds, 0.01f, 10.0f);
+                            bool changed = ImGui::SliderFloat("Fire Rate", &turret.fireRateSeconds, 0.01f, 10.0f);
                             if (ImGui::SliderFloat("Direction", &direction, 0.01f, 10.0f)) {
                                 turret.direction.x = cos(direction);
                                 turret.direction.y = sin(direction);
+                                changed = true;
                             }
                             int tracking_index =
                                 (turret.pattern == cw::TurretPattern::Circle) ? (0)
@@ -308,6 +333,10 @@ int main(int argc, char* argv[]){
                                 : (2));
                             if (auto tracking = tracking_type_combo_box("Tracking Type", tracking_index)) {
                                 turret.pattern = tracking.value().first;
+                                changed = true;
+                            }
+                            if (changed) {
+                                level.setTurret(index, turret);
                             }
                         }
                         ++index;
@@ -328,11 +357,89 @@ int main(int argc, char* argv[]){
                     ImGui::EndTabItem();
                 }
 
+                if (ImGui::BeginTabItem("Select Tool")) {
+                    level.setCurrentTool(EditingTool::Select);
+                    static int select_shape = 0;
+                    static int selection_drag = 0;
+                    static float rotate_degrees = 90.0f;
+                    static float scale_factor = 2.0f;
+
+                    ImGui::Text("%zu selected. Drag to select, hold shift to add to it.", level.getSelectionSize());
+                    ImGui::SeparatorText("Select With");
+                    if (ImGui::RadioButton("Box", &select_shape, 0)) level.setSelectShape(SelectShape::Box);
+                    ImGui::SameLine();
+                    if (ImGui::RadioButton("Lasso", &select_shape, 1)) level.setSelectShape(SelectShape::Lasso);
+
+                    ImGui::SeparatorText("Dragging The Selection");
+                    if (ImGui::RadioButton("Moves", &selection_drag, 0)) level.setSelectionDrag(SelectionDrag::Move);
+                    ImGui::SameLine();
+                    if (ImGui::RadioButton("Rotates", &selection_drag, 1)) level.setSelectionDrag(SelectionDrag::Rotate);
+                    ImGui::SameLine();
+                    if (ImGui::RadioButton("Scales", &selection_drag, 2)) level.setSelectionDrag(SelectionDrag::Scale);
+
+                    ImGui::SeparatorText("Transform");
+                    ImGui::InputFloat("Degrees", &rotate_degrees);
+                    if (ImGui::Button("Rotate")) {
+                        level.rotateSelection(rotate_degrees * 3.14159265f / 180.0f);
+                    }
+                    ImGui::InputFloat("Factor", &scale_factor);
+                    if (ImGui::Button("Scale")) {
+                        level.scaleSelection(scale_factor, scale_factor);
+                    }
+                    if (ImGui::Button("Mirror Horizontally")) {
+                        level.scaleSelection(-1.0f, 1.0f);
+                    }
+                    ImGui::SameLine();
+                    if (ImGui::Button("Mirror Vertically")) {
+                        level.scaleSelection(1.0f, -1.0f);
+                    }
+                    if (ImGui::Button("Clear Selection (Esc)")) {
+                        level.clearSelection();
+                    }
+                    ImGui::SeparatorText("Prefabs");
+                    if (ImGui::Button("Make Prefab From Selection")) {
+                        level.makePrefab();
+                    }
+                    ImGui::EndTabItem();
+                }
+
+                if (ImGui::BeginTabItem("Prefab Tool")) {
+                    level.setCurrentTool(EditingTool::Prefabs);
+                    ImGui::Text("%zu instances placed. Make prefabs with the select tool.", level.getNumInstances());
+                    ImGui::SeparatorText("Place Prefab");
+                    for (size_t i = 0; i < level.getNumPrefabs(); ++i) {
+                        const RoomPrefab& prefab = level.getPrefab(i);
+                        auto name = "Prefab " + std::to_string(i) + " (" +
+                            std::to_string(prefab.vertex_counts.size()) + " terrains, " +
+                            std::to_string(prefab.turrets.size()) + " turrets, " +
+                            std::to_string(prefab.images.size()) + " images, " +
+                            std::to_string(prefab.buildSites.size()) + " build sites)";
+                        if (ImGui::Selectable(name.c_str(), level.getCurrentPrefab() == i)) {
+                            level.setCurrentPrefab(i);
+                        }
+                    }
+                    ImGui::EndTabItem();
+                }
+
                 //End the scrollable region
                 // ImGui::EndChild();
                 ImGui::EndTabBar();
             }
 
+            ImGui::SeparatorText("History");
+
+            ImGui::BeginDisabled(!level.canUndo());
+            if (ImGui::Button("Undo (Ctrl+Z)")) {
+                level.undo();
+            }
+            ImGui::EndDisabled();
+            ImGui::SameLine();
+            ImGui::BeginDisabled(!level.canRedo());
+            if (ImGui::Button("Redo (Ctrl+Y)")) {
+                level.redo();
+            }
+            ImGui::EndDisabled();
+
             ImGui::SeparatorText("Level Save Dialog");
 
             {
@@ -372,6 +479,27 @@ int main(int argc, char* argv[]){
                 }
             }
 
+            ImGui::SeparatorText("Autosave");
+
+            {
+                int interval = int(autosave.getConfig().interval.count());
+                if (ImGui::InputInt("Interval in seconds (0 is off)", &interval) && interval >= 0) {
+                    autosave.setInterval(std::chrono::seconds(interval));
+                }
+                int retention = autosave.getConfig().retention;
+                if (ImGui::InputInt("Autosaves kept", &retention) && retention >= 1 && retention <= UINT16_MAX) {
+                    autosave.setRetention(uint16_t(retention));
+                }
+            }
+
+            if (lastautosave) {
+                if (lastautosave->result == cw::SerializeResultCode::Okay) {
+                    ImGui::Text("Autosaved to %s_%d.", autosave.getConfig().name.c_str(), int(lastautosave->slot));
+                } else {
+                    ImGui::Text("Autosave failed.");
+                }
+            }
+
             ImGui::SeparatorText("Load level");
 
             {
@@ -379,9 +507,30 @@ int main(int argc, char* argv[]){
                 ImGui::InputText("Level", load_buf.data(), load_buf.size());
                 load_buf[1023] = 0; // always null terminated, idk if imgui does this
 
+                // the pack stays mapped between loads, it is only opened
+                // again when a different one is asked for
+                static std::array<char, 1024> pack_buf = {0};
+                static std::string open_pack_name;
+                static cw::LevelPack pack;
+                ImGui::InputText("Pack (optional)", pack_buf.data(), pack_buf.size());
+                pack_buf[1023] = 0;
+
                 ImGui::Text("Warning: loading overwrites all current editor data.");
                 if (ImGui::Button("Load") && strlen(load_buf.data()) != 0) {
-                    lastdeserializeerr = level.tryDeserialize(load_buf.data(), selector);
+                    if (strlen(pack_buf.data()) == 0) {
+                        lastdeserializeerr = level.tryDeserialize(load_buf.data(), selector);
+                    } else {
+                        lastdeserializeerr = cw::DeserializeResultCode::Okay;
+                        if (open_pack_name != pack_buf.data()) {
+                            std::string filename = "levels/" + std::string(pack_buf.data()) + "." + CROSSWIRE_PACK_FILE_EXTENSION;
+                            open_pack_name.clear();
+                            lastdeserializeerr = pack.open(filename.c_str());
+                            if (lastdeserializeerr == cw::DeserializeResultCode::Okay)
+                                open_pack_name = pack_buf.data();
+                        }
+                        if (lastdeserializeerr == cw::DeserializeResultCode::Okay)
+                            lastdeserializeerr = level.tryDeserialize(pack, load_buf.data(), selector);
+                    }
                 }
             }
 
@@ -392,8 +541,19 @@ int main(int argc, char* argv[]){
                         break;
                     case cw::DeserializeResultCode::EarlyEOF:
                     case cw::DeserializeResultCode::InvalidHeader:
+                    case cw::DeserializeResultCode::InvalidSectionTable:
+                    case cw::DeserializeResultCode::InvalidPackIndex:
                         ImGui::Text("File parsing error, corruption or old version?");
                         break;
+                    case cw::DeserializeResultCode::ChecksumMismatch:
+                        ImGui::Text("File is damaged, its contents don't match their checksums.");
+                        break;
+                    case cw::DeserializeResultCode::UnsupportedVersion:
+                        ImGui::Text("File was saved by a newer version of the editor.");
+                        break;
+                    case cw::DeserializeResultCode::NoSuchFile:
+                        ImGui::Text("No level by that name.");
+                        break;
                     case cw::DeserializeResultCode::TryAgain:
                         ImGui::Text("Temporary failure, try again.");
                         break;
@@ -403,6 +563,9 @@ int main(int argc, char* argv[]){
                     case cw::DeserializeResultCode::NoSuchImageFile:
                         ImGui::Text("The file contains references to image files which cannot be found in the assets folder.");
                         break;
+                    case cw::DeserializeResultCode::InvalidJournalEdit:
+                        ImGui::Text("Loaded the level, but edits saved after it could not all be recovered.");
+                        break;
                     default:
                         ImGui::Text("Unknown file save error.");
                         break;
@@ -422,6 +585,10 @@ int main(int argc, char* argv[]){
         SDL_RenderPresent(renderer);
     }
 
+    // saves that only went to the journal go into the level file itself, so
+    // the game and the tools see them
+    level.flushJournal();
+
     // Cleanup
     ImGui_ImplSDLRenderer2_Shutdown();
     ImGui_ImplSDL2_Shutdown();
@@ -0,0 +1,278 @@
+#pragma once
+#include "serialize.h"
+
+// Many level files in one, so a game can ship every room as a single file and
+// map it once. An index sorted by room name sits up front, and each room is
+// looked up with a binary search through the mapping, without touching the
+// filesystem again. The rooms themselves are stored exactly as serialize would
+// write them, and are loaded with the same code as standalone level files.
+
+namespace cw {
+
+#define CROSSWIRE_PACK_FILE_EXTENSION "cwp"
+
+// Packs follow the same rules as version 2 level files: fixed width little
+// endian fields, laid out exactly as the structs below.
+// Layout: PackHeader, a PackEntry per room sorted by name, the names back to
+// back, then each room's level file starting on a multiple of 8.
+
+struct PackHeader {
+  const char header_text[16] = "Crosswire Pack";
+  uint64_t magic = 12834734829301;
+  uint32_t version = 1;
+  uint32_t level_count = 0;
+  /// bytes of names after the index
+  uint32_t names_size = 0;
+  /// CRC-32C of the index and the names, which every lookup reads. the rooms
+  /// carry checksums of their own
+  uint32_t index_checksum = 0;
+};
+
+/// NOTE: written directly to the pack, one per room
+struct PackEntry {
+  /// of the room's level file, from the start of the pack. a multiple of 8, so
+  /// a LevelView of the room can point straight into the mapping
+  uint64_t offset;
+  uint64_t size;
+  /// of the room's name within the names. names are not null terminated
+  uint32_t name_offset;
+  uint32_t name_length;
+};
+
+/// A room to put in a pack
+struct PackInput {
+  std::string_view name;
+  /// a whole level file, as serialize_to_buffer lays it out or as read from
+  /// disk. only borrowed
+  std::span<const std::byte> file;
+};
+
+namespace detail {
+
+template <>
+inline constexpr auto SCHEMA<PackEntry> =
+    std::tuple(&PackEntry::offset, &PackEntry::size, &PackEntry::name_offset,
+               &PackEntry::name_length);
+static_assert(check_record<PackEntry>());
+
+} // namespace detail
+
+/// Lay a pack of the given rooms out in memory. Room names have to be unique
+/// and not empty, they are what the rooms are found by.
+inline SerializeResultCode pack_to_buffer(std::span<const PackInput> levels,
+                                          std::vector<std::byte> *out) {
+  // names compare like memcmp, so the order doesn't depend on whether char is
+  // signed
+  std::vector<uint32_t> order(levels.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+    return levels[a].name < levels[b].name;
+  });
+
+  size_t names_size = 0;
+  for (size_t i = 0; i < order.size(); ++i) {
+    const auto &name = levels[order[i]].name;
+    if (name.empty())
+      return SerializeResultCode::NoLevelNameProvided;
+    if (i > 0 && name == levels[order[i - 1]].name)
+      return SerializeResultCode::DuplicateLevelName;
+    names_size += name.size();
+  }
+  assert(names_size <= UINT32_MAX);
+
+  // everything is placed up front, so the checksum can go in the header
+  // before the index it covers is written
+  std::vector<PackEntry> index(order.size());
+  size_t offset = sizeof(PackHeader) + index.size() * sizeof(PackEntry) +
+                  names_size;
+  uint32_t name_offset = 0;
+  for (size_t i = 0; i < order.size(); ++i) {
+    const auto &level = levels[order[i]];
+    offset = (offset + 7) / 8 * 8;
+    index[i] = detail::record_le(PackEntry{
+        .offset = offset,
+        .size = level.file.size(),
+        .name_offset = name_offset,
+        .name_length = uint32_t(level.name.size()),
+    });
+    offset += level.file.size();
+    name_offset += level.name.size();
+  }
+
+  uint32_t crc = crc32c::checksum(std::as_bytes(std::span(index)));
+  for (uint32_t i : order)
+    crc = crc32c::extend(crc, std::as_bytes(std::span(levels[i].name)));
+
+  static constexpr PackHeader header;
+  out->resize(offset);
+  detail::ByteWriter writer(out->data());
+  writer.write(header.header_text);
+  writer.write(detail::byteswap_le(header.magic));
+  writer.write(detail::byteswap_le(header.version));
+  writer.write(detail::byteswap_le(uint32_t(order.size())));
+  writer.write(detail::byteswap_le(uint32_t(names_size)));
+  writer.write(detail::byteswap_le(crc));
+  writer.write_array(std::span<const PackEntry>(index));
+  for (uint32_t i : order)
+    writer.write_array(std::span(levels[i].name));
+  for (uint32_t i : order) {
+    writer.align(8);
+    writer.write_array(levels[i].file);
+  }
+  assert(writer.used() == out->size());
+  return SerializeResultCode::Okay;
+}
+
+/// Write a pack of the given rooms to folder/packname.cwp, the same way
+/// serialize writes a level
+inline SerializeResultCode write_pack(const char *folder, const char *packname,
+                                      bool overwrite,
+                                      std::span<const PackInput> levels) {
+  detail::PathBuffer buf;
+  if (auto res = detail::format_path(&buf, folder, packname,
+                                     CROSSWIRE_PACK_FILE_EXTENSION);
+      res != SerializeResultCode::Okay)
+    return res;
+
+  if (!overwrite && !access(buf.data(), F_OK))
+    return SerializeResultCode::FileExists;
+
+  std::vector<std::byte> image;
+  if (auto res = pack_to_buffer(levels, &image);
+      res != SerializeResultCode::Okay)
+    return res;
+  return detail::write_file_atomic(folder, buf.data(), overwrite, image);
+}
+
+/// A pack mapped into memory. Looking rooms up only reads the mapping, and the
+/// bytes handed out stay valid for as long as the pack is open.
+class LevelPack {
+public:
+  /// Map a pack and check its index. Rooms aren't read until they're asked
+  /// for.
+  inline DeserializeResultCode open(const char *filename);
+
+  inline size_t size() const { return index.count; }
+
+  inline std::string_view name(size_t i) const {
+    PackEntry entry = this->entry(i);
+    return {names + entry.name_offset, entry.name_length};
+  }
+
+  /// The whole level file of a room, or nothing if the pack has no room by
+  /// that name
+  inline std::span<const std::byte> find(std::string_view name) const;
+
+  /// Load a room like deserialize loads a level file. Returns NoSuchFile if
+  /// the pack has no room by that name.
+  inline DeserializeResultCode
+  deserialize(std::string_view name, Level *out,
+              std::pmr::memory_resource *resource =
+                  std::pmr::get_default_resource(),
+              const LoadOptions &options = {}) const {
+    auto bytes = find(name);
+    if (bytes.empty())
+      return DeserializeResultCode::NoSuchFile;
+    return cw::deserialize(bytes, out, resource, options);
+  }
+
+  /// View a room in place. The view points into the pack, so it has to be
+  /// dropped before the pack is.
+  inline DeserializeResultCode view(std::string_view name, LevelView *out,
+                                    const LoadOptions &options = {}) const {
+    auto bytes = find(name);
+    if (bytes.empty())
+      return DeserializeResultCode::NoSuchFile;
+    return out->open(bytes, options);
+  }
+
+private:
+  detail::MappedFile file;
+  detail::RawSpan<PackEntry> index;
+  const char *names = nullptr;
+
+  inline PackEntry entry(size_t i) const {
+    return detail::record_le(index.load(i));
+  }
+};
+
+inline DeserializeResultCode LevelPack::open(const char *filename) {
+  if (!filename)
+    return DeserializeResultCode::NoFilenameProvided;
+
+  detail::MappedFile newfile;
+  if (auto res = newfile.open(filename); res != DeserializeResultCode::Okay)
+    return res;
+  auto bytes = newfile.bytes();
+
+  static constexpr PackHeader header;
+  detail::ByteReader reader(bytes);
+  std::array<char, sizeof(header.header_text)> text;
+  uint64_t magic;
+  uint32_t version, count, names_size, crc;
+  if (!reader.read(&text) || !reader.read(&magic))
+    return DeserializeResultCode::EarlyEOF;
+  if (std::memcmp(text.data(), header.header_text, text.size()) != 0 ||
+      detail::byteswap_le(magic) != header.magic)
+    return DeserializeResultCode::InvalidHeader;
+  if (!reader.read(&version) || !reader.read(&count) ||
+      !reader.read(&names_size) || !reader.read(&crc))
+    return DeserializeResultCode::EarlyEOF;
+  if (detail::byteswap_le(version) != header.version)
+    return DeserializeResultCode::UnsupportedVersion;
+  count = detail::byteswap_le(count);
+  names_size = detail::byteswap_le(names_size);
+
+  if (count > reader.remaining() / sizeof(PackEntry) ||
+      names_size > reader.remaining() - count * sizeof(PackEntry))
+    return DeserializeResultCode::EarlyEOF;
+  auto checked = bytes.subspan(reader.position(),
+                               count * sizeof(PackEntry) + names_size);
+  if (crc32c::checksum(checked) != detail::byteswap_le(crc))
+    return DeserializeResultCode::ChecksumMismatch;
+
+  detail::RawSpan<PackEntry> newindex{.bytes = checked.data(), .count = count};
+  const char *newnames =
+      reinterpret_cast<const char *>(checked.data()) + count * sizeof(PackEntry);
+
+  // lookups trust the index from here on, so every entry has to point inside
+  // the file and the names have to really be sorted
+  std::string_view previous;
+  for (size_t i = 0; i < count; ++i) {
+    PackEntry entry = detail::record_le(newindex.load(i));
+    if (entry.offset % 8 != 0 || entry.offset > bytes.size() ||
+        entry.size > bytes.size() - entry.offset ||
+        entry.name_offset > names_size ||
+        entry.name_length > names_size - entry.name_offset)
+      return DeserializeResultCode::InvalidPackIndex;
+    std::string_view name(newnames + entry.name_offset, entry.name_length);
+    if (name.empty() || (i > 0 && !(previous < name)))
+      return DeserializeResultCode::InvalidPackIndex;
+    previous = name;
+  }
+
+  file = std::move(newfile);
+  index = newindex;
+  names = newnames;
+  return DeserializeResultCode::Okay;
+}
+
+inline std::span<const std::byte>
+LevelPack::find(std::string_view name) const {
+  size_t first = 0, last = index.count;
+  while (first < last) {
+    size_t middle = first + (last - first) / 2;
+    int order = this->name(middle).compare(name);
+    if (order == 0) {
+      PackEntry entry = this->entry(middle);
+      return file.bytes().subspan(entry.offset, entry.size);
+    }
+    if (order < 0)
+      first = middle + 1;
+    else
+      last = middle;
+  }
+  return {};
+}
+
+} // namespace cw
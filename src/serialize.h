@@ -1,25 +1,64 @@
 #pragma once
+#include "Affine.h"
 #include "Vec2.h"
+#include "bake.h"
+#include "crc32c.h"
+#include "lz.h"
 #include "terrain.h"
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <bit>
 #include <cassert>
 #include <cerrno>
+#include <cmath>
+#include <cstddef>
 // this header will be included in a file compiled with no exceptions, so no
 // fstream
 #include <cstdio>
 #include <cstring>
+#include <fcntl.h>
+#include <limits>
+#include <memory>
+#include <memory_resource>
+#include <numeric>
 #include <span>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <tuple>
 #include <type_traits>
 #include <unistd.h>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+
 namespace cw {
 
+/// NOTE: a level file on its own may be missing edits the editor saved. Saving
+/// often only appends to a journal next to the file (see journal.h), which is
+/// folded back in when the editor closes or moves to another level, or once
+/// it grows big enough. deserialize, LevelView, stream_level and packs only
+/// ever see the file, so anything reading levels the editor may still have a
+/// journal for should go through JournaledLevel instead.
 #define CROSSWIRE_LEVEL_FILE_EXTENSION "cwl"
 
 struct TerrainEntry {
   std::span<const Vec2> verts;
   TerrainType type;
+  /// only filled in by loading a baked level, see SaveOptions::bake. serialize
+  /// works these out again from verts, unless SaveOptions::keep_baked
+  Aabb bounds{};
+  /// triangle_count(verts.size()) triangles covering the terrain
+  std::span<const Triangle> triangles{};
 };
 
 // trivially copyable portion of Image
@@ -31,6 +70,9 @@ struct ImageData {
 struct Image {
   std::span<const char> filename; // string view
   ImageData data;
+  /// which of Level::image_filenames this is. only filled in by loading,
+  /// serialize goes by the filename itself
+  uint32_t filename_index = 0;
 };
 
 enum class TurretPattern : uint8_t {
@@ -57,26 +99,279 @@ struct BuildSite {
   Vec2 position_b;
 };
 
+/// Terrains, turrets, images and build sites which are defined once and placed
+/// any number of times by PrefabInstance. Everything in it is positioned
+/// relative to the prefab, and ends up wherever an instance's transform puts
+/// it. Turret directions are left as they are.
+struct Prefab {
+  std::span<const TerrainEntry> terrains;
+  std::span<const Turret> turrets;
+  std::span<const Image> images;
+  std::span<const BuildSite> build_sites;
+};
+
+// NOTE: this struct is written directly to the level file
+struct PrefabInstance {
+  /// index into Level::prefabs
+  uint32_t prefab;
+  Affine transform;
+};
+
+/// The single block of memory which holds everything a deserialized level
+/// points to. Freeing it is O(1) no matter how big the level is.
+class LevelStorage {
+public:
+  LevelStorage() = default;
+  inline LevelStorage(std::pmr::memory_resource *resource, size_t size)
+      : resource(resource), block_size(size) {
+    if (size)
+      block = resource->allocate(size, alignof(std::max_align_t));
+  }
+  LevelStorage(const LevelStorage &) = delete;
+  LevelStorage &operator=(const LevelStorage &) = delete;
+  LevelStorage(LevelStorage &&other) noexcept { *this = std::move(other); }
+  LevelStorage &operator=(LevelStorage &&other) noexcept {
+    std::swap(resource, other.resource);
+    std::swap(block, other.block);
+    std::swap(block_size, other.block_size);
+    return *this;
+  }
+  inline ~LevelStorage() {
+    if (block)
+      resource->deallocate(block, block_size, alignof(std::max_align_t));
+  }
+
+  inline std::byte *data() const { return static_cast<std::byte *>(block); }
+  inline size_t size() const { return block_size; }
+
+private:
+  std::pmr::memory_resource *resource = nullptr;
+  void *block = nullptr;
+  size_t block_size = 0;
+};
+
 struct Level {
   PlayerSpawnPoint player_spawn;
   std::span<const TerrainEntry> terrains;
   std::span<const Image> images;
   std::span<const BuildSite> build_sites;
   std::span<const Turret> turrets;
-  /// this is true for levels returned by deserialize. otherwise leave it as
-  /// false
-  bool needs_freed = false;
-
-  inline ~Level();
+  /// defined once each, and placed by the instances. a level without any
+  /// prefabs saves exactly as it did before there were any
+  std::span<const Prefab> prefabs;
+  std::span<const PrefabInstance> instances;
+  /// every different filename used by images, prefab images included, once.
+  /// filled in by loading, where each Image::filename points at one of these
+  std::span<const std::span<const char>> image_filenames;
+  /// the terrains sorted by where they are. only filled in by loading a baked
+  /// level, like TerrainEntry::bounds
+  Broadphase broadphase;
+  /// filled in by deserialize, all the spans above point into it. leave it
+  /// empty when building a level to serialize
+  LevelStorage storage;
 };
 
 struct SpanHeader {
-  size_t num_items;
+  uint64_t num_items;
 };
 
+/// magic number of files written before the format was versioned. those files
+/// store every field back to back with no alignment padding, so they can only
+/// be loaded by copying (see LevelView)
+inline constexpr uint64_t LEGACY_LEVEL_MAGIC = 12834734829147;
+
+// Version 2 files are the same bytes on every platform: every field is a fixed
+// width little endian integer or IEEE float, every record is laid out exactly
+// as its struct below with any padding spelled out and written as zero, and
+// nothing depends on the size of size_t. On little endian hosts the structs
+// match the file byte for byte, so sections are used in place. Big endian
+// hosts reverse each section into memory once as it is loaded.
+// Legacy and version 1 files were only ever written by 64 bit little endian
+// builds, and are only loaded on little endian hosts.
+
 struct LevelHeader {
   const char header_text[16] = "Crosswire Level";
-  size_t magic = 12834734829147;
+  uint64_t magic = 12834734829148;
+  /// version 1: same layout as legacy files, but every field starts at an
+  /// offset which is a multiple of its alignment
+  /// version 2: a directory of SectionEntry follows the header, pointing at
+  /// each section of the level
+  /// version 3: same layout as version 2, but always has a Checksums section,
+  /// so losing it to damage can't pass for a file from before checksums
+  uint32_t version = 3;
+  /// always zero for version 1
+  uint32_t section_count = 0;
+};
+
+/// identifies a section of a version 2 level file. written to disk, so only
+/// ever add new values
+enum class SectionId : uint32_t {
+  Spawn = 1,          // one PlayerSpawnPoint
+  Terrains = 2,       // TerrainRecord per terrain
+  Vertices = 3,       // Vec2 for every terrain, one after another
+  Turrets = 4,        // Turret per turret
+  Images = 5,         // ImageRecord per image, only in older files
+  ImageFilenames = 6, // chars of every image filename, not null terminated
+  BuildSites = 7,     // BuildSite per build site
+  VertexGrid = 8,     // one VertexGridRecord, present if VertexDeltas is
+  VertexDeltas = 9,   // VertexDelta for every terrain vertex, replaces Vertices
+  ImageNames = 10,    // FilenameRecord per different image filename
+  ImagePlacements = 11, // PlacementRecord per image, replaces Images
+  Checksums = 12,       // uint32_t per directory entry, see below
+  TerrainBounds = 13,   // Aabb per terrain
+  TerrainTriangles = 14, // Triangle for every terrain, one after another
+  BroadphaseGrid = 15,   // one BroadphaseGrid, present if the two below are
+  BroadphaseCells = 16,  // uint32_t start per grid cell, and one past the end
+  BroadphaseItems = 17,  // uint32_t terrain index per cell a terrain covers
+  Prefabs = 18,          // PrefabRecord per prefab
+  PrefabTerrains = 19,   // TerrainRecord per terrain of every prefab
+  PrefabVertices = 20,   // Vec2 for every prefab terrain, one after another
+  PrefabTurrets = 21,    // Turret per turret of every prefab
+  PrefabImages = 22,     // PlacementRecord per image of every prefab
+  PrefabBuildSites = 23, // BuildSite per build site of every prefab
+  PrefabInstances = 24,  // PrefabInstance per instance
+};
+
+// Baked files (see SaveOptions::bake) have all five of TerrainBounds to
+// BroadphaseItems, worked out from the terrains when the file was written.
+// They're all optional: loaders from before them skip them like any section
+// they don't know, and files without them load with no bounds, triangles or
+// broadphase.
+
+// The seven prefab sections are only written for levels which have prefabs,
+// and a file without them has none. Prefab images share the ImageNames of the
+// level's own images. Baking and vertex grids only cover the level's own
+// terrains, prefab vertices are always stored as plain Vec2s.
+
+// The Checksums section is written last and holds the CRC-32C of the stored
+// bytes of every section, in directory order. Its own slot holds the CRC-32C of
+// the header and directory. Version 2 files from before it was added have no
+// checksums, and load without being checked. Version 3 files must have them.
+
+/// set in SectionEntry::flags when a section is stored compressed. its length
+/// is then the compressed size, and the raw size follows from its count
+inline constexpr uint32_t SECTION_COMPRESSED = 1 << 0;
+
+/// NOTE: written directly to the level file, directly after the LevelHeader
+struct SectionEntry {
+  SectionId id;
+  uint32_t flags;
+  /// from the start of the file, always a multiple of 8
+  uint64_t offset;
+  /// in bytes
+  uint64_t length;
+  /// number of items in the section
+  uint64_t count;
+};
+
+/// NOTE: written directly to the level file
+struct TerrainRecord {
+  /// index into the Vertices section
+  uint32_t first_vertex;
+  uint32_t vertex_count;
+  uint32_t type; // a TerrainType
+};
+
+/// NOTE: written directly to the level file
+struct ImageRecord {
+  /// byte range of the ImageFilenames section
+  uint32_t filename_offset;
+  uint32_t filename_length;
+  ImageData data;
+};
+
+/// NOTE: written directly to the level file
+struct FilenameRecord {
+  /// byte range of the ImageFilenames section
+  uint32_t offset;
+  uint32_t length;
+};
+
+/// NOTE: written directly to the level file
+struct PlacementRecord {
+  /// index into the ImageNames section
+  uint32_t filename;
+  ImageData data;
+};
+
+/// NOTE: written directly to the level file. Which items of the prefab
+/// sections belong to one prefab
+struct PrefabRecord {
+  /// index into the PrefabTerrains section
+  uint32_t first_terrain;
+  uint32_t terrain_count;
+  /// index into the PrefabTurrets section
+  uint32_t first_turret;
+  uint32_t turret_count;
+  /// index into the PrefabImages section
+  uint32_t first_image;
+  uint32_t image_count;
+  /// index into the PrefabBuildSites section
+  uint32_t first_build_site;
+  uint32_t build_site_count;
+};
+
+/// NOTE: written directly to the level file
+struct VertexGridRecord {
+  /// distance between grid lines, in pixels
+  float spacing;
+};
+
+/// NOTE: written directly to the level file. Steps along the vertex grid from
+/// the previous vertex of the whole Vertices list, the first one is from 0,0
+struct VertexDelta {
+  int16_t x;
+  int16_t y;
+};
+
+static_assert(std::numeric_limits<float>::is_iec559 && sizeof(float) == 4,
+              "Level files store IEEE 754 single precision floats.");
+
+/// Parts of a level which a loader can be asked to decode. With sectioned
+/// files the bytes belonging to parts which are not asked for are never read.
+enum class LevelParts : uint32_t {
+  None = 0,
+  Spawn = 1 << 0,
+  Terrains = 1 << 1,
+  Turrets = 1 << 2,
+  Images = 1 << 3,
+  BuildSites = 1 << 4,
+  /// the prefabs and their instances. prefab images are named through the
+  /// level's image filenames, so asking for these loads Images as well
+  Prefabs = 1 << 5,
+  All = Spawn | Terrains | Turrets | Images | BuildSites | Prefabs,
+};
+
+inline constexpr LevelParts operator|(LevelParts a, LevelParts b) {
+  return LevelParts(uint32_t(a) | uint32_t(b));
+}
+inline constexpr bool operator&(LevelParts a, LevelParts b) {
+  return (uint32_t(a) & uint32_t(b)) != 0;
+}
+
+struct LoadOptions {
+  LevelParts parts = LevelParts::All;
+  /// skip checking section checksums, for files we can be sure are intact,
+  /// like one we just wrote ourselves being loaded again
+  bool trusted = false;
+};
+
+struct SaveOptions {
+  /// parts whose sections are compressed, when that makes them smaller
+  LevelParts compressed = LevelParts::None;
+  /// when nonzero, terrain vertices are stored as 16 bit steps along a grid of
+  /// this spacing instead of as floats. only used if every vertex sits exactly
+  /// on the grid and no step is too long, so loading gives back the same
+  /// values
+  float vertex_grid = 0;
+  /// also store the bounds and triangles of every terrain and a broadphase
+  /// grid over them, so that loading the level needs no geometry work. see
+  /// bake.h
+  bool bake = false;
+  /// with bake, terrains that come with their triangles keep them and their
+  /// bounds as they are instead of having them worked out again. for callers
+  /// that hang on to what they baked last time, like the editor
+  bool keep_baked = false;
 };
 
 enum class SerializeResultCode : uint8_t {
@@ -92,398 +387,3184 @@ enum class SerializeResultCode : uint8_t {
   AlreadyOpen, // device or resource busy
   UnknownFileOpenError,
   FileWriteErr, // failed while in the middle of writing a file
+  FileReplaceErr, // file was written but could not be moved into place
+  DuplicateLevelName, // two rooms of a pack have the same name
 };
 
-inline SerializeResultCode serialize(const char *folder, const char *levelname,
-                                     bool overwrite, const Level &level) {
-  if (!folder)
-    return SerializeResultCode::NoFolderProvided;
-  if (!levelname)
-    return SerializeResultCode::NoLevelNameProvided;
+namespace detail {
+
+inline constexpr bool HOST_IS_LITTLE_ENDIAN =
+    std::endian::native == std::endian::little;
+static_assert(HOST_IS_LITTLE_ENDIAN || std::endian::native == std::endian::big,
+              "Mixed endian hosts are not supported.");
+
+/// Convert a single integer or float between little endian and host order
+template <typename T> inline T byteswap_le(T value) {
+  static_assert(std::is_arithmetic_v<T> || std::is_enum_v<T>);
+  if constexpr (HOST_IS_LITTLE_ENDIAN || sizeof(T) == 1) {
+    return value;
+  } else {
+    std::array<std::byte, sizeof(T)> bytes;
+    std::memcpy(bytes.data(), &value, sizeof(T));
+    std::reverse(bytes.begin(), bytes.end());
+    std::memcpy(&value, bytes.data(), sizeof(T));
+    return value;
+  }
+}
 
-  std::array<char, 1024> buf;
-  int bytes =
-      std::snprintf(buf.data(), buf.size(),
-                    "%s/%s." CROSSWIRE_LEVEL_FILE_EXTENSION, folder, levelname);
-  if (bytes < 0)
-    return SerializeResultCode::PathEncodingErr;
-  if (bytes > buf.size())
-    return SerializeResultCode::PathTooLong;
+/// N bytes of a record which don't belong to any field, written as zero
+template <size_t N> struct Padding {
+  static constexpr size_t size = N;
+};
 
-  if (!overwrite && !access(buf.data(), F_OK)) {
-    return SerializeResultCode::FileExists;
-  }
+/// How every record is laid out in level files: its fields in declaration
+/// order, as member pointers or Padding. Fields are records themselves or
+/// scalars. Byte swapping, writing records with padding in them, and the
+/// layout checks below all come from here, so a new record type only needs an
+/// entry.
+template <typename T> inline constexpr auto SCHEMA = nullptr;
+template <> inline constexpr auto SCHEMA<Vec2> = std::tuple(&Vec2::x, &Vec2::y);
+template <>
+inline constexpr auto SCHEMA<ImageData> =
+    std::tuple(&ImageData::position, &ImageData::rotation);
+template <>
+inline constexpr auto SCHEMA<PlayerSpawnPoint> =
+    std::tuple(&PlayerSpawnPoint::position);
+template <>
+inline constexpr auto SCHEMA<Turret> =
+    std::tuple(&Turret::position, &Turret::direction, &Turret::fireRateSeconds,
+               &Turret::pattern, Padding<3>{});
+template <>
+inline constexpr auto SCHEMA<BuildSite> =
+    std::tuple(&BuildSite::position_a, &BuildSite::position_b);
+template <>
+inline constexpr auto SCHEMA<SectionEntry> =
+    std::tuple(&SectionEntry::id, &SectionEntry::flags, &SectionEntry::offset,
+               &SectionEntry::length, &SectionEntry::count);
+template <>
+inline constexpr auto SCHEMA<TerrainRecord> =
+    std::tuple(&TerrainRecord::first_vertex, &TerrainRecord::vertex_count,
+               &TerrainRecord::type);
+template <>
+inline constexpr auto SCHEMA<ImageRecord> =
+    std::tuple(&ImageRecord::filename_offset, &ImageRecord::filename_length,
+               &ImageRecord::data);
+template <>
+inline constexpr auto SCHEMA<FilenameRecord> =
+    std::tuple(&FilenameRecord::offset, &FilenameRecord::length);
+template <>
+inline constexpr auto SCHEMA<PlacementRecord> =
+    std::tuple(&PlacementRecord::filename, &PlacementRecord::data);
+template <>
+inline constexpr auto SCHEMA<Affine> =
+    std::tuple(&Affine::a, &Affine::b, &Affine::c, &Affine::d, &Affine::tx,
+               &Affine::ty);
+template <>
+inline constexpr auto SCHEMA<PrefabInstance> =
+    std::tuple(&PrefabInstance::prefab, &PrefabInstance::transform);
+template <>
+inline constexpr auto SCHEMA<PrefabRecord> = std::tuple(
+    &PrefabRecord::first_terrain, &PrefabRecord::terrain_count,
+    &PrefabRecord::first_turret, &PrefabRecord::turret_count,
+    &PrefabRecord::first_image, &PrefabRecord::image_count,
+    &PrefabRecord::first_build_site, &PrefabRecord::build_site_count);
+template <>
+inline constexpr auto SCHEMA<VertexGridRecord> =
+    std::tuple(&VertexGridRecord::spacing);
+template <>
+inline constexpr auto SCHEMA<VertexDelta> =
+    std::tuple(&VertexDelta::x, &VertexDelta::y);
+template <>
+inline constexpr auto SCHEMA<Aabb> = std::tuple(&Aabb::min, &Aabb::max);
+template <>
+inline constexpr auto SCHEMA<Triangle> =
+    std::tuple(&Triangle::a, &Triangle::b, &Triangle::c);
+template <>
+inline constexpr auto SCHEMA<BroadphaseGrid> =
+    std::tuple(&BroadphaseGrid::origin, &BroadphaseGrid::cell_size,
+               &BroadphaseGrid::columns, &BroadphaseGrid::rows);
+
+template <SectionId Id, typename T, LevelParts Part> struct SectionSchema {
+  static constexpr SectionId id = Id;
+  using Record = T;
+  static constexpr LevelParts part = Part;
+};
 
-  std::FILE *levelfile = std::fopen(buf.data(), "wb");
-  if (!levelfile) {
-    std::perror("Failed to open crosswire level file");
-    switch (errno) {
-    case EACCES:
-      return SerializeResultCode::AccessDenied;
-      break;
-    case EAGAIN:
-      return SerializeResultCode::TryAgain;
-      break;
-    case EBUSY:
-      return SerializeResultCode::AlreadyOpen;
-      break;
-    default:
-      return SerializeResultCode::UnknownFileOpenError;
-    }
-  }
+/// What each section of a version 2 file is made of, and which part of a level
+/// it belongs to
+using Sections = std::tuple<
+    SectionSchema<SectionId::Spawn, PlayerSpawnPoint, LevelParts::Spawn>,
+    SectionSchema<SectionId::Terrains, TerrainRecord, LevelParts::Terrains>,
+    SectionSchema<SectionId::Vertices, Vec2, LevelParts::Terrains>,
+    SectionSchema<SectionId::Turrets, Turret, LevelParts::Turrets>,
+    SectionSchema<SectionId::Images, ImageRecord, LevelParts::Images>,
+    SectionSchema<SectionId::ImageFilenames, char, LevelParts::Images>,
+    SectionSchema<SectionId::BuildSites, BuildSite, LevelParts::BuildSites>,
+    SectionSchema<SectionId::VertexGrid, VertexGridRecord,
+                  LevelParts::Terrains>,
+    SectionSchema<SectionId::VertexDeltas, VertexDelta, LevelParts::Terrains>,
+    SectionSchema<SectionId::ImageNames, FilenameRecord, LevelParts::Images>,
+    SectionSchema<SectionId::ImagePlacements, PlacementRecord,
+                  LevelParts::Images>,
+    SectionSchema<SectionId::Checksums, uint32_t, LevelParts::None>,
+    SectionSchema<SectionId::TerrainBounds, Aabb, LevelParts::Terrains>,
+    SectionSchema<SectionId::TerrainTriangles, Triangle, LevelParts::Terrains>,
+    SectionSchema<SectionId::BroadphaseGrid, BroadphaseGrid,
+                  LevelParts::Terrains>,
+    SectionSchema<SectionId::BroadphaseCells, uint32_t, LevelParts::Terrains>,
+    SectionSchema<SectionId::BroadphaseItems, uint32_t, LevelParts::Terrains>,
+    SectionSchema<SectionId::Prefabs, PrefabRecord, LevelParts::Prefabs>,
+    SectionSchema<SectionId::PrefabTerrains, TerrainRecord,
+                  LevelParts::Prefabs>,
+    SectionSchema<SectionId::PrefabVertices, Vec2, LevelParts::Prefabs>,
+    SectionSchema<SectionId::PrefabTurrets, Turret, LevelParts::Prefabs>,
+    SectionSchema<SectionId::PrefabImages, PlacementRecord,
+                  LevelParts::Prefabs>,
+    SectionSchema<SectionId::PrefabBuildSites, BuildSite, LevelParts::Prefabs>,
+    SectionSchema<SectionId::PrefabInstances, PrefabInstance,
+                  LevelParts::Prefabs>>;
+
+template <SectionId Id, typename List> struct FindSection;
+template <SectionId Id, typename S, typename... Rest>
+struct FindSection<Id, std::tuple<S, Rest...>>
+    : std::conditional_t<S::id == Id, std::type_identity<S>,
+                         FindSection<Id, std::tuple<Rest...>>> {};
+
+/// The type of the items of a section
+template <SectionId Id>
+using SectionRecord = typename FindSection<Id, Sections>::type::Record;
+
+/// Call fn(schema) with the SectionSchema of id. Returns false without calling
+/// it for ids this version doesn't know.
+template <typename Fn> inline bool visit_section(SectionId id, Fn &&fn) {
+  return [&]<typename... S>(std::type_identity<std::tuple<S...>>) {
+    return ((S::id == id && (fn(S{}), true)) || ...);
+  }(std::type_identity<Sections>{});
+}
 
-  // first write level header
-  static constexpr LevelHeader header;
-  {
-    if (std::fwrite(header.header_text, 1, sizeof(header.header_text),
-                    levelfile) != sizeof(header.header_text)) {
-      std::fclose(levelfile);
-      return SerializeResultCode::FileWriteErr;
-    }
-  }
-  // magic size_t
-  if (std::fwrite(&header.magic, sizeof(header.magic), 1, levelfile) != 1) {
-    std::fclose(levelfile);
-    return SerializeResultCode::FileWriteErr;
-  }
+/// Bytes taken up by count items of a section, before any compression
+inline size_t section_size(SectionId id, uint64_t count) {
+  size_t size = 0;
+  visit_section(id, [&](auto schema) {
+    size = count * sizeof(typename decltype(schema)::Record);
+  });
+  return size;
+}
 
-  // player spawn
-  static_assert(std::is_trivially_copyable_v<decltype(level.player_spawn)>,
-                "Player spawn needs to be written to file but it's not "
-                "trivially copyable.");
-  if (std::fwrite(&level.player_spawn, sizeof(level.player_spawn), 1,
-                  levelfile) != 1) {
-    std::fclose(levelfile);
-    return SerializeResultCode::FileWriteErr;
+/// Which part of a level a section belongs to, None for sections no part
+/// needs, including ones added after this was written
+inline LevelParts section_part(SectionId id) {
+  LevelParts part = LevelParts::None;
+  visit_section(id, [&](auto schema) { part = schema.part; });
+  return part;
+}
+
+template <typename T>
+inline constexpr bool IS_SCALAR = std::is_arithmetic_v<T> || std::is_enum_v<T>;
+
+template <typename Field> struct FieldType {};
+template <typename C, typename M> struct FieldType<M C::*> {
+  using Type = M;
+};
+
+/// Call fn(field) for every field of T in order
+template <typename T, typename Fn>
+inline constexpr void for_each_field(Fn &&fn) {
+  std::apply([&](auto... fields) { (fn(fields), ...); }, SCHEMA<T>);
+}
+
+template <size_t... N>
+inline constexpr auto join(const std::array<uint8_t, N> &...parts) {
+  std::array<uint8_t, (N + ... + 0)> joined{};
+  size_t offset = 0;
+  ((std::copy(parts.begin(), parts.end(), joined.begin() + offset),
+    offset += N),
+   ...);
+  return joined;
+}
+
+/// Sizes of the scalars T is made of, in order, with each byte of padding as
+/// its own. Reversing the bytes of each converts T between file and host
+/// order.
+template <typename T> inline constexpr auto scalar_sizes() {
+  if constexpr (IS_SCALAR<T>) {
+    return std::array<uint8_t, 1>{sizeof(T)};
+  } else {
+    return std::apply(
+        [](auto... fields) {
+          return join([]<typename F>(F) {
+            if constexpr (std::is_member_object_pointer_v<F>) {
+              return scalar_sizes<typename FieldType<F>::Type>();
+            } else {
+              std::array<uint8_t, F::size> bytes{};
+              bytes.fill(1);
+              return bytes;
+            }
+          }(fields)...);
+        },
+        SCHEMA<T>);
   }
+}
 
-  // write a span of trivially copyable stuff to a file
-  // NOTE: not capable of writing a span of spans
-  auto write_span = [levelfile](auto span) -> bool {
-    using T = typename decltype(span)::value_type;
-    SpanHeader header{
-        .num_items = span.size(),
-    };
-    static_assert(std::is_trivially_copyable_v<T>,
-                  "Type passed into write_span is not trivially copyable but "
-                  "it needs to be directly written to binary file.");
-    static_assert(std::is_trivially_copyable_v<SpanHeader>,
-                  "SpanHeader is not trivially copyable, but it needs to be "
-                  "directly written to binary file.");
-    if (std::fwrite(&header, sizeof(header), 1, levelfile) != 1) {
-      return false;
-    }
-    return std::fwrite(span.data(), sizeof(T), span.size(), levelfile) ==
-           span.size();
-  };
+template <typename T> inline constexpr bool has_padding() {
+  if constexpr (IS_SCALAR<T>) {
+    return false;
+  } else {
+    bool padded = false;
+    for_each_field<T>([&]<typename F>(F) {
+      if constexpr (std::is_member_object_pointer_v<F>)
+        padded = padded || has_padding<typename FieldType<F>::Type>();
+      else
+        padded = true;
+    });
+    return padded;
+  }
+}
 
-  // write how many terrain entries there are
-  {
-    auto size = level.terrains.size();
-    if (std::fwrite(&size, sizeof(size), 1, levelfile) != 1) {
-      std::fclose(levelfile);
-      return SerializeResultCode::FileWriteErr;
-    }
+/// Whether the schema of T accounts for every byte of it, with each field at
+/// its natural alignment, so that there is no padding the schema doesn't know
+/// about
+template <typename T> inline constexpr bool schema_covers() {
+  if constexpr (IS_SCALAR<T>) {
+    return true;
+  } else {
+    size_t offset = 0;
+    bool covers = true;
+    for_each_field<T>([&]<typename F>(F) {
+      if constexpr (std::is_member_object_pointer_v<F>) {
+        using M = typename FieldType<F>::Type;
+        covers = covers && offset % alignof(M) == 0 && schema_covers<M>();
+        offset += sizeof(M);
+      } else {
+        offset += F::size;
+      }
+    });
+    return covers && offset == sizeof(T);
   }
+}
 
-  for (auto &terrain : level.terrains) {
-    // write the terrain type
-    if (std::fwrite(&terrain.type, sizeof(terrain.type), 1, levelfile) != 1) {
-      std::fclose(levelfile);
-      return SerializeResultCode::FileWriteErr;
-    }
+/// A T whose scalars count up from next in the order the schema lists them
+template <typename T> inline constexpr T numbered(int &next) {
+  if constexpr (IS_SCALAR<T>) {
+    return T(next++);
+  } else {
+    return std::apply(
+        [&](auto... fields) {
+          // padding isn't a member, so it has to be left out of the braces
+          auto members = std::tuple_cat([]<typename F>(F field) {
+            if constexpr (std::is_member_object_pointer_v<F>)
+              return std::tuple(field);
+            else
+              return std::tuple();
+          }(fields)...);
+          return std::apply(
+              [&](auto... member) {
+                return T{numbered<typename FieldType<decltype(member)>::Type>(
+                    next)...};
+              },
+              members);
+        },
+        SCHEMA<T>);
+  }
+}
 
-    // write the vertices
-    if (!write_span(terrain.verts)) {
-      std::fclose(levelfile);
-      return SerializeResultCode::FileWriteErr;
-    }
+/// Whether each field of value, as reached through its member pointer, is
+/// found in bytes at the offset the schema puts it, starting from offset.
+/// Reading a byte of padding instead stops compilation outright.
+template <typename T, size_t N>
+inline constexpr bool fields_in_place(const T &value,
+                                      const std::array<unsigned char, N> &bytes,
+                                      size_t &offset) {
+  if constexpr (IS_SCALAR<T>) {
+    std::array<unsigned char, sizeof(T)> scalar{};
+    std::copy_n(bytes.begin() + offset, sizeof(T), scalar.begin());
+    offset += sizeof(T);
+    return std::bit_cast<T>(scalar) == value;
+  } else {
+    bool in_place = true;
+    for_each_field<T>([&]<typename F>(F field) {
+      if constexpr (std::is_member_object_pointer_v<F>)
+        in_place = fields_in_place(value.*field, bytes, offset) && in_place;
+      else
+        offset += F::size;
+    });
+    return in_place;
   }
+}
 
-  if (!write_span(level.turrets)) {
-    std::fclose(levelfile);
-    return SerializeResultCode::FileWriteErr;
+template <typename T> inline constexpr bool check_record() {
+  static_assert(std::is_trivially_copyable_v<T>,
+                "Records are written directly to level files, so they have to "
+                "be trivially copyable.");
+  static_assert(schema_covers<T>(),
+                "The schema of a record has to cover every byte of it, with "
+                "any padding listed as Padding.");
+  if constexpr (!IS_SCALAR<T>) {
+    // every scalar gets a different number, so one found in the wrong place
+    // can't go unnoticed
+    constexpr bool in_place = [] {
+      int next = 0;
+      T value = numbered<T>(next);
+      auto bytes = std::bit_cast<std::array<unsigned char, sizeof(T)>>(value);
+      size_t offset = 0;
+      return fields_in_place(value, bytes, offset);
+    }();
+    static_assert(in_place, "The schema of a record has to list its fields in "
+                            "the order and at the offsets they are declared.");
   }
+  return true;
+}
 
-  // write how many image entries there are
-  {
-    auto size = level.images.size();
-    if (std::fwrite(&size, sizeof(size), 1, levelfile) != 1) {
-      std::fclose(levelfile);
-      return SerializeResultCode::FileWriteErr;
-    }
+static_assert([]<typename... S>(std::type_identity<std::tuple<S...>>) {
+  return (check_record<typename S::Record>() && ...) &&
+         check_record<SectionEntry>();
+}(std::type_identity<Sections>{}));
+
+/// For each byte of a record in host order, which byte of the stored record it
+/// comes from
+template <typename T> inline constexpr auto wire_permutation() {
+  std::array<uint8_t, sizeof(T)> permutation{};
+  size_t offset = 0;
+  for (uint8_t size : scalar_sizes<T>()) {
+    // fields never straddle a 16 byte boundary, which the SIMD kernel needs
+    assert(offset % size == 0);
+    for (size_t i = 0; i < size; ++i)
+      permutation[offset + i] = uint8_t(offset + size - 1 - i);
+    offset += size;
   }
+  assert(offset == sizeof(T));
+  return permutation;
+}
 
-  // write all images
-  for (auto &image : level.images) {
-    // write filename
-    if (!write_span(image.filename)) {
-      std::fclose(levelfile);
-      return SerializeResultCode::FileWriteErr;
+/// Reverse the fields of every record of T in bytes, which holds a whole
+/// number of them. Works on whole sections at once, 16 bytes at a time where
+/// the hardware allows.
+template <typename T> inline void swap_records(std::span<std::byte> bytes) {
+  static constexpr auto permutation = wire_permutation<T>();
+  static_assert(permutation.size() == sizeof(T));
+  assert(bytes.size() % sizeof(T) == 0);
+  if constexpr (sizeof(T) == 1)
+    return;
+
+  size_t done = 0;
+#if defined(__SSSE3__)
+  // records and 16 byte vectors line up again every lcm(sizeof(T), 16) bytes,
+  // so that many shuffle masks cover every possible position
+  static constexpr size_t period = std::lcm(sizeof(T), size_t(16));
+  static constexpr auto masks = [] {
+    std::array<std::array<uint8_t, 16>, period / 16> masks{};
+    for (size_t i = 0; i < period; ++i) {
+      size_t record = i / sizeof(T) * sizeof(T);
+      masks[i / 16][i % 16] =
+          uint8_t(record + permutation[i % sizeof(T)] - i / 16 * 16);
     }
-
-    // write image data, like its position in the level
-    if (std::fwrite(&image.data, sizeof(image.data), 1, levelfile) != 1) {
-      std::fclose(levelfile);
-      return SerializeResultCode::FileWriteErr;
+    return masks;
+  }();
+  for (; done + period <= bytes.size(); done += period) {
+    for (size_t i = 0; i < masks.size(); ++i) {
+      auto *p = reinterpret_cast<__m128i *>(bytes.data() + done + i * 16);
+      __m128i mask =
+          _mm_loadu_si128(reinterpret_cast<const __m128i *>(masks[i].data()));
+      _mm_storeu_si128(p, _mm_shuffle_epi8(_mm_loadu_si128(p), mask));
     }
   }
+#endif
 
-  // write all build sites
-  static_assert(std::is_trivially_copyable_v<BuildSite>,
-                "Attempt to directly write a BuildSite to a file but its not "
-                "trivially copyable.");
-  if (!write_span(level.build_sites)) {
-    std::fclose(levelfile);
-    return SerializeResultCode::FileWriteErr;
+  for (; done < bytes.size(); done += sizeof(T)) {
+    std::array<std::byte, sizeof(T)> record;
+    std::memcpy(record.data(), bytes.data() + done, sizeof(T));
+    for (size_t i = 0; i < sizeof(T); ++i)
+      bytes[done + i] = record[permutation[i]];
   }
-
-  std::fclose(levelfile);
-  return SerializeResultCode::Okay;
 }
 
-enum class DeserializeResultCode : uint8_t {
-  Okay = 0,
-  NoFilenameProvided,
-  NoLevelOutProvided,
-  NoSuchFile,
-  WriteFailure,
-  AccessDenied,
-  TryAgain,
-  AlreadyOpen,
-  UnknownFileOpenError,
-  InvalidHeader,
-  EarlyEOF,
-  UnknownReadError,
-  ShouldNeverHappenUnlessPosixIsBroken,
-  NoSuchImageFile,
-};
+/// Convert a section between file and host order. Does nothing on little
+/// endian hosts, where they are the same.
+template <typename T> inline void section_to_host(std::span<std::byte> bytes) {
+  if constexpr (!HOST_IS_LITTLE_ENDIAN)
+    swap_records<T>(bytes);
+}
 
-/// Reads some level data from a file, allocate data using malloc. Returned item
-/// has a destructor which will automatically free its contents.
-inline DeserializeResultCode deserialize(const char *filename, Level *out) {
-  if (!filename)
-    return DeserializeResultCode::NoFilenameProvided;
-  if (!out)
-    return DeserializeResultCode::NoLevelOutProvided;
+/// Convert a single record between file and host order
+template <typename T> inline T record_le(T record) {
+  if constexpr (!HOST_IS_LITTLE_ENDIAN)
+    swap_records<T>(std::as_writable_bytes(std::span(&record, 1)));
+  return record;
+}
 
-  std::FILE *levelfile = std::fopen(filename, "rb");
-  if (!levelfile) {
-    std::perror("Failed to open crosswire level file");
-    switch (errno) {
-    case EACCES:
-      return DeserializeResultCode::AccessDenied;
-      break;
-    case EAGAIN:
-      return DeserializeResultCode::TryAgain;
-      break;
-    case EBUSY:
-      return DeserializeResultCode::AlreadyOpen;
-      break;
-    case ENOENT:
-      return DeserializeResultCode::NoSuchFile;
-    default:
-      return DeserializeResultCode::UnknownFileOpenError;
-    }
+/// Lays a level file out into a buffer. With no buffer it only counts, so the
+/// buffer can be sized exactly before anything is written.
+class ByteWriter {
+public:
+  explicit ByteWriter(std::byte *base) : base(base) {}
+
+  // every field gets padded out to its natural alignment, so that LevelView
+  // can hand out spans which point straight into a mapping of the file
+  inline void write_aligned(const void *data, size_t size, size_t alignment) {
+    align(alignment);
+    if (base && size)
+      std::memcpy(base + offset, data, size);
+    offset += size;
   }
 
-#define DESERIALIZE_ERRHANDLE(CLEANUP)                                         \
-  if (std::feof(levelfile)) {                                                  \
-    CLEANUP                                                                    \
-    std::fclose(levelfile);                                                    \
-    return DeserializeResultCode::EarlyEOF;                                    \
-  } else if (std::ferror(levelfile)) {                                         \
-    CLEANUP                                                                    \
-    std::fclose(levelfile);                                                    \
-    return DeserializeResultCode::UnknownReadError;                            \
-  } else {                                                                     \
-    CLEANUP                                                                    \
-    std::fclose(levelfile);                                                    \
-    return DeserializeResultCode::ShouldNeverHappenUnlessPosixIsBroken;        \
+  inline void align(size_t alignment) {
+    size_t padding = (alignment - (offset % alignment)) % alignment;
+    if (base)
+      std::memset(base + offset, 0, padding);
+    offset += padding;
   }
 
-  // read the header text
-  static constexpr LevelHeader header;
-  {
-    std::array<uint8_t, sizeof(header.header_text)> buf;
-    if (std::fread(buf.data(), sizeof(uint8_t), sizeof(header.header_text),
-                   levelfile) != buf.size()) {
-      DESERIALIZE_ERRHANDLE()
-    }
-    if (std::memcmp(buf.data(), header.header_text, buf.size()) != 0) {
-      std::fclose(levelfile);
-      return DeserializeResultCode::InvalidHeader;
-    }
+  // write one trivially copyable item
+  template <typename T> inline void write(const T &item) {
+    static_assert(std::is_trivially_copyable_v<T>,
+                  "Type passed into write is not trivially copyable but it "
+                  "needs to be directly written to binary file.");
+    write_aligned(&item, sizeof(T), alignof(T));
   }
 
-  // read the header magic number
-  size_t magic;
-  if (std::fread(&magic, sizeof(magic), 1, levelfile) != 1) {
-    DESERIALIZE_ERRHANDLE()
-  }
-  if (magic != header.magic) {
-    std::fclose(levelfile);
-    return DeserializeResultCode::InvalidHeader;
+  // write the contents of a span of trivially copyable stuff
+  // NOTE: not capable of writing a span of spans
+  template <typename T> inline void write_array(std::span<const T> span) {
+    static_assert(std::is_trivially_copyable_v<T>,
+                  "Type passed into write_array is not trivially copyable but "
+                  "it needs to be directly written to binary file.");
+    write_aligned(span.data(), span.size_bytes(), alignof(T));
   }
 
-  PlayerSpawnPoint player_spawn;
-  if (std::fread(&player_spawn, sizeof(player_spawn), 1, levelfile) != 1) {
-    DESERIALIZE_ERRHANDLE()
+  /// Write a record as its schema lays it out. Records with padding go field
+  /// by field, so the padding is zero rather than whatever was in memory.
+  template <typename T> inline void write_record(const T &record) {
+    if constexpr (!has_padding<T>()) {
+      write(record);
+    } else {
+      align(alignof(T));
+      for_each_field<T>([&]<typename F>(F field) {
+        if constexpr (std::is_member_object_pointer_v<F>)
+          write_record(record.*field);
+        else
+          write(std::array<uint8_t, F::size>{});
+      });
+    }
   }
 
-  size_t num_terrains;
-  if (std::fread(&num_terrains, sizeof(num_terrains), 1, levelfile) != 1) {
-    DESERIALIZE_ERRHANDLE()
-  }
+  inline size_t used() const { return offset; }
 
-  std::vector<std::vector<Vec2>> polygons;
-  std::vector<TerrainType> types;
+  /// What has been written from start onwards, or nothing while counting
+  inline std::span<std::byte> written_since(size_t start) const {
+    if (!base)
+      return {};
+    return {base + start, offset - start};
+  }
 
-  types.reserve(num_terrains);
-  polygons.reserve(num_terrains);
+private:
+  std::byte *base;
+  size_t offset = 0;
+};
 
-  for (size_t i = 0; i < num_terrains; ++i) {
-    TerrainType type;
-    if (std::fread(&type, sizeof(type), 1, levelfile) != 1) {
-      DESERIALIZE_ERRHANDLE()
-    }
-    types.push_back(type);
+/// Writes the items of one section. Only takes the type of item the schema
+/// gives that section, so what gets written always matches what is read back.
+template <typename T> class RecordWriter {
+public:
+  explicit RecordWriter(ByteWriter &writer) : writer(writer) {}
 
-    size_t num_polygons;
-    if (std::fread(&num_polygons, sizeof(num_polygons), 1, levelfile) != 1) {
-      DESERIALIZE_ERRHANDLE()
-    }
-    polygons.emplace_back();
-    auto &gons = polygons.back();
-    gons.resize(num_polygons);
+  inline void write(const T &record) { writer.write_record(record); }
 
-    if (std::fread(gons.data(), sizeof(Vec2), num_polygons, levelfile) !=
-        num_polygons) {
-      DESERIALIZE_ERRHANDLE()
+  inline void write_array(std::span<const T> records) {
+    if constexpr (has_padding<T>()) {
+      for (const auto &record : records)
+        writer.write_record(record);
+    } else {
+      writer.write_array(records);
     }
   }
 
-  assert(types.size() == polygons.size());
-  assert(types.size() == num_terrains);
+private:
+  ByteWriter &writer;
+};
 
-  size_t num_turrets;
-  if (std::fread(&num_turrets, sizeof(num_turrets), 1, levelfile) != 1) {
-    DESERIALIZE_ERRHANDLE()
-  }
+using SectionDirectory = std::vector<SectionEntry>;
+using PackedSections = std::vector<std::vector<std::byte>>;
 
-  Turret *turrets = new Turret[num_turrets];
-  out->needs_freed = true;
+/// Terrain vertices as steps along a grid, see SaveOptions::vertex_grid
+struct QuantizedVertices {
+  /// zero if the vertices are stored as floats
+  float grid = 0;
+  std::vector<VertexDelta> deltas;
+};
 
-  if (std::fread(turrets, sizeof(Turret), num_turrets, levelfile) !=
-      num_turrets) {
-    DESERIALIZE_ERRHANDLE(delete[] turrets;)
-  }
+/// Work out the steps for every terrain vertex. Returns false, leaving the
+/// vertices to be stored as floats, if any vertex would not come back out
+/// exactly the same or is too far from the one before it.
+inline bool quantize_vertices(const Level &level, float grid,
+                              QuantizedVertices *out) {
+  *out = {};
+  if (!(grid > 0) || !std::isfinite(grid))
+    return false;
+
+  std::vector<VertexDelta> deltas;
+  int32_t previous_x = 0;
+  int32_t previous_y = 0;
+  // past 2^24 floats can't hold every integer, so the steps might not add up
+  auto quantize = [grid](float value, int32_t *step) {
+    float steps = std::round(value / grid);
+    if (!(std::fabs(steps) <= float(1 << 24)))
+      return false;
+    *step = int32_t(steps);
+    // the same bits come back out, other than -0 turning into 0
+    return float(*step) * grid == value;
+  };
+  auto fits = [](int32_t delta) {
+    return delta >= INT16_MIN && delta <= INT16_MAX;
+  };
 
-  size_t num_images;
-  if (std::fread(&num_images, sizeof(num_images), 1, levelfile) != 1) {
-    DESERIALIZE_ERRHANDLE(delete[] turrets;)
+  for (const auto &terrain : level.terrains) {
+    for (const auto &vert : terrain.verts) {
+      int32_t x, y;
+      if (!quantize(vert.x, &x) || !quantize(vert.y, &y) ||
+          !fits(x - previous_x) || !fits(y - previous_y))
+        return false;
+      deltas.push_back({int16_t(x - previous_x), int16_t(y - previous_y)});
+      previous_x = x;
+      previous_y = y;
+    }
   }
 
-  std::vector<std::vector<char>> filenames;
-  std::vector<ImageData> image_datas;
-  filenames.reserve(num_images);
-  image_datas.reserve(num_images);
+  out->grid = grid;
+  out->deltas = std::move(deltas);
+  return true;
+}
 
-  for (size_t i = 0; i < num_images; ++i) {
-    size_t num_chars;
-    if (std::fread(&num_chars, sizeof(num_chars), 1, levelfile) != 1) {
-      DESERIALIZE_ERRHANDLE(delete[] turrets;)
+/// Compressed sections are split into blocks of this many raw bytes which are
+/// compressed separately, so each one decodes straight into its place in the
+/// destination without needing any of the others.
+inline constexpr size_t COMPRESSION_BLOCK_SIZE = 64 * 1024;
+
+/// Stored form of a compressed section: the number of blocks, the stored size
+/// of each block, then the blocks. A block whose stored size equals its raw
+/// size didn't compress and is stored as is.
+inline void compress_section(std::span<const std::byte> raw,
+                             std::vector<std::byte> *out) {
+  const size_t num_blocks =
+      (raw.size() + COMPRESSION_BLOCK_SIZE - 1) / COMPRESSION_BLOCK_SIZE;
+  const size_t table_size = sizeof(uint32_t) * (1 + num_blocks);
+  out->resize(table_size + num_blocks * lz::compress_bound(
+                                            COMPRESSION_BLOCK_SIZE));
+
+  uint32_t header = byteswap_le(uint32_t(num_blocks));
+  std::memcpy(out->data(), &header, sizeof(header));
+  size_t offset = table_size;
+  for (size_t i = 0; i < num_blocks; ++i) {
+    auto block = raw.subspan(i * COMPRESSION_BLOCK_SIZE,
+                             std::min(COMPRESSION_BLOCK_SIZE,
+                                      raw.size() - i * COMPRESSION_BLOCK_SIZE));
+    uint32_t stored = lz::compress(block, out->data() + offset);
+    if (stored >= block.size()) {
+      std::memcpy(out->data() + offset, block.data(), block.size());
+      stored = block.size();
     }
+    offset += stored;
+    stored = byteswap_le(stored);
+    std::memcpy(out->data() + sizeof(uint32_t) * (1 + i), &stored,
+                sizeof(stored));
+  }
+  out->resize(offset);
+}
 
-    filenames.emplace_back();
-    auto &filename = filenames.back();
-    filename.resize(num_chars);
+/// Image filenames with the repeats taken out
+struct InternedFilenames {
+  std::vector<std::span<const char>> unique;
+  /// into unique, for each image and then each image of every prefab in turn
+  std::vector<uint32_t> indices;
+  size_t bytes = 0;
+};
 
-    if (std::fread(filename.data(), sizeof(char), num_chars, levelfile) !=
-        num_chars) {
-      DESERIALIZE_ERRHANDLE(delete[] turrets;)
+inline void intern_filenames(const Level &level, InternedFilenames *out) {
+  std::unordered_map<std::string_view, uint32_t> seen;
+  out->unique.clear();
+  out->indices.clear();
+  out->indices.reserve(level.images.size());
+  out->bytes = 0;
+  auto intern = [&](std::span<const Image> images) {
+    for (const auto &image : images) {
+      auto [it, inserted] = seen.try_emplace(
+          std::string_view(image.filename.data(), image.filename.size()),
+          uint32_t(out->unique.size()));
+      if (inserted) {
+        out->unique.push_back(image.filename);
+        out->bytes += image.filename.size();
+      }
+      out->indices.push_back(it->second);
     }
+  };
+  intern(level.images);
+  for (const auto &prefab : level.prefabs)
+    intern(prefab.images);
+  assert(out->bytes <= UINT32_MAX);
+}
+
+/// How many threads to spread total bytes of work over, when each thread
+/// should get at least piece_size of it
+inline size_t worker_threads(size_t total, size_t piece_size) {
+  return std::min<size_t>(std::thread::hardware_concurrency(),
+                          total / piece_size);
+}
 
-    // make sure its null terminated
-    filename.push_back(0);
+/// Run work(i) for every i below count on up to threads threads, the calling
+/// one included. Threads take the next i as they finish, so uneven jobs still
+/// keep them all busy. Returns once every job is done.
+template <typename Fn>
+inline void parallel_for(size_t count, size_t threads, Fn &&work) {
+  std::atomic<size_t> next = 0;
+  auto worker = [&work, &next, count] {
+    for (size_t i;
+         (i = next.fetch_add(1, std::memory_order_relaxed)) < count;)
+      work(i);
+  };
+  threads = std::min(threads, count);
+  std::vector<std::thread> workers;
+  workers.reserve(threads > 1 ? threads - 1 : 0);
+  for (size_t i = 1; i < threads; ++i)
+    workers.emplace_back(worker);
+  worker();
+  for (auto &thread : workers)
+    thread.join();
+}
+
+/// Geometry worked out from the terrains, see SaveOptions::bake
+struct BakedTerrains {
+  bool baked = false;
+  std::vector<Aabb> bounds;
+  std::vector<Triangle> triangles;
+  BroadphaseGrid grid{};
+  std::vector<uint32_t> cell_starts;
+  std::vector<uint32_t> items;
+};
 
-    // read image data
-    image_datas.emplace_back();
-    ImageData &target = image_datas.back();
-    if (std::fread(&target, sizeof(ImageData), 1, levelfile) != 1) {
-      DESERIALIZE_ERRHANDLE(delete[] turrets;)
+// terrains are triangulated on several threads once there are this many
+// vertices for each
+inline constexpr size_t BAKE_THREAD_VERTICES = 64 * 1024;
+
+inline void bake_terrains(const Level &level, bool keep,
+                          BakedTerrains *out) {
+  out->baked = true;
+  out->bounds.reserve(level.terrains.size());
+  std::vector<size_t> first_triangles;
+  first_triangles.reserve(level.terrains.size());
+  // the terrains that still need triangulating
+  std::vector<uint32_t> stale;
+  size_t num_vertices = 0;
+  for (size_t i = 0; i < level.terrains.size(); ++i) {
+    const auto &terrain = level.terrains[i];
+    const size_t count = bake::triangle_count(terrain.verts.size());
+    first_triangles.push_back(out->triangles.size());
+    if (keep && count != 0 && terrain.triangles.size() == count) {
+      out->bounds.push_back(terrain.bounds);
+      out->triangles.insert(out->triangles.end(), terrain.triangles.begin(),
+                            terrain.triangles.end());
+      continue;
     }
+    out->bounds.push_back(bake::bounds(terrain.verts));
+    out->triangles.resize(out->triangles.size() + count);
+    stale.push_back(uint32_t(i));
+    num_vertices += terrain.verts.size();
   }
+  // every terrain has its own range of triangles, so they can be cut up in
+  // any order
+  parallel_for(stale.size(),
+               worker_threads(num_vertices, BAKE_THREAD_VERTICES),
+               [&](size_t i) {
+                 const auto &verts = level.terrains[stale[i]].verts;
+                 bake::triangulate(
+                     verts,
+                     std::span(out->triangles)
+                         .subspan(first_triangles[stale[i]],
+                                  bake::triangle_count(verts.size())));
+               });
+  out->grid = bake::broadphase_grid(out->bounds);
+  bake::bin(out->grid, out->bounds, &out->cell_starts, &out->items);
+}
 
-  assert(filenames.size() == num_images);
-  assert(filenames.size() == image_datas.size());
+/// Everything about a level that is worked out before any of its sections are
+/// written
+struct WritePlan {
+  QuantizedVertices vertices;
+  InternedFilenames filenames;
+  BakedTerrains baked;
+};
 
-  // read build sites
-  size_t num_build_sites;
-  if (std::fread(&num_build_sites, sizeof(num_build_sites), 1, levelfile) !=
-      1) {
-    DESERIALIZE_ERRHANDLE(delete[] turrets;)
-  }
+inline void plan_level(const Level &level, const SaveOptions &options,
+                       WritePlan *out) {
+  if (options.vertex_grid != 0)
+    quantize_vertices(level, options.vertex_grid, &out->vertices);
+  intern_filenames(level, &out->filenames);
+  if (options.bake)
+    bake_terrains(level, options.keep_baked, &out->baked);
+}
 
-  BuildSite *sites = new BuildSite[num_build_sites];
-  out->needs_freed = true;
+/// Hand fn the section Id, with a body that writes its items through a
+/// RecordWriter of the type the schema gives it
+template <SectionId Id, typename Fn, typename Body>
+inline void write_section(Fn &fn, uint64_t count, Body &&body) {
+  fn(Id, count, [&](ByteWriter &writer) {
+    RecordWriter<SectionRecord<Id>> records(writer);
+    body(records);
+  });
+}
 
-  if (std::fread(sites, sizeof(BuildSite), num_build_sites, levelfile) !=
-      num_build_sites) {
-    DESERIALIZE_ERRHANDLE(delete[] sites; delete[] turrets;)
+/// The prefab sections, in the order for_each_section writes them. Each
+/// prefab's items are written one after another, the same way the level's own
+/// terrains are.
+template <typename Fn>
+inline void write_prefab_sections(const Level &level, const WritePlan &plan,
+                                  Fn &fn) {
+  size_t num_terrains = 0;
+  size_t num_vertices = 0;
+  size_t num_turrets = 0;
+  size_t num_images = 0;
+  size_t num_sites = 0;
+  for (const auto &prefab : level.prefabs) {
+    num_terrains += prefab.terrains.size();
+    for (const auto &terrain : prefab.terrains)
+      num_vertices += terrain.verts.size();
+    num_turrets += prefab.turrets.size();
+    num_images += prefab.images.size();
+    num_sites += prefab.build_sites.size();
   }
+  assert(num_vertices <= UINT32_MAX);
+
+  write_section<SectionId::Prefabs>(fn, level.prefabs.size(), [&](auto &out) {
+    PrefabRecord record{};
+    for (const auto &prefab : level.prefabs) {
+      record.terrain_count = uint32_t(prefab.terrains.size());
+      record.turret_count = uint32_t(prefab.turrets.size());
+      record.image_count = uint32_t(prefab.images.size());
+      record.build_site_count = uint32_t(prefab.build_sites.size());
+      out.write(record);
+      record.first_terrain += record.terrain_count;
+      record.first_turret += record.turret_count;
+      record.first_image += record.image_count;
+      record.first_build_site += record.build_site_count;
+    }
+  });
+  write_section<SectionId::PrefabTerrains>(fn, num_terrains, [&](auto &out) {
+    uint32_t first_vertex = 0;
+    for (const auto &prefab : level.prefabs) {
+      for (const auto &terrain : prefab.terrains) {
+        out.write({
+            .first_vertex = first_vertex,
+            .vertex_count = uint32_t(terrain.verts.size()),
+            .type = uint32_t(terrain.type),
+        });
+        first_vertex += terrain.verts.size();
+      }
+    }
+  });
+  write_section<SectionId::PrefabVertices>(fn, num_vertices, [&](auto &out) {
+    for (const auto &prefab : level.prefabs) {
+      for (const auto &terrain : prefab.terrains)
+        out.write_array(terrain.verts);
+    }
+  });
+  write_section<SectionId::PrefabTurrets>(fn, num_turrets, [&](auto &out) {
+    for (const auto &prefab : level.prefabs)
+      out.write_array(prefab.turrets);
+  });
+  write_section<SectionId::PrefabImages>(fn, num_images, [&](auto &out) {
+    // their filenames were interned after the level's own images
+    size_t index = level.images.size();
+    for (const auto &prefab : level.prefabs) {
+      for (const auto &image : prefab.images) {
+        out.write({
+            .filename = plan.filenames.indices[index++],
+            .data = image.data,
+        });
+      }
+    }
+  });
+  write_section<SectionId::PrefabBuildSites>(fn, num_sites, [&](auto &out) {
+    for (const auto &prefab : level.prefabs)
+      out.write_array(prefab.build_sites);
+  });
+  write_section<SectionId::PrefabInstances>(
+      fn, level.instances.size(),
+      [&](auto &out) { out.write_array(level.instances); });
+}
 
-  // finally shove the data we read into some arrays
-  out->player_spawn = player_spawn;
-  out->terrains = std::span(new TerrainEntry[types.size()], types.size());
-  out->images = std::span(new Image[image_datas.size()], image_datas.size());
-  out->build_sites = std::span(sites, num_build_sites);
-  out->turrets = std::span(turrets, num_turrets);
+/// Call fn(id, count, body) for every section of a version 2 file in the order
+/// they are written, where body(writer) writes the section contents.
+template <typename Fn>
+inline void for_each_section(const Level &level, const WritePlan &plan,
+                             Fn &&fn) {
+  write_section<SectionId::Spawn>(
+      fn, 1, [&](auto &out) { out.write(level.player_spawn); });
+
+  size_t num_vertices = 0;
+  for (const auto &terrain : level.terrains)
+    num_vertices += terrain.verts.size();
+  assert(num_vertices <= UINT32_MAX);
+
+  write_section<SectionId::Terrains>(
+      fn, level.terrains.size(), [&](auto &out) {
+        uint32_t first_vertex = 0;
+        for (const auto &terrain : level.terrains) {
+          out.write({
+              .first_vertex = first_vertex,
+              .vertex_count = uint32_t(terrain.verts.size()),
+              .type = uint32_t(terrain.type),
+          });
+          first_vertex += terrain.verts.size();
+        }
+      });
+  const auto &quantized = plan.vertices;
+  if (quantized.grid != 0) {
+    write_section<SectionId::VertexGrid>(
+        fn, 1, [&](auto &out) { out.write({.spacing = quantized.grid}); });
+    write_section<SectionId::VertexDeltas>(fn, num_vertices, [&](auto &out) {
+      out.write_array(quantized.deltas);
+    });
+  } else {
+    write_section<SectionId::Vertices>(fn, num_vertices, [&](auto &out) {
+      // terrains whose vertices already follow each other in memory, like
+      // the ones in a room's vertex pool, are written in one go
+      std::span<const Vec2> run;
+      for (const auto &terrain : level.terrains) {
+        if (run.data() + run.size() == terrain.verts.data()) {
+          run = {run.data(), run.size() + terrain.verts.size()};
+          continue;
+        }
+        out.write_array(run);
+        run = terrain.verts;
+      }
+      out.write_array(run);
+    });
+  }
 
-  for (size_t i = 0; i < num_terrains; ++i) {
-    auto &modifiable = const_cast<TerrainEntry &>(out->terrains[i]);
-    auto modifiable_verts =
-        std::span(new Vec2[polygons[i].size()], polygons[i].size());
-    modifiable.type = types[i];
-    size_t index = 0;
-    for (const auto &poly : polygons[i]) {
-      modifiable_verts[index] = poly;
-      ++index;
-    }
-    modifiable.verts = modifiable_verts;
+  const auto &baked = plan.baked;
+  if (baked.baked) {
+    write_section<SectionId::TerrainBounds>(
+        fn, baked.bounds.size(),
+        [&](auto &out) { out.write_array(baked.bounds); });
+    write_section<SectionId::TerrainTriangles>(
+        fn, baked.triangles.size(),
+        [&](auto &out) { out.write_array(baked.triangles); });
+    write_section<SectionId::BroadphaseGrid>(
+        fn, 1, [&](auto &out) { out.write(baked.grid); });
+    write_section<SectionId::BroadphaseCells>(
+        fn, baked.cell_starts.size(),
+        [&](auto &out) { out.write_array(baked.cell_starts); });
+    write_section<SectionId::BroadphaseItems>(
+        fn, baked.items.size(),
+        [&](auto &out) { out.write_array(baked.items); });
   }
 
-  for (size_t i = 0; i < num_images; ++i) {
-    auto &modifiable = const_cast<Image &>(out->images[i]);
-    modifiable.data = image_datas[i];
-    auto modifiable_filename =
-        std::span(new char[filenames[i].size()], filenames[i].size());
-    size_t index = 0;
-    for (const auto &c : filenames[i]) {
-      modifiable_filename[index] = c;
-      ++index;
-    }
-    modifiable.filename = modifiable_filename;
+  write_section<SectionId::Turrets>(
+      fn, level.turrets.size(),
+      [&](auto &out) { out.write_array(level.turrets); });
+
+  // rooms place the same few images over and over, so each filename is only
+  // written once and images refer to it by index
+  const auto &filenames = plan.filenames;
+  write_section<SectionId::ImageNames>(
+      fn, filenames.unique.size(), [&](auto &out) {
+        uint32_t offset = 0;
+        for (const auto &filename : filenames.unique) {
+          out.write({.offset = offset, .length = uint32_t(filename.size())});
+          offset += filename.size();
+        }
+      });
+  write_section<SectionId::ImageFilenames>(
+      fn, filenames.bytes, [&](auto &out) {
+        for (const auto &filename : filenames.unique)
+          out.write_array(filename);
+      });
+  write_section<SectionId::ImagePlacements>(
+      fn, level.images.size(), [&](auto &out) {
+        for (size_t i = 0; i < level.images.size(); ++i) {
+          out.write({
+              .filename = filenames.indices[i],
+              .data = level.images[i].data,
+          });
+        }
+      });
+
+  write_section<SectionId::BuildSites>(
+      fn, level.build_sites.size(),
+      [&](auto &out) { out.write_array(level.build_sites); });
+
+  if (!level.prefabs.empty())
+    write_prefab_sections(level, plan, fn);
+  else
+    assert(level.instances.empty() && "instances need their prefabs");
+}
+
+/// Put a section which was written in host order into file order. Does nothing
+/// on little endian hosts.
+inline void section_to_file(SectionId id, std::span<std::byte> bytes) {
+  if constexpr (HOST_IS_LITTLE_ENDIAN)
+    return;
+  [[maybe_unused]] bool known = visit_section(id, [&](auto schema) {
+    swap_records<typename decltype(schema)::Record>(bytes);
+  });
+  assert(known && "every section written needs a schema");
+}
+
+/// Compress the sections of the given parts, leaving out any which would not
+/// get any smaller
+inline void pack_sections(const Level &level, const WritePlan &plan,
+                          LevelParts parts, PackedSections *packed) {
+  packed->clear();
+  for_each_section(level, plan, [&](SectionId id, uint64_t count,
+                                    auto &&body) {
+    auto &out = packed->emplace_back();
+    if (!(parts & section_part(id)))
+      return;
+    std::vector<std::byte> raw(section_size(id, count));
+    ByteWriter writer(raw.data());
+    body(writer);
+    assert(writer.used() == raw.size());
+    section_to_file(id, raw);
+    compress_section(raw, &out);
+    if (out.size() >= raw.size())
+      out.clear();
+  });
+}
+
+/// Write a version 2 level. The directory comes before the sections it
+/// describes, so this runs once while counting to fill in the directory and
+/// then again to write it out for real.
+inline void write_level(ByteWriter &writer, const Level &level,
+                        const WritePlan &plan, const PackedSections &packed,
+                        SectionDirectory &directory) {
+  static constexpr LevelHeader header;
+  writer.write(header.header_text);
+  writer.write(byteswap_le(header.magic));
+  writer.write(byteswap_le(header.version));
+  writer.write(byteswap_le(uint32_t(directory.size())));
+  for (const auto &entry : directory)
+    writer.write(record_le(entry));
+  const size_t directory_end = writer.used();
+
+  size_t index = 0;
+  for_each_section(level, plan, [&](SectionId id, uint64_t count,
+                                    auto &&body) {
+    writer.align(8);
+    const auto &compressed = packed[index];
+    SectionEntry &entry = directory[index++];
+    entry = {
+        .id = id,
+        .flags = compressed.empty() ? 0 : SECTION_COMPRESSED,
+        .offset = writer.used(),
+        .length = 0,
+        .count = count,
+    };
+    if (compressed.empty()) {
+      body(writer);
+      assert(writer.used() - entry.offset == section_size(id, count));
+      section_to_file(id, writer.written_since(entry.offset));
+    } else
+      writer.write_array(std::span<const std::byte>(compressed));
+    entry.length = writer.used() - entry.offset;
+  });
+
+  // last, so that everything it covers has been written by now
+  writer.align(8);
+  SectionEntry &checksums = directory[index++];
+  checksums = {
+      .id = SectionId::Checksums,
+      .flags = 0,
+      .offset = writer.used(),
+      .length = 0,
+      .count = directory.size(),
+  };
+  // empty while only counting, when there is nothing to checksum yet
+  auto file = writer.written_since(0);
+  for (const auto &entry : directory) {
+    uint32_t crc = 0;
+    if (!file.empty())
+      crc = crc32c::checksum(entry.id == SectionId::Checksums
+                                 ? file.first(directory_end)
+                                 : file.subspan(entry.offset, entry.length));
+    writer.write(byteswap_le(crc));
   }
+  checksums.length = writer.used() - checksums.offset;
 
-  std::fclose(levelfile);
-  return DeserializeResultCode::Okay;
-#undef DESERIALIZE_ERRHANDLE
+  assert(index == directory.size());
 }
 
-inline Level::~Level() {
-  if (needs_freed) {
-    delete[] build_sites.data();
-    for (auto &image : images) {
-      delete[] image.filename.data();
+/// Write a whole file image so that the destination either keeps its old
+/// contents or has all of the new ones, even if we crash partway through. The
+/// data goes to a temporary file next to the destination which is synced and
+/// then moved over it.
+inline SerializeResultCode write_file_atomic(const char *folder,
+                                             const char *path, bool overwrite,
+                                             std::span<const std::byte> data) {
+  // unique between threads as well as processes
+  static std::atomic<unsigned> tmp_counter = 0;
+  std::array<char, 1024> tmp_path;
+  int bytes = std::snprintf(tmp_path.data(), tmp_path.size(), "%s.%d.%u.tmp",
+                            path, int(getpid()), tmp_counter++);
+  if (bytes < 0)
+    return SerializeResultCode::PathEncodingErr;
+  if (size_t(bytes) >= tmp_path.size())
+    return SerializeResultCode::PathTooLong;
+
+  int fd = ::open(tmp_path.data(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                  0666);
+  if (fd < 0) {
+    // perror is allowed to clobber errno
+    auto err = errno;
+    std::perror("Failed to open crosswire level file");
+    switch (err) {
+    case EACCES:
+      return SerializeResultCode::AccessDenied;
+    case EAGAIN:
+      return SerializeResultCode::TryAgain;
+    case EBUSY:
+      return SerializeResultCode::AlreadyOpen;
+    case ENOENT:
+      return SerializeResultCode::NoSuchDirectory;
+    default:
+      return SerializeResultCode::UnknownFileOpenError;
     }
-    delete[] images.data();
+  }
 
-    for (auto &terrain : terrains) {
-      delete[] terrain.verts.data();
+  // only loops if the kernel accepts a partial write
+  size_t written = 0;
+  while (written < data.size()) {
+    ssize_t res = ::write(fd, data.data() + written, data.size() - written);
+    if (res < 0 && errno == EINTR)
+      continue;
+    if (res <= 0) {
+      close(fd);
+      unlink(tmp_path.data());
+      return SerializeResultCode::FileWriteErr;
     }
-    delete[] terrains.data();
+    written += res;
+  }
+
+  if (fsync(fd) != 0) {
+    close(fd);
+    unlink(tmp_path.data());
+    return SerializeResultCode::FileWriteErr;
   }
+  close(fd);
+
+  // link() refuses to replace an existing file, so it doubles as an atomic
+  // existence check when we aren't allowed to overwrite
+  if (overwrite ? rename(tmp_path.data(), path) != 0
+                : link(tmp_path.data(), path) != 0) {
+    auto err = errno;
+    unlink(tmp_path.data());
+    return err == EEXIST ? SerializeResultCode::FileExists
+                         : SerializeResultCode::FileReplaceErr;
+  }
+  if (!overwrite)
+    unlink(tmp_path.data());
+
+  // make the rename itself durable
+  int dirfd = ::open(folder, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dirfd >= 0) {
+    fsync(dirfd);
+    close(dirfd);
+  }
+  return SerializeResultCode::Okay;
+}
+
+} // namespace detail
+
+/// Lay a whole level file out in memory, exactly as serialize would write it
+inline void serialize_to_buffer(const Level &level,
+                                std::vector<std::byte> *out,
+                                const SaveOptions &options = {}) {
+  detail::WritePlan plan;
+  detail::plan_level(level, options, &plan);
+
+  detail::PackedSections packed;
+  detail::pack_sections(level, plan, options.compressed, &packed);
+
+  // one more for the checksums, which aren't packed
+  detail::SectionDirectory directory(packed.size() + 1);
+  detail::ByteWriter sizer(nullptr);
+  detail::write_level(sizer, level, plan, packed, directory);
+  out->resize(sizer.used());
+  detail::ByteWriter writer(out->data());
+  detail::write_level(writer, level, plan, packed, directory);
+  assert(writer.used() == out->size());
+}
+
+namespace detail {
+
+using PathBuffer = std::array<char, 1024>;
+
+/// Put together folder/name.extension
+inline SerializeResultCode format_path(PathBuffer *out, const char *folder,
+                                       const char *name,
+                                       const char *extension) {
+  if (!folder)
+    return SerializeResultCode::NoFolderProvided;
+  if (!name)
+    return SerializeResultCode::NoLevelNameProvided;
+  int bytes = std::snprintf(out->data(), out->size(), "%s/%s.%s", folder, name,
+                            extension);
+  if (bytes < 0)
+    return SerializeResultCode::PathEncodingErr;
+  if (size_t(bytes) >= out->size())
+    return SerializeResultCode::PathTooLong;
+  return SerializeResultCode::Okay;
+}
+
+} // namespace detail
+
+inline SerializeResultCode serialize(const char *folder, const char *levelname,
+                                     bool overwrite, const Level &level,
+                                     const SaveOptions &options = {}) {
+  detail::PathBuffer buf;
+  if (auto res = detail::format_path(&buf, folder, levelname,
+                                     CROSSWIRE_LEVEL_FILE_EXTENSION);
+      res != SerializeResultCode::Okay)
+    return res;
+
+  if (!overwrite && !access(buf.data(), F_OK)) {
+    return SerializeResultCode::FileExists;
+  }
+
+  // build the whole file in memory so it goes out in a single write
+  std::vector<std::byte> image;
+  serialize_to_buffer(level, &image, options);
+  return detail::write_file_atomic(folder, buf.data(), overwrite, image);
+}
+
+enum class DeserializeResultCode : uint8_t {
+  Okay = 0,
+  NoFilenameProvided,
+  NoLevelOutProvided,
+  NoSuchFile,
+  WriteFailure,
+  AccessDenied,
+  TryAgain,
+  AlreadyOpen,
+  UnknownFileOpenError,
+  InvalidHeader,
+  EarlyEOF,
+  UnknownReadError,
+  ShouldNeverHappenUnlessPosixIsBroken,
+  NoSuchImageFile,
+  UnsupportedVersion,
+  LegacyFormat, // file predates aligned layout, only deserialize can load it
+  InvalidSectionTable,
+  JournalMismatch,    // journal was written for a different level file
+  InvalidJournalEdit, // an intact journal edit didn't apply to the level
+  ChecksumMismatch,   // file is damaged, see LoadOptions::trusted
+  InvalidPackIndex,   // a pack's index points outside it or isn't sorted
+  InvalidText,        // level text doesn't parse, see deserialize_text
+};
+
+namespace detail {
+
+/// A read-only mapping of a whole file. Unmapped when destroyed.
+class MappedFile {
+public:
+  MappedFile() = default;
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+  MappedFile(MappedFile &&other) noexcept { *this = std::move(other); }
+  MappedFile &operator=(MappedFile &&other) noexcept {
+    std::swap(mapping, other.mapping);
+    std::swap(mapping_size, other.mapping_size);
+    return *this;
+  }
+  ~MappedFile() {
+    if (mapping)
+      munmap(mapping, mapping_size);
+  }
+
+  inline DeserializeResultCode open(const char *filename) {
+    int fd = ::open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      // perror is allowed to clobber errno
+      auto err = errno;
+      std::perror("Failed to open crosswire level file");
+      switch (err) {
+      case EACCES:
+        return DeserializeResultCode::AccessDenied;
+      case EAGAIN:
+        return DeserializeResultCode::TryAgain;
+      case EBUSY:
+        return DeserializeResultCode::AlreadyOpen;
+      case ENOENT:
+        return DeserializeResultCode::NoSuchFile;
+      default:
+        return DeserializeResultCode::UnknownFileOpenError;
+      }
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+      close(fd);
+      return DeserializeResultCode::UnknownReadError;
+    }
+
+    // mmap refuses zero length mappings, an empty file just reads as EOF
+    if (info.st_size > 0) {
+      void *result = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (result == MAP_FAILED) {
+        close(fd);
+        return DeserializeResultCode::UnknownReadError;
+      }
+      mapping = result;
+      mapping_size = info.st_size;
+    }
+
+    // the mapping keeps the file alive on its own
+    close(fd);
+    return DeserializeResultCode::Okay;
+  }
+
+  inline std::span<const std::byte> bytes() const {
+    return {static_cast<const std::byte *>(mapping), mapping_size};
+  }
+
+private:
+  void *mapping = nullptr;
+  size_t mapping_size = 0;
+};
+
+/// Items of T inside a level file which have not been copied out of it. Legacy
+/// files make no alignment guarantees, so only aligned ranges can be viewed.
+template <typename T> struct RawSpan {
+  const std::byte *bytes = nullptr;
+  size_t count = 0;
+
+  inline bool is_aligned() const {
+    return reinterpret_cast<uintptr_t>(bytes) % alignof(T) == 0;
+  }
+  inline std::span<const T> view() const {
+    assert(is_aligned());
+    return {reinterpret_cast<const T *>(bytes), count};
+  }
+  inline void copy_to(T *dest) const {
+    if (count)
+      std::memcpy(dest, bytes, count * sizeof(T));
+  }
+  inline T load(size_t index) const {
+    assert(index < count);
+    T item;
+    std::memcpy(&item, bytes + index * sizeof(T), sizeof(T));
+    return item;
+  }
+  inline RawSpan subspan(size_t first, size_t length) const {
+    assert(first <= count && length <= count - first);
+    return {.bytes = bytes + first * sizeof(T), .count = length};
+  }
+  inline std::span<const std::byte> as_bytes() const {
+    return {bytes, count * sizeof(T)};
+  }
+};
+
+/// Bounds checked cursor over an in-memory level file. Every length read out
+/// of the file is checked against the remaining bytes before it is used.
+class ByteReader {
+public:
+  ByteReader(std::span<const std::byte> bytes) : bytes(bytes) {}
+
+  /// legacy files have no alignment padding between fields
+  bool aligned = true;
+
+  inline size_t remaining() const { return bytes.size() - offset; }
+  inline size_t position() const { return offset; }
+
+  template <typename T> inline bool read(T *out) {
+    static_assert(std::is_trivially_copyable_v<T>,
+                  "Type passed into read is not trivially copyable but it "
+                  "needs to be directly read from binary file.");
+    if (!skip_padding(alignof(T)) || remaining() < sizeof(T))
+      return false;
+    std::memcpy(out, bytes.data() + offset, sizeof(T));
+    offset += sizeof(T);
+    return true;
+  }
+
+  inline bool skip(size_t count) {
+    if (count > remaining())
+      return false;
+    offset += count;
+    return true;
+  }
+
+  /// Read a SpanHeader and then locate that many items of T after it
+  template <typename T> inline bool read_span(RawSpan<T> *out) {
+    SpanHeader header;
+    if (!read(&header) || !skip_padding(alignof(T)) ||
+        header.num_items > remaining() / sizeof(T))
+      return false;
+    out->bytes = bytes.data() + offset;
+    out->count = header.num_items;
+    offset += header.num_items * sizeof(T);
+    return true;
+  }
+
+private:
+  std::span<const std::byte> bytes;
+  size_t offset = 0;
+
+  inline bool skip_padding(size_t alignment) {
+    if (!aligned)
+      return true;
+    size_t padding = (alignment - (offset % alignment)) % alignment;
+    if (padding > remaining())
+      return false;
+    offset += padding;
+    return true;
+  }
+};
+
+/// A section of a version 2 file, as it is stored
+struct Section {
+  SectionEntry entry{};
+  std::span<const std::byte> stored;
+  /// bytes of the section once decoded
+  size_t raw_size = 0;
+
+  inline bool compressed() const { return entry.flags & SECTION_COMPRESSED; }
+};
+
+struct ChecksumJob {
+  std::span<const std::byte> bytes;
+  uint32_t expected;
+};
+
+// below this much, starting threads costs more than they save
+inline constexpr size_t PARALLEL_CHECKSUM_BYTES = 2 * 1024 * 1024;
+// big sections are split into pieces this size, so one huge section doesn't
+// keep a single thread busy while the rest wait
+inline constexpr size_t CHECKSUM_PIECE_SIZE = 512 * 1024;
+
+/// Returns whether every job's bytes have the checksum it expects, spreading
+/// the work over as many threads as the hardware runs at once. Only worth it
+/// for at least PARALLEL_CHECKSUM_BYTES in total.
+inline bool verify_checksums_parallel(std::span<const ChecksumJob> jobs,
+                                      size_t total) {
+  size_t threads = worker_threads(total, CHECKSUM_PIECE_SIZE);
+  if (threads < 2) {
+    return std::all_of(jobs.begin(), jobs.end(), [](const ChecksumJob &job) {
+      return crc32c::checksum(job.bytes) == job.expected;
+    });
+  }
+
+  struct Piece {
+    size_t job;
+    std::span<const std::byte> bytes;
+    uint32_t crc = 0;
+  };
+  std::vector<Piece> pieces;
+  pieces.reserve(total / CHECKSUM_PIECE_SIZE + jobs.size());
+  for (size_t i = 0; i < jobs.size(); ++i) {
+    auto bytes = jobs[i].bytes;
+    for (size_t offset = 0; offset < bytes.size();
+         offset += CHECKSUM_PIECE_SIZE) {
+      size_t size = std::min(CHECKSUM_PIECE_SIZE, bytes.size() - offset);
+      pieces.push_back({.job = i, .bytes = bytes.subspan(offset, size)});
+    }
+  }
+
+  parallel_for(pieces.size(), threads, [&pieces](size_t i) {
+    pieces[i].crc = crc32c::checksum(pieces[i].bytes);
+  });
+
+  // pieces are in order, so each section's checksum can be put back together
+  // one piece at a time
+  std::vector<uint32_t> crcs(jobs.size(), 0);
+  for (const auto &piece : pieces)
+    crcs[piece.job] =
+        crc32c::combine(crcs[piece.job], piece.crc, piece.bytes.size());
+  for (size_t i = 0; i < jobs.size(); ++i) {
+    if (crcs[i] != jobs[i].expected)
+      return false;
+  }
+  return true;
+}
+
+/// files from this version on always have checksums
+inline constexpr uint32_t CHECKSUMMED_VERSION = 3;
+
+/// The directory of a version 2 file. Every entry is checked to lie inside the
+/// file when the table is read, and checked against the type of its contents
+/// when it is looked up.
+class SectionTable {
+public:
+  inline DeserializeResultCode read(ByteReader &reader,
+                                    std::span<const std::byte> file,
+                                    uint32_t count) {
+    if (count > reader.remaining() / sizeof(SectionEntry))
+      return DeserializeResultCode::EarlyEOF;
+    this->file = file;
+    for (uint32_t i = 0; i < count; ++i) {
+      SectionEntry entry;
+      if (!reader.read(&entry))
+        return DeserializeResultCode::EarlyEOF;
+      entry = record_le(entry);
+      if (entry.offset % 8 != 0 || entry.offset > file.size())
+        return DeserializeResultCode::InvalidSectionTable;
+      if (entry.length > file.size() - entry.offset)
+        return DeserializeResultCode::EarlyEOF;
+    }
+    entries = {
+        .bytes = file.data() + reader.position() - count * sizeof(SectionEntry),
+        .count = count,
+    };
+    return DeserializeResultCode::Okay;
+  }
+
+  inline bool contains(SectionId id) const {
+    for (size_t i = 0; i < entries.count; ++i) {
+      if (entry(i).id == id)
+        return true;
+    }
+    return false;
+  }
+
+  /// Find a section and check it against its schema. Sections missing from
+  /// the file are empty, but sections whose length doesn't fit their count are
+  /// invalid.
+  template <SectionId Id> inline bool find(Section *out) const {
+    using T = SectionRecord<Id>;
+    *out = {};
+    for (size_t i = 0; i < entries.count; ++i) {
+      SectionEntry entry = this->entry(i);
+      if (entry.id != Id)
+        continue;
+      auto stored = file.subspan(entry.offset, entry.length);
+      if (entry.flags & SECTION_COMPRESSED) {
+        // a corrupt count must not be able to ask for more memory than the
+        // stored bytes could possibly decompress to
+        if (entry.count > SIZE_MAX / sizeof(T) ||
+            entry.count * sizeof(T) / 255 > stored.size())
+          return false;
+      } else if (entry.length % sizeof(T) != 0 ||
+                 entry.length / sizeof(T) != entry.count) {
+        return false;
+      }
+      *out = {
+          .entry = entry,
+          .stored = stored,
+          .raw_size = entry.count * sizeof(T),
+      };
+      return true;
+    }
+    return true;
+  }
+
+  /// Check the header, the directory, and the stored bytes of the sections
+  /// belonging to parts against the file's checksums. Sections of other parts
+  /// are never read. version is the file's, from its header. Stored sections
+  /// with an id in later are left for the caller to check as it copies them,
+  /// see checksum_of.
+  inline DeserializeResultCode
+  verify(LevelParts parts, uint32_t version,
+         std::span<const SectionId> later = {}) const {
+    if (!contains(SectionId::Checksums)) {
+      if (version >= CHECKSUMMED_VERSION)
+        return DeserializeResultCode::InvalidSectionTable;
+      // a file without checksums predates them, so it can't have any newer
+      // sections. if it does, it's the id of the checksums that got damaged
+      for (size_t i = 0; i < entries.count; ++i) {
+        if (uint32_t(entry(i).id) >= uint32_t(SectionId::Checksums))
+          return DeserializeResultCode::InvalidSectionTable;
+      }
+      return DeserializeResultCode::Okay;
+    }
+    Section checksums;
+    if (!find<SectionId::Checksums>(&checksums) ||
+        checksums.compressed() || checksums.entry.count != entries.count)
+      return DeserializeResultCode::InvalidSectionTable;
+    RawSpan<uint32_t> expected{.bytes = checksums.stored.data(),
+                               .count = checksums.entry.count};
+
+    const size_t directory_end = size_t(entries.bytes - file.data()) +
+                                 entries.count * sizeof(SectionEntry);
+    auto for_each_job = [&](auto &&fn) {
+      for (size_t i = 0; i < entries.count; ++i) {
+        SectionEntry entry = this->entry(i);
+        std::span<const std::byte> bytes;
+        if (entry.id == SectionId::Checksums)
+          bytes = file.first(directory_end);
+        else if ((section_part(entry.id) & parts) &&
+                 ((entry.flags & SECTION_COMPRESSED) ||
+                  std::find(later.begin(), later.end(), entry.id) ==
+                      later.end()))
+          bytes = file.subspan(entry.offset, entry.length);
+        else
+          continue;
+        fn(ChecksumJob{.bytes = bytes,
+                       .expected = byteswap_le(expected.load(i))});
+      }
+    };
+
+    size_t total = 0;
+    for_each_job([&](const ChecksumJob &job) { total += job.bytes.size(); });
+    bool intact = true;
+    if (total < PARALLEL_CHECKSUM_BYTES) {
+      for_each_job([&](const ChecksumJob &job) {
+        intact = intact && crc32c::checksum(job.bytes) == job.expected;
+      });
+    } else {
+      std::vector<ChecksumJob> jobs;
+      jobs.reserve(entries.count);
+      for_each_job([&](const ChecksumJob &job) { jobs.push_back(job); });
+      intact = verify_checksums_parallel(jobs, total);
+    }
+    return intact ? DeserializeResultCode::Okay
+                  : DeserializeResultCode::ChecksumMismatch;
+  }
+
+  /// The checksum the section with id should have. Returns false if the file
+  /// has no checksums, or no such section. Only to be trusted once verify has
+  /// passed.
+  inline bool checksum_of(SectionId id, uint32_t *out) const {
+    Section checksums;
+    if (!find<SectionId::Checksums>(&checksums) ||
+        checksums.entry.count != entries.count)
+      return false;
+    for (size_t i = 0; i < entries.count; ++i) {
+      if (entry(i).id != id)
+        continue;
+      RawSpan<uint32_t> expected{.bytes = checksums.stored.data(),
+                                 .count = checksums.entry.count};
+      *out = byteswap_le(expected.load(i));
+      return true;
+    }
+    return false;
+  }
+
+private:
+  std::span<const std::byte> file;
+  RawSpan<SectionEntry> entries;
+
+  inline SectionEntry entry(size_t index) const {
+    return record_le(entries.load(index));
+  }
+};
+
+/// Part of a section which can be decoded on its own
+struct DecodePiece {
+  std::span<const std::byte> stored;
+  std::span<std::byte> dest;
+  bool compressed = false;
+};
+
+inline bool decode_piece(const DecodePiece &piece) {
+  if (piece.compressed)
+    return lz::decompress(piece.stored, piece.dest);
+  if (!piece.dest.empty())
+    std::memcpy(piece.dest.data(), piece.stored.data(), piece.dest.size());
+  return true;
+}
+
+/// Split decoding a section into dest, which must be exactly its raw size,
+/// into pieces which don't depend on each other. Stored sections are cut every
+/// piece_size bytes, compressed ones into their blocks. Returns false if the
+/// section's block table doesn't fit it.
+template <typename Fn>
+inline bool split_section(const Section &section, std::span<std::byte> dest,
+                          size_t piece_size, Fn &&fn) {
+  assert(dest.size() == section.raw_size);
+  if (!section.compressed()) {
+    for (size_t offset = 0; offset < dest.size(); offset += piece_size) {
+      size_t size = std::min(piece_size, dest.size() - offset);
+      fn(DecodePiece{.stored = section.stored.subspan(offset, size),
+                     .dest = dest.subspan(offset, size)});
+    }
+    return true;
+  }
+
+  const auto &stored = section.stored;
+  auto read_u32 = [&stored](size_t index) {
+    uint32_t value;
+    std::memcpy(&value, stored.data() + index * sizeof(value), sizeof(value));
+    return byteswap_le(value);
+  };
+
+  const size_t num_blocks =
+      (dest.size() + COMPRESSION_BLOCK_SIZE - 1) / COMPRESSION_BLOCK_SIZE;
+  if (stored.size() / sizeof(uint32_t) < 1 + num_blocks ||
+      read_u32(0) != num_blocks)
+    return false;
+
+  size_t offset = sizeof(uint32_t) * (1 + num_blocks);
+  for (size_t i = 0; i < num_blocks; ++i) {
+    size_t block_size = read_u32(1 + i);
+    auto raw = dest.subspan(i * COMPRESSION_BLOCK_SIZE,
+                            std::min(COMPRESSION_BLOCK_SIZE,
+                                     dest.size() - i * COMPRESSION_BLOCK_SIZE));
+    if (block_size > stored.size() - offset)
+      return false;
+    // blocks which didn't get any smaller are kept as they were
+    fn(DecodePiece{.stored = stored.subspan(offset, block_size),
+                   .dest = raw,
+                   .compressed = block_size != raw.size()});
+    offset += block_size;
+  }
+  return offset == stored.size();
+}
+
+/// Copy stored bytes into dest, which is the same size, and return their
+/// checksum
+inline uint32_t copy_checked(std::span<const std::byte> stored,
+                             std::span<std::byte> dest) {
+  assert(stored.size() == dest.size());
+  return crc32c::copy_extend(0, dest, stored);
+}
+
+/// Decode a section into dest, which must be exactly its raw size. Compressed
+/// sections are decompressed block by block straight into place.
+inline bool decode_section(const Section &section,
+                           std::span<std::byte> dest) {
+  bool decoded = true;
+  return split_section(section, dest, SIZE_MAX,
+                       [&decoded](const DecodePiece &piece) {
+                         decoded = decoded && decode_piece(piece);
+                       }) &&
+         decoded;
+}
+
+/// Find a section and make its contents readable. Stored sections are used in
+/// place, compressed ones are decoded into memory from target(bytes), which
+/// must be aligned to at least 8. So are all sections on big endian hosts,
+/// where they have to be put into host order.
+template <SectionId Id, typename Target>
+inline bool load_section(const SectionTable &table, Target &&target,
+                         RawSpan<SectionRecord<Id>> *out) {
+  using T = SectionRecord<Id>;
+  Section section;
+  if (!table.find<Id>(&section))
+    return false;
+  if (!section.compressed() && HOST_IS_LITTLE_ENDIAN) {
+    *out = {.bytes = section.stored.data(), .count = section.entry.count};
+    return true;
+  }
+  std::byte *dest = target(section.raw_size);
+  if (!decode_section(section, {dest, section.raw_size}))
+    return false;
+  section_to_host<T>({dest, section.raw_size});
+  *out = {.bytes = dest, .count = section.entry.count};
+  return true;
+}
+
+/// The image sections of a version 2 file
+struct ImageSections {
+  RawSpan<FilenameRecord> names;
+  RawSpan<PlacementRecord> placements;
+  RawSpan<char> filenames;
+};
+
+/// Load the image sections and check that every name and placement is in
+/// range. Files from before filenames were interned have an ImageRecord per
+/// image instead, which are turned into a name and a placement each.
+template <typename Target>
+inline bool load_images(const SectionTable &table, Target &&target,
+                        ImageSections *out) {
+  if (!load_section<SectionId::ImageFilenames>(table, target, &out->filenames))
+    return false;
+
+  if (table.contains(SectionId::ImagePlacements)) {
+    if (!load_section<SectionId::ImageNames>(table, target, &out->names) ||
+        !load_section<SectionId::ImagePlacements>(table, target,
+                                                  &out->placements))
+      return false;
+  } else {
+    RawSpan<ImageRecord> records;
+    if (!load_section<SectionId::Images>(table, target, &records))
+      return false;
+    auto *names = reinterpret_cast<FilenameRecord *>(
+        target(records.count * sizeof(FilenameRecord)));
+    auto *placements = reinterpret_cast<PlacementRecord *>(
+        target(records.count * sizeof(PlacementRecord)));
+    for (size_t i = 0; i < records.count; ++i) {
+      ImageRecord record = records.load(i);
+      names[i] = {.offset = record.filename_offset,
+                  .length = record.filename_length};
+      placements[i] = {.filename = uint32_t(i), .data = record.data};
+    }
+    out->names = {.bytes = reinterpret_cast<const std::byte *>(names),
+                  .count = records.count};
+    out->placements = {.bytes = reinterpret_cast<const std::byte *>(placements),
+                       .count = records.count};
+  }
+
+  for (size_t i = 0; i < out->names.count; ++i) {
+    FilenameRecord name = out->names.load(i);
+    if (name.offset > out->filenames.count ||
+        name.length > out->filenames.count - name.offset)
+      return false;
+  }
+  for (size_t i = 0; i < out->placements.count; ++i) {
+    if (out->placements.load(i).filename >= out->names.count)
+      return false;
+  }
+  return true;
+}
+
+/// The prefab sections of a version 2 file. Terrains count their first_vertex
+/// from the start of verts, and prefabs their items from the start of each.
+struct PrefabSections {
+  RawSpan<PrefabRecord> prefabs;
+  RawSpan<TerrainRecord> terrains;
+  RawSpan<Vec2> verts;
+  RawSpan<Turret> turrets;
+  RawSpan<PlacementRecord> images;
+  RawSpan<BuildSite> build_sites;
+  RawSpan<PrefabInstance> instances;
+};
+
+/// Load the prefab sections and check that every range and index in them is
+/// in range. Prefab images name one of the image_filenames of the level.
+template <typename Target>
+inline bool load_prefabs(const SectionTable &table, Target &&target,
+                         size_t image_filenames, PrefabSections *out) {
+  if (!load_section<SectionId::Prefabs>(table, target, &out->prefabs) ||
+      !load_section<SectionId::PrefabTerrains>(table, target,
+                                               &out->terrains) ||
+      !load_section<SectionId::PrefabVertices>(table, target, &out->verts) ||
+      !load_section<SectionId::PrefabTurrets>(table, target, &out->turrets) ||
+      !load_section<SectionId::PrefabImages>(table, target, &out->images) ||
+      !load_section<SectionId::PrefabBuildSites>(table, target,
+                                                 &out->build_sites) ||
+      !load_section<SectionId::PrefabInstances>(table, target,
+                                                &out->instances))
+    return false;
+
+  auto in_range = [](uint32_t first, uint32_t count, size_t total) {
+    return first <= total && count <= total - first;
+  };
+  for (size_t i = 0; i < out->prefabs.count; ++i) {
+    PrefabRecord record = out->prefabs.load(i);
+    if (!in_range(record.first_terrain, record.terrain_count,
+                  out->terrains.count) ||
+        !in_range(record.first_turret, record.turret_count,
+                  out->turrets.count) ||
+        !in_range(record.first_image, record.image_count, out->images.count) ||
+        !in_range(record.first_build_site, record.build_site_count,
+                  out->build_sites.count))
+      return false;
+  }
+  for (size_t i = 0; i < out->terrains.count; ++i) {
+    TerrainRecord record = out->terrains.load(i);
+    if (!in_range(record.first_vertex, record.vertex_count, out->verts.count))
+      return false;
+  }
+  for (size_t i = 0; i < out->images.count; ++i) {
+    if (out->images.load(i).filename >= image_filenames)
+      return false;
+  }
+  for (size_t i = 0; i < out->instances.count; ++i) {
+    if (out->instances.load(i).prefab >= out->prefabs.count)
+      return false;
+  }
+  return true;
+}
+
+/// The parts a loader has to look at to give back the ones asked for
+inline LevelParts needed_parts(LevelParts parts) {
+  return parts & LevelParts::Prefabs ? parts | LevelParts::Images : parts;
+}
+
+/// Load the steps of a file which stores its vertices on a grid. grid is left
+/// at zero for files which store them as plain Vec2s.
+template <typename Target>
+inline bool load_vertex_deltas(const SectionTable &table, Target &&target,
+                               RawSpan<VertexDelta> *deltas, float *grid) {
+  *grid = 0;
+  RawSpan<VertexGridRecord> record;
+  if (!load_section<SectionId::VertexGrid>(table, target, &record) ||
+      record.count > 1)
+    return false;
+  if (record.count == 0)
+    return true;
+  float spacing = record.load(0).spacing;
+  if (!(spacing > 0) || !std::isfinite(spacing) ||
+      !load_section<SectionId::VertexDeltas>(table, target, deltas))
+    return false;
+  *grid = spacing;
+  return true;
+}
+
+/// The sections of a baked file, see SaveOptions::bake
+struct BakedSections {
+  RawSpan<Aabb> bounds;
+  RawSpan<Triangle> triangles;
+  BroadphaseGrid grid{};
+  RawSpan<uint32_t> cell_starts;
+  RawSpan<uint32_t> items;
+};
+
+/// Load the grid of a baked file, which has to be exactly one sensible grid
+template <typename Target>
+inline bool load_broadphase_grid(const SectionTable &table, Target &&target,
+                                 BroadphaseGrid *out) {
+  RawSpan<BroadphaseGrid> record;
+  if (!load_section<SectionId::BroadphaseGrid>(table, target, &record) ||
+      record.count != 1)
+    return false;
+  *out = record.load(0);
+  // a zero size wraps around
+  return std::isfinite(out->origin.x) && std::isfinite(out->origin.y) &&
+         out->cell_size > 0 && std::isfinite(out->cell_size) &&
+         out->columns - 1 < MAX_BROADPHASE_CELLS &&
+         out->rows - 1 < MAX_BROADPHASE_CELLS;
+}
+
+template <typename Target>
+inline bool load_baked(const SectionTable &table, Target &&target,
+                       BakedSections *out) {
+  return load_section<SectionId::TerrainBounds>(table, target,
+                                                &out->bounds) &&
+         load_section<SectionId::TerrainTriangles>(table, target,
+                                                   &out->triangles) &&
+         load_broadphase_grid(table, target, &out->grid) &&
+         load_section<SectionId::BroadphaseCells>(table, target,
+                                                  &out->cell_starts) &&
+         load_section<SectionId::BroadphaseItems>(table, target, &out->items);
+}
+
+/// Check baked sections against the terrains they were worked out from. Games
+/// index vertices and terrains with them without checking, so they have to be
+/// in range just like the terrains themselves.
+inline bool check_baked(RawSpan<TerrainRecord> records,
+                        const BakedSections &baked) {
+  if (baked.bounds.count != records.count ||
+      baked.cell_starts.count !=
+          size_t(baked.grid.columns) * baked.grid.rows + 1)
+    return false;
+
+  size_t first = 0;
+  for (size_t i = 0; i < records.count; ++i) {
+    uint32_t vertex_count = records.load(i).vertex_count;
+    size_t count = bake::triangle_count(vertex_count);
+    if (count > baked.triangles.count - first)
+      return false;
+    for (size_t j = first; j < first + count; ++j) {
+      Triangle triangle = baked.triangles.load(j);
+      if (triangle.a >= vertex_count || triangle.b >= vertex_count ||
+          triangle.c >= vertex_count)
+        return false;
+    }
+    first += count;
+  }
+  if (first != baked.triangles.count)
+    return false;
+
+  uint32_t previous = 0;
+  for (size_t i = 0; i < baked.cell_starts.count; ++i) {
+    uint32_t start = baked.cell_starts.load(i);
+    if (start < previous || (i == 0 && start != 0))
+      return false;
+    previous = start;
+  }
+  if (previous != baked.items.count)
+    return false;
+  for (size_t i = 0; i < baked.items.count; ++i) {
+    if (baked.items.load(i) >= records.count)
+      return false;
+  }
+  return true;
+}
+
+/// Where the steps of VertexDeltas end up, relative to where they start.
+/// Unsigned so that a corrupt file wraps around instead of overflowing.
+struct DeltaSum {
+  uint32_t x = 0;
+  uint32_t y = 0;
+};
+
+inline DeltaSum sum_vertex_deltas(RawSpan<VertexDelta> deltas) {
+  size_t i = 0;
+  DeltaSum sum;
+#if defined(__SSE2__)
+  __m128i total = _mm_setzero_si128(); // x y x y
+  for (; i + 4 <= deltas.count; i += 4) {
+    __m128i steps = _mm_loadu_si128(reinterpret_cast<const __m128i *>(
+        deltas.bytes + i * sizeof(VertexDelta)));
+    total = _mm_add_epi32(
+        total, _mm_srai_epi32(_mm_unpacklo_epi16(steps, steps), 16));
+    total = _mm_add_epi32(
+        total, _mm_srai_epi32(_mm_unpackhi_epi16(steps, steps), 16));
+  }
+  total = _mm_add_epi32(total, _mm_srli_si128(total, 8));
+  sum.x = uint32_t(_mm_cvtsi128_si32(total));
+  sum.y = uint32_t(_mm_cvtsi128_si32(_mm_srli_si128(total, 4)));
+#endif
+  for (; i < deltas.count; ++i) {
+    VertexDelta delta = deltas.load(i);
+    sum.x += uint32_t(int32_t(delta.x));
+    sum.y += uint32_t(int32_t(delta.y));
+  }
+  return sum;
+}
+
+/// Add up the steps of VertexDeltas into vertices, starting from the sum of
+/// the steps before them. The running sum is kept in integers and each vertex
+/// is scaled separately, so they come out exactly as they were before saving.
+/// Returns the sum after the last step.
+inline DeltaSum decode_vertex_deltas(RawSpan<VertexDelta> deltas, float grid,
+                                     Vec2 *out, DeltaSum start = {}) {
+  static_assert(sizeof(Vec2) == 2 * sizeof(float) &&
+                sizeof(VertexDelta) == 2 * sizeof(int16_t));
+  size_t i = 0;
+  uint32_t x = start.x;
+  uint32_t y = start.y;
+
+#if defined(__SSE2__)
+  // four vertices at a time: widen the steps to 32 bits, add up each pair of
+  // vertices, then carry the running total across from the previous pairs
+  const __m128 scale = _mm_set1_ps(grid);
+  __m128i total = _mm_setr_epi32(int(x), int(y), int(x), int(y)); // x y x y
+  for (; i + 4 <= deltas.count; i += 4) {
+    __m128i steps = _mm_loadu_si128(reinterpret_cast<const __m128i *>(
+        deltas.bytes + i * sizeof(VertexDelta)));
+    __m128i low = _mm_srai_epi32(_mm_unpacklo_epi16(steps, steps), 16);
+    __m128i high = _mm_srai_epi32(_mm_unpackhi_epi16(steps, steps), 16);
+    low = _mm_add_epi32(low, _mm_slli_si128(low, 8));
+    high = _mm_add_epi32(high, _mm_slli_si128(high, 8));
+    low = _mm_add_epi32(low, total);
+    high = _mm_add_epi32(high, _mm_shuffle_epi32(low, _MM_SHUFFLE(3, 2, 3, 2)));
+    total = _mm_shuffle_epi32(high, _MM_SHUFFLE(3, 2, 3, 2));
+    _mm_storeu_ps(&out[i].x, _mm_mul_ps(_mm_cvtepi32_ps(low), scale));
+    _mm_storeu_ps(&out[i + 2].x, _mm_mul_ps(_mm_cvtepi32_ps(high), scale));
+  }
+  x = uint32_t(_mm_cvtsi128_si32(total));
+  y = uint32_t(_mm_cvtsi128_si32(_mm_srli_si128(total, 4)));
+#endif
+
+  for (; i < deltas.count; ++i) {
+    VertexDelta delta = deltas.load(i);
+    x += uint32_t(int32_t(delta.x));
+    y += uint32_t(int32_t(delta.y));
+    out[i] = {float(int32_t(x)) * grid, float(int32_t(y)) * grid};
+  }
+  return {x, y};
+}
+
+/// Parse a legacy or version 1 file, where everything is laid out one after
+/// another. Parts which weren't asked for still have to be stepped over.
+template <typename Visitor>
+inline DeserializeResultCode parse_sequential(ByteReader &reader,
+                                              LevelParts parts,
+                                              Visitor &visitor) {
+  PlayerSpawnPoint player_spawn;
+  if (!reader.read(&player_spawn))
+    return DeserializeResultCode::EarlyEOF;
+  if (parts & LevelParts::Spawn)
+    visitor.spawn(player_spawn);
+
+  // counts are checked against the smallest possible size of an entry so a
+  // corrupt count can't make the visitor reserve an absurd amount of memory
+  uint64_t num_terrains;
+  if (!reader.read(&num_terrains) ||
+      num_terrains >
+          reader.remaining() / (sizeof(TerrainType) + sizeof(SpanHeader)))
+    return DeserializeResultCode::EarlyEOF;
+  if (parts & LevelParts::Terrains)
+    visitor.terrain_count(num_terrains);
+
+  for (size_t i = 0; i < num_terrains; ++i) {
+    TerrainType type;
+    RawSpan<Vec2> verts;
+    if (!reader.read(&type) || !reader.read_span(&verts))
+      return DeserializeResultCode::EarlyEOF;
+    if (parts & LevelParts::Terrains)
+      visitor.terrain(type, verts);
+  }
+
+  RawSpan<Turret> turrets;
+  if (!reader.read_span(&turrets))
+    return DeserializeResultCode::EarlyEOF;
+  if (parts & LevelParts::Turrets)
+    visitor.turrets(turrets);
+
+  uint64_t num_images;
+  if (!reader.read(&num_images) ||
+      num_images >
+          reader.remaining() / (sizeof(SpanHeader) + sizeof(ImageData)))
+    return DeserializeResultCode::EarlyEOF;
+  // filenames are stored with every image, so each gets its own
+  if (parts & LevelParts::Images) {
+    visitor.image_filename_count(num_images);
+    visitor.image_count(num_images);
+  }
+
+  for (size_t i = 0; i < num_images; ++i) {
+    RawSpan<char> filename;
+    ImageData data;
+    if (!reader.read_span(&filename) || !reader.read(&data))
+      return DeserializeResultCode::EarlyEOF;
+    if (parts & LevelParts::Images) {
+      visitor.image_filename(filename);
+      visitor.image(uint32_t(i), data);
+    }
+  }
+
+  RawSpan<BuildSite> sites;
+  if (!reader.read_span(&sites))
+    return DeserializeResultCode::EarlyEOF;
+  if (parts & LevelParts::BuildSites)
+    visitor.build_sites(sites);
+
+  return DeserializeResultCode::Okay;
+}
+
+/// Parse a version 2 file. Only the sections belonging to the requested parts
+/// are looked at.
+template <typename Visitor>
+inline DeserializeResultCode parse_sections(const SectionTable &table,
+                                            LevelParts parts,
+                                            Visitor &visitor) {
+  auto target = [&visitor](size_t bytes) {
+    return visitor.decode_target(bytes);
+  };
+
+  if (parts & LevelParts::Spawn) {
+    RawSpan<PlayerSpawnPoint> spawn;
+    if (!load_section<SectionId::Spawn>(table, target, &spawn) ||
+        spawn.count > 1)
+      return DeserializeResultCode::InvalidSectionTable;
+    visitor.spawn(spawn.count ? spawn.load(0) : PlayerSpawnPoint{});
+  }
+
+  if (parts & LevelParts::Terrains) {
+    RawSpan<TerrainRecord> records;
+    RawSpan<Vec2> verts;
+    RawSpan<VertexDelta> deltas;
+    float grid;
+    if (!load_section<SectionId::Terrains>(table, target, &records) ||
+        !load_vertex_deltas(table, target, &deltas, &grid))
+      return DeserializeResultCode::InvalidSectionTable;
+    if (grid != 0) {
+      std::byte *dest = target(deltas.count * sizeof(Vec2));
+      decode_vertex_deltas(deltas, grid, reinterpret_cast<Vec2 *>(dest));
+      verts = {.bytes = dest, .count = deltas.count};
+    } else if (!load_section<SectionId::Vertices>(table, target, &verts)) {
+      return DeserializeResultCode::InvalidSectionTable;
+    }
+    visitor.terrain_count(records.count);
+    for (size_t i = 0; i < records.count; ++i) {
+      TerrainRecord record = records.load(i);
+      if (record.first_vertex > verts.count ||
+          record.vertex_count > verts.count - record.first_vertex)
+        return DeserializeResultCode::InvalidSectionTable;
+      visitor.terrain(TerrainType(record.type),
+                      verts.subspan(record.first_vertex, record.vertex_count));
+    }
+    // only loaded for visitors which have a use for them
+    if constexpr (requires { visitor.baked(BakedSections{}); }) {
+      if (table.contains(SectionId::TerrainBounds)) {
+        BakedSections baked;
+        if (!load_baked(table, target, &baked) || !check_baked(records, baked))
+          return DeserializeResultCode::InvalidSectionTable;
+        visitor.baked(baked);
+      }
+    }
+  }
+
+  if (parts & LevelParts::Turrets) {
+    RawSpan<Turret> turrets;
+    if (!load_section<SectionId::Turrets>(table, target, &turrets))
+      return DeserializeResultCode::InvalidSectionTable;
+    visitor.turrets(turrets);
+  }
+
+  // prefab images are checked against these
+  size_t image_filenames = 0;
+  if (parts & LevelParts::Images) {
+    ImageSections images;
+    if (!load_images(table, target, &images))
+      return DeserializeResultCode::InvalidSectionTable;
+    image_filenames = images.names.count;
+    visitor.image_filename_count(images.names.count);
+    for (size_t i = 0; i < images.names.count; ++i) {
+      FilenameRecord name = images.names.load(i);
+      visitor.image_filename(
+          images.filenames.subspan(name.offset, name.length));
+    }
+    visitor.image_count(images.placements.count);
+    for (size_t i = 0; i < images.placements.count; ++i) {
+      PlacementRecord placement = images.placements.load(i);
+      visitor.image(placement.filename, placement.data);
+    }
+  }
+
+  if (parts & LevelParts::BuildSites) {
+    RawSpan<BuildSite> sites;
+    if (!load_section<SectionId::BuildSites>(table, target, &sites))
+      return DeserializeResultCode::InvalidSectionTable;
+    visitor.build_sites(sites);
+  }
+
+  // like the baked sections, only for visitors which take them
+  if constexpr (requires { visitor.prefabs(PrefabSections{}); }) {
+    if ((parts & LevelParts::Prefabs) && table.contains(SectionId::Prefabs)) {
+      PrefabSections prefabs;
+      if (!load_prefabs(table, target, image_filenames, &prefabs))
+        return DeserializeResultCode::InvalidSectionTable;
+      visitor.prefabs(prefabs);
+    }
+  }
+
+  return DeserializeResultCode::Okay;
+}
+
+/// What the header of a level file says about the rest of it
+struct FileLayout {
+  /// zero for legacy files
+  uint32_t version = 0;
+  uint32_t section_count = 0;
+};
+
+/// Read the header text and magic number, which tell us the layout. Leaves the
+/// reader just past the header.
+inline DeserializeResultCode read_header(ByteReader &reader, bool allow_legacy,
+                                         FileLayout *out) {
+  static constexpr LevelHeader header;
+  std::array<char, sizeof(header.header_text)> text;
+  uint64_t magic;
+  if (!reader.read(&text) || !reader.read(&magic))
+    return DeserializeResultCode::EarlyEOF;
+  if (std::memcmp(text.data(), header.header_text, text.size()) != 0)
+    return DeserializeResultCode::InvalidHeader;
+  magic = byteswap_le(magic);
+
+  if (magic == LEGACY_LEVEL_MAGIC) {
+    if (!allow_legacy)
+      return DeserializeResultCode::LegacyFormat;
+    if (!HOST_IS_LITTLE_ENDIAN)
+      return DeserializeResultCode::UnsupportedVersion;
+    reader.aligned = false;
+    *out = {};
+    return DeserializeResultCode::Okay;
+  }
+  if (magic != header.magic)
+    return DeserializeResultCode::InvalidHeader;
+
+  if (!reader.read(&out->version) || !reader.read(&out->section_count))
+    return DeserializeResultCode::EarlyEOF;
+  out->version = byteswap_le(out->version);
+  out->section_count = byteswap_le(out->section_count);
+  if (out->version < 1 || out->version > header.version ||
+      (out->version < 2 && !HOST_IS_LITTLE_ENDIAN))
+    return DeserializeResultCode::UnsupportedVersion;
+  return DeserializeResultCode::Okay;
+}
+
+/// Walk a level file held in memory, handing each requested part of it to the
+/// visitor as a RawSpan. Nothing is copied, except that compressed sections
+/// are decoded into memory the visitor provides. Parts come in the order
+/// below, each count before the items it counts. Visitors implement:
+///   std::byte *decode_target(size_t bytes) // aligned to at least 8
+///   void spawn(PlayerSpawnPoint)
+///   void terrain_count(size_t)
+///   void terrain(TerrainType, RawSpan<Vec2>)
+///   void baked(const BakedSections &) // optional, only for baked files
+///   void turrets(RawSpan<Turret>)
+///   void image_filename_count(size_t)
+///   void image_filename(RawSpan<char>)
+///   void image_count(size_t)
+///   void image(uint32_t filename_index, ImageData) // after its filename
+///   void build_sites(RawSpan<BuildSite>)
+///   void prefabs(const PrefabSections &) // optional, only for files with
+///                                        // prefabs
+template <typename Visitor>
+inline DeserializeResultCode parse_level(std::span<const std::byte> file,
+                                         bool allow_legacy,
+                                         const LoadOptions &options,
+                                         Visitor &visitor) {
+  ByteReader reader(file);
+  FileLayout layout;
+  if (auto res = read_header(reader, allow_legacy, &layout);
+      res != DeserializeResultCode::Okay)
+    return res;
+
+  const LevelParts parts = needed_parts(options.parts);
+  if (layout.version < 2)
+    return parse_sequential(reader, parts, visitor);
+
+  SectionTable table;
+  if (auto res = table.read(reader, file, layout.section_count);
+      res != DeserializeResultCode::Okay)
+    return res;
+  if (!options.trusted) {
+    if (auto res = table.verify(parts, layout.version);
+        res != DeserializeResultCode::Okay)
+      return res;
+  }
+  return parse_sections(table, parts, visitor);
+}
+
+} // namespace detail
+
+/// A level file mapped into memory. The spans in level() point straight into
+/// the mapping, so loading costs no copies, and they stay valid for as long as
+/// the view does. Compressed sections are the exception: they are decoded into
+/// memory owned by the view. Image filenames are NOT null terminated.
+class LevelView {
+public:
+  LevelView() = default;
+  LevelView(const LevelView &) = delete;
+  LevelView &operator=(const LevelView &) = delete;
+  LevelView(LevelView &&) = default;
+  LevelView &operator=(LevelView &&) = default;
+
+  /// Map a level file and validate the parts of it asked for in options.
+  /// Files written before the aligned layout return LegacyFormat and must be
+  /// loaded with deserialize instead.
+  inline DeserializeResultCode open(const char *filename,
+                                    const LoadOptions &options = {});
+  /// Same, over a level file somebody else holds in memory, like a room in a
+  /// LevelPack. The bytes have to outlive the view.
+  inline DeserializeResultCode open(std::span<const std::byte> bytes,
+                                    const LoadOptions &options = {});
+
+  inline const Level &level() const { return view; }
+
+private:
+  detail::MappedFile file;
+  std::vector<std::unique_ptr<std::byte[]>> decoded;
+  std::vector<TerrainEntry> terrains;
+  std::vector<std::span<const char>> filenames;
+  std::vector<Image> images;
+  std::vector<Prefab> prefabs;
+  std::vector<TerrainEntry> prefab_terrains;
+  std::vector<Image> prefab_images;
+  Level view;
+
+  inline void clear() {
+    decoded.clear();
+    terrains.clear();
+    filenames.clear();
+    images.clear();
+    prefabs.clear();
+    prefab_terrains.clear();
+    prefab_images.clear();
+    view = {};
+  }
+};
+
+inline DeserializeResultCode LevelView::open(const char *filename,
+                                             const LoadOptions &options) {
+  if (!filename)
+    return DeserializeResultCode::NoFilenameProvided;
+
+  detail::MappedFile newfile;
+  if (auto res = newfile.open(filename); res != DeserializeResultCode::Okay)
+    return res;
+  auto res = open(newfile.bytes(), options);
+  if (res == DeserializeResultCode::Okay)
+    file = std::move(newfile);
+  return res;
+}
+
+inline DeserializeResultCode LevelView::open(std::span<const std::byte> bytes,
+                                             const LoadOptions &options) {
+  struct Visitor {
+    LevelView &out;
+    std::byte *decode_target(size_t bytes) {
+      out.decoded.push_back(std::make_unique_for_overwrite<std::byte[]>(bytes));
+      return out.decoded.back().get();
+    }
+    void spawn(PlayerSpawnPoint spawn) { out.view.player_spawn = spawn; }
+    void terrain_count(size_t count) { out.terrains.reserve(count); }
+    void terrain(TerrainType type, detail::RawSpan<Vec2> verts) {
+      out.terrains.push_back({.verts = verts.view(), .type = type});
+    }
+    void baked(const detail::BakedSections &baked) {
+      auto triangles = baked.triangles.view();
+      size_t first = 0;
+      for (size_t i = 0; i < out.terrains.size(); ++i) {
+        auto &terrain = out.terrains[i];
+        size_t count = bake::triangle_count(terrain.verts.size());
+        terrain.bounds = baked.bounds.load(i);
+        terrain.triangles = triangles.subspan(first, count);
+        first += count;
+      }
+      out.view.broadphase = {
+          .grid = baked.grid,
+          .cell_starts = baked.cell_starts.view(),
+          .items = baked.items.view(),
+      };
+    }
+    void turrets(detail::RawSpan<Turret> turrets) {
+      out.view.turrets = turrets.view();
+    }
+    void image_filename_count(size_t count) { out.filenames.reserve(count); }
+    void image_filename(detail::RawSpan<char> filename) {
+      out.filenames.push_back(filename.view());
+    }
+    void image_count(size_t count) { out.images.reserve(count); }
+    void image(uint32_t filename_index, ImageData data) {
+      out.images.push_back({
+          .filename = out.filenames[filename_index],
+          .data = data,
+          .filename_index = filename_index,
+      });
+    }
+    void build_sites(detail::RawSpan<BuildSite> sites) {
+      out.view.build_sites = sites.view();
+    }
+    void prefabs(const detail::PrefabSections &prefabs) {
+      auto verts = prefabs.verts.view();
+      out.prefab_terrains.reserve(prefabs.terrains.count);
+      for (size_t i = 0; i < prefabs.terrains.count; ++i) {
+        TerrainRecord record = prefabs.terrains.load(i);
+        out.prefab_terrains.push_back({
+            .verts = verts.subspan(record.first_vertex, record.vertex_count),
+            .type = TerrainType(record.type),
+        });
+      }
+      out.prefab_images.reserve(prefabs.images.count);
+      for (size_t i = 0; i < prefabs.images.count; ++i) {
+        PlacementRecord placement = prefabs.images.load(i);
+        out.prefab_images.push_back({
+            .filename = out.filenames[placement.filename],
+            .data = placement.data,
+            .filename_index = placement.filename,
+        });
+      }
+      auto turrets = prefabs.turrets.view();
+      auto sites = prefabs.build_sites.view();
+      out.prefabs.reserve(prefabs.prefabs.count);
+      for (size_t i = 0; i < prefabs.prefabs.count; ++i) {
+        PrefabRecord record = prefabs.prefabs.load(i);
+        out.prefabs.push_back({
+            .terrains = std::span(out.prefab_terrains)
+                            .subspan(record.first_terrain,
+                                     record.terrain_count),
+            .turrets = turrets.subspan(record.first_turret,
+                                       record.turret_count),
+            .images = std::span(out.prefab_images)
+                          .subspan(record.first_image, record.image_count),
+            .build_sites = sites.subspan(record.first_build_site,
+                                         record.build_site_count),
+        });
+      }
+      out.view.instances = prefabs.instances.view();
+    }
+  };
+
+  clear();
+  Visitor visitor{*this};
+  auto res = detail::parse_level(bytes, false, options, visitor);
+  if (res != DeserializeResultCode::Okay) {
+    clear();
+    return res;
+  }
+
+  view.terrains = terrains;
+  view.images = images;
+  view.image_filenames = filenames;
+  view.prefabs = prefabs;
+  // whatever we mapped before isn't looked at anymore
+  file = {};
+  return res;
+}
+
+namespace detail {
+
+/// Hands out consecutive, aligned pieces of a block of memory. With no block
+/// it only counts, so the same layout code can size the block first.
+class BumpAllocator {
+public:
+  explicit BumpAllocator(std::byte *base) : base(base) {}
+
+  template <typename T> inline T *take(size_t count) {
+    offset = (offset + alignof(T) - 1) / alignof(T) * alignof(T);
+    T *result = base ? reinterpret_cast<T *>(base + offset) : nullptr;
+    offset += count * sizeof(T);
+    return result;
+  }
+
+  inline size_t used() const { return offset; }
+  inline bool counting() const { return !base; }
+
+private:
+  std::byte *base;
+  size_t offset = 0;
+};
+
+} // namespace detail
+
+namespace detail {
+
+static_assert(std::is_trivially_destructible_v<TerrainEntry> &&
+                  std::is_trivially_destructible_v<Image> &&
+                  std::is_trivially_destructible_v<Turret> &&
+                  std::is_trivially_destructible_v<BuildSite> &&
+                  std::is_trivially_destructible_v<Prefab> &&
+                  std::is_trivially_destructible_v<PrefabInstance>,
+              "Level contents are freed along with their storage without "
+              "running destructors.");
+
+/// Lay out the table of image filenames of a level, each null terminated. The
+/// terminator is kept out of the spans so that saving the level again writes
+/// the same filenames.
+template <typename GetFilename>
+inline std::span<const char> *take_filenames(BumpAllocator &bump, size_t count,
+                                             GetFilename &&get_filename) {
+  auto *table = bump.take<std::span<const char>>(count);
+  for (size_t i = 0; i < count; ++i) {
+    RawSpan<char> raw = get_filename(i);
+    auto *filename = bump.take<char>(raw.count + 1);
+    if (!bump.counting()) {
+      raw.copy_to(filename);
+      filename[raw.count] = 0;
+      std::construct_at(&table[i], filename, raw.count);
+    }
+  }
+  return table;
+}
+
+/// Lay out the prefabs of a level and everything in them, and copy them in
+/// unless only counting. Their images point at filenames, which have to be in
+/// place by then.
+inline void take_prefabs(BumpAllocator &bump, const PrefabSections &prefabs,
+                         const std::span<const char> *filenames, Level *out) {
+  auto *list = bump.take<Prefab>(prefabs.prefabs.count);
+  auto *terrains = bump.take<TerrainEntry>(prefabs.terrains.count);
+  auto *images = bump.take<Image>(prefabs.images.count);
+  auto *verts = bump.take<Vec2>(prefabs.verts.count);
+  auto *turrets = bump.take<Turret>(prefabs.turrets.count);
+  auto *sites = bump.take<BuildSite>(prefabs.build_sites.count);
+  auto *instances = bump.take<PrefabInstance>(prefabs.instances.count);
+  if (bump.counting())
+    return;
+
+  prefabs.verts.copy_to(verts);
+  prefabs.turrets.copy_to(turrets);
+  prefabs.build_sites.copy_to(sites);
+  prefabs.instances.copy_to(instances);
+  for (size_t i = 0; i < prefabs.terrains.count; ++i) {
+    TerrainRecord record = prefabs.terrains.load(i);
+    std::construct_at(&terrains[i],
+                      TerrainEntry{
+                          .verts = std::span<const Vec2>(
+                              verts + record.first_vertex, record.vertex_count),
+                          .type = TerrainType(record.type),
+                      });
+  }
+  for (size_t i = 0; i < prefabs.images.count; ++i) {
+    PlacementRecord placement = prefabs.images.load(i);
+    std::construct_at(&images[i], Image{
+                                      .filename = filenames[placement.filename],
+                                      .data = placement.data,
+                                      .filename_index = placement.filename,
+                                  });
+  }
+  for (size_t i = 0; i < prefabs.prefabs.count; ++i) {
+    PrefabRecord record = prefabs.prefabs.load(i);
+    std::construct_at(
+        &list[i],
+        Prefab{
+            .terrains = std::span<const TerrainEntry>(
+                terrains + record.first_terrain, record.terrain_count),
+            .turrets = std::span<const Turret>(turrets + record.first_turret,
+                                               record.turret_count),
+            .images = std::span<const Image>(images + record.first_image,
+                                             record.image_count),
+            .build_sites = std::span<const BuildSite>(
+                sites + record.first_build_site, record.build_site_count),
+        });
+  }
+  out->prefabs = std::span(list, prefabs.prefabs.count);
+  out->instances = std::span(instances, prefabs.instances.count);
+}
+
+/// Copy a legacy or version 1 file into one block of memory
+inline DeserializeResultCode
+deserialize_sequential(ByteReader &reader, LevelParts parts,
+                       std::pmr::memory_resource *resource, Level *out) {
+  // collect where everything is in the mapping, then copy each piece once
+  struct Visitor {
+    PlayerSpawnPoint player_spawn;
+    std::vector<std::pair<TerrainType, RawSpan<Vec2>>> terrain_spans;
+    RawSpan<Turret> turret_span;
+    std::vector<RawSpan<char>> filename_spans;
+    std::vector<std::pair<uint32_t, ImageData>> placements;
+    RawSpan<BuildSite> site_span;
+
+    void spawn(PlayerSpawnPoint spawn) { player_spawn = spawn; }
+    void terrain_count(size_t count) { terrain_spans.reserve(count); }
+    void terrain(TerrainType type, RawSpan<Vec2> verts) {
+      terrain_spans.emplace_back(type, verts);
+    }
+    void turrets(RawSpan<Turret> span) { turret_span = span; }
+    void image_filename_count(size_t count) { filename_spans.reserve(count); }
+    void image_filename(RawSpan<char> filename) {
+      filename_spans.push_back(filename);
+    }
+    void image_count(size_t count) { placements.reserve(count); }
+    void image(uint32_t filename_index, ImageData data) {
+      placements.emplace_back(filename_index, data);
+    }
+    void build_sites(RawSpan<BuildSite> span) { site_span = span; }
+  };
+
+  Visitor visitor{};
+  auto res = parse_sequential(reader, parts, visitor);
+  if (res != DeserializeResultCode::Okay)
+    return res;
+
+  // run once without storage to size the block, and again to fill it
+  Level level;
+  auto layout = [&visitor, &level](BumpAllocator &bump) {
+    auto *terrains = bump.take<TerrainEntry>(visitor.terrain_spans.size());
+    auto *images = bump.take<Image>(visitor.placements.size());
+    auto *turrets = bump.take<Turret>(visitor.turret_span.count);
+    auto *sites = bump.take<BuildSite>(visitor.site_span.count);
+    const bool fill = !bump.counting();
+
+    if (fill) {
+      visitor.turret_span.copy_to(turrets);
+      visitor.site_span.copy_to(sites);
+    }
+
+    for (size_t i = 0; i < visitor.terrain_spans.size(); ++i) {
+      const auto &[type, raw_verts] = visitor.terrain_spans[i];
+      auto *verts = bump.take<Vec2>(raw_verts.count);
+      if (fill) {
+        raw_verts.copy_to(verts);
+        std::construct_at(&terrains[i],
+                          TerrainEntry{
+                              .verts = std::span(verts, raw_verts.count),
+                              .type = type,
+                          });
+      }
+    }
+
+    const size_t num_filenames = visitor.filename_spans.size();
+    auto *filenames = take_filenames(bump, num_filenames, [&](size_t i) {
+      return visitor.filename_spans[i];
+    });
+    for (size_t i = 0; fill && i < visitor.placements.size(); ++i) {
+      const auto &[filename_index, data] = visitor.placements[i];
+      std::construct_at(&images[i],
+                        Image{
+                            .filename = filenames[filename_index],
+                            .data = data,
+                            .filename_index = filename_index,
+                        });
+    }
+
+    if (fill) {
+      level.terrains = std::span(terrains, visitor.terrain_spans.size());
+      level.images = std::span(images, visitor.placements.size());
+      level.image_filenames = std::span(filenames, num_filenames);
+      level.turrets = std::span(turrets, visitor.turret_span.count);
+      level.build_sites = std::span(sites, visitor.site_span.count);
+    }
+  };
+
+  BumpAllocator sizer(nullptr);
+  layout(sizer);
+  level.storage = LevelStorage(resource, sizer.used());
+  BumpAllocator filler(level.storage.data());
+  layout(filler);
+  assert(filler.used() == sizer.used());
+
+  level.player_spawn = visitor.player_spawn;
+  *out = std::move(level);
+  return res;
+}
+
+
+// levels which take less memory than this are filled in on the calling thread
+inline constexpr size_t PARALLEL_DECODE_BYTES = 2 * 1024 * 1024;
+// stored sections are copied, and swapped on big endian hosts, in pieces this
+// size
+inline constexpr size_t DECODE_PIECE_SIZE = 256 * 1024;
+// terrains, images and vertex steps are handed out this many at a time
+inline constexpr size_t DECODE_CHUNK_ITEMS = 32 * 1024;
+
+/// A section decoded straight into its place in a level's storage
+struct SectionCopy {
+  Section section;
+  std::span<std::byte> dest{};
+  size_t record_size = 1;
+  /// section_to_host of its records
+  void (*to_host)(std::span<std::byte>) = nullptr;
+  /// whether its stored bytes are checked against checksum as they're copied
+  bool checked = false;
+  uint32_t checksum = 0;
+};
+
+template <typename T>
+inline SectionCopy section_copy(const Section &section, std::span<T> dest) {
+  return {.section = section,
+          .dest = std::as_writable_bytes(dest),
+          .record_size = sizeof(T),
+          .to_host = section_to_host<T>};
+}
+
+/// The big stored sections of a level, which are checked against their
+/// checksums as they're decoded instead of read once more beforehand
+struct LateChecks {
+  std::array<SectionId, 7> ids{};
+  std::array<uint32_t, 7> checksums{};
+  size_t count = 0;
+
+  /// Check the section with Id late if it's needed, stored, and has a
+  /// checksum. Empty ones cost nothing to check up front.
+  template <SectionId Id>
+  inline void add(const SectionTable &table, bool needed) {
+    Section section;
+    uint32_t checksum;
+    if (!needed || !table.find<Id>(&section) || section.compressed() ||
+        section.stored.empty() || !table.checksum_of(Id, &checksum))
+      return;
+    assert(count < ids.size());
+    ids[count] = Id;
+    checksums[count++] = checksum;
+  }
+  /// Set *checksum and return true if the section is checked late
+  inline bool find(SectionId id, uint32_t *checksum) const {
+    for (size_t i = 0; i < count; ++i) {
+      if (ids[i] == id) {
+        *checksum = checksums[i];
+        return true;
+      }
+    }
+    return false;
+  }
+  inline std::span<const SectionId> sections() const {
+    return std::span(ids).first(count);
+  }
+};
+
+/// What is left to do once a level's storage is laid out: the big sections
+/// to decode into it, and the terrains and images to point at their vertices
+/// and filenames. Every piece of it writes its own part of the storage.
+struct SectionFill {
+  RawSpan<TerrainRecord> terrain_records;
+  TerrainEntry *terrains = nullptr;
+  RawSpan<PlacementRecord> placements;
+  Image *images = nullptr;
+  /// already copied in, by take_filenames
+  std::span<const char> *filenames = nullptr;
+
+  /// decoded into verts when grid isn't zero, otherwise the Vertices section
+  /// is one of the copies
+  RawSpan<VertexDelta> deltas;
+  float grid = 0;
+  /// whether deltas are checked against deltas_checksum as they're decoded
+  bool deltas_checked = false;
+  uint32_t deltas_checksum = 0;
+  std::span<Vec2> verts{};
+  /// vertices, turrets, build sites and the big baked sections
+  std::array<SectionCopy, 6> copies{};
+  size_t num_copies = 0;
+
+  template <typename T>
+  inline void copy(const Section &section, std::span<T> dest,
+                   const LateChecks &late) {
+    assert(num_copies < copies.size());
+    SectionCopy &copy = copies[num_copies++];
+    copy = section_copy(section, dest);
+    copy.checked = late.find(section.entry.id, &copy.checksum);
+  }
+  inline std::span<const SectionCopy> sections() const {
+    return std::span(copies).first(num_copies);
+  }
+};
+
+inline void fill_terrains(const SectionFill &fill, size_t first,
+                          size_t count) {
+  for (size_t i = first; i < first + count; ++i) {
+    TerrainRecord record = fill.terrain_records.load(i);
+    std::construct_at(&fill.terrains[i],
+                      TerrainEntry{
+                          .verts = fill.verts.subspan(record.first_vertex,
+                                                      record.vertex_count),
+                          .type = TerrainType(record.type),
+                      });
+  }
+}
+
+inline void fill_images(const SectionFill &fill, size_t first, size_t count) {
+  for (size_t i = first; i < first + count; ++i) {
+    PlacementRecord placement = fill.placements.load(i);
+    std::construct_at(&fill.images[i],
+                      Image{
+                          .filename = fill.filenames[placement.filename],
+                          .data = placement.data,
+                          .filename_index = placement.filename,
+                      });
+  }
+}
+
+inline DeserializeResultCode fill_sequential(const SectionFill &fill) {
+  fill_terrains(fill, 0, fill.terrain_records.count);
+  fill_images(fill, 0, fill.placements.count);
+
+  if (fill.grid != 0 && fill.deltas_checked) {
+    // a chunk at a time, to check the steps while they're in cache
+    DeltaSum sum;
+    uint32_t crc = 0;
+    for (size_t first = 0; first < fill.deltas.count;
+         first += DECODE_CHUNK_ITEMS) {
+      auto chunk = fill.deltas.subspan(
+          first, std::min(DECODE_CHUNK_ITEMS, fill.deltas.count - first));
+      sum = decode_vertex_deltas(chunk, fill.grid, fill.verts.data() + first,
+                                 sum);
+      crc = crc32c::extend(crc, chunk.as_bytes());
+    }
+    if (crc != fill.deltas_checksum)
+      return DeserializeResultCode::ChecksumMismatch;
+  } else if (fill.grid != 0) {
+    decode_vertex_deltas(fill.deltas, fill.grid, fill.verts.data());
+  }
+  for (const auto &copy : fill.sections()) {
+    if (copy.checked) {
+      if (copy_checked(copy.section.stored, copy.dest) != copy.checksum)
+        return DeserializeResultCode::ChecksumMismatch;
+    } else if (!decode_section(copy.section, copy.dest)) {
+      return DeserializeResultCode::InvalidSectionTable;
+    }
+    copy.to_host(copy.dest);
+  }
+  return DeserializeResultCode::Okay;
+}
+
+/// Same as fill_sequential, split into pieces and spread over threads. Runs
+/// in two rounds: the first decodes everything which stands on its own and
+/// adds up runs of vertex steps, the second turns those steps into vertices
+/// and puts what was decoded into host order. Every piece writes the same
+/// bytes no matter which thread runs it, so the level comes out identical.
+/// Pieces of sections checked late each work out the checksum of their own
+/// bytes, which are put back together in order between the rounds.
+inline DeserializeResultCode fill_parallel(const SectionFill &fill,
+                                           size_t threads) {
+  enum class JobKind : uint8_t {
+    Decode,
+    Terrains,
+    Images,
+    SumDeltas,
+    Deltas,
+    Swap,
+  };
+  struct Job {
+    JobKind kind;
+    DecodePiece piece{};
+    // which items, for everything but Decode
+    size_t first = 0;
+    size_t count = 0;
+    // which of fill.copies, for Swap and Decode
+    size_t copy = 0;
+    // whether it checks its bytes, and then their checksum
+    bool checked = false;
+    uint32_t crc = 0;
+  };
+  std::vector<Job> first_round;
+  std::vector<Job> second_round;
+
+  bool split = true;
+  auto add_pieces = [&](size_t copy) {
+    const SectionCopy &section = fill.copies[copy];
+    split = split_section(section.section, section.dest, DECODE_PIECE_SIZE,
+                          [&](const DecodePiece &piece) {
+                            first_round.push_back({.kind = JobKind::Decode,
+                                                   .piece = piece,
+                                                   .copy = copy,
+                                                   .checked = section.checked});
+                          }) &&
+            split;
+  };
+  auto add_ranges = [](std::vector<Job> &jobs, JobKind kind, size_t count,
+                       size_t chunk) {
+    for (size_t first = 0; first < count; first += chunk)
+      jobs.push_back({.kind = kind,
+                      .first = first,
+                      .count = std::min(chunk, count - first)});
+  };
+
+  for (size_t i = 0; i < fill.num_copies; ++i)
+    add_pieces(i);
+  if (!split)
+    return DeserializeResultCode::InvalidSectionTable;
+  add_ranges(first_round, JobKind::Terrains, fill.terrain_records.count,
+             DECODE_CHUNK_ITEMS);
+  add_ranges(first_round, JobKind::Images, fill.placements.count,
+             DECODE_CHUNK_ITEMS);
+  if (fill.grid != 0) {
+    size_t first_job = first_round.size();
+    add_ranges(first_round, JobKind::SumDeltas, fill.deltas.count,
+               DECODE_CHUNK_ITEMS);
+    for (size_t j = first_job; j < first_round.size(); ++j)
+      first_round[j].checked = fill.deltas_checked;
+    add_ranges(second_round, JobKind::Deltas, fill.deltas.count,
+               DECODE_CHUNK_ITEMS);
+  }
+  if constexpr (!HOST_IS_LITTLE_ENDIAN) {
+    // swapped by whole records, where decoding cuts anywhere
+    for (size_t i = 0; i < fill.num_copies; ++i) {
+      size_t size = fill.copies[i].record_size;
+      size_t first_job = second_round.size();
+      add_ranges(second_round, JobKind::Swap, fill.copies[i].dest.size() / size,
+                 DECODE_PIECE_SIZE / size);
+      for (size_t j = first_job; j < second_round.size(); ++j)
+        second_round[j].copy = i;
+    }
+  }
+
+  // where each run of vertex steps ends up relative to where it starts, and
+  // after the first round, where it starts
+  std::vector<DeltaSum> sums(
+      (fill.deltas.count + DECODE_CHUNK_ITEMS - 1) / DECODE_CHUNK_ITEMS);
+  std::atomic<bool> failed = false;
+  auto run = [&](Job &job) {
+    switch (job.kind) {
+    case JobKind::Decode:
+      if (job.checked)
+        job.crc = copy_checked(job.piece.stored, job.piece.dest);
+      else if (!decode_piece(job.piece))
+        failed.store(true, std::memory_order_relaxed);
+      break;
+    case JobKind::Terrains:
+      fill_terrains(fill, job.first, job.count);
+      break;
+    case JobKind::Images:
+      fill_images(fill, job.first, job.count);
+      break;
+    case JobKind::SumDeltas: {
+      auto chunk = fill.deltas.subspan(job.first, job.count);
+      sums[job.first / DECODE_CHUNK_ITEMS] = sum_vertex_deltas(chunk);
+      if (job.checked)
+        job.crc = crc32c::checksum(chunk.as_bytes());
+      break;
+    }
+    case JobKind::Deltas:
+      decode_vertex_deltas(fill.deltas.subspan(job.first, job.count),
+                           fill.grid, fill.verts.data() + job.first,
+                           sums[job.first / DECODE_CHUNK_ITEMS]);
+      break;
+    case JobKind::Swap: {
+      const auto &copy = fill.copies[job.copy];
+      copy.to_host(copy.dest.subspan(job.first * copy.record_size,
+                                     job.count * copy.record_size));
+      break;
+    }
+    }
+  };
+
+  parallel_for(first_round.size(), threads,
+               [&](size_t i) { run(first_round[i]); });
+  if (failed)
+    return DeserializeResultCode::InvalidSectionTable;
+
+  // jobs are in order within each section, so its checksum can be put back
+  // together one piece at a time
+  std::array<uint32_t, std::tuple_size_v<decltype(fill.copies)>> copy_crcs{};
+  uint32_t deltas_crc = 0;
+  for (const auto &job : first_round) {
+    if (!job.checked)
+      continue;
+    if (job.kind == JobKind::Decode)
+      copy_crcs[job.copy] = crc32c::combine(copy_crcs[job.copy], job.crc,
+                                            job.piece.stored.size());
+    else
+      deltas_crc = crc32c::combine(deltas_crc, job.crc,
+                                   job.count * sizeof(VertexDelta));
+  }
+  for (size_t i = 0; i < fill.num_copies; ++i) {
+    if (fill.copies[i].checked && copy_crcs[i] != fill.copies[i].checksum)
+      return DeserializeResultCode::ChecksumMismatch;
+  }
+  if (fill.grid != 0 && fill.deltas_checked &&
+      deltas_crc != fill.deltas_checksum)
+    return DeserializeResultCode::ChecksumMismatch;
+
+  DeltaSum start;
+  for (auto &sum : sums) {
+    DeltaSum run_sum = sum;
+    sum = start;
+    start.x += run_sum.x;
+    start.y += run_sum.y;
+  }
+  parallel_for(second_round.size(), threads,
+               [&](size_t i) { run(second_round[i]); });
+  return DeserializeResultCode::Okay;
+}
+
+/// Copy the sections of a version 2 file into one block of memory. Vertices,
+/// turrets, build sites and baked triangles and broadphase are each copied, or
+/// decompressed, straight into their final place in a single pass, split over
+/// threads for big levels. Unless trusted, the file is checked against its
+/// checksums, the big stored sections as they're copied.
+inline DeserializeResultCode
+deserialize_sections(const SectionTable &table, LevelParts parts,
+                     uint32_t version, bool trusted,
+                     std::pmr::memory_resource *resource, Level *out) {
+  // the small record sections are needed to size the block, so they are
+  // decoded into scratch memory first if they are compressed
+  std::vector<std::unique_ptr<std::byte[]>> scratch;
+  auto target = [&scratch](size_t bytes) {
+    scratch.push_back(std::make_unique_for_overwrite<std::byte[]>(bytes));
+    return scratch.back().get();
+  };
+
+  RawSpan<PlayerSpawnPoint> spawn;
+  RawSpan<TerrainRecord> terrain_records;
+  ImageSections images;
+  RawSpan<VertexDelta> vertex_deltas;
+  float grid = 0;
+  Section vertex_section;
+  Section turret_section;
+  Section site_section;
+  BakedSections baked;
+  Section triangle_section;
+  Section cell_section;
+  Section item_section;
+  const bool is_baked = (parts & LevelParts::Terrains) &&
+                        table.contains(SectionId::TerrainBounds);
+
+  // reading the big sections once to check them and again to copy them costs
+  // about as much as the copy, so they're checked on the way through, when
+  // it's nearly free. the rest is checked before anything is read from it
+  LateChecks late;
+  if (!trusted) {
+    // deltas are read in place on little endian hosts, and replace the
+    // vertices if there's a grid to put them on
+    Section vertex_grid;
+    const bool has_grid = table.find<SectionId::VertexGrid>(&vertex_grid) &&
+                          vertex_grid.entry.count != 0;
+    const bool terrains = parts & LevelParts::Terrains;
+    late.add<SectionId::VertexDeltas>(table, terrains && has_grid &&
+                                                 HOST_IS_LITTLE_ENDIAN);
+    late.add<SectionId::Vertices>(table, terrains && !has_grid);
+    late.add<SectionId::Turrets>(table, parts & LevelParts::Turrets);
+    late.add<SectionId::BuildSites>(table, parts & LevelParts::BuildSites);
+    late.add<SectionId::TerrainTriangles>(table, is_baked);
+    late.add<SectionId::BroadphaseCells>(table, is_baked);
+    late.add<SectionId::BroadphaseItems>(table, is_baked);
+    if (auto res = table.verify(parts, version, late.sections());
+        res != DeserializeResultCode::Okay)
+      return res;
+  }
+
+  if ((parts & LevelParts::Spawn) &&
+      (!load_section<SectionId::Spawn>(table, target, &spawn) ||
+       spawn.count > 1))
+    return DeserializeResultCode::InvalidSectionTable;
+  if ((parts & LevelParts::Terrains) &&
+      (!load_section<SectionId::Terrains>(table, target, &terrain_records) ||
+       !load_vertex_deltas(table, target, &vertex_deltas, &grid) ||
+       !table.find<SectionId::Vertices>(&vertex_section)))
+    return DeserializeResultCode::InvalidSectionTable;
+  if ((parts & LevelParts::Turrets) &&
+      !table.find<SectionId::Turrets>(&turret_section))
+    return DeserializeResultCode::InvalidSectionTable;
+  if ((parts & LevelParts::Images) && !load_images(table, target, &images))
+    return DeserializeResultCode::InvalidSectionTable;
+  if ((parts & LevelParts::BuildSites) &&
+      !table.find<SectionId::BuildSites>(&site_section))
+    return DeserializeResultCode::InvalidSectionTable;
+  // prefabs are small next to the rest, and copied in on their own
+  PrefabSections prefabs;
+  if ((parts & LevelParts::Prefabs) &&
+      !load_prefabs(table, target, images.names.count, &prefabs))
+    return DeserializeResultCode::InvalidSectionTable;
+  // the bounds and grid are small, the rest is copied in with the vertices
+  if (is_baked &&
+      (!load_section<SectionId::TerrainBounds>(table, target, &baked.bounds) ||
+       !load_broadphase_grid(table, target, &baked.grid) ||
+       !table.find<SectionId::TerrainTriangles>(&triangle_section) ||
+       !table.find<SectionId::BroadphaseCells>(&cell_section) ||
+       !table.find<SectionId::BroadphaseItems>(&item_section)))
+    return DeserializeResultCode::InvalidSectionTable;
+
+  // check every record before trusting it to size the block
+  const size_t num_vertices =
+      grid != 0 ? vertex_deltas.count : vertex_section.entry.count;
+  for (size_t i = 0; i < terrain_records.count; ++i) {
+    TerrainRecord record = terrain_records.load(i);
+    if (record.first_vertex > num_vertices ||
+        record.vertex_count > num_vertices - record.first_vertex)
+      return DeserializeResultCode::InvalidSectionTable;
+  }
+
+  // run once without storage to size the block, and again to fill it
+  Level level;
+  SectionFill fill{
+      .terrain_records = terrain_records,
+      .placements = images.placements,
+      .deltas = vertex_deltas,
+      .grid = grid,
+  };
+  fill.deltas_checked =
+      late.find(SectionId::VertexDeltas, &fill.deltas_checksum);
+  std::span<Triangle> triangles;
+  std::span<uint32_t> cell_starts;
+  std::span<uint32_t> items;
+  auto layout = [&](BumpAllocator &bump) {
+    fill.terrains = bump.take<TerrainEntry>(terrain_records.count);
+    fill.images = bump.take<Image>(images.placements.count);
+    auto *verts = bump.take<Vec2>(num_vertices);
+    auto *turrets = bump.take<Turret>(turret_section.entry.count);
+    auto *sites = bump.take<BuildSite>(site_section.entry.count);
+    auto *triangle_data = bump.take<Triangle>(triangle_section.entry.count);
+    auto *cell_data = bump.take<uint32_t>(cell_section.entry.count);
+    auto *item_data = bump.take<uint32_t>(item_section.entry.count);
+    fill.filenames =
+        take_filenames(bump, images.names.count, [&](size_t i) {
+          FilenameRecord name = images.names.load(i);
+          return images.filenames.subspan(name.offset, name.length);
+        });
+    take_prefabs(bump, prefabs, fill.filenames, &level);
+
+    if (!bump.counting()) {
+      fill.verts = std::span(verts, num_vertices);
+      triangles = std::span(triangle_data, triangle_section.entry.count);
+      cell_starts = std::span(cell_data, cell_section.entry.count);
+      items = std::span(item_data, item_section.entry.count);
+      if (grid == 0)
+        fill.copy(vertex_section, fill.verts, late);
+      fill.copy(turret_section, std::span(turrets, turret_section.entry.count),
+                late);
+      fill.copy(site_section, std::span(sites, site_section.entry.count),
+                late);
+      fill.copy(triangle_section, triangles, late);
+      fill.copy(cell_section, cell_starts, late);
+      fill.copy(item_section, items, late);
+      level.terrains = std::span(fill.terrains, terrain_records.count);
+      level.images = std::span(fill.images, images.placements.count);
+      level.image_filenames = std::span(fill.filenames, images.names.count);
+      level.turrets = std::span(turrets, turret_section.entry.count);
+      level.build_sites = std::span(sites, site_section.entry.count);
+    }
+  };
+
+  BumpAllocator sizer(nullptr);
+  layout(sizer);
+  level.storage = LevelStorage(resource, sizer.used());
+  BumpAllocator filler(level.storage.data());
+  layout(filler);
+  assert(filler.used() == sizer.used());
+
+  // only big levels are worth starting threads for
+  size_t threads = 1;
+  if (sizer.used() >= PARALLEL_DECODE_BYTES)
+    threads = worker_threads(sizer.used(), DECODE_PIECE_SIZE);
+  if (auto res = threads < 2 ? fill_sequential(fill)
+                             : fill_parallel(fill, threads);
+      res != DeserializeResultCode::Okay)
+    return res;
+
+  if (is_baked) {
+    auto raw = [](auto span) {
+      return RawSpan<typename decltype(span)::value_type>{
+          .bytes = reinterpret_cast<const std::byte *>(span.data()),
+          .count = span.size()};
+    };
+    baked.triangles = raw(triangles);
+    baked.cell_starts = raw(cell_starts);
+    baked.items = raw(items);
+    if (!check_baked(terrain_records, baked))
+      return DeserializeResultCode::InvalidSectionTable;
+    size_t first = 0;
+    for (size_t i = 0; i < terrain_records.count; ++i) {
+      size_t count = bake::triangle_count(fill.terrains[i].verts.size());
+      fill.terrains[i].bounds = baked.bounds.load(i);
+      fill.terrains[i].triangles = triangles.subspan(first, count);
+      first += count;
+    }
+    level.broadphase = {
+        .grid = baked.grid, .cell_starts = cell_starts, .items = items};
+  }
+
+  if (spawn.count)
+    level.player_spawn = spawn.load(0);
+  *out = std::move(level);
+  return DeserializeResultCode::Okay;
+}
+
+} // namespace detail
+
+/// Reads the parts of a level file held in memory which are asked for in
+/// options into a single block of memory from the given resource. The block
+/// belongs to out->storage and is freed with it, nothing in out points back
+/// into file.
+inline DeserializeResultCode
+deserialize(std::span<const std::byte> file, Level *out,
+            std::pmr::memory_resource *resource =
+                std::pmr::get_default_resource(),
+            const LoadOptions &options = {}) {
+  if (!out)
+    return DeserializeResultCode::NoLevelOutProvided;
+
+  detail::ByteReader reader(file);
+  detail::FileLayout layout;
+  if (auto res = detail::read_header(reader, true, &layout);
+      res != DeserializeResultCode::Okay)
+    return res;
+
+  const LevelParts parts = detail::needed_parts(options.parts);
+  if (layout.version < 2)
+    return detail::deserialize_sequential(reader, parts, resource, out);
+
+  detail::SectionTable table;
+  if (auto res = table.read(reader, file, layout.section_count);
+      res != DeserializeResultCode::Okay)
+    return res;
+  return detail::deserialize_sections(table, parts, layout.version,
+                                      options.trusted, resource, out);
+}
+
+/// Same as above, for a level file on disk
+inline DeserializeResultCode
+deserialize(const char *filename, Level *out,
+            std::pmr::memory_resource *resource =
+                std::pmr::get_default_resource(),
+            const LoadOptions &options = {}) {
+  if (!filename)
+    return DeserializeResultCode::NoFilenameProvided;
+  if (!out)
+    return DeserializeResultCode::NoLevelOutProvided;
+
+  detail::MappedFile file;
+  if (auto res = file.open(filename); res != DeserializeResultCode::Okay)
+    return res;
+  return deserialize(file.bytes(), out, resource, options);
+}
+
+/// Items of a level file handed to a visitor by stream_level. They point into
+/// the file, or into memory the visitor gave decode_target, and are not
+/// necessarily aligned, so copy them out with copy_to or load.
+template <typename T> using LevelItems = detail::RawSpan<T>;
+
+/// The prefabs of a level file, handed to stream_level visitors which have a
+/// prefabs(const LevelPrefabs &) after everything else. Every range and index
+/// in them has been checked.
+using LevelPrefabs = detail::PrefabSections;
+
+/// Hand the parts of a level file asked for in options to visitor as they are
+/// read, instead of building a Level, so callers with containers of their own
+/// can fill them straight from the file. Visitors implement the functions
+/// listed at detail::parse_level, taking LevelItems. Items stay valid until
+/// stream_level returns, or for as long as the memory from decode_target does.
+template <typename Visitor>
+inline DeserializeResultCode stream_level(std::span<const std::byte> file,
+                                          Visitor &visitor,
+                                          const LoadOptions &options = {}) {
+  return detail::parse_level(file, true, options, visitor);
+}
+
+/// Same as above, for a level file on disk
+template <typename Visitor>
+inline DeserializeResultCode stream_level(const char *filename,
+                                          Visitor &visitor,
+                                          const LoadOptions &options = {}) {
+  if (!filename)
+    return DeserializeResultCode::NoFilenameProvided;
+
+  detail::MappedFile file;
+  if (auto res = file.open(filename); res != DeserializeResultCode::Okay)
+    return res;
+  return stream_level(file.bytes(), visitor, options);
 }
 
 } // namespace cw
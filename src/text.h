@@ -0,0 +1,677 @@
+#pragma once
+#include "serialize.h"
+#include <charconv>
+
+// Levels as plain text, one thing per line, so changes to them can be read and
+// diffed in code review. Floats are written in the shortest form which reads
+// back as the same value, so a level goes through text and back unchanged.
+// Baked geometry is left out, saving works it out again from the terrains.
+//
+//   crosswire level text 1
+//   spawn 100 100
+//   terrain ditch
+//     100 100
+//     250 100.5
+//     180 240
+//   turret circle 300 400 0 1 0.5
+//   site 10 10 20 20
+//   image 30 40 0 "rock.png"
+//   prefab
+//   terrain obstacle
+//     -10 -10
+//     10 -10
+//     0 10
+//   turret tracking 0 0 1 0 2
+//   end
+//   instance 0 1 0 0 1 500 500
+//
+// Vertices are indented under the terrain they belong to. Terrain types and
+// turret patterns the names don't cover are written as numbers. Everything
+// between prefab and end belongs to that prefab, and an instance names the
+// prefab it places, counting from 0, followed by the a b c d tx ty of its
+// transform. Blank lines and lines starting with # are skipped, and each kind
+// of line keeps its own order, whatever order the kinds come in.
+
+namespace cw {
+
+#define CROSSWIRE_TEXT_FILE_EXTENSION "cwt"
+
+inline constexpr uint32_t TEXT_LEVEL_VERSION = 1;
+
+namespace detail {
+
+inline constexpr std::string_view TEXT_LEVEL_HEADER = "crosswire level text ";
+
+// indexed by the value of the enum
+inline constexpr std::array<std::string_view, 2> TERRAIN_TYPE_NAMES = {
+    "ditch", "obstacle"};
+inline constexpr std::array<std::string_view, 3> TURRET_PATTERN_NAMES = {
+    "circle", "tracking", "straight_line"};
+
+// longest a float or uint32_t can come out of to_chars, with room to spare
+inline constexpr size_t MAX_NUMBER_CHARS = 24;
+
+/// Appends text to a growable buffer. Callers reserve the most room the next
+/// stretch of text could take, and everything after that is written without
+/// checking for space.
+class TextWriter {
+public:
+  explicit TextWriter(std::vector<char> *out) : out(out) { out->clear(); }
+
+  inline void reserve(size_t bytes) {
+    if (out->size() - used < bytes)
+      out->resize(std::max(out->size() * 2, used + bytes));
+  }
+  inline void text(std::string_view text) {
+    assert(out->size() - used >= text.size());
+    std::memcpy(out->data() + used, text.data(), text.size());
+    used += text.size();
+  }
+  inline void put(char c) {
+    assert(used < out->size());
+    (*out)[used++] = c;
+  }
+  template <typename T> inline void number(T value) {
+    auto [end, ec] =
+        std::to_chars(out->data() + used, out->data() + out->size(), value);
+    assert(ec == std::errc());
+    used = end - out->data();
+  }
+  /// editor coordinates mostly land on whole pixels, and those are written
+  /// as integers, which is much quicker than finding the shortest float
+  inline void number(float value) {
+    if (std::abs(value) < 16777216.0f && value == std::trunc(value) &&
+        !std::signbit(value))
+      number(int32_t(value));
+    else
+      number<float>(value);
+  }
+  template <size_t N>
+  inline void name(const std::array<std::string_view, N> &names,
+                   uint8_t value) {
+    if (value < N)
+      text(names[value]);
+    else
+      number(uint32_t(value));
+  }
+  /// in double quotes, with quotes, backslashes and control characters
+  /// escaped. takes up to 4 bytes per character plus 2
+  inline void quoted(std::span<const char> string) {
+    static constexpr char HEX[] = "0123456789abcdef";
+    put('"');
+    for (char c : string) {
+      auto byte = uint8_t(c);
+      if (c == '"' || c == '\\') {
+        put('\\');
+        put(c);
+      } else if (byte < 0x20 || byte == 0x7f) {
+        text("\\x");
+        put(HEX[byte >> 4]);
+        put(HEX[byte & 15]);
+      } else {
+        put(c);
+      }
+    }
+    put('"');
+  }
+
+  /// Trim the buffer down to what was written
+  inline void finish() { out->resize(used); }
+
+private:
+  std::vector<char> *out;
+  size_t used = 0;
+};
+
+/// Bounds checked cursor over level text, which keeps track of the line it is
+/// on for error messages.
+class TextReader {
+public:
+  explicit TextReader(std::span<const char> text)
+      : pos(text.data()), end(text.data() + text.size()), line_start(pos) {}
+
+  /// Move to the first thing on the next line which isn't blank or a comment.
+  /// Returns false at the end of the text.
+  inline bool next_line() {
+    while (true) {
+      line_start = pos;
+      skip_spaces();
+      if (pos == end)
+        return false;
+      if (*pos == '#') {
+        pos = std::find(pos, end, '\n');
+        if (pos == end)
+          return false;
+      }
+      if (*pos == '\r' && pos + 1 < end && pos[1] == '\n')
+        ++pos;
+      if (*pos != '\n')
+        return true;
+      ++pos;
+      ++line_number;
+    }
+  }
+  /// whether the line next_line moved to starts with whitespace
+  inline bool indented() const { return pos != line_start; }
+
+  /// The rest of the line has to be empty. Moves past it.
+  inline bool end_of_line() {
+    skip_spaces();
+    if (pos < end && *pos == '\r')
+      ++pos;
+    if (pos == end)
+      return true;
+    if (*pos != '\n')
+      return false;
+    ++pos;
+    ++line_number;
+    return true;
+  }
+
+  /// A run of characters up to the next whitespace
+  inline std::string_view word() {
+    skip_spaces();
+    const char *start = pos;
+    while (pos < end && *pos != ' ' && *pos != '\t' && *pos != '\r' &&
+           *pos != '\n')
+      ++pos;
+    return {start, size_t(pos - start)};
+  }
+
+  template <typename T> inline bool number(T *out) {
+    skip_spaces();
+    auto [next, ec] = std::from_chars(pos, end, *out);
+    if (ec != std::errc() || (next < end && !is_separator(*next)))
+      return false;
+    pos = next;
+    return true;
+  }
+  /// whole numbers, which is most of them, skip from_chars
+  inline bool number(float *out) {
+    skip_spaces();
+    const char *digits = pos + (pos < end && *pos == '-');
+    const char *p = digits;
+    int32_t value = 0;
+    // 7 digits always fit in a float exactly
+    while (p < end && p - digits < 7 && *p >= '0' && *p <= '9')
+      value = value * 10 + (*p++ - '0');
+    if (p == digits || (p < end && !is_separator(*p)))
+      return number<float>(out);
+    // negating keeps the sign of -0
+    *out = digits == pos ? float(value) : -float(value);
+    pos = p;
+    return true;
+  }
+  inline bool number(Vec2 *out) { return number(&out->x) && number(&out->y); }
+
+  /// Either one of the names or the value of the enum as a number
+  template <typename Enum, size_t N>
+  inline bool name(const std::array<std::string_view, N> &names, Enum *out) {
+    const char *start = pos;
+    std::string_view found = word();
+    for (size_t i = 0; i < N; ++i) {
+      if (found == names[i]) {
+        *out = Enum(i);
+        return true;
+      }
+    }
+    pos = start;
+    uint32_t value;
+    if (!number(&value) || value > UINT8_MAX)
+      return false;
+    *out = Enum(value);
+    return true;
+  }
+
+  /// Undo the escapes TextWriter::quoted puts in, appending to out
+  inline bool quoted(std::vector<char> *out) {
+    skip_spaces();
+    if (pos == end || *pos != '"')
+      return false;
+    ++pos;
+    while (pos < end && *pos != '"' && *pos != '\n') {
+      if (*pos != '\\') {
+        out->push_back(*pos++);
+        continue;
+      }
+      if (end - pos >= 2 && (pos[1] == '"' || pos[1] == '\\')) {
+        out->push_back(pos[1]);
+        pos += 2;
+        continue;
+      }
+      uint8_t byte = 0;
+      if (end - pos < 4 || pos[1] != 'x' ||
+          std::from_chars(pos + 2, pos + 4, byte, 16).ptr != pos + 4)
+        return false;
+      out->push_back(char(byte));
+      pos += 4;
+    }
+    if (pos == end || *pos != '"')
+      return false;
+    ++pos;
+    return pos == end || is_separator(*pos);
+  }
+
+  /// Whether the text starts with prefix, moving past it if so
+  inline bool starts_with(std::string_view prefix) {
+    if (size_t(end - pos) < prefix.size() ||
+        std::string_view(pos, prefix.size()) != prefix)
+      return false;
+    pos += prefix.size();
+    return true;
+  }
+
+  inline size_t line() const { return line_number; }
+
+private:
+  static inline bool is_separator(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+  }
+  inline void skip_spaces() {
+    while (pos < end && (*pos == ' ' || *pos == '\t'))
+      ++pos;
+  }
+
+  const char *pos;
+  const char *end;
+  const char *line_start;
+  size_t line_number = 1;
+};
+
+/// The terrains, turrets, build sites and images read out of level text, of
+/// the level itself or of one prefab
+struct TextItems {
+  /// of each terrain, whose vertices follow the previous terrain's in verts
+  std::vector<std::pair<TerrainType, size_t>> terrains;
+  std::vector<Vec2> verts;
+  std::vector<Turret> turrets;
+  std::vector<BuildSite> build_sites;
+  std::vector<ImageData> images;
+  /// of each image's filename within TextLevel::filename_chars
+  std::vector<std::pair<size_t, size_t>> image_filenames;
+};
+
+/// Everything read out of level text, before it is laid out in one block
+struct TextLevel {
+  PlayerSpawnPoint player_spawn{};
+  TextItems items;
+  std::vector<TextItems> prefabs;
+  std::vector<PrefabInstance> instances;
+  std::vector<char> filename_chars;
+};
+
+/// Read one line which puts something in items, after the word saying what
+/// kind of line it is. Returns false if the line doesn't parse.
+inline bool parse_item(TextReader &reader, std::string_view kind,
+                       TextItems *items, std::vector<char> *filename_chars) {
+  if (kind == "terrain") {
+    TerrainType type{};
+    bool ok = reader.name(TERRAIN_TYPE_NAMES, &type);
+    items->terrains.emplace_back(type, 0);
+    return ok;
+  }
+  if (kind == "turret") {
+    Turret turret{};
+    bool ok = reader.name(TURRET_PATTERN_NAMES, &turret.pattern) &&
+              reader.number(&turret.position) &&
+              reader.number(&turret.direction) &&
+              reader.number(&turret.fireRateSeconds);
+    items->turrets.push_back(turret);
+    return ok;
+  }
+  if (kind == "site") {
+    BuildSite site{};
+    bool ok = reader.number(&site.position_a) && reader.number(&site.position_b);
+    items->build_sites.push_back(site);
+    return ok;
+  }
+  if (kind == "image") {
+    ImageData data{};
+    size_t offset = filename_chars->size();
+    bool ok = reader.number(&data.position) && reader.number(&data.rotation) &&
+              reader.quoted(filename_chars);
+    items->images.push_back(data);
+    items->image_filenames.emplace_back(offset,
+                                        filename_chars->size() - offset);
+    return ok;
+  }
+  return false;
+}
+
+inline DeserializeResultCode parse_text(TextReader &reader, TextLevel *out) {
+  if (!reader.starts_with(TEXT_LEVEL_HEADER))
+    return DeserializeResultCode::InvalidHeader;
+  uint32_t version;
+  if (!reader.number(&version))
+    return DeserializeResultCode::InvalidHeader;
+  if (version != TEXT_LEVEL_VERSION)
+    return DeserializeResultCode::UnsupportedVersion;
+  if (!reader.end_of_line())
+    return DeserializeResultCode::InvalidHeader;
+
+  // vertices only go on a terrain directly above them
+  bool in_terrain = false;
+  bool has_spawn = false;
+  // the level's own items, or the prefab being read
+  TextItems *items = &out->items;
+  while (reader.next_line()) {
+    if (reader.indented()) {
+      Vec2 vert;
+      if (!in_terrain || !reader.number(&vert))
+        return DeserializeResultCode::InvalidText;
+      items->verts.push_back(vert);
+      ++items->terrains.back().second;
+    } else {
+      std::string_view kind = reader.word();
+      in_terrain = kind == "terrain";
+      bool ok = false;
+      if (kind == "spawn" && !has_spawn) {
+        ok = has_spawn = reader.number(&out->player_spawn.position);
+      } else if (kind == "prefab" && items == &out->items) {
+        items = &out->prefabs.emplace_back();
+        ok = true;
+      } else if (kind == "end" && items != &out->items) {
+        items = &out->items;
+        ok = true;
+      } else if (kind == "instance") {
+        PrefabInstance instance{};
+        Affine &t = instance.transform;
+        ok = reader.number(&instance.prefab) && reader.number(&t.a) &&
+             reader.number(&t.b) && reader.number(&t.c) &&
+             reader.number(&t.d) && reader.number(&t.tx) &&
+             reader.number(&t.ty);
+        out->instances.push_back(instance);
+      } else {
+        ok = parse_item(reader, kind, items, &out->filename_chars);
+      }
+      if (!ok)
+        return DeserializeResultCode::InvalidText;
+    }
+    if (!reader.end_of_line())
+      return DeserializeResultCode::InvalidText;
+  }
+  // a prefab left open, or an instance of one which was never defined
+  if (items != &out->items)
+    return DeserializeResultCode::InvalidText;
+  for (const auto &instance : out->instances) {
+    if (instance.prefab >= out->prefabs.size())
+      return DeserializeResultCode::InvalidText;
+  }
+  return DeserializeResultCode::Okay;
+}
+
+/// Write the lines of the terrains, turrets, build sites and images of a
+/// level or of one prefab
+inline void write_items(TextWriter &writer,
+                        std::span<const TerrainEntry> terrains,
+                        std::span<const Turret> turrets,
+                        std::span<const BuildSite> build_sites,
+                        std::span<const Image> images) {
+  // one reservation per terrain, not per vertex
+  constexpr size_t VERTEX_LINE = 4 + 2 * MAX_NUMBER_CHARS;
+  for (const auto &terrain : terrains) {
+    writer.reserve(16 + MAX_NUMBER_CHARS + terrain.verts.size() * VERTEX_LINE);
+    writer.text("terrain ");
+    writer.name(TERRAIN_TYPE_NAMES, uint8_t(terrain.type));
+    writer.put('\n');
+    for (Vec2 vert : terrain.verts) {
+      writer.text("  ");
+      writer.number(vert.x);
+      writer.put(' ');
+      writer.number(vert.y);
+      writer.put('\n');
+    }
+  }
+
+  writer.reserve(turrets.size() * (24 + 5 * (1 + MAX_NUMBER_CHARS)));
+  for (const auto &turret : turrets) {
+    writer.text("turret ");
+    writer.name(TURRET_PATTERN_NAMES, uint8_t(turret.pattern));
+    for (float value :
+         {turret.position.x, turret.position.y, turret.direction.x,
+          turret.direction.y, turret.fireRateSeconds}) {
+      writer.put(' ');
+      writer.number(value);
+    }
+    writer.put('\n');
+  }
+
+  writer.reserve(build_sites.size() * (8 + 4 * (1 + MAX_NUMBER_CHARS)));
+  for (const auto &site : build_sites) {
+    writer.text("site");
+    for (float value : {site.position_a.x, site.position_a.y,
+                        site.position_b.x, site.position_b.y}) {
+      writer.put(' ');
+      writer.number(value);
+    }
+    writer.put('\n');
+  }
+
+  for (const auto &image : images) {
+    writer.reserve(16 + 3 * (1 + MAX_NUMBER_CHARS) + 4 * image.filename.size());
+    writer.text("image");
+    for (float value : {image.data.position.x, image.data.position.y,
+                        image.data.rotation}) {
+      writer.put(' ');
+      writer.number(value);
+    }
+    writer.put(' ');
+    writer.quoted(image.filename);
+    writer.put('\n');
+  }
+}
+
+/// Lay out the terrains, images, turrets and build sites read into items, and
+/// copy them in unless only counting. indices says which of names each image
+/// has. They come back as a Prefab, which has a span of each.
+inline Prefab take_items(BumpAllocator &bump, const TextItems &items,
+                         const std::span<const char> *names,
+                         const uint32_t *indices) {
+  auto *terrains = bump.take<TerrainEntry>(items.terrains.size());
+  auto *images = bump.take<Image>(items.images.size());
+  auto *turrets = bump.take<Turret>(items.turrets.size());
+  auto *sites = bump.take<BuildSite>(items.build_sites.size());
+  auto *verts = bump.take<Vec2>(items.verts.size());
+  if (bump.counting())
+    return {};
+
+  std::uninitialized_copy(items.turrets.begin(), items.turrets.end(),
+                          turrets);
+  std::uninitialized_copy(items.build_sites.begin(), items.build_sites.end(),
+                          sites);
+  std::uninitialized_copy(items.verts.begin(), items.verts.end(), verts);
+  size_t first = 0;
+  for (size_t i = 0; i < items.terrains.size(); ++i) {
+    auto [type, count] = items.terrains[i];
+    std::construct_at(&terrains[i], TerrainEntry{
+                                        .verts = std::span(verts + first,
+                                                           count),
+                                        .type = type,
+                                    });
+    first += count;
+  }
+  for (size_t i = 0; i < items.images.size(); ++i) {
+    std::construct_at(&images[i], Image{
+                                      .filename = names[indices[i]],
+                                      .data = items.images[i],
+                                      .filename_index = indices[i],
+                                  });
+  }
+  return {
+      .terrains = std::span(terrains, items.terrains.size()),
+      .turrets = std::span(turrets, items.turrets.size()),
+      .images = std::span(images, items.images.size()),
+      .build_sites = std::span(sites, items.build_sites.size()),
+  };
+}
+
+} // namespace detail
+
+/// Write a level out as text, see the top of text.h
+inline void serialize_text_to_buffer(const Level &level,
+                                     std::vector<char> *out) {
+  using detail::MAX_NUMBER_CHARS;
+  detail::TextWriter writer(out);
+  writer.reserve(detail::TEXT_LEVEL_HEADER.size() + 16 + 3 * MAX_NUMBER_CHARS);
+  writer.text(detail::TEXT_LEVEL_HEADER);
+  writer.number(TEXT_LEVEL_VERSION);
+  writer.text("\nspawn ");
+  writer.number(level.player_spawn.position.x);
+  writer.put(' ');
+  writer.number(level.player_spawn.position.y);
+  writer.put('\n');
+
+  detail::write_items(writer, level.terrains, level.turrets, level.build_sites,
+                      level.images);
+  for (const auto &prefab : level.prefabs) {
+    writer.reserve(16);
+    writer.text("prefab\n");
+    detail::write_items(writer, prefab.terrains, prefab.turrets,
+                        prefab.build_sites, prefab.images);
+    writer.reserve(16);
+    writer.text("end\n");
+  }
+
+  writer.reserve(level.instances.size() * (16 + 7 * (1 + MAX_NUMBER_CHARS)));
+  for (const auto &instance : level.instances) {
+    const Affine &t = instance.transform;
+    writer.text("instance ");
+    writer.number(instance.prefab);
+    for (float value : {t.a, t.b, t.c, t.d, t.tx, t.ty}) {
+      writer.put(' ');
+      writer.number(value);
+    }
+    writer.put('\n');
+  }
+  writer.finish();
+}
+
+inline SerializeResultCode serialize_text(const char *folder,
+                                          const char *levelname,
+                                          bool overwrite, const Level &level) {
+  detail::PathBuffer buf;
+  if (auto res = detail::format_path(&buf, folder, levelname,
+                                     CROSSWIRE_TEXT_FILE_EXTENSION);
+      res != SerializeResultCode::Okay)
+    return res;
+
+  if (!overwrite && !access(buf.data(), F_OK))
+    return SerializeResultCode::FileExists;
+
+  std::vector<char> text;
+  serialize_text_to_buffer(level, &text);
+  return detail::write_file_atomic(folder, buf.data(), overwrite,
+                                   std::as_bytes(std::span(text)));
+}
+
+/// Read level text into a single block of memory from the given resource,
+/// like deserialize. When the text doesn't parse, the line it went wrong on
+/// is put in error_line.
+inline DeserializeResultCode
+deserialize_text(std::span<const char> text, Level *out,
+                 std::pmr::memory_resource *resource =
+                     std::pmr::get_default_resource(),
+                 size_t *error_line = nullptr) {
+  if (!out)
+    return DeserializeResultCode::NoLevelOutProvided;
+
+  detail::TextReader reader(text);
+  detail::TextLevel parsed;
+  if (auto res = detail::parse_text(reader, &parsed);
+      res != DeserializeResultCode::Okay) {
+    if (error_line)
+      *error_line = reader.line();
+    return res;
+  }
+
+  // the filenames won't move any more, so they can be interned in place.
+  // indices has the level's images first and then each prefab's in turn
+  detail::InternedFilenames filenames;
+  std::unordered_map<std::string_view, uint32_t> seen;
+  auto intern = [&](const detail::TextItems &items) {
+    for (auto [offset, length] : items.image_filenames) {
+      std::span<const char> filename(parsed.filename_chars.data() + offset,
+                                     length);
+      auto [it, inserted] =
+          seen.try_emplace(std::string_view(filename.data(), filename.size()),
+                           uint32_t(filenames.unique.size()));
+      if (inserted)
+        filenames.unique.push_back(filename);
+      filenames.indices.push_back(it->second);
+    }
+  };
+  filenames.indices.reserve(parsed.items.images.size());
+  intern(parsed.items);
+  for (const auto &prefab : parsed.prefabs)
+    intern(prefab);
+
+  // run once without storage to size the block, and again to fill it
+  Level level;
+  auto layout = [&](detail::BumpAllocator &bump) {
+    auto *names = detail::take_filenames(
+        bump, filenames.unique.size(), [&](size_t i) {
+          return detail::RawSpan<char>{
+              .bytes = reinterpret_cast<const std::byte *>(
+                  filenames.unique[i].data()),
+              .count = filenames.unique[i].size(),
+          };
+        });
+    const uint32_t *indices = filenames.indices.data();
+    Prefab own = detail::take_items(bump, parsed.items, names, indices);
+    indices += parsed.items.images.size();
+    auto *prefabs = bump.take<Prefab>(parsed.prefabs.size());
+    for (size_t i = 0; i < parsed.prefabs.size(); ++i) {
+      Prefab prefab =
+          detail::take_items(bump, parsed.prefabs[i], names, indices);
+      indices += parsed.prefabs[i].images.size();
+      if (!bump.counting())
+        std::construct_at(&prefabs[i], prefab);
+    }
+    auto *instances = bump.take<PrefabInstance>(parsed.instances.size());
+    if (bump.counting())
+      return;
+
+    std::uninitialized_copy(parsed.instances.begin(), parsed.instances.end(),
+                            instances);
+    level.terrains = own.terrains;
+    level.images = own.images;
+    level.image_filenames = std::span(names, filenames.unique.size());
+    level.turrets = own.turrets;
+    level.build_sites = own.build_sites;
+    level.prefabs = std::span(prefabs, parsed.prefabs.size());
+    level.instances = std::span(instances, parsed.instances.size());
+  };
+
+  detail::BumpAllocator sizer(nullptr);
+  layout(sizer);
+  level.storage = LevelStorage(resource, sizer.used());
+  detail::BumpAllocator filler(level.storage.data());
+  layout(filler);
+  assert(filler.used() == sizer.used());
+
+  level.player_spawn = parsed.player_spawn;
+  *out = std::move(level);
+  return DeserializeResultCode::Okay;
+}
+
+/// Same as above, for level text on disk. The file is mapped rather than read
+inline DeserializeResultCode
+deserialize_text(const char *filename, Level *out,
+                 std::pmr::memory_resource *resource =
+                     std::pmr::get_default_resource(),
+                 size_t *error_line = nullptr) {
+  if (!filename)
+    return DeserializeResultCode::NoFilenameProvided;
+  if (!out)
+    return DeserializeResultCode::NoLevelOutProvided;
+
+  detail::MappedFile file;
+  if (auto res = file.open(filename); res != DeserializeResultCode::Okay)
+    return res;
+  auto bytes = file.bytes();
+  return deserialize_text(
+      std::span(reinterpret_cast<const char *>(bytes.data()), bytes.size()),
+      out, resource, error_line);
+}
+
+} // namespace cw
@@ -22,6 +22,20 @@ float pointPointDistance(const Vec2& p, const Vec2& v) {
     return sqrt(pow(y,2) + pow(x,2));
 }
 
+bool pointInPolygon(const Vec2& p, std::span<const Vec2> points) {
+    // count the edges a ray going right from p crosses
+    bool inside = false;
+    for (size_t i = 0, j = points.size() - 1; i < points.size(); j = i++) {
+        const Vec2& a = points[i];
+        const Vec2& b = points[j];
+        if ((a.y > p.y) != (b.y > p.y) &&
+            p.x < (b.x - a.x) * (p.y - a.y) / (b.y - a.y) + a.x) {
+            inside = !inside;
+        }
+    }
+    return inside;
+}
+
 //Function that saves string to file
 bool saveStringToFile(const std::string& data, const std::string& filepath) {
     std::ofstream file(filepath);
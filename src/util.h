@@ -1,10 +1,13 @@
 #pragma once
 #include <math.h>
+#include <span>
 #include <string>
 #include "Vec2.h"
 
 
 float pointLineDistance(const Vec2& p, const Vec2& v, const Vec2& w);
 float pointPointDistance(const Vec2& p, const Vec2& v);
+// Whether p is inside the outline going through points in order, closed back to the first
+bool pointInPolygon(const Vec2& p, std::span<const Vec2> points);
 bool saveStringToFile(const std::string& data, const std::string& filepath);
 void saveLevelData(std::string data);
@@ -0,0 +1,77 @@
+// Packs level files into one .cwp, each room named after its file. Every level
+// is loaded first, so a damaged one never makes it into a pack, and neither
+// does one missing edits that the editor only saved to its journal.
+// Usage: crosswire_pack <folder> <pack name> <level files...>
+
+#include "journal.h"
+#include "pack.h"
+#include <cstdio>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+namespace {
+
+bool read_file(const char *path, std::vector<std::byte> *out) {
+  FILE *file = std::fopen(path, "rb");
+  if (!file)
+    return false;
+  std::error_code err;
+  out->resize(std::filesystem::file_size(path, err));
+  bool ok = !err && std::fread(out->data(), 1, out->size(), file) ==
+                        out->size();
+  std::fclose(file);
+  return ok;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  if (argc < 4) {
+    std::fprintf(stderr,
+                 "usage: %s <folder> <pack name> <level files...>\n",
+                 argv[0]);
+    return 2;
+  }
+
+  std::vector<std::string> names;
+  std::vector<std::vector<std::byte>> files;
+  for (int i = 3; i < argc; ++i) {
+    files.emplace_back();
+    if (!read_file(argv[i], &files.back())) {
+      std::fprintf(stderr, "failed to read %s\n", argv[i]);
+      return 1;
+    }
+    const std::string journal =
+        std::filesystem::path(argv[i])
+            .replace_extension(CROSSWIRE_JOURNAL_FILE_EXTENSION)
+            .string();
+    cw::JournaledLevel level;
+    if (auto res = level.open(argv[i], journal.c_str());
+        res != cw::DeserializeResultCode::Okay) {
+      std::fprintf(stderr, "%s is not a valid level (error %d)\n", argv[i],
+                   int(res));
+      return 1;
+    }
+    if (level.edits() != 0) {
+      std::fprintf(stderr,
+                   "%s is missing edits saved to %s, open and close it in "
+                   "the editor to fold them in\n",
+                   argv[i], journal.c_str());
+      return 1;
+    }
+    names.push_back(std::filesystem::path(argv[i]).stem().string());
+  }
+
+  std::vector<cw::PackInput> inputs;
+  for (size_t i = 0; i < files.size(); ++i)
+    inputs.push_back({.name = names[i], .file = files[i]});
+  if (auto res = cw::write_pack(argv[1], argv[2], true, inputs);
+      res != cw::SerializeResultCode::Okay) {
+    std::fprintf(stderr, "failed to write pack (error %d)\n", int(res));
+    return 1;
+  }
+  std::printf("packed %zu levels into %s/%s.%s\n", inputs.size(), argv[1],
+              argv[2], CROSSWIRE_PACK_FILE_EXTENSION);
+  return 0;
+}
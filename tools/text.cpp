@@ -0,0 +1,93 @@
+// Converts levels between the binary format and text, going by the extension
+// of the input. A level's journal is replayed over it, so the text has every
+// edit the editor saved. With no output the text is printed, so it can be used to diff
+// level files in git:
+//   git config diff.crosswire.textconv crosswire_text
+//   echo '*.cwl diff=crosswire' >> .gitattributes
+// Usage: crosswire_text <level.cwl> [out.cwt]
+//        crosswire_text <level.cwt> <out.cwl>
+
+#include "journal.h"
+#include "text.h"
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+namespace {
+
+bool write_file(const char *path, std::span<const std::byte> data) {
+  FILE *file = std::fopen(path, "wb");
+  if (!file)
+    return false;
+  bool ok = std::fwrite(data.data(), 1, data.size(), file) == data.size();
+  return std::fclose(file) == 0 && ok;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  if (argc < 2 || argc > 3) {
+    std::fprintf(stderr,
+                 "usage: %s <level.%s> [out.%s]\n"
+                 "       %s <level.%s> <out.%s>\n",
+                 argv[0], CROSSWIRE_LEVEL_FILE_EXTENSION,
+                 CROSSWIRE_TEXT_FILE_EXTENSION, argv[0],
+                 CROSSWIRE_TEXT_FILE_EXTENSION,
+                 CROSSWIRE_LEVEL_FILE_EXTENSION);
+    return 2;
+  }
+
+  const bool from_text = std::filesystem::path(argv[1]).extension() ==
+                         "." CROSSWIRE_TEXT_FILE_EXTENSION;
+  if (from_text && argc < 3) {
+    std::fprintf(stderr, "%s: text has to be converted into a file\n",
+                 argv[0]);
+    return 2;
+  }
+
+  if (from_text) {
+    cw::Level level;
+    size_t line = 0;
+    if (auto res = cw::deserialize_text(argv[1], &level,
+                                        std::pmr::get_default_resource(),
+                                        &line);
+        res != cw::DeserializeResultCode::Okay) {
+      std::fprintf(stderr, "%s:%zu: not valid level text (error %d)\n",
+                   argv[1], line, int(res));
+      return 1;
+    }
+    std::vector<std::byte> file;
+    cw::serialize_to_buffer(level, &file);
+    if (!write_file(argv[2], file)) {
+      std::fprintf(stderr, "failed to write %s\n", argv[2]);
+      return 1;
+    }
+    return 0;
+  }
+
+  const std::string journal =
+      std::filesystem::path(argv[1])
+          .replace_extension(CROSSWIRE_JOURNAL_FILE_EXTENSION)
+          .string();
+  cw::JournaledLevel level;
+  if (auto res = level.open(argv[1], journal.c_str());
+      res != cw::DeserializeResultCode::Okay) {
+    std::fprintf(stderr, "%s is not a valid level (error %d)\n", argv[1],
+                 int(res));
+    return 1;
+  }
+  std::vector<char> text;
+  cw::serialize_text_to_buffer(level.level(), &text);
+  if (argc < 3) {
+    return std::fwrite(text.data(), 1, text.size(), stdout) == text.size()
+               ? 0
+               : 1;
+  }
+  if (!write_file(argv[2], std::as_bytes(std::span(text)))) {
+    std::fprintf(stderr, "failed to write %s\n", argv[2]);
+    return 1;
+  }
+  return 0;
+}